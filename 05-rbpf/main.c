@@ -38,21 +38,40 @@
 #include <stdio.h>
 
 #include "rbpf.h"
+#include "sandbox.h"
 #include "shared.h"
 #include "stdriot.h"
 
 #define PROGNAME "rbpf.bin"
 
 #define RBPF_STACK_SIZE   (512)
+#if RBPF_ENABLE_AOT
+/* room for the native code section */
+#define BYTECODE_SIZE_MAX (2048)
+#else
 #define BYTECODE_SIZE_MAX (600)
+#endif
 #define BUFFER_SIZE_MAX   (362)
+#define LOWERED_SIZE_MAX  (BYTECODE_SIZE_MAX / 8)
+#define JIT_SIZE_MAX      (4096)
+#define PROOF_SIZE_MAX    ((LOWERED_SIZE_MAX + 31) / 32)
+#define ARENA_SIZE        (2048)
+/* the copy of the application run by the child, and its data section */
+#define SHADOW_SIZE       (sizeof(rbpf_application_t) + BYTECODE_SIZE_MAX)
+/* the memory the application writes to, its context included */
+#define SANDBOX_SIZE      (RBPF_STACK_SIZE + SHADOW_SIZE + 64)
+/* the memory the application only reads */
+#define SANDBOX_IMAGE_SIZE (BYTECODE_SIZE_MAX + BUFFER_SIZE_MAX + \
+                            LOWERED_SIZE_MAX * sizeof(rbpf_insn_t) + 64)
 #define RUN_ONCE          (1)
 
 #define BPF_RUN_N(ctx, size) \
     do { \
-        status = RBPF_OK; \
+        void *run_ctx = bpf_ctx(ctx, size); \
+        status = (run_ctx != NULL || size == 0) ? RBPF_OK : \
+            RBPF_OUT_OF_MEMORY; \
         for (i = 0; i < n && status == RBPF_OK; i++) { \
-            status = rbpf_application_run_ctx(rbpf, ctx, \
+            status = rbpf_application_run_ctx(rbpf, run_ctx, \
                 size, &result); \
         } \
     } while (0)
@@ -62,6 +81,29 @@ typedef struct {
     uint32_t words;
 } fletcher32_ctx_t;
 
+#if RBPF_ENABLE_MPU
+/* the blocks of the application in the child partition */
+static sandbox_t sandbox;
+#endif
+
+/* the context must lie in the memory the application reaches */
+static void *
+bpf_ctx(void *ctx, size_t size)
+{
+#if RBPF_ENABLE_MPU
+    uint8_t *copy = size ? sandbox_alloc(&sandbox, size) : NULL;
+    size_t i;
+
+    for (i = 0; copy != NULL && i < size; i++) {
+        copy[i] = ((const uint8_t *)ctx)[i];
+    }
+    return size ? copy : ctx;
+#else
+    (void)size;
+    return ctx;
+#endif
+}
+
 static int
 bpf_print_result(int64_t result, int status)
 {
@@ -129,23 +171,68 @@ bpf_run(rbpf_application_t *rbpf, unsigned n)
 int
 main(int argc, char **argv)
 {
-    static uint8_t rbpf_stack[RBPF_STACK_SIZE];
-    static char buf[BUFFER_SIZE_MAX];
-    static char bytecode[BYTECODE_SIZE_MAX];
+    static uint8_t stack_buf[RBPF_STACK_SIZE];
+    static char file_buf[BUFFER_SIZE_MAX];
+    static alignas(8) char bytecode_buf[BYTECODE_SIZE_MAX];
+    static rbpf_insn_t lowered_buf[LOWERED_SIZE_MAX];
+    static uint32_t proof[PROOF_SIZE_MAX];
     static size_t bytecode_size;
-    rbpf_application_t rbpf;
+    static rbpf_application_t rbpf_buf;
     rbpf_mem_region_t region;
     uint64_t integer;
+    rbpf_application_t *rbpf = &rbpf_buf;
+    uint8_t *rbpf_stack = stack_buf;
+    rbpf_insn_t *lowered = lowered_buf;
+    char *bytecode = bytecode_buf;
+    char *buf = file_buf;
     ssize_t result;
     char *endptr;
+    int status;
+#if RBPF_ENABLE_JIT
+    void *jit;
+#endif
+#if RBPF_ENABLE_MASKING
+    void *arena;
+#endif
+#if RBPF_ENABLE_MPU
+    void *shadow;
+#endif
 
     if (argc < 2) {
         printf(PROGNAME": <rbpf-file> [file | integer]\n");
         return 1;
     }
 
+#if RBPF_ENABLE_MPU
+    /*
+     * the child partition only reaches the blocks of the
+     * application: the application writes to its copy, its
+     * stack and its context, and only reads its bytecode, its
+     * pre-decoded form and its data; the application itself
+     * stays in the memory of the partition
+     */
+    if (sandbox_init() < 0 ||
+        sandbox_create(&sandbox, SANDBOX_SIZE, SANDBOX_IMAGE_SIZE) < 0 ||
+        (shadow = sandbox_alloc(&sandbox, SHADOW_SIZE)) == NULL ||
+        (rbpf_stack = sandbox_alloc(&sandbox, RBPF_STACK_SIZE)) == NULL ||
+        (bytecode = sandbox_alloc_image(&sandbox,
+        BYTECODE_SIZE_MAX)) == NULL ||
+        (lowered = sandbox_alloc_image(&sandbox,
+        LOWERED_SIZE_MAX * sizeof(rbpf_insn_t))) == NULL ||
+        (buf = sandbox_alloc_image(&sandbox, BUFFER_SIZE_MAX)) == NULL) {
+        printf(PROGNAME": failed to create the sandbox\n");
+        sandbox_fini();
+        return 1;
+    }
+    rbpf_application_sandbox_init(rbpf, sandbox_run, &sandbox, shadow,
+        SHADOW_SIZE);
+#endif
+
     if ((result = copy_file(argv[1], bytecode, BYTECODE_SIZE_MAX)) < 0) {
         printf(PROGNAME": %s: failed to copy bytecode\n", argv[1]);
+#if RBPF_ENABLE_MPU
+        sandbox_fini();
+#endif
         return 1;
     }
     bytecode_size = (size_t)result;
@@ -153,28 +240,63 @@ main(int argc, char **argv)
     printf(PROGNAME": \"%s\" bytecode loaded at address %p\n", argv[1],
         (void *)bytecode);
 
-    rbpf_application_setup(&rbpf, rbpf_stack, (void *)bytecode,
+#if RBPF_ENABLE_MASKING
+    /* room to align the arena on its size, and for its guard bytes */
+    if ((arena = alloc_unused_ram(2 * ARENA_SIZE + 8)) == NULL ||
+        rbpf_application_arena_init(rbpf, arena, 2 * ARENA_SIZE + 8) < 0) {
+        printf(PROGNAME": failed to allocate the arena\n");
+        return 1;
+    }
+    printf(PROGNAME": %u bytes arena at address %p\n",
+        (unsigned)rbpf->arena_len, (void *)rbpf->arena);
+#endif
+    rbpf_application_setup(rbpf, rbpf_stack, (void *)bytecode,
         bytecode_size);
+#if RBPF_ENABLE_AOT
+    /* the bytecode comes from the files installed on the board, whose native
+     * code is trusted to run unchecked */
+    rbpf->flags |= RBPF_CONFIG_NATIVE_TRUSTED;
+#endif
+#if RBPF_ENABLE_MASKING
+    /* the data must be reachable by the application */
+    if ((buf = rbpf_arena_alloc(rbpf, BUFFER_SIZE_MAX)) == NULL) {
+        printf(PROGNAME": failed to allocate the data in the arena\n");
+        return 1;
+    }
+#endif
+    rbpf_application_lowering_init(rbpf, lowered, LOWERED_SIZE_MAX);
+    rbpf_application_proof_init(rbpf, proof, PROOF_SIZE_MAX);
+#if RBPF_ENABLE_JIT
+    /* the native code must be fetched from an executable region */
+    if ((jit = alloc_unused_ram(JIT_SIZE_MAX)) == NULL) {
+        printf(PROGNAME": failed to allocate the native code buffer\n");
+    } else {
+        rbpf_application_jit_init(rbpf, jit, JIT_SIZE_MAX);
+    }
+#endif
     rbpf_memory_region_init(&region, bytecode, bytecode_size,
         RBPF_MEM_REGION_READ);
-    rbpf_add_region(&rbpf, &region);
+    rbpf_add_region(rbpf, &region);
 
     if (argc < 3) {
-        return bpf_run(&rbpf, RUN_ONCE);
-    }
-
-    if ((result = copy_file(argv[2], buf, BUFFER_SIZE_MAX)) >= 0) {
+        status = bpf_run(rbpf, RUN_ONCE);
+    } else if ((result = copy_file(argv[2], buf, BUFFER_SIZE_MAX)) >= 0) {
         printf(PROGNAME": \"%s\" data loaded at address %p\n", argv[2],
             (void *)buf);
-        return bpf_run_with_file(&rbpf, RUN_ONCE, buf, (size_t)result);
-    }
-
-    integer = (uint64_t)strtol(argv[2], &endptr, 16);
-    if (argv[2] != endptr && *endptr == '\0') {
-        return bpf_run_with_integer(&rbpf, RUN_ONCE, integer);
+        status = bpf_run_with_file(rbpf, RUN_ONCE, buf, (size_t)result);
+    } else {
+        integer = (uint64_t)strtol(argv[2], &endptr, 16);
+        if (argv[2] != endptr && *endptr == '\0') {
+            status = bpf_run_with_integer(rbpf, RUN_ONCE, integer);
+        } else {
+            /* other argument types are not yet supported */
+            status = 1;
+        }
     }
 
-    /* other argument types are not yet supported */
+#if RBPF_ENABLE_MPU
+    sandbox_fini();
+#endif
 
-    return 1;
+    return status;
 }
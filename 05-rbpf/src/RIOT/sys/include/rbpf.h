@@ -90,6 +90,199 @@
  * The rbpf engine itself ensures correct memory permissions to the application
  * regions, stack and context struct.
  *
+ * The regions are indexed by start address and the last region a load and a
+ * store went through is checked first, so that repeated accesses to one buffer
+ * don't depend on the number of regions.
+ *
+ * ### Branch budget
+ *
+ * A run takes at most RBPF_BRANCHES_ALLOWED backward branches and local calls,
+ * and fails with RBPF_OUT_OF_BRANCHES beyond, unless the application is
+ * configured with RBPF_CONFIG_NO_RETURN. The forward branches can't loop and
+ * aren't counted. With RBPF_ENABLE_BOUNDED_LOOPS the pre-flight checks find
+ * the loops of the pre-decoded form counting a register by a fixed step up to
+ * an immediate bound, from a constant, or from a range with a step of one, and
+ * charge all their iterations when the loop is entered, the most the range
+ * allows, so that their backward branch is taken without any accounting. The
+ * number of these loops is left in rbpf_application_t::loops. The native code
+ * section of `gen_rbf.py aot` still charges every iteration.
+ *
+ * ### Native code
+ *
+ * With RBPF_ENABLE_AOT the native code section appended by `gen_rbf.py aot`
+ * runs in place of the interpreter, without the pre-flight checks: nothing
+ * in the section can be verified, and the Fletcher-32 checksum only tells
+ * that it was built from the sections preceding it, not by whom. The section
+ * is therefore only executed for an application the host flags with
+ * RBPF_CONFIG_NATIVE_TRUSTED, set after @ref rbpf_application_setup by a
+ * loader that authenticated the application by its own means, such as the
+ * file system it was installed in. Other applications are interpreted.
+ *
+ * ### Preemption
+ *
+ * With RBPF_ENABLE_YIELD an application given a quantum with @ref
+ * rbpf_application_quantum_init is suspended once it executed that many
+ * instructions, before the next one. The run returns RBPF_YIELD, keeping the
+ * registers, the instruction it stopped at and the local calls in progress in
+ * the application, and @ref rbpf_application_resume goes on from there with
+ * the rest of the budget, for another quantum. Every instruction dispatched
+ * counts, a superinstruction once, so that the time between two yields is
+ * bounded by the quantum whatever the budget, the bounded loops included:
+ * their iterations are charged at once to the budget, but preempted as any
+ * other instruction. The applications a run hands over to with a tail call go
+ * on in the same quantum. A new run of the application drops the suspended
+ * one. Only the interpreter can suspend a run, so a run given a quantum fails
+ * with RBPF_NOT_PREEMPTIBLE rather than running native code, or a context
+ * copied in the arena with RBPF_ENABLE_MASKING, to completion.
+ *
+ * ### 32 bit registers
+ *
+ * Applications built with `gen_rbf.py generate --reg32` carry the
+ * RBPF_HEADER_FLAG_REG32 flag. With RBPF_ENABLE_REG32 they are interpreted with
+ * 32 bit registers, whose upper half reads as zero. The 64 bit loads keep the
+ * lower half of the value, as for the pointers shared with @ref
+ * __bpf_shared_ptr, and the pre-flight checks reject the 64 bit immediates and
+ * the 64 bit ALU operations besides the moves, additions and subtractions of
+ * the address arithmetic.
+ *
+ * ### Compressed text
+ *
+ * Applications built with `gen_rbf.py generate --compress` carry the
+ * RBPF_HEADER_FLAG_COMPRESSED flag, and each instruction of their text only
+ * keeps the fields it uses, from 2 to 10 bytes. With RBPF_ENABLE_COMPRESSED
+ * the pre-flight checks walk the compressed text and the interpreter decodes
+ * it in place, one instruction at a time. With RBPF_ENABLE_LOWERING it is
+ * decoded into the pre-decoded form instead. The memory proof, the narrowing,
+ * the fusion and the native code only apply to the uncompressed text.
+ * Without RBPF_ENABLE_COMPRESSED the pre-flight checks reject such
+ * applications.
+ *
+ * ### Functions
+ *
+ * The functions of the application listed in its function table can be run
+ * by name with @ref rbpf_application_run_entry, so that a single image hosts
+ * several routines. `gen_rbf.py` sorts the table by name and sets the
+ * RBPF_HEADER_FLAG_SORTED flag, the name is then found by a binary search
+ * instead of a walk of the table. The runs of any other function than the one
+ * at the start of the text are interpreted.
+ *
+ * With RBPF_ENABLE_LOCAL_CALLS the application calls its own functions with
+ * the eBPF local call, a call instruction with a source register of 1 and the
+ * offset of the function in its immediate. Each call takes a frame of the
+ * buffer supplied with @ref rbpf_application_frames_init, saving r6 to r9 and
+ * the frame pointer, and moves the frame pointer down by the deepest stack
+ * access of the application, so that the callee gets a stack of its own. The
+ * calls count against the branches allowed, and a call finding no free frame
+ * or stack fails with RBPF_OUT_OF_MEMORY. Local calls are neither compiled to
+ * native code nor available to compressed applications.
+ *
+ * ### Tail calls
+ *
+ * With RBPF_ENABLE_TAIL_CALLS an application hands the run over to another
+ * one with the BPF_FUNC_BPF_TAIL_CALL helper, taking the context and the
+ * index of the next application in the program array supplied with @ref
+ * rbpf_application_prog_array_init. The next application starts on the same
+ * context with fresh registers and its own stack, and the branches it may
+ * take are what is left of the budget of the run, without a return to the
+ * caller of @ref rbpf_application_run_ctx. A run takes at most
+ * RBPF_TAIL_CALLS_ALLOWED tail calls. A tail call to an empty slot, to an
+ * application not set up, beyond that limit or, with RBPF_ENABLE_MASKING, to
+ * an application with another arena returns a nonzero value and the
+ * application goes on. The applications using tail calls are interpreted.
+ *
+ * ### Key/value stores
+ *
+ * With RBPF_ENABLE_STORE_CALLS the applications keep 32 bit values between
+ * their runs under 32 bit keys with the BPF_FUNC_BPF_STORE_LOCAL and
+ * BPF_FUNC_BPF_FETCH_LOCAL helpers, in a store of their own, and share them
+ * with BPF_FUNC_BPF_STORE_GLOBAL and BPF_FUNC_BPF_FETCH_GLOBAL in a store
+ * common to all applications, both supplied with @ref
+ * rbpf_application_store_init. The store helpers take the key and the value,
+ * and return 0, or -1 when the store is missing or full. The fetch helpers
+ * take the key and a pointer to the 32 bit value, set to 0 for a key never
+ * stored, and return 0, or -1 when the store is missing or the value not
+ * writable by the application.
+ *
+ * A store is a fixed table of keys hashed with open addressing in a buffer
+ * laid out by @ref rbpf_store_init, so that the helpers never allocate. The
+ * store takes new keys until three quarters of the table are in use, which
+ * keeps the probes short.
+ *
+ * ### Maps
+ *
+ * With RBPF_ENABLE_MAPS an application declares array maps, zeroed arrays
+ * of elements of a fixed size kept between its runs, in the list of maps
+ * `gen_rbf.py generate` writes from the definitions of the `maps` section of
+ * the ELF file. The application passes the number of a map, which the
+ * generator substitutes for the address of its definition, and the index of
+ * an element to the BPF_FUNC_BPF_MAP_LOOKUP helper, which returns a pointer
+ * to the element, or 0 when the index is out of bounds. The host lays the
+ * maps out with @ref rbpf_application_maps_init and reads their elements with
+ * @ref rbpf_application_map_lookup.
+ *
+ * The pre-flight checks reject the lookups in a map the application does not
+ * declare and the ones with a constant index beyond the end of the map. The
+ * other lookups with a constant index then always return the same element:
+ * the memory proof knows its bounds, and the pre-decoded form and the
+ * just-in-time compiler load its address instead of calling the helper.
+ *
+ * A map defined with the BPF_F_PERSISTENT flag keeps its elements across the
+ * reboots in the storage the host supplies with
+ * @ref rbpf_application_map_storage_init. The map is read back from the
+ * storage before the first run of the application, so that a boot doesn't
+ * pay for the maps of the applications never run, and then lives in RAM: the
+ * runs never wait on the storage. The changes are written back in batches by
+ * @ref rbpf_application_maps_flush, which the host calls periodically, and at
+ * the end of a run that called the BPF_FUNC_BPF_MAP_SYNC helper. The
+ * write-back compares a checksum of each page of RBPF_MAP_PAGE_SIZE bytes to
+ * the one of the page last loaded or written, and only writes the pages that
+ * changed, the adjacent ones in a single write. The pages the storage failed
+ * to write are written by the next write-back, which the end of the next run
+ * then does: a run ending with a failed write-back returns
+ * RBPF_MAPS_NOT_SYNCED instead of RBPF_OK, its result still being valid.
+ *
+ * ### Helpers
+ *
+ * The call instructions reach the native helpers by number, in the table of
+ * the built-in helpers or, with RBPF_EXTERNAL_CALLS, through the
+ * rbpf_get_external_call() function of the host. A helper takes the
+ * application and the registers r1 to r5 as arguments, and its result goes to
+ * r0. Each helper declares the type of its arguments, and the pre-flight
+ * checks reject the calls whose arguments are known not to match within the
+ * straight-line code before the call: a number passed as the context, a
+ * pointer passed as a number, an argument not known as a constant where one
+ * is expected, a null memory pointer, or a memory range of the stack, the
+ * data, the read-only data or the maps out of its region. The helpers still
+ * check the memory they access. With RBPF_ENABLE_MPU the helpers run in the
+ * sandbox, which never reaches the memory of the host: the helpers of the
+ * host, the stores and the tail calls are left out, and the pre-flight checks
+ * reject the calls to them.
+ *
+ * With RBPF_ENABLE_MEM_CALLS, the built-in helpers BPF_FUNC_BPF_MEMCPY,
+ * BPF_FUNC_BPF_MEMSET, BPF_FUNC_BPF_MEMCMP and BPF_FUNC_BPF_MEMCHR work like
+ * their C counterparts on ranges of the application, with the size as last
+ * argument: `memset(dst, c, len)`, `memchr(s, c, len)`. Each range is checked
+ * once and then copied, filled or compared a word at a time. A range the
+ * application can't access leaves the memory untouched and makes memcpy and
+ * memset return -1, memcmp INT32_MIN sign extended and memchr 0. The ranges
+ * of memcpy must not overlap.
+ *
+ * With RBPF_ENABLE_HASH_CALLS, the built-in helpers go over data of any
+ * length in chunks:
+ *  - BPF_FUNC_BPF_FLETCHER32 `(state, data, len)` returns the Fletcher-32
+ *    checksum of the little-endian 16 bit words of the data, a last odd byte
+ *    padded with zero, continuing from the checksum of the previous chunk or
+ *    BPF_FLETCHER32_INIT,
+ *  - BPF_FUNC_BPF_CRC32 `(crc, data, len)` returns the CRC-32 (IEEE 802.3)
+ *    of the data, continuing from the CRC of the previous chunk or 0,
+ *  - BPF_FUNC_BPF_SHA256_INIT `(state)`, BPF_FUNC_BPF_SHA256_UPDATE `(state,
+ *    data, len)` and BPF_FUNC_BPF_SHA256_FINAL `(state, digest)` compute the
+ *    SHA-256 hash in a bpf_sha256_state_t of the application, the final call
+ *    writing the 32 bytes of the digest.
+ *
+ * They return -1 when a range is not accessible, the SHA-256 ones 0
+ * otherwise.
+ *
  * ### Application format
  *
  * The binary format of a full application consists of:
@@ -98,6 +291,8 @@
  *  - The read-only data section
  *  - The application code itself
  *  - A list of functions exposed
+ *  - Optionally, a list of maps
+ *  - Optionally, the application code compiled ahead of time to Thumb-2
  *
  *  The header contains all the necessary information to parse the application.
  *  It includes a magic number to verify the header. There is a version field to
@@ -134,6 +329,14 @@ extern "C" {
  */
 #define RBPF_STACK_SIZE  (512)
 
+/**
+ * @brief Number of memory regions indexed by start address for the memory
+ *        checks, regions added beyond are only found by walking the list
+ */
+#ifndef RBPF_REGIONS_MAX
+#define RBPF_REGIONS_MAX (8)
+#endif
+
 /**
  * @brief Magic number for the header
  */
@@ -152,6 +355,40 @@ typedef struct __attribute__((packed)) {
     uint32_t functions;     /**< Number of functions available */
 } rbpf_header_t;
 
+/**
+ * @name Application header flags
+ * @{
+ */
+#define RBPF_HEADER_FLAG_COMPRESSED 0x01    /**< The text is compressed, see RBPF_ENABLE_COMPRESSED */
+#define RBPF_HEADER_FLAG_NATIVE     0x02    /**< A native code section follows the functions */
+#define RBPF_HEADER_FLAG_REG32      0x04    /**< The application runs with 32 bit registers, see
+                                                 RBPF_ENABLE_REG32 */
+#define RBPF_HEADER_FLAG_SORTED     0x08    /**< The functions are sorted by name */
+#define RBPF_HEADER_FLAG_MAPS       0x10    /**< A list of maps follows the functions, see
+                                                 RBPF_ENABLE_MAPS */
+/** @} */
+
+/**
+ * @brief Version of the interface between the native code section and the
+ *        virtual machine, see rbpf_native_env_t
+ */
+#define RBPF_NATIVE_VERSION (4)
+
+/**
+ * @brief Header of the native code section
+ *
+ * Starts at the first multiple of 4 bytes offset from the start of the
+ * application header following the list of functions, or of maps, and is
+ * directly followed by the code generated by `gen_rbf.py aot`.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t checksum;      /**< Fletcher-32 checksum from the read-only data section up to
+                                 this header */
+    uint32_t version;       /**< Interface version of the code, RBPF_NATIVE_VERSION */
+    uint32_t entry;         /**< Offset of the entry point in the code */
+    uint32_t code_len;      /**< Length of the code in bytes */
+} rbpf_native_header_t;
+
 /**
  * @brief Data structure defining a function exposed by the application
  */
@@ -161,21 +398,58 @@ typedef struct __attribute__((packed)) {
     uint16_t location_offset;   /**< Location in the text section where the function starts */
 } rbpf_function_t;
 
+/**
+ * @brief Definition of a map of the application, see RBPF_ENABLE_MAPS
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t type;              /**< Type of the map, BPF_MAP_TYPE_ARRAY */
+    uint32_t value_size;        /**< Size of an element in bytes */
+    uint32_t max_entries;       /**< Number of elements */
+    uint32_t flags;             /**< Flags of the map, BPF_F_PERSISTENT */
+} rbpf_map_def_t;
+
+/**
+ * @brief List of the maps of the application, following the functions
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t len;               /**< Number of maps */
+    rbpf_map_def_t maps[];      /**< Definitions of the maps, numbered from 0 */
+} rbpf_map_list_t;
+
+/**
+ * @brief Frame of a local call, see RBPF_ENABLE_LOCAL_CALLS
+ */
+typedef struct {
+    const void *ret;            /**< Call instruction to return to */
+    uint64_t regs[5];           /**< Registers r6 to r9 and the frame pointer of the caller */
+} rbpf_frame_t;
+
 /**
  * @brief rBPF Virtual Machine exit codes
  */
 enum {
     RBPF_CONTINUE               = 1,    /**< Next instruction, never returned to user */
+    RBPF_TAIL_CALL              = 2,    /**< Run goes on with the next application, never
+                                             returned to user */
+    RBPF_YIELD                  = 3,    /**< Run suspended after its quantum, goes on with
+                                             rbpf_application_resume() */
     RBPF_OK                     = 0,    /**< Successful execution */
     RBPF_ILLEGAL_INSTRUCTION    = -1,   /**< Failed on instruction parsing */
     RBPF_ILLEGAL_MEM            = -2,   /**< Illegal memory load */
     RBPF_ILLEGAL_JUMP           = -3,   /**< Jump offset not allowed */
-    RBPF_ILLEGAL_CALL           = -4,   /**< Illegal call instruction, called function not known */
+    RBPF_ILLEGAL_CALL           = -4,   /**< Illegal call instruction, called function not known
+                                             or arguments not matching its signature */
     RBPF_ILLEGAL_LEN            = -5,   /**< Invalid length of application */
     RBPF_ILLEGAL_REGISTER       = -6,   /**< Instruction register argument invalid */
     RBPF_NO_RETURN              = -7,   /**< No valid return found in the application code */
     RBPF_OUT_OF_BRANCHES        = -8,   /**< Number of branches taken is more than allowed */
     RBPF_ILLEGAL_DIV            = -9,   /**< Divide by zero error in instructions */
+    RBPF_OUT_OF_MEMORY          = -10,  /**< Buffer supplied for the pre-decoded form, arena
+                                             or frames too small */
+    RBPF_MAPS_NOT_SYNCED        = -11,  /**< Storage failed to write the persistent maps back,
+                                             retried by the next write-back */
+    RBPF_NOT_PREEMPTIBLE        = -12,  /**< Run given a quantum can't be suspended, as native
+                                             code or on a context copied in the arena */
 };
 
 /**
@@ -209,32 +483,288 @@ struct rbpf_mem_region {
  * @{
  */
 #define RBPF_FLAG_SETUP_DONE        0x01    /**< Initial setup of vm done */
-#define RBPF_FLAG_PREFLIGHT_DONE    0x02    /**< Pre-flight checks executed at least once */
+#define RBPF_FLAG_PREFLIGHT_DONE    0x02    /**< Pre-flight checks executed at least once, the
+                                                 pre-decoded form or the native code is built */
+#define RBPF_FLAG_MEMORY_PROVEN     0x04    /**< Memory proof of the pre-flight checks in
+                                                 rbpf_application_t::proof */
+#define RBPF_FLAG_REG32             0x08    /**< Application interpreted with the 32 bit
+                                                 registers of rbpf_application_t::regmap32 */
+#define RBPF_FLAG_COMPRESSED        0x10    /**< Text of the application compressed */
+#define RBPF_FLAG_MAPS_LOADED       0x20    /**< Persistent maps read back from their storage */
+#define RBPF_FLAG_MAPS_SYNC         0x40    /**< Persistent maps written back at the end of the
+                                                 run, see rbpf_application_maps_flush() */
+#define RBPF_FLAG_SUSPENDED         0x80    /**< Run suspended, see RBPF_ENABLE_YIELD */
 #define RBPF_CONFIG_NO_RETURN       0x0100  /**< Script doesn't need to have a return */
+#define RBPF_CONFIG_NATIVE_TRUSTED  0x0200  /**< Native code section of the application
+                                                 trusted by the host, see RBPF_ENABLE_AOT */
+#define RBPF_FLAG_GUARD_FAILED      0x0400  /**< Loop entered out of bounds, the rest of the run
+                                                 checks every access */
 /** @} */
 
 /**
- * @brief rBPF application
+ * @brief Forward declaration of the rBPF application
+ */
+typedef struct rbpf_application rbpf_application_t;
+
+/**
+ * @brief Program array, the applications reached by the tail calls
+ */
+typedef struct {
+    rbpf_application_t *const *apps;    /**< Applications, NULL for the empty slots */
+    size_t len;                         /**< Number of slots */
+} rbpf_prog_array_t;
+
+/**
+ * @brief Entry of a key/value store
  */
 typedef struct {
+    uint32_t key;                       /**< Key */
+    uint32_t value;                     /**< Value */
+} rbpf_store_entry_t;
+
+/**
+ * @brief Key/value store of the applications, see rbpf_store_init()
+ */
+typedef struct {
+    rbpf_store_entry_t *entries;        /**< Table of the entries */
+    uint32_t *used;                     /**< One bit per entry, set when in use */
+    uint32_t mask;                      /**< Number of entries minus 1, a power of two */
+    uint32_t count;                     /**< Number of entries in use */
+} rbpf_store_t;
+
+/**
+ * @brief Size of the buffer of a store of @p entries entries, a power of two
+ */
+#define RBPF_STORE_SIZE(entries) \
+    ((entries) * sizeof(rbpf_store_entry_t) + ((entries) + 31) / 32 * sizeof(uint32_t))
+
+/**
+ * @brief Storage of the persistent maps, see RBPF_ENABLE_MAPS
+ */
+typedef struct {
+    /** Reads up to len bytes of the map into buf, returns the number of bytes
+     *  read or a negative number when the map was never stored */
+    int (*load)(void *arg, uint32_t map, void *buf, size_t len);
+    /** Writes len bytes of buf at offset of the map, returns a negative number
+     *  on failure */
+    int (*store)(void *arg, uint32_t map, size_t offset, const void *buf, size_t len);
+    void *arg;                          /**< Argument passed to the functions */
+} rbpf_map_storage_t;
+
+/**
+ * @brief rBPF helper function
+ *
+ * Called with the registers r1 to r5 of the virtual machine as arguments, the
+ * result goes to r0.
+ *
+ * @param rbpf  rBPF application calling the function
+ */
+typedef uint64_t (*rbpf_call_t)(rbpf_application_t *rbpf, uint64_t r1, uint64_t r2, uint64_t r3,
+                                uint64_t r4, uint64_t r5);
+
+/**
+ * @brief Types of the helper arguments, checked by the pre-flight checks
+ */
+enum {
+    RBPF_ARG_ANY        = 0,    /**< Any value, or argument not used */
+    RBPF_ARG_CTX,               /**< Context of the run */
+    RBPF_ARG_SCALAR,            /**< Number */
+    RBPF_ARG_CONST,             /**< Number known to the pre-flight checks */
+    RBPF_ARG_MEM,               /**< Pointer to the memory read, of the size in the
+                                     following size argument */
+    RBPF_ARG_MEM_WRITE,         /**< Pointer to the memory written, of the size in the
+                                     following size argument */
+    RBPF_ARG_SIZE,              /**< Size of the memory of the previous pointer
+                                     arguments */
+};
+
+/**
+ * @brief Native helper reached by the call instructions
+ */
+typedef struct {
+    rbpf_call_t call;           /**< Function of the helper */
+    uint8_t args[5];            /**< Type of the arguments r1 to r5, RBPF_ARG_* */
+} rbpf_helper_t;
+
+/**
+ * @brief Native code of an application
+ *
+ * Takes the application as argument, with the register file of the
+ * application as in- and output, and returns the execution result of the
+ * virtual machine.
+ */
+typedef int (*rbpf_native_t)(rbpf_application_t *rbpf);
+
+/**
+ * @brief Environment of the native code section
+ *
+ * The native code section is position independent and only reaches the
+ * virtual machine through this structure. Its layout is shared with
+ * `gen_rbf.py` and changes with RBPF_NATIVE_VERSION.
+ */
+typedef struct {
+    rbpf_application_t *rbpf;       /**< Application, passed to the functions below */
+    uint32_t branches_remaining;    /**< Number of allowed branch instructions remaining */
+    /** Checks a load, see rbpf_load_allowed() */
+    bool (*load_allowed)(const rbpf_application_t *rbpf, void *addr, size_t size);
+    /** Checks a store, see rbpf_store_allowed() */
+    bool (*store_allowed)(const rbpf_application_t *rbpf, void *addr, size_t size);
+    rbpf_call_t (*get_call)(uint32_t num);  /**< Looks up the function of a call instruction */
+    uint64_t (*div)(uint64_t a, uint64_t b);    /**< 64 bit unsigned division */
+    uint64_t (*mod)(uint64_t a, uint64_t b);    /**< 64 bit unsigned modulo */
+    uint64_t (*sdiv)(uint64_t a, uint64_t b);   /**< 64 bit signed division */
+    uint64_t (*smod)(uint64_t a, uint64_t b);   /**< 64 bit signed modulo */
+    /** 64 bit atomic operation op on the aligned addr, with the operands and
+     *  the result in the register file */
+    void (*atomic64)(uint64_t *regs, uint64_t *addr, int32_t op, uint32_t src);
+} rbpf_native_env_t;
+
+/**
+ * @brief Entry point of the native code section
+ *
+ * Takes the register file of the application as in- and output, and returns
+ * the execution result of the virtual machine.
+ */
+typedef int (*rbpf_aot_t)(uint64_t *regs, rbpf_native_env_t *env);
+
+/**
+ * @brief Sandbox running the application isolated by the MPU
+ *
+ * Takes the copy of the application and the argument supplied with it, runs
+ * rbpf_application_run_sandboxed() on the copy in the isolated context and
+ * returns its result, or RBPF_ILLEGAL_MEM when the application faulted.
+ */
+typedef int (*rbpf_sandbox_t)(rbpf_application_t *rbpf, void *arg);
+
+/**
+ * @brief Forward declaration of the pre-decoded instruction
+ */
+typedef struct rbpf_insn rbpf_insn_t;
+
+/**
+ * @brief Pre-decoded rBPF instruction
+ *
+ * Internal form of an instruction, built once by the pre-flight checks when
+ * RBPF_ENABLE_LOWERING is set. The registers are resolved to pointers into the
+ * register file of the application, the branch targets and called functions
+ * are resolved and the double word loads carry their full 64 bit value. The
+ * offset of the jumps and the local calls holds the branches they charge to
+ * the budget. With
+ * RBPF_ENABLE_NARROWING, the 64 bit operations and jumps whose operands fit in
+ * 32 bits are rewritten to their 32 bit counterparts. With RBPF_ENABLE_FUSION,
+ * the first instruction of a frequent sequence is rewritten to a
+ * superinstruction executing the whole sequence, which reads the operands of
+ * the following instructions from their entries, left in place.
+ */
+struct rbpf_insn {
+    uint8_t opcode;                     /**< Opcode of the instruction */
+    uint8_t branch_target;              /**< Set when a branch targets the instruction */
+    int16_t offset;                     /**< Memory offset, or branches charged by a jump or a
+                                             local call */
+    union {
+        uint64_t *dst;                  /**< Destination register */
+        uint32_t *dst32;                /**< Destination register, 32 bit register file */
+    };
+    union {
+        const uint64_t *src;            /**< Source register */
+        const uint32_t *src32;          /**< Source register, 32 bit register file */
+    };
+    union {
+        const rbpf_insn_t *target;      /**< Instruction executed when the branch is taken */
+        rbpf_call_t call;               /**< Function called by a call instruction */
+    };
+    int64_t immediate;                  /**< Immediate value, sign extended */
+};
+
+/**
+ * @brief Superinstructions of the pre-decoded form, see RBPF_ENABLE_FUSION
+ */
+enum {
+    RBPF_FUSION_LDX_ADD,        /**< Load, then addition of the loaded value */
+    RBPF_FUSION_LDX_OR,         /**< Load, then bitwise or of the loaded value */
+    RBPF_FUSION_MOV_AND_RSH,    /**< Copy of a register, masked and shifted right */
+    RBPF_FUSION_MOV_RSH,        /**< Copy of a register, shifted right */
+    RBPF_FUSION_ZEXT,           /**< Copy of the lower half of a register by two shifts */
+    RBPF_FUSION_ZEXT_JMP,       /**< Copy of the lower half, then jump on its equality to
+                                     an immediate */
+    RBPF_FUSION_ALU_JMP,        /**< Addition or bitwise and of an immediate, then jump on
+                                     the equality of the result to an immediate */
+    RBPF_FUSION_NUM,            /**< Number of superinstructions */
+};
+
+/**
+ * @brief rBPF application
+ */
+struct rbpf_application {
     rbpf_mem_region_t stack_region;     /**< Memory permission region for the stack */
     rbpf_mem_region_t rodata_region;    /**< Memory permissions for the application read-only data */
     rbpf_mem_region_t data_region;      /**< Memory permissions for the application data region */
     rbpf_mem_region_t arg_region;       /**< Memory region for the caller-supplied arguments */
+    rbpf_mem_region_t maps_region;      /**< Memory of the maps of the application */
     const void *application;            /**< Application header */
     size_t application_len;             /**< Application length */
     uint8_t *stack;                     /**< VM stack, must be  and aligned */
     uint16_t flags;                     /**< State flags for the virtual machine */
     uint32_t branches_remaining;        /**< Number of allowed branch instructions remaining */
-} rbpf_application_t;
-
-/**
- * @brief rBPF syscall interface function
- *
- * @param rbpf  rBPF application calling the function
- * @param regs  Register state of the virtual machine
- */
-typedef uint32_t (*rbpf_call_t)(rbpf_application_t *rbpf, uint64_t *regs);
+    uint32_t loop_charge;               /**< Branches charged at the start of a run from the first
+                                             instruction, for the bounded loops it falls
+                                             through to */
+    uint16_t loops;                     /**< Number of loops charged when entered, only counted
+                                             with RBPF_ENABLE_BOUNDED_LOOPS */
+    uint16_t guards;                    /**< Number of loops whose memory is checked when
+                                             entered, only counted with RBPF_ENABLE_MEMORY_PROOF
+                                             and RBPF_ENABLE_LOWERING */
+    uint32_t quantum;                   /**< Instructions executed before the run is suspended,
+                                             0 to run to completion */
+    uint32_t slice;                     /**< Instructions left to the run before it is
+                                             suspended */
+    uint32_t instruction_count;         /**< Number of instructions executed, only counted with
+                                             RBPF_ENABLE_INSTRUCTION_COUNT */
+    uint64_t regmap[11];                /**< Register file of the virtual machine */
+    uint32_t regmap32[11];              /**< Register file of the applications interpreted with
+                                             32 bit registers */
+    rbpf_insn_t *lowered;               /**< Pre-decoded form of the application text */
+    size_t lowered_len;                 /**< Number of instructions the pre-decoded buffer holds */
+    uint16_t fusions[RBPF_FUSION_NUM];  /**< Number of each superinstruction in the pre-decoded
+                                             form, only filled with RBPF_ENABLE_FUSION */
+    void *jit_buf;                      /**< Buffer for the just-in-time compiled code */
+    size_t jit_len;                     /**< Length of the just-in-time compiler buffer in bytes */
+    rbpf_native_t native;               /**< Native code of the application, NULL when interpreted */
+    rbpf_aot_t aot;                     /**< Entry of the native code section, NULL when absent */
+    uint32_t *proof;                    /**< One bit per instruction, set when its memory access
+                                             is proven in bounds */
+    size_t proof_len;                   /**< Number of words the proof buffer holds */
+    size_t proof_ctx_len;               /**< Context length the proof relies on */
+    const rbpf_mem_region_t *regions[RBPF_REGIONS_MAX];    /**< Regions sorted by start
+                                                                 address */
+    uint8_t regions_len;                /**< Number of regions in rbpf_application_t::regions */
+    const rbpf_mem_region_t *last_hit[2];   /**< Region of the last allowed load and store */
+    uint8_t *arena;                     /**< Memory of the application, aligned on its length */
+    size_t arena_len;                   /**< Length of the arena, a power of two */
+    size_t arena_used;                  /**< Length of the arena in use, 0 until laid out */
+    rbpf_sandbox_t sandbox;             /**< Sandbox running the application */
+    void *sandbox_arg;                  /**< Argument of the sandbox */
+    rbpf_application_t *shadow;         /**< Copy of the application the sandbox runs, followed
+                                             by the data section */
+    size_t shadow_len;                  /**< Length of the shadow buffer in bytes */
+    size_t entry;                       /**< Instruction the current run starts at, or the
+                                             suspended run goes on from */
+    rbpf_frame_t *frames;               /**< Frames of the local calls */
+    size_t frames_len;                  /**< Number of frames the frame buffer holds */
+    size_t depth;                       /**< Local calls in progress in the suspended run */
+    uint16_t frame_size;                /**< Stack of a local call in bytes, the deepest stack
+                                             access of the application */
+    const rbpf_prog_array_t *prog_array;    /**< Applications the tail calls reach */
+    rbpf_application_t *tail_call;      /**< Next application, set by a tail call */
+    uint32_t tail_calls_remaining;      /**< Number of tail calls remaining to the run */
+    rbpf_application_t *suspended;      /**< Application of the chain the suspended run stopped
+                                             in, NULL when none */
+    rbpf_store_t *local_store;          /**< Key/value store of the application */
+    rbpf_store_t *global_store;         /**< Key/value store shared by the applications */
+    const rbpf_map_storage_t *map_storage;  /**< Storage of the persistent maps */
+    uint32_t *map_sums;                 /**< Checksum of each page of the persistent maps as
+                                             last loaded or written */
+};
 
 /**
  * @brief Initialize a new rBPF application
@@ -270,6 +800,274 @@ int rbpf_application_verify_preflight(rbpf_application_t *rbpf);
  */
 int rbpf_application_run_ctx(rbpf_application_t *rbpf, void *ctx, size_t ctx_size, int64_t *result);
 
+/**
+ * @brief Execute a function of the application with a supplied context
+ *
+ * Runs the application from the start of the function named @p name in its
+ * function table instead of from the start of its text, as
+ * rbpf_application_run_ctx() otherwise.
+ *
+ * @param   rBPF    rBPF application to launch
+ * @param   name    Name of the function
+ * @param   ctx     Context struct to supply to the virtual machine
+ * @param   ctx_size    Size of the context in bytes
+ * @param   result  Result returned by the function inside the virtual machine
+ *
+ * @returns execution result of the virtual machine, RBPF_ILLEGAL_CALL when the
+ *          application has no such function, negative on error
+ */
+int rbpf_application_run_entry(rbpf_application_t *rbpf, const char *name, void *ctx,
+                               size_t ctx_size, int64_t *result);
+
+/**
+ * @brief Go on with the suspended run of the application
+ *
+ * Only used when RBPF_ENABLE_YIELD is set. Continues the run that returned
+ * RBPF_YIELD, on the same context, which must remain valid until the run ends,
+ * in the application of the chain it stopped in.
+ *
+ * @param   rBPF    rBPF application whose run was suspended
+ * @param   result  Result returned by the application inside the virtual machine
+ *
+ * @returns execution result of the virtual machine, RBPF_YIELD when suspended
+ *          again, RBPF_ILLEGAL_JUMP when no run of the application is
+ *          suspended, negative on error
+ */
+int rbpf_application_resume(rbpf_application_t *rbpf, int64_t *result);
+
+/**
+ * @brief Set the quantum of the runs of the application
+ *
+ * Only used when RBPF_ENABLE_YIELD is set. The runs are suspended with
+ * RBPF_YIELD before the instruction exceeding @p quantum, counted from the
+ * start of the run or its last resumption. Only the interpreter suspends the
+ * runs, those of native code or on a context copied in the arena fail with
+ * RBPF_NOT_PREEMPTIBLE instead.
+ *
+ * @param   rbpf    rBPF application
+ * @param   quantum Instructions executed before the run is suspended, 0 to run
+ *                  to completion
+ */
+static inline void rbpf_application_quantum_init(rbpf_application_t *rbpf, uint32_t quantum)
+{
+    rbpf->quantum = quantum;
+}
+
+/**
+ * @brief Supply the buffer for the frames of the local calls
+ *
+ * Only used when RBPF_ENABLE_LOCAL_CALLS is set. Every local call in progress
+ * takes one frame, a call beyond the frames of the buffer fails. The buffer
+ * must remain valid as long as the application runs.
+ *
+ * @param   rbpf    rBPF application
+ * @param   buf     Buffer for the frames
+ * @param   len     Number of frames @p buf holds
+ */
+static inline void rbpf_application_frames_init(rbpf_application_t *rbpf, rbpf_frame_t *buf,
+                                                size_t len)
+{
+    rbpf->frames = buf;
+    rbpf->frames_len = len;
+}
+
+/**
+ * @brief Supply the program array the tail calls of the application reach
+ *
+ * Only used when RBPF_ENABLE_TAIL_CALLS is set. Several applications may
+ * share the same array, and the array may hold the application itself.
+ *
+ * @param   rbpf        rBPF application
+ * @param   prog_array  Applications reached by the tail calls
+ */
+static inline void rbpf_application_prog_array_init(rbpf_application_t *rbpf,
+                                                    const rbpf_prog_array_t *prog_array)
+{
+    rbpf->prog_array = prog_array;
+}
+
+/**
+ * @brief Supply the key/value stores of the application
+ *
+ * Only used when RBPF_ENABLE_STORE_CALLS is set. The global store is the same
+ * for all the applications, the local one is the application's own.
+ *
+ * @param   rbpf    rBPF application
+ * @param   local   Store of the application, NULL for none
+ * @param   global  Store shared by the applications, NULL for none
+ */
+static inline void rbpf_application_store_init(rbpf_application_t *rbpf, rbpf_store_t *local,
+                                               rbpf_store_t *global)
+{
+    rbpf->local_store = local;
+    rbpf->global_store = global;
+}
+
+/**
+ * @brief Supply the buffer for the pre-decoded form of the application
+ *
+ * Only used when RBPF_ENABLE_LOWERING is set. The buffer must hold one entry
+ * per instruction of the application text, two for the double word loads of a
+ * compressed text, it is filled by the pre-flight
+ * checks and must remain valid as long as the application runs. The
+ * pre-decoded form refers to the register file of @p rbpf, which must not be
+ * moved after the pre-flight checks.
+ *
+ * @param   rbpf    rBPF application
+ * @param   buf     Buffer for the pre-decoded instructions
+ * @param   len     Number of instructions @p buf holds
+ */
+static inline void rbpf_application_lowering_init(rbpf_application_t *rbpf, rbpf_insn_t *buf,
+                                                  size_t len)
+{
+    rbpf->lowered = buf;
+    rbpf->lowered_len = len;
+}
+
+/**
+ * @brief Get the name of a superinstruction of the pre-decoded form
+ *
+ * Used to report rbpf_application_t::fusions after the pre-flight checks when
+ * RBPF_ENABLE_FUSION is set.
+ *
+ * @param   fusion  Superinstruction, below RBPF_FUSION_NUM
+ *
+ * @return  Name of the superinstruction
+ */
+const char *rbpf_fusion_name(unsigned fusion);
+
+/**
+ * @brief Supply the buffer for the just-in-time compiled code
+ *
+ * Only used when RBPF_ENABLE_JIT is set. The application is translated to
+ * Thumb-2 code in this buffer by the pre-flight checks and the native code is
+ * executed instead of the interpreter. The buffer must be executable and
+ * remain valid as long as the application runs. Applications not fitting in
+ * the buffer, or using instructions the compiler doesn't support, keep being
+ * interpreted.
+ *
+ * @param   rbpf    rBPF application
+ * @param   buf     Buffer for the native code
+ * @param   len     Length of @p buf in bytes
+ */
+static inline void rbpf_application_jit_init(rbpf_application_t *rbpf, void *buf, size_t len)
+{
+    rbpf->jit_buf = buf;
+    rbpf->jit_len = len;
+}
+
+/**
+ * @brief Supply the buffer for the memory proof of the application
+ *
+ * Only used when RBPF_ENABLE_MEMORY_PROOF is set. The pre-flight checks follow
+ * the pointers to the stack, the context, the data and the read-only data
+ * through the application and record, with one bit per instruction, the loads
+ * and stores always within their region. Those skip the memory permission
+ * checks. Accesses to the context are proven against the largest context
+ * offset they use, runs with a smaller context check every access. With
+ * RBPF_ENABLE_LOWERING, the loops walking the memory with a pointer and
+ * counting their iterations down, such as the one of fletcher32, check the
+ * whole range the pointer walks once, when entered, and skip the checks of
+ * their accesses through it. A range out of bounds makes the rest of the run
+ * check every access. Their number is left in rbpf_application_t::guards. The
+ * buffer must remain valid as long as the application runs. Applications not
+ * fitting in the buffer check every access.
+ *
+ * @param   rbpf    rBPF application
+ * @param   buf     Buffer for the proof
+ * @param   len     Number of 32 bit words @p buf holds
+ */
+static inline void rbpf_application_proof_init(rbpf_application_t *rbpf, uint32_t *buf,
+                                               size_t len)
+{
+    rbpf->proof = buf;
+    rbpf->proof_len = len;
+}
+
+/**
+ * @brief Supply the memory of the arena of the application
+ *
+ * Only used when RBPF_ENABLE_MASKING is set, and must precede
+ * rbpf_application_setup(). The arena is the largest block of @p buf whose
+ * length is a power of two and which is aligned on its length, leaving 8 bytes
+ * after it for the accesses straddling its end. rbpf_application_setup() places
+ * the stack, instead of the one passed, and copies the data and the read-only
+ * data of the application in the arena. Every address the application accesses
+ * is then confined to the arena by masking, without any memory check, the
+ * memory regions only apply to the functions called by the application. The
+ * copy of the read-only data is writable by the application.
+ *
+ * The context of a run is copied in the arena and back when it lies outside.
+ * Memory the context points to must be allocated with rbpf_arena_alloc().
+ *
+ * @param   rbpf    rBPF application
+ * @param   buf     Buffer for the arena
+ * @param   len     Length of @p buf in bytes
+ *
+ * @return  Length of the arena, negative when @p buf can't hold the stack
+ */
+int rbpf_application_arena_init(rbpf_application_t *rbpf, void *buf, size_t len);
+
+/**
+ * @brief Allocate memory reachable by the application in its arena
+ *
+ * Only used when RBPF_ENABLE_MASKING is set, after rbpf_application_setup().
+ *
+ * @param   rbpf    rBPF application
+ * @param   len     Length of the memory in bytes
+ *
+ * @return  8 bytes aligned memory, NULL when the arena is full
+ */
+void *rbpf_arena_alloc(rbpf_application_t *rbpf, size_t len);
+
+/**
+ * @brief Supply the sandbox running the application
+ *
+ * Only used when RBPF_ENABLE_MPU is set, the memory accesses of the
+ * application are then never checked and every run goes through @p sandbox.
+ * The application itself stays out of reach of the sandbox: each run copies
+ * the application to @p shadow, which holds the register file of the run, and
+ * @p sandbox runs the copy. The data section is laid out after the copy by
+ * rbpf_application_setup(), called after this function. The sandbox must only
+ * let the application write to @p shadow, its stack, its context, its frames
+ * and its maps, and only let it read its image, its pre-decoded form and the
+ * data of its context besides: the memory of the host, the stores and the
+ * checksums of the maps included, must stay out of its reach. The host only
+ * takes back the registers and the state of the run from the copy, once
+ * checked. The runs fail with
+ * RBPF_ILLEGAL_MEM without a sandbox and with RBPF_OUT_OF_MEMORY when the
+ * data section doesn't fit in @p shadow. The pre-flight checks still run
+ * outside of the sandbox, and the application is always interpreted.
+ *
+ * @param   rbpf    rBPF application
+ * @param   sandbox Sandbox running the application
+ * @param   arg     Argument passed to @p sandbox
+ * @param   shadow  Memory of the copy of the application, aligned on 8 bytes
+ * @param   len     Length of @p shadow in bytes, at least the size of the
+ *                  application plus its data section
+ */
+static inline void rbpf_application_sandbox_init(rbpf_application_t *rbpf,
+                                                 rbpf_sandbox_t sandbox, void *arg,
+                                                 void *shadow, size_t len)
+{
+    rbpf->sandbox = sandbox;
+    rbpf->sandbox_arg = arg;
+    rbpf->shadow = shadow;
+    rbpf->shadow_len = len;
+}
+
+/**
+ * @brief Run the application without any memory check
+ *
+ * Only used when RBPF_ENABLE_MPU is set, called by the sandbox from within
+ * the isolated context once the run is set up.
+ *
+ * @param   rbpf    Copy of the rBPF application the sandbox was given
+ *
+ * @return  Execution result of the virtual machine, negative on error
+ */
+int rbpf_application_run_sandboxed(rbpf_application_t *rbpf);
+
 /**
  * @brief Initialize a memory region
  *
@@ -334,7 +1132,7 @@ static inline void *rbpf_application_rodata(const rbpf_application_t *rbpf)
 {
     const rbpf_header_t *header = rbpf_header(rbpf);
 
-    return (uint8_t *)header + sizeof(rbpf_application_t) + header->data_len;
+    return (uint8_t *)header + sizeof(rbpf_header_t) + header->data_len;
 }
 
 /**
@@ -362,7 +1160,7 @@ static inline void *rbpf_application_data(const rbpf_application_t *rbpf)
 {
     const rbpf_header_t *header = rbpf_header(rbpf);
 
-    return (uint8_t *)header + sizeof(rbpf_application_t);
+    return (uint8_t *)header + sizeof(rbpf_header_t);
 }
 
 /**
@@ -407,8 +1205,169 @@ static inline size_t rbpf_application_text_len(const rbpf_application_t *rbpf)
     return header->text_len;
 }
 
-/* to be implemented by platform specifc code. */
-void rbpf_store_init(void);
+/**
+ * @brief Get a pointer to the rBPF application function table
+ *
+ * @param   rBPF    The rBPF application
+ *
+ * @return  The pointer of the rBPF applications function table, of
+ *          rbpf_header_t::functions entries
+ */
+static inline const rbpf_function_t *rbpf_application_functions(const rbpf_application_t *rbpf)
+{
+    const rbpf_header_t *header = rbpf_header(rbpf);
+
+    return (const rbpf_function_t *)((uint8_t *)rbpf_application_text(rbpf) +
+                                     header->text_len);
+}
+
+/**
+ * @brief Get a pointer to the rBPF application list of maps
+ *
+ * @param   rBPF    The rBPF application
+ *
+ * @return  The pointer of the list following the function table, NULL when
+ *          the application has no maps
+ */
+static inline const rbpf_map_list_t *rbpf_application_maps(const rbpf_application_t *rbpf)
+{
+    const rbpf_header_t *header = rbpf_header(rbpf);
+
+    if (!(header->flags & RBPF_HEADER_FLAG_MAPS)) {
+        return NULL;
+    }
+    return (const rbpf_map_list_t *)(rbpf_application_functions(rbpf) + header->functions);
+}
+
+/**
+ * @brief Lay out the maps of the application in a buffer
+ *
+ * Only available when RBPF_ENABLE_MAPS is set. Must be called after
+ * rbpf_application_setup() and before the first run. The maps are zeroed and
+ * laid out one after the other, each starting at a multiple of 8 bytes, and
+ * the application may load and store anywhere in them. With
+ * RBPF_ENABLE_MASKING the buffer must lie in the arena, see
+ * rbpf_arena_alloc(), and with RBPF_ENABLE_MPU in the sandbox.
+ *
+ * @param   rbpf    rBPF application
+ * @param   buf     Buffer of the maps, 8 bytes aligned
+ * @param   len     Length of @p buf in bytes
+ *
+ * @return  Number of bytes of @p buf in use, 0 for an application without
+ *          maps
+ * @return  RBPF_ILLEGAL_LEN when the list of maps lies beyond the application
+ * @return  RBPF_ILLEGAL_INSTRUCTION for a type or a flag of map not supported
+ * @return  RBPF_OUT_OF_MEMORY when @p buf can't hold the maps
+ * @return  RBPF_ILLEGAL_MEM when @p buf lies outside of the arena
+ */
+int rbpf_application_maps_init(rbpf_application_t *rbpf, void *buf, size_t len);
+
+/**
+ * @brief Supply the storage of the persistent maps of the application
+ *
+ * Only available when RBPF_ENABLE_MAPS is set. Must be called after
+ * rbpf_application_maps_init() and before the first run. The maps flagged
+ * BPF_F_PERSISTENT only live in RAM without a storage. The checksums of the
+ * pages of the persistent maps, one per page, are kept in @p sums, which
+ * must stay out of reach of the application: with RBPF_ENABLE_MPU, out of
+ * the sandbox.
+ *
+ * @param   rbpf    rBPF application
+ * @param   storage Storage of the maps, NULL for none
+ * @param   sums    Checksums of the pages of the persistent maps
+ * @param   len     Number of checksums @p sums holds
+ *
+ * @return  Number of checksums in use
+ * @return  RBPF_OUT_OF_MEMORY when @p sums can't hold a checksum per page
+ */
+int rbpf_application_map_storage_init(rbpf_application_t *rbpf, const rbpf_map_storage_t *storage,
+                                      uint32_t *sums, size_t len);
+
+/**
+ * @brief Get an element of a map of the application
+ *
+ * Returns what the BPF_FUNC_BPF_MAP_LOOKUP helper returns to the application.
+ *
+ * @param   rbpf    rBPF application
+ * @param   map     Number of the map
+ * @param   index   Index of the element
+ *
+ * @return  Pointer to the element, NULL when the map or the element does not
+ *          exist or the maps are not laid out
+ */
+void *rbpf_application_map_lookup(const rbpf_application_t *rbpf, uint32_t map, uint32_t index);
+
+/**
+ * @brief Write the changes of the persistent maps back to their storage
+ *
+ * Only the pages that changed since they were last loaded or written are
+ * written, the adjacent ones in a single write. A page the storage fails to
+ * write is kept for the next sync, and the other pages are still written.
+ * Does nothing before the first run, the maps not being loaded yet. The
+ * host calls rbpf_application_maps_flush() instead, which doesn't write the
+ * maps of a suspended run.
+ *
+ * @param   rbpf    rBPF application
+ *
+ * @return  Number of pages written
+ * @return  RBPF_MAPS_NOT_SYNCED when the storage failed to write a page
+ */
+int rbpf_application_maps_sync(rbpf_application_t *rbpf);
+
+/**
+ * @brief Periodic write-back of the persistent maps
+ *
+ * Meant to be called by the host on a timer, or between its runs, to bound
+ * the changes lost on a reboot; also called at the end of the runs that
+ * called the BPF_FUNC_BPF_MAP_SYNC helper. Writes the maps back with
+ * rbpf_application_maps_sync(), unless a run of the application is
+ * suspended: its maps may then be half updated, and are written back once
+ * the run ends. After a failure, the end of the next run writes the maps back
+ * again.
+ *
+ * @param   rbpf    rBPF application
+ *
+ * @return  Number of pages written, 0 while a run is suspended
+ * @return  RBPF_MAPS_NOT_SYNCED when the storage failed to write a page
+ */
+int rbpf_application_maps_flush(rbpf_application_t *rbpf);
+
+/**
+ * @brief Lay out an empty key/value store in a buffer
+ *
+ * Only available when RBPF_ENABLE_STORE_CALLS is set. The store takes the
+ * largest power of two of entries the buffer holds, see RBPF_STORE_SIZE().
+ *
+ * @param   store   Store to initialize
+ * @param   buf     Buffer of the store, 4 bytes aligned
+ * @param   len     Length of @p buf in bytes
+ *
+ * @return  Number of entries of the store, RBPF_OUT_OF_MEMORY when @p buf
+ *          can't hold two
+ */
+int rbpf_store_init(rbpf_store_t *store, void *buf, size_t len);
+
+/**
+ * @brief Set the value of a key of a store
+ *
+ * @param   store   Store
+ * @param   key     Key
+ * @param   value   Value
+ *
+ * @return  0 on success, -1 when the key is new and the store full
+ */
+int rbpf_store_update(rbpf_store_t *store, uint32_t key, uint32_t value);
+
+/**
+ * @brief Get the value of a key of a store
+ *
+ * @param   store   Store
+ * @param   key     Key
+ * @param   value   Value of the key, 0 when not found
+ *
+ * @return  true when the key was found
+ */
+bool rbpf_store_fetch(const rbpf_store_t *store, uint32_t key, uint32_t *value);
 
 #ifdef __cplusplus
 }
@@ -14,8 +14,15 @@
 extern "C" {
 #endif
 
-/* TODO: add headers for system calls */
-
+/**
+ * @brief Helper of a call instruction
+ *
+ * @param   num     Number of the call, the immediate of the instruction
+ *
+ * @returns the built-in helper or the helper of the host with that number,
+ *          NULL when unknown
+ */
+const rbpf_helper_t *rbpf_get_helper(uint32_t num);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2023 Freie Universität Berlin
+ * Copyright (C) 2023 Inria
+ * Copyright (C) 2023 Koen Zandberg <koen@bergzand.net>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/*
+ * Compressed text, written by `gen_rbf.py generate --compress`
+ *
+ * Every instruction starts with its opcode and registers bytes, followed by
+ * the fields it uses only, in little endian and unaligned:
+ *
+ *  - 2 bytes: ALU on registers, negation and return
+ *  - 4 bytes: 16 bit offset, for the register loads and stores and the jumps
+ *             on registers
+ *  - 6 bytes: 32 bit immediate, for ALU with an immediate, the byte order
+ *             conversions and calls
+ *  - 8 bytes: 16 bit offset and 32 bit immediate, for the immediate stores, the
+ *             atomic operations, the jumps on an immediate and the long jump
+ *  - 10 bytes: 64 bit immediate, for the double word loads
+ *
+ * The offset of a jump is in bytes, from the end of the jump instruction. The
+ * offset of the ALU instructions, for the signed divisions and sign extending
+ * moves, has no encoding.
+ */
+
+#ifndef RBPF_COMPRESSED_H
+#define RBPF_COMPRESSED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "rbpf/instruction.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Length of a compressed instruction, 0 for an opcode without encoding */
+static inline size_t rbpf_compressed_len(uint8_t opcode)
+{
+    switch (opcode & BPF_INSTRUCTION_CLS_MASK) {
+    case BPF_INSTRUCTION_CLS_LD:
+        return (opcode == BPF_INSTRUCTION_MEM_LDDW || opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+                opcode == BPF_INSTRUCTION_MEM_LDDWR) ? 10 : 0;
+    case BPF_INSTRUCTION_CLS_STX:
+        if ((opcode & BPF_INSTRUCTION_MEM_MDE_MASK) == BPF_INSTRUCTION_STX_ATOMIC) {
+            return 8;
+        }
+        /* fall through */
+    case BPF_INSTRUCTION_CLS_LDX:
+        return 4;
+    case BPF_INSTRUCTION_CLS_ST:
+        return 8;
+    case BPF_INSTRUCTION_CLS_ALU32:
+    case BPF_INSTRUCTION_CLS_ALU64:
+        if ((opcode & BPF_INSTRUCTION_ALU_OP_MASK) == BPF_INSTRUCTION_ALU_NEG) {
+            return 2;
+        }
+        if ((opcode & BPF_INSTRUCTION_ALU_OP_MASK) == BPF_INSTRUCTION_ALU_BYTESWAP) {
+            return 6;
+        }
+        return (opcode & BPF_INSTRUCTION_ALU_S_MASK) ? 2 : 6;
+    case BPF_INSTRUCTION_CLS_BRANCH:
+        if (opcode == BPF_INSTRUCTION_CALL) {
+            return 6;
+        }
+        if (opcode == BPF_INSTRUCTION_RETURN) {
+            return 2;
+        }
+        if (opcode == BPF_INSTRUCTION_JMP_ALWAYS) {
+            return 4;
+        }
+        /* fall through */
+    case BPF_INSTRUCTION_CLS_JMP32:
+        return (opcode & BPF_INSTRUCTION_ALU_S_MASK) ? 4 : 8;
+    default:
+        return 0;
+    }
+}
+
+/* Expand the compressed instruction, into two instructions for the double
+ * word loads, and return its length */
+static inline size_t rbpf_compressed_expand(const uint8_t *pc, bpf_instruction_t *instr)
+{
+    size_t len = rbpf_compressed_len(pc[0]);
+    int16_t offset = 0;
+    int32_t immediate[2] = { 0, 0 };
+
+    switch (len) {
+    case 4:
+        memcpy(&offset, pc + 2, sizeof(offset));
+        break;
+    case 6:
+        memcpy(&immediate[0], pc + 2, sizeof(immediate[0]));
+        break;
+    case 8:
+        memcpy(&offset, pc + 2, sizeof(offset));
+        memcpy(&immediate[0], pc + 4, sizeof(immediate[0]));
+        break;
+    case 10:
+        memcpy(immediate, pc + 2, sizeof(immediate));
+        instr[1].opcode = 0;
+        instr[1].dst = 0;
+        instr[1].src = 0;
+        instr[1].offset = 0;
+        instr[1].immediate = immediate[1];
+        break;
+    }
+    instr->opcode = pc[0];
+    instr->dst = pc[1] & 0x0f;
+    instr->src = pc[1] >> 4;
+    instr->offset = offset;
+    instr->immediate = immediate[0];
+    return len;
+}
+
+/* Number of instruction slots of the expanded text preceding the offset, the
+ * double word loads take two */
+static inline size_t rbpf_compressed_slots(const uint8_t *text, size_t offset)
+{
+    size_t slots = 0;
+
+    for (size_t pc = 0; pc < offset; pc += rbpf_compressed_len(text[pc])) {
+        slots += rbpf_compressed_len(text[pc]) == 10 ? 2 : 1;
+    }
+    return slots;
+}
+
+/* Offset of the instruction taking the slot of the expanded text, the length
+ * of the text when no instruction starts at the slot */
+static inline size_t rbpf_compressed_offset(const uint8_t *text, size_t len, size_t slot)
+{
+    size_t slots = 0;
+    size_t pc;
+
+    for (pc = 0; pc < len && slots < slot; pc += rbpf_compressed_len(text[pc])) {
+        slots += rbpf_compressed_len(text[pc]) == 10 ? 2 : 1;
+    }
+    return slots == slot ? pc : len;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBPF_COMPRESSED_H */
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2023 Inria
+ * Copyright (C) 2023 Koen Zandberg <koen@bergzand.net>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/*
+ * 64 bit divisions and modulos of the native code, shared by the just-in-time
+ * compiler and the native code section
+ *
+ * The cores have no 64 bit division, the native code calls these functions
+ * instead. The divisor is checked for zero by the native code beforehand.
+ */
+
+#ifndef RBPF_DIVIDE_H
+#define RBPF_DIVIDE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline uint64_t rbpf_native_div(uint64_t a, uint64_t b)
+{
+    return a / b;
+}
+
+static inline uint64_t rbpf_native_mod(uint64_t a, uint64_t b)
+{
+    return a % b;
+}
+
+/* The division of the smallest value by -1 wraps around, as the interpreter */
+static inline uint64_t rbpf_native_sdiv(uint64_t a, uint64_t b)
+{
+    return (int64_t)b == -1 ? 0 - a : (uint64_t)((int64_t)a / (int64_t)b);
+}
+
+static inline uint64_t rbpf_native_smod(uint64_t a, uint64_t b)
+{
+    return (int64_t)b == -1 ? 0 : (uint64_t)((int64_t)a % (int64_t)b);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBPF_DIVIDE_H */
@@ -0,0 +1,519 @@
+/*
+ * Copyright (C) 2023 Inria
+ * Copyright (C) 2023 Koen Zandberg <koen@bergzand.net>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/*
+ * Built-in helpers of the call instructions
+ *
+ * The helpers are found by number in a table indexed by the number of the
+ * call, which holds the type of their arguments for the pre-flight checks.
+ * The numbers the table doesn't hold go to the helpers of the host.
+ *
+ * With RBPF_ENABLE_MPU the helpers run in the sandbox along with the
+ * application, which never reaches the memory of the host: the helpers of the
+ * host, the stores and the tail calls through the program array are left out.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kernel_defines.h"
+#include "rbpf.h"
+#include "rbpf/builtin_shared.h"
+#include "rbpf/builtin_calls.h"
+#include "rbpf/config.h"
+
+#if (RBPF_ENABLE_TAIL_CALLS) && !(RBPF_ENABLE_MPU)
+/* The tail call only picks the next application, the interpreter leaves the
+ * current one right after the call and the run starts the next one */
+static uint64_t _rbpf_tail_call(rbpf_application_t *rbpf, uint64_t ctx, uint64_t index,
+                                uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    const rbpf_prog_array_t *prog_array = rbpf->prog_array;
+    rbpf_application_t *next;
+
+    if (!prog_array || index >= prog_array->len || !rbpf->tail_calls_remaining) {
+        return UINT32_MAX;
+    }
+    next = prog_array->apps[index];
+    if (!next || !(next->flags & RBPF_FLAG_SETUP_DONE)) {
+        return UINT32_MAX;
+    }
+#if (RBPF_ENABLE_MASKING)
+    /* The context must lie in the arena of the next application as well */
+    if (next->arena != rbpf->arena) {
+        return UINT32_MAX;
+    }
+#endif
+    rbpf->tail_call = next;
+    return 0;
+}
+#endif
+
+#if (RBPF_ENABLE_MEM_CALLS) || (RBPF_ENABLE_HASH_CALLS) || \
+    ((RBPF_ENABLE_STORE_CALLS) && !(RBPF_ENABLE_MPU))
+/* The range of the application in the memory of the host, NULL when the
+ * application can't access all of it */
+static uint8_t *_rbpf_range(const rbpf_application_t *rbpf, uint64_t addr, uint64_t len,
+                            bool store)
+{
+#if (RBPF_ENABLE_MASKING)
+    /* Confined to the arena like the accesses of the instructions */
+    uintptr_t offset = (uintptr_t)addr & (rbpf->arena_len - 1);
+
+    if (len > rbpf->arena_len - offset) {
+        return NULL;
+    }
+    return rbpf->arena + offset;
+#else
+    if (addr > UINTPTR_MAX || len > UINTPTR_MAX - addr) {
+        return NULL;
+    }
+#if (RBPF_ENABLE_MPU)
+    /* The MPU isolating the sandbox catches the illegal accesses */
+    (void)rbpf;
+    (void)store;
+#else
+    if (store ? !rbpf_store_allowed(rbpf, (void *)(uintptr_t)addr, len) :
+                !rbpf_load_allowed(rbpf, (void *)(uintptr_t)addr, len)) {
+        return NULL;
+    }
+#endif
+    return (uint8_t *)(uintptr_t)addr;
+#endif
+}
+
+#define WORD_ALIGNED(PTR)   (((uintptr_t)(PTR) & (sizeof(uint32_t) - 1)) == 0)
+#endif
+
+#if (RBPF_ENABLE_MEM_CALLS)
+static uint64_t _rbpf_memcpy(rbpf_application_t *rbpf, uint64_t dst_addr, uint64_t src_addr,
+                             uint64_t len, uint64_t r4, uint64_t r5)
+{
+    uint8_t *dst = _rbpf_range(rbpf, dst_addr, len, true);
+    const uint8_t *src = _rbpf_range(rbpf, src_addr, len, false);
+
+    if (!dst || !src) {
+        return UINT64_MAX;
+    }
+    memcpy(dst, src, (size_t)len);
+    return 0;
+}
+
+static uint64_t _rbpf_memset(rbpf_application_t *rbpf, uint64_t dst_addr, uint64_t c,
+                             uint64_t len, uint64_t r4, uint64_t r5)
+{
+    uint8_t *dst = _rbpf_range(rbpf, dst_addr, len, true);
+
+    if (!dst) {
+        return UINT64_MAX;
+    }
+    memset(dst, (uint8_t)c, (size_t)len);
+    return 0;
+}
+
+static uint64_t _rbpf_memcmp(rbpf_application_t *rbpf, uint64_t a_addr, uint64_t b_addr,
+                             uint64_t len, uint64_t r4, uint64_t r5)
+{
+    const uint8_t *a = _rbpf_range(rbpf, a_addr, len, false);
+    const uint8_t *b = _rbpf_range(rbpf, b_addr, len, false);
+    size_t i = 0;
+
+    /* Negative in the lower half as well, for the callers comparing an int */
+    if (!a || !b) {
+        return (uint64_t)(int64_t)INT32_MIN;
+    }
+    /* Whole words are skipped while equal, the bytes tell the order */
+    if (WORD_ALIGNED(a) && WORD_ALIGNED(b)) {
+        for (; len - i >= sizeof(uint32_t) &&
+             *(const uint32_t *)(a + i) == *(const uint32_t *)(b + i); i += sizeof(uint32_t)) {}
+    }
+    for (; i < len; i++) {
+        if (a[i] != b[i]) {
+            return (uint64_t)((int64_t)a[i] - b[i]);
+        }
+    }
+    return 0;
+}
+
+static uint64_t _rbpf_memchr(rbpf_application_t *rbpf, uint64_t s_addr, uint64_t c,
+                             uint64_t len, uint64_t r4, uint64_t r5)
+{
+    const uint8_t *s = _rbpf_range(rbpf, s_addr, len, false);
+
+    if (!s) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == (uint8_t)c) {
+            return s_addr + i;
+        }
+    }
+    return 0;
+}
+#endif
+
+#if (RBPF_ENABLE_HASH_CALLS)
+/* Words read in any alignment, the Cortex-M4 loads them in one access */
+static inline uint32_t _rbpf_word(const uint8_t *data)
+{
+    uint32_t word;
+
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+/* Folds a sum of the Fletcher-32 checksum back to 16 bits */
+#define FLETCHER32_REDUCE(SUM)  ((SUM) = ((SUM) & 0xffff) + ((SUM) >> 16))
+
+/* The sums add two words per load, up to 358 words between the reductions
+ * so that they don't overflow. With the DSP extension, UXTAH adds either half
+ * of the loaded word without extracting it first. */
+static uint64_t _rbpf_fletcher32(rbpf_application_t *rbpf, uint64_t state, uint64_t addr,
+                                 uint64_t len, uint64_t r4, uint64_t r5)
+{
+    const uint8_t *data = _rbpf_range(rbpf, addr, len, false);
+    uint32_t sum1 = state & 0xffff;
+    uint32_t sum2 = (state >> 16) & 0xffff;
+    size_t words = len / 2;
+
+    if (!data) {
+        return UINT64_MAX;
+    }
+    while (words) {
+        size_t block = words > 358 ? 358 : words;
+
+        words -= block;
+        for (; block >= 2; block -= 2, data += 4) {
+            uint32_t word = _rbpf_word(data);
+#if defined(__ARM_FEATURE_DSP)
+            __asm__ ("uxtah %0, %0, %1" : "+r" (sum1) : "r" (word));
+            sum2 += sum1;
+            __asm__ ("uxtah %0, %0, %1, ror #16" : "+r" (sum1) : "r" (word));
+            sum2 += sum1;
+#else
+            sum1 += word & 0xffff;
+            sum2 += sum1;
+            sum1 += word >> 16;
+            sum2 += sum1;
+#endif
+        }
+        if (block) {
+            sum1 += data[0] | (data[1] << 8);
+            sum2 += sum1;
+            data += 2;
+        }
+        FLETCHER32_REDUCE(sum1);
+        FLETCHER32_REDUCE(sum2);
+    }
+    if (len & 1) {
+        sum1 += data[0];
+        sum2 += sum1;
+        FLETCHER32_REDUCE(sum1);
+        FLETCHER32_REDUCE(sum2);
+    }
+    FLETCHER32_REDUCE(sum1);
+    FLETCHER32_REDUCE(sum2);
+    return (sum2 << 16) | sum1;
+}
+
+/* CRC-32 of the reflected polynomial 0xedb88320, four bits at a time to keep
+ * the table small */
+static const uint32_t _rbpf_crc32_table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static inline uint32_t _rbpf_crc32_bits(uint32_t crc, unsigned bits)
+{
+    for (; bits; bits -= 4) {
+        crc = (crc >> 4) ^ _rbpf_crc32_table[crc & 0xf];
+    }
+    return crc;
+}
+
+static uint64_t _rbpf_crc32(rbpf_application_t *rbpf, uint64_t state, uint64_t addr,
+                            uint64_t len, uint64_t r4, uint64_t r5)
+{
+    const uint8_t *data = _rbpf_range(rbpf, addr, len, false);
+    uint32_t crc = ~(uint32_t)state;
+    size_t i = 0;
+
+    if (!data) {
+        return UINT64_MAX;
+    }
+    for (; len - i >= sizeof(uint32_t); i += sizeof(uint32_t)) {
+        crc = _rbpf_crc32_bits(crc ^ _rbpf_word(data + i), 32);
+    }
+    for (; i < len; i++) {
+        crc = _rbpf_crc32_bits(crc ^ data[i], 8);
+    }
+    return ~crc;
+}
+
+static const uint32_t _rbpf_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(X, N)     (((X) >> (N)) | ((X) << (32 - (N))))
+
+/* The message schedule is kept as a window of 16 words */
+static void _rbpf_sha256_block(uint32_t *hash, const uint8_t *block)
+{
+    uint32_t w[16];
+    uint32_t a = hash[0], b = hash[1], c = hash[2], d = hash[3];
+    uint32_t e = hash[4], f = hash[5], g = hash[6], h = hash[7];
+
+    for (unsigned i = 0; i < 64; i++) {
+        uint32_t t1, t2;
+
+        if (i < 16) {
+            w[i] = __builtin_bswap32(_rbpf_word(block + 4 * i));
+        }
+        else {
+            uint32_t w15 = w[(i - 15) % 16], w2 = w[(i - 2) % 16];
+            w[i % 16] += (ROR32(w15, 7) ^ ROR32(w15, 18) ^ (w15 >> 3)) + w[(i - 7) % 16] +
+                         (ROR32(w2, 17) ^ ROR32(w2, 19) ^ (w2 >> 10));
+        }
+        t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+             _rbpf_sha256_k[i] + w[i % 16];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    hash[0] += a;
+    hash[1] += b;
+    hash[2] += c;
+    hash[3] += d;
+    hash[4] += e;
+    hash[5] += f;
+    hash[6] += g;
+    hash[7] += h;
+}
+
+static uint64_t _rbpf_sha256_init(rbpf_application_t *rbpf, uint64_t addr, uint64_t r2,
+                                  uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    bpf_sha256_state_t *state = (bpf_sha256_state_t *)_rbpf_range(rbpf, addr, sizeof(*state),
+                                                                  true);
+
+    if (!state) {
+        return UINT64_MAX;
+    }
+    memcpy(state->hash, init, sizeof(init));
+    state->len = 0;
+    return 0;
+}
+
+static uint64_t _rbpf_sha256_update(rbpf_application_t *rbpf, uint64_t addr, uint64_t data_addr,
+                                    uint64_t len, uint64_t r4, uint64_t r5)
+{
+    bpf_sha256_state_t *state = (bpf_sha256_state_t *)_rbpf_range(rbpf, addr, sizeof(*state),
+                                                                  true);
+    const uint8_t *data = _rbpf_range(rbpf, data_addr, len, false);
+    size_t used;
+
+    if (!state || !data) {
+        return UINT64_MAX;
+    }
+    used = state->len % sizeof(state->block);
+    state->len += len;
+
+    /* Whole blocks are hashed in place, the rest waits in the state */
+    if (used) {
+        size_t fill = sizeof(state->block) - used;
+        if (fill > len) {
+            fill = len;
+        }
+        memcpy(state->block + used, data, fill);
+        data += fill;
+        len -= fill;
+        if (used + fill < sizeof(state->block)) {
+            return 0;
+        }
+        _rbpf_sha256_block(state->hash, state->block);
+    }
+    for (; len >= sizeof(state->block); len -= sizeof(state->block)) {
+        _rbpf_sha256_block(state->hash, data);
+        data += sizeof(state->block);
+    }
+    memcpy(state->block, data, len);
+    return 0;
+}
+
+static uint64_t _rbpf_sha256_final(rbpf_application_t *rbpf, uint64_t addr, uint64_t digest_addr,
+                                   uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    bpf_sha256_state_t *state = (bpf_sha256_state_t *)_rbpf_range(rbpf, addr, sizeof(*state),
+                                                                  true);
+    uint8_t *digest = _rbpf_range(rbpf, digest_addr, 32, true);
+    size_t used;
+    uint64_t bits;
+
+    if (!state || !digest) {
+        return UINT64_MAX;
+    }
+    used = state->len % sizeof(state->block);
+    bits = state->len * 8;
+
+    /* Padding with a one bit, zeros and the length in bits */
+    state->block[used++] = 0x80;
+    if (used > sizeof(state->block) - sizeof(bits)) {
+        memset(state->block + used, 0, sizeof(state->block) - used);
+        _rbpf_sha256_block(state->hash, state->block);
+        used = 0;
+    }
+    memset(state->block + used, 0, sizeof(state->block) - sizeof(bits) - used);
+    for (unsigned i = 0; i < sizeof(bits); i++) {
+        state->block[sizeof(state->block) - 1 - i] = bits >> (8 * i);
+    }
+    _rbpf_sha256_block(state->hash, state->block);
+
+    for (unsigned i = 0; i < 8; i++) {
+        uint32_t word = __builtin_bswap32(state->hash[i]);
+        memcpy(digest + 4 * i, &word, sizeof(word));
+    }
+    return 0;
+}
+#endif
+
+#if (RBPF_ENABLE_STORE_CALLS) && !(RBPF_ENABLE_MPU)
+static uint64_t _rbpf_store(rbpf_store_t *store, uint64_t key, uint64_t value)
+{
+    if (!store || rbpf_store_update(store, (uint32_t)key, (uint32_t)value) < 0) {
+        return UINT64_MAX;
+    }
+    return 0;
+}
+
+static uint64_t _rbpf_fetch(const rbpf_application_t *rbpf, const rbpf_store_t *store,
+                            uint64_t key, uint64_t addr)
+{
+    uint8_t *value = _rbpf_range(rbpf, addr, sizeof(uint32_t), true);
+    uint32_t found;
+
+    if (!store || !value) {
+        return UINT64_MAX;
+    }
+    rbpf_store_fetch(store, (uint32_t)key, &found);
+    /* The application may hand an unaligned pointer */
+    memcpy(value, &found, sizeof(found));
+    return 0;
+}
+
+static uint64_t _rbpf_store_local(rbpf_application_t *rbpf, uint64_t key, uint64_t value,
+                                  uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    return _rbpf_store(rbpf->local_store, key, value);
+}
+
+static uint64_t _rbpf_store_global(rbpf_application_t *rbpf, uint64_t key, uint64_t value,
+                                   uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    return _rbpf_store(rbpf->global_store, key, value);
+}
+
+static uint64_t _rbpf_fetch_local(rbpf_application_t *rbpf, uint64_t key, uint64_t addr,
+                                  uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    return _rbpf_fetch(rbpf, rbpf->local_store, key, addr);
+}
+
+static uint64_t _rbpf_fetch_global(rbpf_application_t *rbpf, uint64_t key, uint64_t addr,
+                                   uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    return _rbpf_fetch(rbpf, rbpf->global_store, key, addr);
+}
+#endif
+
+#if (RBPF_ENABLE_MAPS)
+static uint64_t _rbpf_map_lookup(rbpf_application_t *rbpf, uint64_t map, uint64_t index,
+                                 uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    if (map > UINT32_MAX || index > UINT32_MAX) {
+        return 0;
+    }
+    return (uintptr_t)rbpf_application_map_lookup(rbpf, (uint32_t)map, (uint32_t)index);
+}
+
+/* Only asks for the sync, done once the run left the sandbox */
+static uint64_t _rbpf_map_sync(rbpf_application_t *rbpf, uint64_t r1, uint64_t r2,
+                               uint64_t r3, uint64_t r4, uint64_t r5)
+{
+    rbpf->flags |= RBPF_FLAG_MAPS_SYNC;
+    return 0;
+}
+#endif
+
+static const rbpf_helper_t _rbpf_helpers[] = {
+    /* Keeps the table valid without any helper */
+    [0] = { NULL, { 0 } },
+#if (RBPF_ENABLE_STORE_CALLS) && !(RBPF_ENABLE_MPU)
+    [BPF_FUNC_BPF_STORE_LOCAL] = { _rbpf_store_local, { RBPF_ARG_SCALAR, RBPF_ARG_SCALAR } },
+    [BPF_FUNC_BPF_STORE_GLOBAL] = { _rbpf_store_global, { RBPF_ARG_SCALAR, RBPF_ARG_SCALAR } },
+    [BPF_FUNC_BPF_FETCH_LOCAL] = { _rbpf_fetch_local, { RBPF_ARG_SCALAR, RBPF_ARG_MEM_WRITE } },
+    [BPF_FUNC_BPF_FETCH_GLOBAL] = { _rbpf_fetch_global,
+                                    { RBPF_ARG_SCALAR, RBPF_ARG_MEM_WRITE } },
+#endif
+#if (RBPF_ENABLE_TAIL_CALLS) && !(RBPF_ENABLE_MPU)
+    [BPF_FUNC_BPF_TAIL_CALL] = { _rbpf_tail_call, { RBPF_ARG_CTX, RBPF_ARG_SCALAR } },
+#endif
+#if (RBPF_ENABLE_MEM_CALLS)
+    [BPF_FUNC_BPF_MEMCPY] = { _rbpf_memcpy, { RBPF_ARG_MEM_WRITE, RBPF_ARG_MEM, RBPF_ARG_SIZE } },
+    [BPF_FUNC_BPF_MEMSET] = { _rbpf_memset,
+                              { RBPF_ARG_MEM_WRITE, RBPF_ARG_SCALAR, RBPF_ARG_SIZE } },
+    [BPF_FUNC_BPF_MEMCMP] = { _rbpf_memcmp, { RBPF_ARG_MEM, RBPF_ARG_MEM, RBPF_ARG_SIZE } },
+    [BPF_FUNC_BPF_MEMCHR] = { _rbpf_memchr, { RBPF_ARG_MEM, RBPF_ARG_SCALAR, RBPF_ARG_SIZE } },
+#endif
+#if (RBPF_ENABLE_HASH_CALLS)
+    [BPF_FUNC_BPF_FLETCHER32] = { _rbpf_fletcher32,
+                                  { RBPF_ARG_SCALAR, RBPF_ARG_MEM, RBPF_ARG_SIZE } },
+    [BPF_FUNC_BPF_CRC32] = { _rbpf_crc32, { RBPF_ARG_SCALAR, RBPF_ARG_MEM, RBPF_ARG_SIZE } },
+    [BPF_FUNC_BPF_SHA256_INIT] = { _rbpf_sha256_init, { RBPF_ARG_MEM_WRITE } },
+    /* The size only applies to the data, the helper checks the state */
+    [BPF_FUNC_BPF_SHA256_UPDATE] = { _rbpf_sha256_update,
+                                     { RBPF_ARG_ANY, RBPF_ARG_MEM, RBPF_ARG_SIZE } },
+    [BPF_FUNC_BPF_SHA256_FINAL] = { _rbpf_sha256_final,
+                                    { RBPF_ARG_MEM_WRITE, RBPF_ARG_MEM_WRITE } },
+#endif
+#if (RBPF_ENABLE_MAPS)
+    [BPF_FUNC_BPF_MAP_LOOKUP] = { _rbpf_map_lookup, { RBPF_ARG_CONST, RBPF_ARG_SCALAR } },
+    [BPF_FUNC_BPF_MAP_SYNC] = { _rbpf_map_sync, { 0 } },
+#endif
+};
+
+const rbpf_helper_t *rbpf_get_helper(uint32_t num)
+{
+    if (num < ARRAY_SIZE(_rbpf_helpers) && _rbpf_helpers[num].call) {
+        return &_rbpf_helpers[num];
+    }
+#if (RBPF_ENABLE_MPU)
+    return NULL;
+#else
+    return rbpf_get_external_call(num);
+#endif
+}
@@ -0,0 +1,1365 @@
+/*
+ * Copyright (C) 2023 Inria
+ * Copyright (C) 2023 Koen Zandberg <koen@bergzand.net>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/*
+ * Just-in-time compiler from eBPF to Thumb-2, for ARMv7-M cores.
+ *
+ * The application is translated once during the pre-flight checks into the
+ * buffer supplied with rbpf_application_jit_init(). The generated code is a
+ * function taking the application as only argument and returning the rBPF
+ * exit code, with the register file of the application (rbpf->regmap) as
+ * in- and output.
+ *
+ * Register usage of the generated code:
+ *  - r0:r1 and r2:r3 hold the destination and source operands of the
+ *    instruction being executed when they live in the register file,
+ *  - r4:r5, r6:r7 and r8:r9 cache the three most used eBPF registers for
+ *    the whole run,
+ *  - r11 holds the application,
+ *  - r12 and lr are scratch registers,
+ *  - r10 (sl) is the PIC base of the firmware and is never touched.
+ *
+ * Memory accesses call rbpf_load_allowed() or rbpf_store_allowed() unless
+ * the access is relative to the frame pointer within the stack, and the
+ * application never writes the frame pointer, or the pre-flight checks proved
+ * the access in bounds. Every instruction slot gets its own code, so that the
+ * branch offsets translate directly.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "rbpf.h"
+#include "rbpf/builtin_shared.h"
+#include "rbpf/instruction.h"
+#include "rbpf/config.h"
+#include "atomic.h"
+#include "divide.h"
+
+#if (RBPF_ENABLE_JIT)
+
+extern rbpf_call_t rbpf_engine_get_call(uint32_t num);
+
+/* Stack taken by the arguments r2 to r5 of a helper call */
+#define JIT_CALL_STACK  (32)
+
+/* Registers of the generated code */
+#define JIT_DST         (0)     /* r0:r1, destination operand */
+#define JIT_SRC         (2)     /* r2:r3, source operand */
+#define JIT_PAIRS       (4)     /* r4:r5, r6:r7 and r8:r9, cached eBPF registers */
+#define JIT_NUM_PAIRS   (3)
+#define JIT_APP         (11)    /* r11, the application */
+#define JIT_TMP         (12)    /* r12, scratch */
+#define JIT_SP          (13)
+#define JIT_TMP2        (14)    /* lr, scratch, saved by the prologue */
+#define JIT_PC          (15)
+
+/* Saved by the prologue, restored by the epilogue */
+#define JIT_SAVED_REGS  ((1 << 4) | (1 << 5) | (1 << 6) | (1 << 7) | (1 << 8) | (1 << 9) | \
+                         (1 << 11))
+
+/* Offsets in the application struct */
+#define JIT_REG_OFFSET(reg)     (offsetof(rbpf_application_t, regmap) + 8 * (reg))
+#define JIT_BUDGET_OFFSET       (offsetof(rbpf_application_t, branches_remaining))
+
+/* Condition codes */
+#define COND_EQ         (0x0)
+#define COND_NE         (0x1)
+#define COND_CS         (0x2)
+#define COND_CC         (0x3)
+#define COND_PL         (0x5)
+#define COND_LS         (0x9)
+#define COND_GE         (0xa)
+#define COND_LT         (0xb)
+#define COND_AL         (0xe)
+
+/* Data processing operations */
+#define DP_AND          (0x0)
+#define DP_ORR          (0x2)
+#define DP_ORN          (0x3)
+#define DP_EOR          (0x4)
+#define DP_ADD          (0x8)
+#define DP_ADC          (0xa)
+#define DP_SBC          (0xb)
+#define DP_SUB          (0xd)
+#define DP_RSB          (0xe)
+
+/* Shift types */
+#define SHIFT_LSL       (0x0)
+#define SHIFT_LSR       (0x1)
+#define SHIFT_ASR       (0x2)
+
+/* Load and store with a 12 bit positive offset */
+#define LDST_STRB       (0xf880)
+#define LDST_LDRB       (0xf890)
+#define LDST_STRH       (0xf8a0)
+#define LDST_LDRH       (0xf8b0)
+#define LDST_STR        (0xf8c0)
+#define LDST_LDR        (0xf8d0)
+#define LDST_LDRSB      (0xf990)
+#define LDST_LDRSH      (0xf9b0)
+
+/* Extensions of the low byte or halfword */
+#define EXTEND_SXTH     (0xfa0f)
+#define EXTEND_UXTH     (0xfa1f)
+#define EXTEND_SXTB     (0xfa4f)
+
+/* Exits of the generated code, shared by all instructions */
+enum {
+    JIT_EXIT_ILLEGAL_INSTRUCTION,
+    JIT_EXIT_ILLEGAL_MEM,
+    JIT_EXIT_OUT_OF_BRANCHES,
+    JIT_EXIT_ILLEGAL_DIV,
+    JIT_EXIT_NUMOF,
+};
+
+static const int8_t _exit_codes[JIT_EXIT_NUMOF] = {
+    [JIT_EXIT_ILLEGAL_INSTRUCTION] = RBPF_ILLEGAL_INSTRUCTION,
+    [JIT_EXIT_ILLEGAL_MEM] = RBPF_ILLEGAL_MEM,
+    [JIT_EXIT_OUT_OF_BRANCHES] = RBPF_OUT_OF_BRANCHES,
+    [JIT_EXIT_ILLEGAL_DIV] = RBPF_ILLEGAL_DIV,
+};
+
+typedef struct {
+    uint16_t *code;                 /* Code buffer */
+    size_t len;                     /* Capacity of the code buffer in halfwords */
+    size_t pos;                     /* Current position in halfwords */
+    uint32_t *slots;                /* Position of the code of every instruction slot */
+    size_t exits[JIT_EXIT_NUMOF];   /* Position of the exits */
+    size_t epilogue;                /* Position of the epilogue */
+    uint8_t map[11];                /* Low register of the pair caching an eBPF register, 0
+                                       when the register lives in the register file */
+    bool fixed_fp;                  /* The application never writes the frame pointer */
+    bool budget;                    /* Count the branches taken */
+    uintptr_t arena;                /* Arena the addresses are confined to */
+    unsigned arena_bits;            /* Number of address bits kept from the application */
+} _jit_t;
+
+/*
+ * Instruction encoders
+ */
+
+static void _emit16(_jit_t *j, uint16_t hw)
+{
+    /* Keep counting past the end of the buffer, the caller checks the size */
+    if (j->pos < j->len) {
+        j->code[j->pos] = hw;
+    }
+    j->pos++;
+}
+
+static void _emit32(_jit_t *j, uint16_t hw1, uint16_t hw2)
+{
+    _emit16(j, hw1);
+    _emit16(j, hw2);
+}
+
+/* rd = rn op (rm shifted by amount), amount 0 to 31 */
+static void _dp_reg(_jit_t *j, unsigned op, bool s, unsigned rd, unsigned rn, unsigned rm,
+                    unsigned shift, unsigned amount)
+{
+    _emit32(j, 0xea00 | (op << 5) | (s << 4) | rn,
+            ((amount >> 2) << 12) | (rd << 8) | ((amount & 0x3) << 6) | (shift << 4) | rm);
+}
+
+/* rd = rn op imm, imm 0 to 255 */
+static void _dp_imm(_jit_t *j, unsigned op, bool s, unsigned rd, unsigned rn, uint8_t imm)
+{
+    _emit32(j, 0xf000 | (op << 5) | (s << 4) | rn, (rd << 8) | imm);
+}
+
+static void _mov(_jit_t *j, unsigned rd, unsigned rm)
+{
+    _dp_reg(j, DP_ORR, false, rd, JIT_PC, rm, SHIFT_LSL, 0);
+}
+
+/* rd = rm shifted by amount, amount 1 to 31 */
+static void _shift_imm(_jit_t *j, unsigned shift, unsigned rd, unsigned rm, unsigned amount)
+{
+    _dp_reg(j, DP_ORR, false, rd, JIT_PC, rm, shift, amount);
+}
+
+/* rd = rn shifted by rm */
+static void _shift_reg(_jit_t *j, unsigned shift, unsigned rd, unsigned rn, unsigned rm)
+{
+    _emit32(j, 0xfa00 | (shift << 5) | rn, 0xf000 | (rd << 8) | rm);
+}
+
+/* rd = rm with its bytes reversed, within its halfwords with REV16 */
+static void _rev(_jit_t *j, bool halfwords, unsigned rd, unsigned rm)
+{
+    _emit32(j, 0xfa90 | rm, 0xf080 | (rd << 8) | (halfwords << 4) | rm);
+}
+
+static void _extend(_jit_t *j, uint16_t op, unsigned rd, unsigned rm)
+{
+    _emit32(j, op, 0xf080 | (rd << 8) | rm);
+}
+
+static void _cmp(_jit_t *j, unsigned rn, unsigned rm)
+{
+    _dp_reg(j, DP_SUB, true, JIT_PC, rn, rm, SHIFT_LSL, 0);
+}
+
+static void _cmp_imm(_jit_t *j, unsigned rn, uint8_t imm)
+{
+    _dp_imm(j, DP_SUB, true, JIT_PC, rn, imm);
+}
+
+static void _tst(_jit_t *j, unsigned rn, unsigned rm)
+{
+    _dp_reg(j, DP_AND, true, JIT_PC, rn, rm, SHIFT_LSL, 0);
+}
+
+/* rd = rn + imm and rd = rn - imm, imm 0 to 4095 */
+static void _addw(_jit_t *j, unsigned rd, unsigned rn, unsigned imm)
+{
+    _emit32(j, 0xf200 | ((imm >> 11) << 10) | rn,
+            (((imm >> 8) & 0x7) << 12) | (rd << 8) | (imm & 0xff));
+}
+
+static void _subw(_jit_t *j, unsigned rd, unsigned rn, unsigned imm)
+{
+    _emit32(j, 0xf2a0 | ((imm >> 11) << 10) | rn,
+            (((imm >> 8) & 0x7) << 12) | (rd << 8) | (imm & 0xff));
+}
+
+#if (RBPF_ENABLE_MASKING)
+/* Insert the low width bits of rn into rd */
+static void _bfi(_jit_t *j, unsigned rd, unsigned rn, unsigned width)
+{
+    _emit32(j, 0xf360 | rn, (rd << 8) | (width - 1));
+}
+#endif
+
+static void _movw(_jit_t *j, unsigned rd, uint16_t imm)
+{
+    _emit32(j, 0xf240 | (((imm >> 11) & 0x1) << 10) | (imm >> 12),
+            (((imm >> 8) & 0x7) << 12) | (rd << 8) | (imm & 0xff));
+}
+
+static void _movt(_jit_t *j, unsigned rd, uint16_t imm)
+{
+    _emit32(j, 0xf2c0 | (((imm >> 11) & 0x1) << 10) | (imm >> 12),
+            (((imm >> 8) & 0x7) << 12) | (rd << 8) | (imm & 0xff));
+}
+
+static void _mov_imm32(_jit_t *j, unsigned rd, uint32_t imm)
+{
+    if (imm <= 0xff) {
+        _dp_imm(j, DP_ORR, false, rd, JIT_PC, imm);
+    }
+    else if (~imm <= 0xff) {
+        _dp_imm(j, DP_ORN, false, rd, JIT_PC, ~imm);
+    }
+    else {
+        _movw(j, rd, imm & 0xffff);
+        if (imm >> 16) {
+            _movt(j, rd, imm >> 16);
+        }
+    }
+}
+
+/* Sign extended immediate in a register pair */
+static void _mov_imm64(_jit_t *j, unsigned rd, int32_t imm)
+{
+    _mov_imm32(j, rd, imm);
+    _mov_imm32(j, rd + 1, imm < 0 ? UINT32_MAX : 0);
+}
+
+/* sp = sp - bytes or sp + bytes, bytes a multiple of 4 up to 508 */
+static void _sp(_jit_t *j, bool sub, unsigned bytes)
+{
+    _emit16(j, (sub ? 0xb080 : 0xb000) | (bytes >> 2));
+}
+
+static void _ldst(_jit_t *j, uint16_t op, unsigned rt, unsigned rn, unsigned offset)
+{
+    _emit32(j, op | rn, (rt << 12) | offset);
+}
+
+static void _ldrd(_jit_t *j, unsigned rt, unsigned rn, unsigned offset)
+{
+    _emit32(j, 0xe9d0 | rn, (rt << 12) | ((rt + 1) << 8) | (offset >> 2));
+}
+
+static void _strd(_jit_t *j, unsigned rt, unsigned rn, unsigned offset)
+{
+    _emit32(j, 0xe9c0 | rn, (rt << 12) | ((rt + 1) << 8) | (offset >> 2));
+}
+
+/* Exclusive load of rt from [rn], and exclusive store of rt to [rn] setting rd
+ * to 0 on success */
+static void _ldrex(_jit_t *j, unsigned rt, unsigned rn)
+{
+    _emit32(j, 0xe850 | rn, (rt << 12) | 0x0f00);
+}
+
+static void _strex(_jit_t *j, unsigned rd, unsigned rt, unsigned rn)
+{
+    _emit32(j, 0xe840 | rn, (rt << 12) | (rd << 8));
+}
+
+static void _it(_jit_t *j, unsigned cond)
+{
+    _emit16(j, 0xbf08 | (cond << 4));
+}
+
+static void _blx(_jit_t *j, unsigned rm)
+{
+    _emit16(j, 0x4780 | (rm << 3));
+}
+
+/* Branch to a position, conditional branches reach +-1MB, the others +-16MB */
+static void _branch(_jit_t *j, unsigned cond, size_t target)
+{
+    int32_t offset = ((int32_t)target - (int32_t)(j->pos + 2)) * 2;
+    uint32_t s = (offset >> 24) & 0x1;
+
+    if (cond == COND_AL) {
+        uint32_t j1 = (~(offset >> 23) ^ s) & 0x1;
+        uint32_t j2 = (~(offset >> 22) ^ s) & 0x1;
+        _emit32(j, 0xf000 | (s << 10) | ((offset >> 12) & 0x3ff),
+                0x9000 | (j1 << 13) | (j2 << 11) | ((offset >> 1) & 0x7ff));
+    }
+    else {
+        _emit32(j, 0xf000 | (s << 10) | (cond << 6) | ((offset >> 12) & 0x3f),
+                0x8000 | (((offset >> 18) & 0x1) << 13) | (((offset >> 19) & 0x1) << 11) |
+                ((offset >> 1) & 0x7ff));
+    }
+}
+
+static void _call(_jit_t *j, const void *func)
+{
+    _mov_imm32(j, JIT_TMP, (uintptr_t)func);
+    _blx(j, JIT_TMP);
+}
+
+/*
+ * eBPF register handling
+ */
+
+/* Register pair holding an eBPF register, loaded in the scratch pair when not cached */
+static unsigned _load(_jit_t *j, unsigned reg, unsigned scratch)
+{
+    if (j->map[reg]) {
+        return j->map[reg];
+    }
+    _ldrd(j, scratch, JIT_APP, JIT_REG_OFFSET(reg));
+    return scratch;
+}
+
+/* Register pair receiving a new value for an eBPF register */
+static unsigned _target(_jit_t *j, unsigned reg)
+{
+    return j->map[reg] ? j->map[reg] : JIT_DST;
+}
+
+static void _store(_jit_t *j, unsigned reg, unsigned pair)
+{
+    if (!j->map[reg]) {
+        _strd(j, pair, JIT_APP, JIT_REG_OFFSET(reg));
+    }
+}
+
+/* Write the cached registers back to the register file */
+static void _flush(_jit_t *j)
+{
+    for (unsigned reg = 0; reg < 11; reg++) {
+        if (j->map[reg]) {
+            _strd(j, j->map[reg], JIT_APP, JIT_REG_OFFSET(reg));
+        }
+    }
+}
+
+static void _reload(_jit_t *j)
+{
+    for (unsigned reg = 0; reg < 11; reg++) {
+        if (j->map[reg]) {
+            _ldrd(j, j->map[reg], JIT_APP, JIT_REG_OFFSET(reg));
+        }
+    }
+}
+
+/* Charge the branches a taken jump counts to the budget, exiting when it
+ * runs out */
+static void _budget(_jit_t *j, unsigned charge)
+{
+    if (!j->budget || !charge) {
+        return;
+    }
+    _ldst(j, LDST_LDR, JIT_TMP, JIT_APP, JIT_BUDGET_OFFSET);
+    if (charge <= UINT8_MAX) {
+        _dp_imm(j, DP_SUB, true, JIT_TMP, JIT_TMP, charge);
+    }
+    else {
+        _mov_imm32(j, JIT_TMP2, charge);
+        _dp_reg(j, DP_SUB, true, JIT_TMP, JIT_TMP, JIT_TMP2, SHIFT_LSL, 0);
+    }
+    _ldst(j, LDST_STR, JIT_TMP, JIT_APP, JIT_BUDGET_OFFSET);
+    _branch(j, COND_LS, j->exits[JIT_EXIT_OUT_OF_BRANCHES]);
+}
+
+/* The branches a taken jump charges, the ones of the pre-decoded form which
+ * moved the iterations of the bounded loops to their entry, or the backward
+ * jumps only */
+static unsigned _charge(const rbpf_application_t *rbpf, size_t i, size_t target)
+{
+#if (RBPF_ENABLE_LOWERING)
+    if (rbpf->lowered) {
+        return rbpf->lowered[i].offset;
+    }
+#else
+    (void)rbpf;
+#endif
+    return target <= i;
+}
+
+/* Exit when the 64 bit value in a register pair is zero */
+static void _check_div(_jit_t *j, unsigned pair)
+{
+    _dp_reg(j, DP_ORR, true, JIT_TMP, pair, pair + 1, SHIFT_LSL, 0);
+    _branch(j, COND_EQ, j->exits[JIT_EXIT_ILLEGAL_DIV]);
+}
+
+/*
+ * Instruction translation
+ */
+
+static void _jit_shift64_imm(_jit_t *j, unsigned op, unsigned d, unsigned n)
+{
+    unsigned lo = d, hi = d + 1;
+
+    if (n == 0) {
+        return;
+    }
+    if (op == BPF_INSTRUCTION_ALU_LSH) {
+        if (n < 32) {
+            _shift_imm(j, SHIFT_LSL, hi, hi, n);
+            _dp_reg(j, DP_ORR, false, hi, hi, lo, SHIFT_LSR, 32 - n);
+            _shift_imm(j, SHIFT_LSL, lo, lo, n);
+        }
+        else {
+            if (n == 32) {
+                _mov(j, hi, lo);
+            }
+            else {
+                _shift_imm(j, SHIFT_LSL, hi, lo, n - 32);
+            }
+            _mov_imm32(j, lo, 0);
+        }
+        return;
+    }
+    /* Right shifts, logical or arithmetic */
+    unsigned shift = (op == BPF_INSTRUCTION_ALU_RSH) ? SHIFT_LSR : SHIFT_ASR;
+    if (n < 32) {
+        _shift_imm(j, SHIFT_LSR, lo, lo, n);
+        _dp_reg(j, DP_ORR, false, lo, lo, hi, SHIFT_LSL, 32 - n);
+        _shift_imm(j, shift, hi, hi, n);
+    }
+    else {
+        if (n == 32) {
+            _mov(j, lo, hi);
+        }
+        else {
+            _shift_imm(j, shift, lo, hi, n - 32);
+        }
+        if (shift == SHIFT_LSR) {
+            _mov_imm32(j, hi, 0);
+        }
+        else {
+            _shift_imm(j, SHIFT_ASR, hi, hi, 31);
+        }
+    }
+}
+
+/* Shift by a register, relies on the shifts by 32 up to 255 giving zero */
+static void _jit_shift64_reg(_jit_t *j, unsigned op, unsigned d, unsigned s)
+{
+    unsigned lo = d, hi = d + 1;
+
+    _dp_imm(j, DP_AND, false, JIT_TMP, s, 63);
+    if (op == BPF_INSTRUCTION_ALU_LSH) {
+        /* hi = hi << n | lo >> (32 - n) | lo << (n - 32) */
+        _shift_reg(j, SHIFT_LSL, hi, hi, JIT_TMP);
+        _dp_imm(j, DP_RSB, false, JIT_TMP2, JIT_TMP, 32);
+        _shift_reg(j, SHIFT_LSR, JIT_TMP2, lo, JIT_TMP2);
+        _dp_reg(j, DP_ORR, false, hi, hi, JIT_TMP2, SHIFT_LSL, 0);
+        _dp_imm(j, DP_SUB, false, JIT_TMP2, JIT_TMP, 32);
+        _shift_reg(j, SHIFT_LSL, JIT_TMP2, lo, JIT_TMP2);
+        _dp_reg(j, DP_ORR, false, hi, hi, JIT_TMP2, SHIFT_LSL, 0);
+        _shift_reg(j, SHIFT_LSL, lo, lo, JIT_TMP);
+        return;
+    }
+    /* lo = lo >> n | hi << (32 - n) */
+    _shift_reg(j, SHIFT_LSR, lo, lo, JIT_TMP);
+    _dp_imm(j, DP_RSB, false, JIT_TMP2, JIT_TMP, 32);
+    _shift_reg(j, SHIFT_LSL, JIT_TMP2, hi, JIT_TMP2);
+    _dp_reg(j, DP_ORR, false, lo, lo, JIT_TMP2, SHIFT_LSL, 0);
+    if (op == BPF_INSTRUCTION_ALU_RSH) {
+        /* lo |= hi >> (n - 32) */
+        _dp_imm(j, DP_SUB, false, JIT_TMP2, JIT_TMP, 32);
+        _shift_reg(j, SHIFT_LSR, JIT_TMP2, hi, JIT_TMP2);
+        _dp_reg(j, DP_ORR, false, lo, lo, JIT_TMP2, SHIFT_LSL, 0);
+        _shift_reg(j, SHIFT_LSR, hi, hi, JIT_TMP);
+    }
+    else {
+        /* lo = hi >> (n - 32) when shifting by 32 or more */
+        _dp_imm(j, DP_SUB, true, JIT_TMP2, JIT_TMP, 32);
+        _it(j, COND_PL);
+        _shift_reg(j, SHIFT_ASR, lo, hi, JIT_TMP2);
+        _shift_reg(j, SHIFT_ASR, hi, hi, JIT_TMP);
+    }
+}
+
+static void _jit_shift32_imm(_jit_t *j, unsigned op, unsigned d, uint32_t imm)
+{
+    /* Matches a shift by a register, which only uses the lowest byte */
+    unsigned n = imm & 0xff;
+    unsigned shift = (op == BPF_INSTRUCTION_ALU_LSH) ? SHIFT_LSL :
+                     (op == BPF_INSTRUCTION_ALU_RSH) ? SHIFT_LSR : SHIFT_ASR;
+
+    if (n == 0) {
+        return;
+    }
+    if (n < 32) {
+        _shift_imm(j, shift, d, d, n);
+    }
+    else if (shift == SHIFT_ASR) {
+        _shift_imm(j, SHIFT_ASR, d, d, 31);
+    }
+    else {
+        _mov_imm32(j, d, 0);
+    }
+}
+
+static int _jit_alu(_jit_t *j, const bpf_instruction_t *instr)
+{
+    bool alu32 = (instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_ALU32;
+    bool imm = !(instr->opcode & BPF_INSTRUCTION_ALU_S_MASK);
+    unsigned op = instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK;
+    int32_t value = instr->immediate;
+    unsigned d, s = 0;
+
+#if !(RBPF_ENABLE_ALU32)
+    if (alu32) {
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+#endif
+
+    if (op == BPF_INSTRUCTION_ALU_MOV) {
+        d = _target(j, instr->dst);
+        if (imm) {
+            _mov_imm32(j, d, value);
+            _mov_imm32(j, d + 1, (!alu32 && value < 0) ? UINT32_MAX : 0);
+        }
+        else if (instr->offset) {
+            /* Sign extension of the lower 8, 16 or 32 bits */
+            s = _load(j, instr->src, d);
+            if (instr->offset != 32) {
+                _extend(j, instr->offset == 8 ? EXTEND_SXTB : EXTEND_SXTH, d, s);
+            }
+            else if (s != d) {
+                _mov(j, d, s);
+            }
+            if (alu32) {
+                _mov_imm32(j, d + 1, 0);
+            }
+            else {
+                _shift_imm(j, SHIFT_ASR, d + 1, d, 31);
+            }
+        }
+        else {
+            s = _load(j, instr->src, d);
+            if (s != d) {
+                _mov(j, d, s);
+            }
+            if (alu32) {
+                _mov_imm32(j, d + 1, 0);
+            }
+            else if (s != d) {
+                _mov(j, d + 1, s + 1);
+            }
+        }
+        _store(j, instr->dst, d);
+        return RBPF_OK;
+    }
+
+    d = _load(j, instr->dst, JIT_DST);
+
+    /* Byte order conversions of the lower 16, 32 or 64 bits, the target is
+     * little endian */
+    if (op == BPF_INSTRUCTION_ALU_BYTESWAP) {
+        bool swap = instr->opcode != BPF_INSTRUCTION_ALU32_END_LE;
+        if (value == 16) {
+            if (swap) {
+                _rev(j, true, d, d);
+            }
+            _extend(j, EXTEND_UXTH, d, d);
+            _mov_imm32(j, d + 1, 0);
+        }
+        else if (value == 32) {
+            if (swap) {
+                _rev(j, false, d, d);
+            }
+            _mov_imm32(j, d + 1, 0);
+        }
+        else if (swap) {
+            _rev(j, false, JIT_TMP, d);
+            _rev(j, false, d, d + 1);
+            _mov(j, d + 1, JIT_TMP);
+        }
+        _store(j, instr->dst, d);
+        return RBPF_OK;
+    }
+
+    /* Operations with a small immediate encoded in the instruction */
+    if (imm && (op == BPF_INSTRUCTION_ALU_ADD || op == BPF_INSTRUCTION_ALU_SUB) &&
+        value >= -255 && value <= 255) {
+        bool add = (op == BPF_INSTRUCTION_ALU_ADD) == (value >= 0);
+        uint8_t magnitude = value < 0 ? -value : value;
+        _dp_imm(j, add ? DP_ADD : DP_SUB, !alu32, d, d, magnitude);
+        if (!alu32) {
+            _dp_imm(j, add ? DP_ADC : DP_SBC, false, d + 1, d + 1, 0);
+        }
+        goto done;
+    }
+    if (imm && (op == BPF_INSTRUCTION_ALU_AND || op == BPF_INSTRUCTION_ALU_OR ||
+                op == BPF_INSTRUCTION_ALU_XOR) && value >= 0 && value <= 255) {
+        unsigned dp = (op == BPF_INSTRUCTION_ALU_AND) ? DP_AND :
+                      (op == BPF_INSTRUCTION_ALU_OR) ? DP_ORR : DP_EOR;
+        _dp_imm(j, dp, false, d, d, value);
+        if (!alu32 && op == BPF_INSTRUCTION_ALU_AND) {
+            _mov_imm32(j, d + 1, 0);
+        }
+        goto done;
+    }
+
+    switch (op) {
+    case BPF_INSTRUCTION_ALU_NEG:
+        if (!imm) {
+            return RBPF_ILLEGAL_INSTRUCTION;
+        }
+        if (alu32) {
+            _dp_imm(j, DP_RSB, false, d, d, 0);
+        }
+        else {
+            _dp_imm(j, DP_RSB, true, d, d, 0);
+            _dp_reg(j, DP_SBC, false, d + 1, d + 1, d + 1, SHIFT_LSL, 1);
+        }
+        goto done;
+    case BPF_INSTRUCTION_ALU_LSH:
+    case BPF_INSTRUCTION_ALU_RSH:
+    case BPF_INSTRUCTION_ALU_ARSH:
+        if (imm) {
+            if (alu32) {
+                _jit_shift32_imm(j, op, d, value);
+            }
+            else {
+                _jit_shift64_imm(j, op, d, value & 63);
+            }
+            goto done;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_DIV:
+    case BPF_INSTRUCTION_ALU_MOD:
+        if (imm && value == 0) {
+            _branch(j, COND_AL, j->exits[JIT_EXIT_ILLEGAL_DIV]);
+            return RBPF_OK;
+        }
+        break;
+    }
+
+    if (imm) {
+        s = JIT_SRC;
+        _mov_imm64(j, s, value);
+    }
+    else {
+        s = _load(j, instr->src, JIT_SRC);
+        if (s == d && op == BPF_INSTRUCTION_ALU_MUL && !alu32) {
+            /* The multiplication overwrites its operands */
+            _mov(j, JIT_SRC, s);
+            _mov(j, JIT_SRC + 1, s + 1);
+            s = JIT_SRC;
+        }
+    }
+
+    switch (op) {
+    case BPF_INSTRUCTION_ALU_ADD:
+    case BPF_INSTRUCTION_ALU_SUB:
+    case BPF_INSTRUCTION_ALU_AND:
+    case BPF_INSTRUCTION_ALU_OR:
+    case BPF_INSTRUCTION_ALU_XOR:
+    {
+        unsigned dp_lo, dp_hi;
+        switch (op) {
+        case BPF_INSTRUCTION_ALU_ADD: dp_lo = DP_ADD; dp_hi = DP_ADC; break;
+        case BPF_INSTRUCTION_ALU_SUB: dp_lo = DP_SUB; dp_hi = DP_SBC; break;
+        case BPF_INSTRUCTION_ALU_AND: dp_lo = dp_hi = DP_AND; break;
+        case BPF_INSTRUCTION_ALU_OR: dp_lo = dp_hi = DP_ORR; break;
+        default: dp_lo = dp_hi = DP_EOR; break;
+        }
+        _dp_reg(j, dp_lo, !alu32 && dp_lo != dp_hi, d, d, s, SHIFT_LSL, 0);
+        if (!alu32) {
+            _dp_reg(j, dp_hi, false, d + 1, d + 1, s + 1, SHIFT_LSL, 0);
+        }
+        break;
+    }
+    case BPF_INSTRUCTION_ALU_MUL:
+        if (alu32) {
+            _emit32(j, 0xfb00 | d, 0xf000 | (d << 8) | s);
+        }
+        else {
+            /* hi = hi * s_lo + lo * s_hi + high word of lo * s_lo */
+            _emit32(j, 0xfb00 | (d + 1), 0xf000 | ((d + 1) << 8) | s);
+            _emit32(j, 0xfb00 | d, ((d + 1) << 12) | ((d + 1) << 8) | (s + 1));
+            _emit32(j, 0xfba0 | d, (d << 12) | (JIT_TMP << 8) | s);
+            _dp_reg(j, DP_ADD, false, d + 1, d + 1, JIT_TMP, SHIFT_LSL, 0);
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_DIV:
+    case BPF_INSTRUCTION_ALU_MOD:
+        /* The whole 64 bit source is checked, as the interpreter does */
+        if (!imm) {
+            _check_div(j, s);
+        }
+        if (alu32) {
+            /* UDIV, or SDIV for the signed ones */
+            uint16_t div = instr->offset ? 0xfb90 : 0xfbb0;
+            if (op == BPF_INSTRUCTION_ALU_DIV) {
+                _emit32(j, div | d, 0xf0f0 | (d << 8) | s);
+            }
+            else {
+                _emit32(j, div | d, 0xf0f0 | (JIT_TMP << 8) | s);
+                _emit32(j, 0xfb00 | JIT_TMP, (d << 12) | (d << 8) | 0x10 | s);
+            }
+        }
+        else {
+            /* Arguments in r0:r1 and r2:r3, result in r0:r1 */
+            if (s != JIT_SRC) {
+                _mov(j, JIT_SRC, s);
+                _mov(j, JIT_SRC + 1, s + 1);
+            }
+            if (d != JIT_DST) {
+                _mov(j, JIT_DST, d);
+                _mov(j, JIT_DST + 1, d + 1);
+            }
+            if (instr->offset) {
+                _call(j, op == BPF_INSTRUCTION_ALU_DIV ? (const void *)rbpf_native_sdiv :
+                      (const void *)rbpf_native_smod);
+            }
+            else {
+                _call(j, op == BPF_INSTRUCTION_ALU_DIV ? (const void *)rbpf_native_div :
+                      (const void *)rbpf_native_mod);
+            }
+            if (d != JIT_DST) {
+                _mov(j, d, JIT_DST);
+                _mov(j, d + 1, JIT_DST + 1);
+            }
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_LSH:
+    case BPF_INSTRUCTION_ALU_RSH:
+    case BPF_INSTRUCTION_ALU_ARSH:
+        if (alu32) {
+            unsigned shift = (op == BPF_INSTRUCTION_ALU_LSH) ? SHIFT_LSL :
+                             (op == BPF_INSTRUCTION_ALU_RSH) ? SHIFT_LSR : SHIFT_ASR;
+            _shift_reg(j, shift, d, d, s);
+        }
+        else {
+            _jit_shift64_reg(j, op, d, s);
+        }
+        break;
+    default:
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+
+done:
+    if (alu32) {
+        /* The 32 bit results are zero extended, the signed ones included */
+        _mov_imm32(j, d + 1, 0);
+    }
+    _store(j, instr->dst, d);
+    return RBPF_OK;
+}
+
+static void _jit_imm64(_jit_t *j, unsigned reg, uint64_t value)
+{
+    unsigned d = _target(j, reg);
+
+    _mov_imm32(j, d, value);
+    _mov_imm32(j, d + 1, value >> 32);
+    _store(j, reg, d);
+}
+
+static void _jit_lddw(_jit_t *j, const rbpf_application_t *rbpf, const bpf_instruction_t *instr)
+{
+    uint64_t value = (uint64_t)(uint32_t)instr[0].immediate |
+                     ((uint64_t)(uint32_t)instr[1].immediate << 32);
+
+    if (instr->opcode == BPF_INSTRUCTION_MEM_LDDWD) {
+        value += (intptr_t)rbpf->data_region.start;
+    }
+    else if (instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+        value += (intptr_t)rbpf->rodata_region.start;
+    }
+    _jit_imm64(j, instr->dst, value);
+}
+
+/* Register holding the base of a memory access, with the offset left to add */
+static unsigned _jit_address(_jit_t *j, unsigned reg, int16_t offset, unsigned rd,
+                             unsigned *displacement)
+{
+    unsigned base = j->map[reg];
+
+    *displacement = 0;
+    if (!base) {
+        _ldst(j, LDST_LDR, rd, JIT_APP, JIT_REG_OFFSET(reg));
+        base = rd;
+    }
+    if (offset >= 0 && offset <= 4088) {
+        *displacement = offset;
+        return base;
+    }
+    if (offset < 0 && offset > -4096) {
+        _subw(j, rd, base, -offset);
+    }
+    else {
+        _mov_imm32(j, JIT_TMP2, offset);
+        _dp_reg(j, DP_ADD, false, rd, base, JIT_TMP2, SHIFT_LSL, 0);
+    }
+    return rd;
+}
+
+/* Register holding the base of a checked or masked memory access */
+static unsigned _jit_access(_jit_t *j, unsigned reg, int16_t offset, unsigned *displacement)
+{
+    unsigned base = _jit_address(j, reg, offset, JIT_TMP, displacement);
+
+#if (RBPF_ENABLE_MASKING)
+    /* Keep the low bits of the address, the high bits are the arena ones */
+    if (*displacement) {
+        _addw(j, JIT_TMP, base, *displacement);
+        base = JIT_TMP;
+        *displacement = 0;
+    }
+    _mov_imm32(j, JIT_TMP2, j->arena);
+    _bfi(j, JIT_TMP2, base, j->arena_bits);
+    base = JIT_TMP2;
+#endif
+    return base;
+}
+
+/* Check a memory access, unless proven in bounds */
+static void _jit_check(_jit_t *j, unsigned reg, int16_t offset, unsigned size, bool load,
+                       bool proven)
+{
+#if (RBPF_ENABLE_MASKING)
+    (void)j;
+    (void)reg;
+    (void)offset;
+    (void)size;
+    (void)load;
+    (void)proven;
+#else
+    unsigned displacement, base;
+
+    /* Accesses within the stack through an untouched frame pointer need no check */
+    if (!proven && !(reg == 10 && j->fixed_fp && offset >= -RBPF_STACK_SIZE &&
+                     offset + (int)size <= 0)) {
+        base = _jit_address(j, reg, offset, 1, &displacement);
+        if (displacement) {
+            _addw(j, 1, base, displacement);
+        }
+        else if (base != 1) {
+            _mov(j, 1, base);
+        }
+        _mov(j, 0, JIT_APP);
+        _mov_imm32(j, 2, size);
+        _call(j, load ? (const void *)rbpf_load_allowed : (const void *)rbpf_store_allowed);
+        _cmp_imm(j, 0, 0);
+        _branch(j, COND_EQ, j->exits[JIT_EXIT_ILLEGAL_MEM]);
+    }
+#endif
+}
+
+/* Atomic operations, the 32 bit ones in an exclusive load and store loop, the
+ * 64 bit ones through rbpf_atomic64_regs(). The address is kept in lr and
+ * must be aligned on the size of the access. */
+static int _jit_atomic(_jit_t *j, const bpf_instruction_t *instr, bool proven)
+{
+    unsigned size = instr->opcode == BPF_INSTRUCTION_MEM_ATOMICW ? 4 : 8;
+    int32_t op = instr->immediate;
+    unsigned displacement, base, s = 0, expected = 3;
+
+    _jit_check(j, instr->dst, instr->offset, size, false, proven);
+
+    if (size == 4) {
+        s = _load(j, instr->src, JIT_SRC);
+        if (op == BPF_INSTRUCTION_ATOMIC_CMPXCHG && j->map[0]) {
+            expected = j->map[0];
+        }
+        else if (op == BPF_INSTRUCTION_ATOMIC_CMPXCHG) {
+            _ldst(j, LDST_LDR, expected, JIT_APP, JIT_REG_OFFSET(0));
+        }
+    }
+    else {
+        _flush(j);
+    }
+
+    base = _jit_access(j, instr->dst, instr->offset, &displacement);
+    if (base != JIT_TMP2 || displacement) {
+        _addw(j, JIT_TMP2, base, displacement);
+    }
+    _dp_imm(j, DP_AND, true, JIT_PC, JIT_TMP2, size - 1);
+    _branch(j, COND_NE, j->exits[JIT_EXIT_ILLEGAL_MEM]);
+
+    if (size == 8) {
+        _mov(j, 1, JIT_TMP2);
+        _addw(j, 0, JIT_APP, JIT_REG_OFFSET(0));
+        _mov_imm32(j, 2, op);
+        _mov_imm32(j, 3, instr->src);
+        _call(j, (const void *)rbpf_atomic64_regs);
+        _reload(j);
+        return RBPF_OK;
+    }
+
+    /* Previous value in r0, new value in r1 */
+    size_t loop = j->pos;
+    unsigned value = 1;
+    _ldrex(j, 0, JIT_TMP2);
+    switch (op & ~BPF_INSTRUCTION_ATOMIC_FETCH) {
+    case BPF_INSTRUCTION_ATOMIC_ADD:
+        _dp_reg(j, DP_ADD, false, 1, 0, s, SHIFT_LSL, 0);
+        break;
+    case BPF_INSTRUCTION_ATOMIC_OR:
+        _dp_reg(j, DP_ORR, false, 1, 0, s, SHIFT_LSL, 0);
+        break;
+    case BPF_INSTRUCTION_ATOMIC_AND:
+        _dp_reg(j, DP_AND, false, 1, 0, s, SHIFT_LSL, 0);
+        break;
+    case BPF_INSTRUCTION_ATOMIC_XOR:
+        _dp_reg(j, DP_EOR, false, 1, 0, s, SHIFT_LSL, 0);
+        break;
+    case BPF_INSTRUCTION_ATOMIC_XCHG & ~BPF_INSTRUCTION_ATOMIC_FETCH:
+        value = s;
+        break;
+    case BPF_INSTRUCTION_ATOMIC_CMPXCHG & ~BPF_INSTRUCTION_ATOMIC_FETCH:
+        /* Skip the store and the retry when the values differ */
+        _cmp(j, 0, expected);
+        _branch(j, COND_NE, j->pos + 2 + 6);
+        value = s;
+        break;
+    default:
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+    _strex(j, JIT_TMP, value, JIT_TMP2);
+    _cmp_imm(j, JIT_TMP, 0);
+    _branch(j, COND_NE, loop);
+
+    /* The compare and exchange returns the previous value in r0 */
+    if (op & BPF_INSTRUCTION_ATOMIC_FETCH) {
+        unsigned reg = (op == BPF_INSTRUCTION_ATOMIC_CMPXCHG) ? 0 : instr->src;
+        unsigned d = _target(j, reg);
+        if (d != 0) {
+            _mov(j, d, 0);
+        }
+        _mov_imm32(j, d + 1, 0);
+        _store(j, reg, d);
+    }
+    return RBPF_OK;
+}
+
+static int _jit_mem(_jit_t *j, const bpf_instruction_t *instr, bool proven)
+{
+    unsigned cls = instr->opcode & BPF_INSTRUCTION_MEM_CLS_MASK;
+    unsigned size_op = instr->opcode & BPF_INSTRUCTION_MEM_SZ_MASK;
+    bool load = (cls == BPF_INSTRUCTION_CLS_LDX);
+    unsigned reg = load ? instr->src : instr->dst;
+    unsigned size = (size_op == 0x00) ? 4 : (size_op == 0x08) ? 2 : (size_op == 0x10) ? 1 : 8;
+    bool sign_extend = load && (instr->opcode & BPF_INSTRUCTION_MEM_MDE_MASK) ==
+                       BPF_INSTRUCTION_LDX_MEMSX;
+    unsigned displacement, base, d;
+
+    if (instr->opcode == BPF_INSTRUCTION_MEM_ATOMICW ||
+        instr->opcode == BPF_INSTRUCTION_MEM_ATOMICDW) {
+        return _jit_atomic(j, instr, proven);
+    }
+    if ((instr->opcode & BPF_INSTRUCTION_MEM_MDE_MASK) != 0x60 && !sign_extend) {
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+
+    _jit_check(j, reg, instr->offset, size, load, proven);
+
+    if (load) {
+        d = _target(j, instr->dst);
+        base = _jit_access(j, reg, instr->offset, &displacement);
+        if (size == 8 && base == d) {
+            /* The first load overwrites the base */
+            _mov(j, JIT_TMP, base);
+            base = JIT_TMP;
+        }
+        switch (size) {
+        case 1: _ldst(j, sign_extend ? LDST_LDRSB : LDST_LDRB, d, base, displacement); break;
+        case 2: _ldst(j, sign_extend ? LDST_LDRSH : LDST_LDRH, d, base, displacement); break;
+        case 4: _ldst(j, LDST_LDR, d, base, displacement); break;
+        default:
+            /* Two word loads, as the double word loads fault on unaligned addresses */
+            _ldst(j, LDST_LDR, d, base, displacement);
+            _ldst(j, LDST_LDR, d + 1, base, displacement + 4);
+        }
+        if (sign_extend) {
+            _shift_imm(j, SHIFT_ASR, d + 1, d, 31);
+        }
+        else if (size != 8) {
+            _mov_imm32(j, d + 1, 0);
+        }
+        _store(j, instr->dst, d);
+        return RBPF_OK;
+    }
+
+    if (cls == BPF_INSTRUCTION_CLS_STX) {
+        d = _load(j, instr->src, JIT_SRC);
+    }
+    else {
+        d = JIT_SRC;
+        _mov_imm32(j, d, instr->immediate);
+        if (size == 8) {
+            _mov_imm32(j, d + 1, instr->immediate < 0 ? UINT32_MAX : 0);
+        }
+    }
+    base = _jit_access(j, reg, instr->offset, &displacement);
+    switch (size) {
+    case 1: _ldst(j, LDST_STRB, d, base, displacement); break;
+    case 2: _ldst(j, LDST_STRH, d, base, displacement); break;
+    case 4: _ldst(j, LDST_STR, d, base, displacement); break;
+    default:
+        _ldst(j, LDST_STR, d, base, displacement);
+        _ldst(j, LDST_STR, d + 1, base, displacement + 4);
+    }
+    return RBPF_OK;
+}
+
+static int _jit_jump(_jit_t *j, const bpf_instruction_t *instr, size_t target, unsigned charge)
+{
+    unsigned op = instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK;
+    bool imm = !(instr->opcode & BPF_INSTRUCTION_ALU_S_MASK);
+    bool wide = (instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_BRANCH;
+    unsigned d, s, cond;
+
+    if (instr->opcode == BPF_INSTRUCTION_JMP_ALWAYS ||
+        instr->opcode == BPF_INSTRUCTION_JMP32_ALWAYS) {
+        _budget(j, charge);
+        _branch(j, COND_AL, j->slots[target]);
+        return RBPF_OK;
+    }
+
+    d = _load(j, instr->dst, JIT_DST);
+    if (imm) {
+        s = JIT_SRC;
+        _mov_imm64(j, s, instr->immediate);
+    }
+    else {
+        s = _load(j, instr->src, JIT_SRC);
+    }
+
+    /* Compare the 64 bit values, the ordered comparisons subtract the high
+     * words with carry and only keep the carry and the sign flags valid. The
+     * 32 bit jumps compare the low words only. */
+    switch (op) {
+    case BPF_INSTRUCTION_BRANCH_JEQ:
+    case BPF_INSTRUCTION_BRANCH_JNE:
+        _cmp(j, d, s);
+        if (wide) {
+            _it(j, COND_EQ);
+            _cmp(j, d + 1, s + 1);
+        }
+        cond = (op == BPF_INSTRUCTION_BRANCH_JEQ) ? COND_EQ : COND_NE;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JSET:
+        _tst(j, d, s);
+        if (wide) {
+            _it(j, COND_EQ);
+            _tst(j, d + 1, s + 1);
+        }
+        cond = COND_NE;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JGE:
+    case BPF_INSTRUCTION_BRANCH_JLT:
+    case BPF_INSTRUCTION_BRANCH_JSGE:
+    case BPF_INSTRUCTION_BRANCH_JSLT:
+        /* dst - src */
+        _cmp(j, d, s);
+        if (wide) {
+            _dp_reg(j, DP_SBC, true, JIT_TMP, d + 1, s + 1, SHIFT_LSL, 0);
+        }
+        cond = (op == BPF_INSTRUCTION_BRANCH_JGE) ? COND_CS :
+               (op == BPF_INSTRUCTION_BRANCH_JLT) ? COND_CC :
+               (op == BPF_INSTRUCTION_BRANCH_JSGE) ? COND_GE : COND_LT;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JGT:
+    case BPF_INSTRUCTION_BRANCH_JLE:
+    case BPF_INSTRUCTION_BRANCH_JSGT:
+    case BPF_INSTRUCTION_BRANCH_JSLE:
+        /* src - dst */
+        _cmp(j, s, d);
+        if (wide) {
+            _dp_reg(j, DP_SBC, true, JIT_TMP, s + 1, d + 1, SHIFT_LSL, 0);
+        }
+        cond = (op == BPF_INSTRUCTION_BRANCH_JGT) ? COND_CC :
+               (op == BPF_INSTRUCTION_BRANCH_JLE) ? COND_CS :
+               (op == BPF_INSTRUCTION_BRANCH_JSGT) ? COND_LT : COND_GE;
+        break;
+    default:
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+
+    if (!j->budget || !charge) {
+        _branch(j, cond, j->slots[target]);
+        return RBPF_OK;
+    }
+
+    /* Skip the taken path with the inverted condition */
+    size_t skip = j->pos;
+    _branch(j, cond ^ 1, 0);
+    _budget(j, charge);
+    _branch(j, COND_AL, j->slots[target]);
+    size_t next = j->pos;
+    j->pos = skip;
+    _branch(j, cond ^ 1, next);
+    j->pos = next;
+    return RBPF_OK;
+}
+
+static int _jit_call(_jit_t *j, const rbpf_application_t *rbpf, const bpf_instruction_t *instr,
+                     size_t i)
+{
+    rbpf_call_t call = rbpf_engine_get_call(instr->immediate);
+
+#if (RBPF_ENABLE_MAPS) && (RBPF_ENABLE_LOWERING)
+    /* The map lookups the pre-decoded form replaced with the address of
+     * their element */
+    if (rbpf->lowered && rbpf->lowered[i].opcode == BPF_INSTRUCTION_ALU64_MOV_IMM) {
+        _jit_imm64(j, 0, rbpf->lowered[i].immediate);
+        return RBPF_OK;
+    }
+#else
+    (void)rbpf;
+    (void)i;
+#endif
+
+    /* The local calls and the tail calls are only interpreted */
+    if (!call || instr->src == BPF_INSTRUCTION_CALL_LOCAL ||
+        instr->immediate == BPF_FUNC_BPF_TAIL_CALL) {
+        return RBPF_ILLEGAL_CALL;
+    }
+
+    /* The AAPCS passes the application in r0, r1 in r2:r3 and r2 to r5 on
+     * the stack. The cached pairs are saved by the called function. */
+    _sp(j, true, JIT_CALL_STACK);
+    for (unsigned reg = 2; reg <= 5; reg++) {
+        _strd(j, _load(j, reg, JIT_DST), JIT_SP, 8 * (reg - 2));
+    }
+    unsigned arg = _load(j, 1, JIT_SRC);
+    if (arg != JIT_SRC) {
+        _mov(j, JIT_SRC, arg);
+        _mov(j, JIT_SRC + 1, arg + 1);
+    }
+    _mov(j, 0, JIT_APP);
+    _call(j, (const void *)call);
+    _sp(j, false, JIT_CALL_STACK);
+
+    unsigned d = _target(j, 0);
+    if (d != JIT_DST) {
+        _mov(j, d, JIT_DST);
+        _mov(j, d + 1, JIT_DST + 1);
+    }
+    _store(j, 0, JIT_DST);
+    return RBPF_OK;
+}
+
+static int _jit_instruction(_jit_t *j, const rbpf_application_t *rbpf,
+                            const bpf_instruction_t *instr, size_t i, size_t num_instructions)
+{
+    size_t target;
+
+    switch (instr->opcode & BPF_INSTRUCTION_CLS_MASK) {
+    case BPF_INSTRUCTION_CLS_ALU32:
+    case BPF_INSTRUCTION_CLS_ALU64:
+        return _jit_alu(j, instr);
+    case BPF_INSTRUCTION_CLS_LDX:
+    case BPF_INSTRUCTION_CLS_ST:
+    case BPF_INSTRUCTION_CLS_STX:
+#if (RBPF_ENABLE_MEMORY_PROOF)
+        if (rbpf->flags & RBPF_FLAG_MEMORY_PROVEN) {
+            return _jit_mem(j, instr, rbpf->proof[i / 32] & (1UL << (i % 32)));
+        }
+#endif
+        return _jit_mem(j, instr, false);
+    case BPF_INSTRUCTION_CLS_LD:
+        break;
+    case BPF_INSTRUCTION_CLS_BRANCH:
+        if (instr->opcode == BPF_INSTRUCTION_CALL) {
+            return _jit_call(j, rbpf, instr, i);
+        }
+        if (instr->opcode == BPF_INSTRUCTION_RETURN) {
+            _mov_imm32(j, 0, RBPF_OK);
+            _branch(j, COND_AL, j->epilogue);
+            return RBPF_OK;
+        }
+        target = i + bpf_instruction_jump_offset(instr) + 1;
+        return _jit_jump(j, instr, target, _charge(rbpf, i, target));
+    case BPF_INSTRUCTION_CLS_JMP32:
+        target = i + bpf_instruction_jump_offset(instr) + 1;
+        return _jit_jump(j, instr, target, _charge(rbpf, i, target));
+    }
+
+    switch (instr->opcode) {
+    case BPF_INSTRUCTION_MEM_LDDW:
+    case BPF_INSTRUCTION_MEM_LDDWD:
+    case BPF_INSTRUCTION_MEM_LDDWR:
+        if (i + 1 >= num_instructions) {
+            return RBPF_ILLEGAL_LEN;
+        }
+        _jit_lddw(j, rbpf, instr);
+        return RBPF_OK;
+    }
+    return RBPF_ILLEGAL_INSTRUCTION;
+}
+
+/* Cache the most used eBPF registers in register pairs */
+static void _jit_registers(_jit_t *j, const bpf_instruction_t *text, size_t num_instructions)
+{
+    unsigned uses[11] = { 0 };
+
+    j->fixed_fp = true;
+    for (size_t i = 0; i < num_instructions; i++) {
+        uint8_t cls = text[i].opcode & BPF_INSTRUCTION_CLS_MASK;
+        uses[text[i].dst]++;
+        uses[text[i].src]++;
+        if (text[i].dst == 10 && (cls == BPF_INSTRUCTION_CLS_ALU32 ||
+                                  cls == BPF_INSTRUCTION_CLS_ALU64 ||
+                                  cls == BPF_INSTRUCTION_CLS_LD ||
+                                  cls == BPF_INSTRUCTION_CLS_LDX)) {
+            j->fixed_fp = false;
+        }
+        /* The atomic operations fetching into the source register */
+        if (text[i].src == 10 && (text[i].opcode == BPF_INSTRUCTION_MEM_ATOMICW ||
+                                  text[i].opcode == BPF_INSTRUCTION_MEM_ATOMICDW) &&
+            (text[i].immediate & BPF_INSTRUCTION_ATOMIC_FETCH)) {
+            j->fixed_fp = false;
+        }
+    }
+
+    for (unsigned pair = 0; pair < JIT_NUM_PAIRS; pair++) {
+        unsigned best = 0;
+        for (unsigned reg = 1; reg < 11; reg++) {
+            if (!j->map[reg] && uses[reg] > uses[best]) {
+                best = reg;
+            }
+        }
+        if (j->map[best] || !uses[best]) {
+            break;
+        }
+        j->map[best] = JIT_PAIRS + 2 * pair;
+        uses[best] = 0;
+    }
+}
+
+/* Emit the whole program, returns the position of the entry point */
+static int _jit_program(_jit_t *j, const rbpf_application_t *rbpf,
+                        const bpf_instruction_t *text, size_t num_instructions)
+{
+    /* Exits, each one loads its exit code and falls through to the next one
+     * or to the epilogue */
+    for (unsigned exit = 0; exit < JIT_EXIT_NUMOF; exit++) {
+        j->exits[exit] = j->pos;
+        _mov_imm32(j, 0, (uint32_t)(int32_t)_exit_codes[exit]);
+        if (exit + 1 < JIT_EXIT_NUMOF) {
+            _branch(j, COND_AL, j->epilogue);
+        }
+    }
+
+    j->epilogue = j->pos;
+    _flush(j);
+    _emit32(j, 0xe8bd, JIT_SAVED_REGS | (1 << JIT_PC));
+
+    int entry = j->pos;
+    _emit32(j, 0xe92d, JIT_SAVED_REGS | (1 << JIT_TMP2));
+    _mov(j, JIT_APP, 0);
+    _reload(j);
+
+    for (size_t i = 0; i < num_instructions; i++) {
+        j->slots[i] = j->pos;
+        int res = _jit_instruction(j, rbpf, &text[i], i, num_instructions);
+        if (res < 0) {
+            return res;
+        }
+        if ((text[i].opcode == BPF_INSTRUCTION_MEM_LDDW) ||
+            (text[i].opcode == BPF_INSTRUCTION_MEM_LDDWD) ||
+            (text[i].opcode == BPF_INSTRUCTION_MEM_LDDWR)) {
+            /* The second half is not an instruction on its own */
+            i++;
+            j->slots[i] = j->exits[JIT_EXIT_ILLEGAL_INSTRUCTION];
+        }
+    }
+    return entry;
+}
+
+int rbpf_jit_compile(rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+    uintptr_t start = ((uintptr_t)rbpf->jit_buf + 3) & ~(uintptr_t)3;
+    uintptr_t end = ((uintptr_t)rbpf->jit_buf + rbpf->jit_len) & ~(uintptr_t)3;
+    _jit_t j = { 0 };
+    int entry = 0;
+
+    rbpf->native = NULL;
+    if (!rbpf->jit_buf || end < start + num_instructions * sizeof(uint32_t)) {
+        return RBPF_OUT_OF_MEMORY;
+    }
+
+    /* The slot positions are kept at the end of the buffer */
+    j.code = (uint16_t *)start;
+    j.slots = (uint32_t *)end - num_instructions;
+    j.len = ((uintptr_t)j.slots - start) / sizeof(uint16_t);
+    j.budget = !(rbpf->flags & RBPF_CONFIG_NO_RETURN);
+#if (RBPF_ENABLE_MASKING)
+    j.arena = (uintptr_t)rbpf->arena;
+    j.arena_bits = __builtin_ctz(rbpf->arena_len);
+#endif
+    _jit_registers(&j, text, num_instructions);
+
+    /* The first pass finds the position of every slot and exit, the second
+     * one emits the branches to them. Both passes emit the same sizes. */
+    for (unsigned pass = 0; pass < 2; pass++) {
+        j.pos = 0;
+        entry = _jit_program(&j, rbpf, text, num_instructions);
+        if (entry < 0) {
+            return entry;
+        }
+        if (j.pos > j.len) {
+            return RBPF_OUT_OF_MEMORY;
+        }
+    }
+
+#if defined(__arm__)
+    /* Make sure the code is written before executing it */
+    __asm__ volatile ("dsb\n\tisb" ::: "memory");
+#endif
+
+    /* Thumb state entry point */
+    rbpf->native = (rbpf_native_t)(start + entry * sizeof(uint16_t) + 1);
+    return RBPF_OK;
+}
+
+#endif /* RBPF_ENABLE_JIT */
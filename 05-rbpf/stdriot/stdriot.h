@@ -570,4 +570,42 @@ extern ssize_t copy_file(const char *name, void *buf, size_t nbyte);
 
 extern int get_file_size(const char *name, size_t *size);
 
+/*!
+ * \brief Writes a buffer at an offset of a file of the
+ *        file system, the file being created when it does
+ *        not exist.
+ *
+ * \param name The name of the file.
+ *
+ * \param offset The offset in the file in bytes.
+ *
+ * \param buf The buffer to write.
+ *
+ * \param nbyte The size of the buffer in bytes.
+ *
+ * \return The number of bytes written, or -1 on failure.
+ */
+extern ssize_t write_file(const char *name, size_t offset,
+    const void *buf, size_t nbyte);
+
+/*!
+ * \brief Allocates a buffer, aligned on 8 bytes, from the RAM
+ *        left unused by the partition. The buffer is never
+ *        released.
+ *
+ * \param size The size of the buffer in bytes.
+ *
+ * \return The buffer, or NULL if the unused RAM is exhausted.
+ */
+extern void *alloc_unused_ram(size_t size);
+
+/*!
+ * \brief Returns the interface Pip provided to the partition,
+ *        to issue Pip system calls on its own blocks.
+ *
+ * \return The interface, or NULL if the partition does not
+ *         run over Pip.
+ */
+extern interface_t *get_pip_interface(void);
+
 #endif /* STDRIOT_H */
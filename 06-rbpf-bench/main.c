@@ -38,22 +38,69 @@
 #include <stdio.h>
 
 #include "rbpf.h"
+#include "rbpf/instruction.h"
+#include "sandbox.h"
 #include "shared.h"
 #include "stdriot.h"
 
 #define PROGNAME "rbpf-bench.bin"
 
 #define RBPF_STACK_SIZE   (512)
+#if RBPF_ENABLE_AOT
+/* room for the native code section */
+#define BYTECODE_SIZE_MAX (2048)
+#else
 #define BYTECODE_SIZE_MAX (600)
+#endif
 #define BUFFER_SIZE_MAX   (362)
+#define LOWERED_SIZE_MAX  (BYTECODE_SIZE_MAX / 8)
+#define JIT_SIZE_MAX      (4096)
+#define PROOF_SIZE_MAX    ((LOWERED_SIZE_MAX + 31) / 32)
+#define ARENA_SIZE        (2048)
+#define FRAMES_MAX        (8)
+#define QUANTUM           (1000)
+/* the out-of-bounds accesses trap, checked before the bench */
+#define OVERRUN_CHECK     (1)
+#if RBPF_ENABLE_LOCAL_CALLS
+#define FRAMES_SIZE       (FRAMES_MAX * sizeof(rbpf_frame_t))
+#else
+#define FRAMES_SIZE       (0)
+#endif
+#define STORE_ENTRIES     (64)
+#if RBPF_ENABLE_MAPS
+#define MAPS_SIZE         (256)
+#else
+#define MAPS_SIZE         (0)
+#endif
+/* a checksum per page of the maps, each at least 8 bytes long */
+#define MAP_SUMS_MAX      (MAPS_SIZE / 8)
+/* the runs between two write-backs of the maps, in place of a timer */
+#define MAPS_FLUSH_RUNS   (16)
+/* the copy of the application run by the child, and its data section */
+#define SHADOW_SIZE       (sizeof(rbpf_application_t) + BYTECODE_SIZE_MAX)
+/* the memory the application writes to, its context included */
+#define SANDBOX_SIZE      (RBPF_STACK_SIZE + SHADOW_SIZE + FRAMES_SIZE + \
+                           MAPS_SIZE + 64)
+/* the memory the application only reads */
+#define SANDBOX_IMAGE_SIZE (BYTECODE_SIZE_MAX + BUFFER_SIZE_MAX + \
+                            LOWERED_SIZE_MAX * sizeof(rbpf_insn_t) + 64)
 
 #define BPF_RUN_N(ctx, size) \
     do { \
-        status = RBPF_OK; \
+        void *run_ctx = bpf_ctx(ctx, size); \
+        status = (run_ctx != NULL || size == 0) ? RBPF_OK : \
+            RBPF_OUT_OF_MEMORY; \
         for (i = 0; i < n && status == RBPF_OK; i++) { \
-            status = rbpf_application_run_ctx(rbpf, ctx, \
+            status = rbpf_application_run_ctx(rbpf, run_ctx, \
                 size, &result); \
+            status = bpf_resume(rbpf, status, &result); \
+            if ((i + 1) % MAPS_FLUSH_RUNS == 0) { \
+                bpf_maps_flush(rbpf); \
+            } \
         } \
+        bpf_print_count(rbpf); \
+        bpf_print_fusions(rbpf); \
+        bpf_print_loops(rbpf); \
     } while (0)
 
 typedef struct {
@@ -61,6 +108,209 @@ typedef struct {
     uint32_t words;
 } fletcher32_ctx_t;
 
+#if RBPF_ENABLE_MPU
+/* the blocks of the application in the child partition */
+static sandbox_t sandbox;
+#endif
+
+/* the context must lie in the memory the application reaches */
+static void *
+bpf_ctx(void *ctx, size_t size)
+{
+#if RBPF_ENABLE_MPU
+    uint8_t *copy = size ? sandbox_alloc(&sandbox, size) : NULL;
+    size_t i;
+
+    for (i = 0; copy != NULL && i < size; i++) {
+        copy[i] = ((const uint8_t *)ctx)[i];
+    }
+    return size ? copy : ctx;
+#else
+    (void)size;
+    return ctx;
+#endif
+}
+
+#if RBPF_ENABLE_MAPS
+/* the persistent map <map> of the bytecode <file> is kept in <file>.<map> */
+static const char *
+bpf_map_file(const char *file, uint32_t map)
+{
+    static char name[64];
+    char digits[10];
+    size_t i, n = 0;
+
+    do {
+        digits[n++] = '0' + map % 10;
+        map /= 10;
+    } while (map != 0);
+    for (i = 0; file[i] != '\0' && i < sizeof(name) - n - 2; i++) {
+        name[i] = file[i];
+    }
+    name[i++] = '.';
+    while (n != 0) {
+        name[i++] = digits[--n];
+    }
+    name[i] = '\0';
+    return name;
+}
+
+static int
+bpf_map_load(void *arg, uint32_t map, void *buf, size_t len)
+{
+    return (int)copy_file(bpf_map_file(arg, map), buf, len);
+}
+
+static int
+bpf_map_store(void *arg, uint32_t map, size_t offset, const void *buf,
+    size_t len)
+{
+    return write_file(bpf_map_file(arg, map), offset, buf, len) < 0 ?
+        -1 : 0;
+}
+#endif
+
+static void
+bpf_maps_flush(rbpf_application_t *rbpf)
+{
+#if RBPF_ENABLE_MAPS
+    int res;
+
+    if ((res = rbpf_application_maps_flush(rbpf)) < 0) {
+        printf(PROGNAME": failed to write the maps back (%d)\n", res);
+    }
+#else
+    (void)rbpf;
+#endif
+}
+
+static void
+bpf_print_count(const rbpf_application_t *rbpf)
+{
+#if RBPF_ENABLE_INSTRUCTION_COUNT
+    printf(PROGNAME": %lu instructions executed\n",
+        rbpf->instruction_count);
+#else
+    (void)rbpf;
+#endif
+}
+
+static void
+bpf_print_fusions(const rbpf_application_t *rbpf)
+{
+#if RBPF_ENABLE_FUSION
+    unsigned i;
+
+    for (i = 0; i < RBPF_FUSION_NUM; i++) {
+        printf(PROGNAME": %u %s superinstructions\n",
+            (unsigned)rbpf->fusions[i], rbpf_fusion_name(i));
+    }
+#else
+    (void)rbpf;
+#endif
+}
+
+static void
+bpf_print_loops(const rbpf_application_t *rbpf)
+{
+#if RBPF_ENABLE_BOUNDED_LOOPS
+    printf(PROGNAME": %u loops charged when entered\n",
+        (unsigned)rbpf->loops);
+#else
+    (void)rbpf;
+#endif
+}
+
+/* the suspended runs go on right away, where other work would interleave */
+static int
+bpf_resume(rbpf_application_t *rbpf, int status, int64_t *result)
+{
+#if RBPF_ENABLE_YIELD
+    while (status == RBPF_YIELD) {
+        status = rbpf_application_resume(rbpf, result);
+    }
+#else
+    (void)rbpf;
+    (void)result;
+#endif
+    return status;
+}
+
+#if OVERRUN_CHECK && !RBPF_ENABLE_MASKING && !RBPF_ENABLE_MPU
+/* an application and the instructions of its text */
+typedef struct {
+    rbpf_header_t header;
+    bpf_instruction_t text[11];
+} bpf_overrun_t;
+
+/* the loop reads the stack 8 bytes at a time, from 16 bytes below its end
+ * to 16 bytes past it */
+static const bpf_overrun_t bpf_stack_overrun = {
+    .header = {
+        .magic = RBPF_MAGIC_NO,
+        .text_len = 11 * sizeof(bpf_instruction_t),
+    },
+    .text = {
+        { BPF_INSTRUCTION_ALU64_MOV_IMM, 0, 0, 0, 0 },
+        { BPF_INSTRUCTION_ALU64_MOV_REG, 2, 10, 0, 0 },
+        { BPF_INSTRUCTION_ALU64_ADD_IMM, 2, 0, 0, -16 },
+        { BPF_INSTRUCTION_ALU32_MOV_IMM, 3, 0, 0, 4 },
+        { BPF_INSTRUCTION_JMP_ALWAYS, 0, 0, 0, 0 },
+        { BPF_INSTRUCTION_MEM_LDXDW, 4, 2, 0, 0 },
+        { BPF_INSTRUCTION_ALU64_ADD_REG, 0, 4, 0, 0 },
+        { BPF_INSTRUCTION_ALU64_ADD_IMM, 2, 0, 0, 8 },
+        { BPF_INSTRUCTION_ALU32_ADD_IMM, 3, 0, 0, -1 },
+        { BPF_INSTRUCTION_JMP32_NE_IMM, 3, 0, -5, 0 },
+        { BPF_INSTRUCTION_RETURN, 0, 0, 0, 0 },
+    },
+};
+
+/* the load reads 4 bytes from 8 bytes into a context of 8 bytes */
+static const bpf_overrun_t bpf_ctx_overrun = {
+    .header = {
+        .magic = RBPF_MAGIC_NO,
+        .text_len = 2 * sizeof(bpf_instruction_t),
+    },
+    .text = {
+        { BPF_INSTRUCTION_MEM_LDXW, 0, 1, 8, 0 },
+        { BPF_INSTRUCTION_RETURN, 0, 0, 0, 0 },
+    },
+};
+
+/* run the application, which must be refused by the pre-flight checks or
+ * stopped on the access out of bounds */
+static int
+bpf_overrun(rbpf_application_t *rbpf, uint8_t *stack,
+    const bpf_overrun_t *app, const char *name, void *ctx, size_t size)
+{
+    int64_t result;
+    int status;
+
+    rbpf_application_setup(rbpf, stack, (const void *)app,
+        sizeof(app->header) + app->header.text_len);
+    status = rbpf_application_run_ctx(rbpf, ctx, size, &result);
+    if (status == RBPF_OK) {
+        printf(PROGNAME": %s out of bounds not caught\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+/* the memory proof only skips the checks of the accesses in bounds */
+static int
+bpf_check_overruns(rbpf_application_t *rbpf, uint8_t *stack,
+    rbpf_insn_t *lowered, uint32_t *proof)
+{
+    uint64_t integer = 0;
+
+    rbpf_application_lowering_init(rbpf, lowered, LOWERED_SIZE_MAX);
+    rbpf_application_proof_init(rbpf, proof, PROOF_SIZE_MAX);
+    return bpf_overrun(rbpf, stack, &bpf_stack_overrun, "stack", NULL, 0) |
+        bpf_overrun(rbpf, stack, &bpf_ctx_overrun, "context", &integer,
+        sizeof(integer));
+}
+#endif
+
 static int
 bpf_print_result(int64_t result, int status)
 {
@@ -73,6 +323,10 @@ bpf_print_result(int64_t result, int status)
         printf(PROGNAME": illegal memory access\n");
         return 1;
         break;
+    case RBPF_MAPS_NOT_SYNCED:
+        printf(PROGNAME": %lx, maps not written back\n", (uint32_t)result);
+        return 1;
+        break;
     default:
         printf(PROGNAME": error\n");
         return 1;
@@ -128,16 +382,49 @@ bpf_run(rbpf_application_t *rbpf, unsigned n)
 int
 main(int argc, char **argv)
 {
-    static uint8_t rbpf_stack[RBPF_STACK_SIZE];
-    static char buf[BUFFER_SIZE_MAX];
-    static char bytecode[BYTECODE_SIZE_MAX];
+    static uint8_t stack_buf[RBPF_STACK_SIZE];
+    static char file_buf[BUFFER_SIZE_MAX];
+    static alignas(8) char bytecode_buf[BYTECODE_SIZE_MAX];
+    static rbpf_insn_t lowered_buf[LOWERED_SIZE_MAX];
+    static uint32_t proof[PROOF_SIZE_MAX];
+    static rbpf_frame_t frames_buf[FRAMES_MAX];
     static size_t bytecode_size;
-    rbpf_application_t rbpf;
+    static rbpf_application_t rbpf_buf;
     rbpf_mem_region_t region;
     uint64_t integer;
+    rbpf_application_t *rbpf = &rbpf_buf;
+    uint8_t *rbpf_stack = stack_buf;
+    rbpf_frame_t *frames = frames_buf;
+#if RBPF_ENABLE_STORE_CALLS
+    /* the local and the global store */
+    static rbpf_store_t stores[2];
+    static alignas(8) uint8_t store_data[2 * RBPF_STORE_SIZE(STORE_ENTRIES)];
+#endif
+#if RBPF_ENABLE_MAPS
+    static alignas(8) uint8_t maps_buf[MAPS_SIZE];
+    static uint32_t map_sums[MAP_SUMS_MAX];
+    static rbpf_map_storage_t map_storage = {
+        .load = bpf_map_load,
+        .store = bpf_map_store,
+    };
+    uint8_t *maps = maps_buf;
+#endif
+    rbpf_insn_t *lowered = lowered_buf;
+    char *bytecode = bytecode_buf;
+    char *buf = file_buf;
     ssize_t result;
     char *endptr;
+    int status;
     unsigned n;
+#if RBPF_ENABLE_JIT
+    void *jit;
+#endif
+#if RBPF_ENABLE_MASKING
+    void *arena;
+#endif
+#if RBPF_ENABLE_MPU
+    void *shadow;
+#endif
 
     if (argc < 3) {
         printf(PROGNAME": <n> <rbpf-file> [file | integer]\n");
@@ -150,8 +437,43 @@ main(int argc, char **argv)
         return 1;
     }
 
+#if RBPF_ENABLE_MPU
+    /*
+     * the child partition only reaches the blocks of the
+     * application: the application writes to its copy, its
+     * stack, its context, its frames and its maps, and only
+     * reads its bytecode, its pre-decoded form and its data;
+     * the application itself and the checksums of its maps
+     * stay in the memory of the partition
+     */
+    if (sandbox_init() < 0 ||
+        sandbox_create(&sandbox, SANDBOX_SIZE, SANDBOX_IMAGE_SIZE) < 0 ||
+        (shadow = sandbox_alloc(&sandbox, SHADOW_SIZE)) == NULL ||
+#if RBPF_ENABLE_LOCAL_CALLS
+        (frames = sandbox_alloc(&sandbox, FRAMES_SIZE)) == NULL ||
+#endif
+#if RBPF_ENABLE_MAPS
+        (maps = sandbox_alloc(&sandbox, MAPS_SIZE)) == NULL ||
+#endif
+        (rbpf_stack = sandbox_alloc(&sandbox, RBPF_STACK_SIZE)) == NULL ||
+        (bytecode = sandbox_alloc_image(&sandbox,
+        BYTECODE_SIZE_MAX)) == NULL ||
+        (lowered = sandbox_alloc_image(&sandbox,
+        LOWERED_SIZE_MAX * sizeof(rbpf_insn_t))) == NULL ||
+        (buf = sandbox_alloc_image(&sandbox, BUFFER_SIZE_MAX)) == NULL) {
+        printf(PROGNAME": failed to create the sandbox\n");
+        sandbox_fini();
+        return 1;
+    }
+    rbpf_application_sandbox_init(rbpf, sandbox_run, &sandbox, shadow,
+        SHADOW_SIZE);
+#endif
+
     if ((result = copy_file(argv[2], bytecode, BYTECODE_SIZE_MAX)) < 0) {
         printf(PROGNAME": %s: failed to copy bytecode\n", argv[2]);
+#if RBPF_ENABLE_MPU
+        sandbox_fini();
+#endif
         return 1;
     }
     bytecode_size = (size_t)result;
@@ -159,28 +481,113 @@ main(int argc, char **argv)
     printf(PROGNAME": \"%s\" bytecode loaded at address %p\n", argv[2],
         (void *)bytecode);
 
-    rbpf_application_setup(&rbpf, rbpf_stack, (void *)bytecode,
+#if RBPF_ENABLE_MASKING
+    /* room to align the arena on its size, and for its guard bytes */
+    if ((arena = alloc_unused_ram(2 * ARENA_SIZE + 8)) == NULL ||
+        rbpf_application_arena_init(rbpf, arena, 2 * ARENA_SIZE + 8) < 0) {
+        printf(PROGNAME": failed to allocate the arena\n");
+        return 1;
+    }
+    printf(PROGNAME": %u bytes arena at address %p\n",
+        (unsigned)rbpf->arena_len, (void *)rbpf->arena);
+#endif
+#if OVERRUN_CHECK && !RBPF_ENABLE_MASKING && !RBPF_ENABLE_MPU
+    /* the arena and the sandbox confine the accesses instead */
+    if (bpf_check_overruns(rbpf, rbpf_stack, lowered, proof) != 0) {
+        return 1;
+    }
+#endif
+    rbpf_application_setup(rbpf, rbpf_stack, (void *)bytecode,
         bytecode_size);
+#if RBPF_ENABLE_AOT
+    /* the bytecode comes from the files installed on the board, whose native
+     * code is trusted to run unchecked */
+    rbpf->flags |= RBPF_CONFIG_NATIVE_TRUSTED;
+#endif
+#if RBPF_ENABLE_MASKING
+    /* the data must be reachable by the application */
+    if ((buf = rbpf_arena_alloc(rbpf, BUFFER_SIZE_MAX)) == NULL) {
+        printf(PROGNAME": failed to allocate the data in the arena\n");
+        return 1;
+    }
+#endif
+#if RBPF_ENABLE_MAPS
+#if RBPF_ENABLE_MASKING
+    if ((maps = rbpf_arena_alloc(rbpf, MAPS_SIZE)) == NULL) {
+        printf(PROGNAME": failed to allocate the maps in the arena\n");
+        return 1;
+    }
+#endif
+    /* the maps of the application keep their values between the runs */
+    if ((result = rbpf_application_maps_init(rbpf, maps, MAPS_SIZE)) < 0) {
+        printf(PROGNAME": failed to lay out the maps (%d)\n", (int)result);
+#if RBPF_ENABLE_MPU
+        sandbox_fini();
+#endif
+        return 1;
+    }
+    /* the persistent maps are read back from xipfs on the first run */
+    map_storage.arg = argv[2];
+    if ((result = rbpf_application_map_storage_init(rbpf, &map_storage,
+        map_sums, MAP_SUMS_MAX)) < 0) {
+        printf(PROGNAME": failed to keep the checksums of the maps (%d)\n",
+            (int)result);
+#if RBPF_ENABLE_MPU
+        sandbox_fini();
+#endif
+        return 1;
+    }
+#endif
+    rbpf_application_lowering_init(rbpf, lowered, LOWERED_SIZE_MAX);
+    rbpf_application_proof_init(rbpf, proof, PROOF_SIZE_MAX);
+    /* the interpreter saves the registers of the local calls in the frames */
+    rbpf_application_frames_init(rbpf, frames, FRAMES_MAX);
+#if RBPF_ENABLE_YIELD && !RBPF_ENABLE_JIT && !RBPF_ENABLE_AOT
+    /* the runs are suspended every QUANTUM instructions, which the native
+     * code can't be */
+    rbpf_application_quantum_init(rbpf, QUANTUM);
+#endif
+#if RBPF_ENABLE_STORE_CALLS
+    /* the helpers keep the values of the application between the runs */
+    rbpf_store_init(&stores[0], store_data, RBPF_STORE_SIZE(STORE_ENTRIES));
+    rbpf_store_init(&stores[1], store_data + RBPF_STORE_SIZE(STORE_ENTRIES),
+        RBPF_STORE_SIZE(STORE_ENTRIES));
+    rbpf_application_store_init(rbpf, &stores[0], &stores[1]);
+#endif
+#if RBPF_ENABLE_JIT
+    /* the native code must be fetched from an executable region */
+    if ((jit = alloc_unused_ram(JIT_SIZE_MAX)) == NULL) {
+        printf(PROGNAME": failed to allocate the native code buffer\n");
+    } else {
+        rbpf_application_jit_init(rbpf, jit, JIT_SIZE_MAX);
+    }
+#endif
     rbpf_memory_region_init(&region, bytecode, bytecode_size,
         RBPF_MEM_REGION_READ);
-    rbpf_add_region(&rbpf, &region);
+    rbpf_add_region(rbpf, &region);
 
     if (argc < 4) {
-        return bpf_run(&rbpf, n);
-    }
-
-    if ((result = copy_file(argv[3], buf, BUFFER_SIZE_MAX)) >= 0) {
+        status = bpf_run(rbpf, n);
+    } else if ((result = copy_file(argv[3], buf, BUFFER_SIZE_MAX)) >= 0) {
         printf(PROGNAME": \"%s\" data loaded at address %p\n", argv[3],
             (void *)buf);
-        return bpf_run_with_file(&rbpf, n, buf, (size_t)result);
+        status = bpf_run_with_file(rbpf, n, buf, (size_t)result);
+    } else {
+        integer = (uint64_t)strtol(argv[3], &endptr, 16);
+        if (argv[3] != endptr && *endptr == '\0') {
+            status = bpf_run_with_integer(rbpf, n, integer);
+        } else {
+            /* other argument types are not yet supported */
+            status = 1;
+        }
     }
 
-    integer = (uint64_t)strtol(argv[3], &endptr, 16);
-    if (argv[3] != endptr && *endptr == '\0') {
-        return bpf_run_with_integer(&rbpf, n, integer);
-    }
+    /* the changes of the last runs */
+    bpf_maps_flush(rbpf);
 
-    /* other argument types are not yet supported */
+#if RBPF_ENABLE_MPU
+    sandbox_fini();
+#endif
 
-    return 1;
+    return status;
 }
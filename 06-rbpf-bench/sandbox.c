@@ -0,0 +1,395 @@
+/*******************************************************************************/
+/*  © Université de Lille, The Pip Development Team (2015-2024)                */
+/*                                                                             */
+/*  This software is a computer program whose purpose is to run a minimal,     */
+/*  hypervisor relying on proven properties such as memory isolation.          */
+/*                                                                             */
+/*  This software is governed by the CeCILL license under French law and       */
+/*  abiding by the rules of distribution of free software.  You can  use,      */
+/*  modify and/ or redistribute the software under the terms of the CeCILL     */
+/*  license as circulated by CEA, CNRS and INRIA at the following URL          */
+/*  "http://www.cecill.info".                                                  */
+/*                                                                             */
+/*  As a counterpart to the access to the source code and  rights to copy,     */
+/*  modify and redistribute granted by the license, users are provided only    */
+/*  with a limited warranty  and the software's author,  the holder of the     */
+/*  economic rights,  and the successive licensors  have only  limited         */
+/*  liability.                                                                 */
+/*                                                                             */
+/*  In this respect, the user's attention is drawn to the risks associated     */
+/*  with loading,  using,  modifying and/or developing or reproducing the      */
+/*  software by the user in light of its specific status of free software,     */
+/*  that may mean  that it is complicated to manipulate,  and  that  also      */
+/*  therefore means  that it is reserved for developers  and  experienced      */
+/*  professionals having in-depth computer knowledge. Users are therefore      */
+/*  encouraged to load and test the software's suitability as regards their    */
+/*  requirements in conditions enabling the security of their systems and/or   */
+/*  data to be ensured and,  more generally, to use and operate it in the      */
+/*  same conditions as regards security.                                       */
+/*                                                                             */
+/*  The fact that you are presently reading this means that you have had       */
+/*  knowledge of the CeCILL license and that you accept its terms.             */
+/*******************************************************************************/
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rbpf.h"
+#include "sandbox.h"
+#include "stdriot.h"
+
+#if RBPF_ENABLE_MPU
+
+/* granularity of the blocks the MPU enforces */
+#define SANDBOX_ALIGN        (32)
+/* room for the structures Pip keeps for the child */
+#define SANDBOX_DESC_SIZE    (512)
+#define SANDBOX_KERNEL_SIZE  (512)
+#define SANDBOX_STACK_SIZE   (1024)
+/*
+ * the partition splits its RAM block in the window of the
+ * child on its data, the structures Pip keeps for the child
+ * and the two blocks of each application
+ */
+#define SANDBOX_APPLICATIONS_MAX (2)
+#define SANDBOX_BLOCKS_MAX   (6 + 3 * SANDBOX_APPLICATIONS_MAX)
+
+/*
+ * MPU regions of the child: the code and the constant data of
+ * the virtual machine, then the two blocks of the application
+ * it runs
+ */
+#define SANDBOX_REGION_CODE   (0)
+#define SANDBOX_REGION_DATA   (1)
+#define SANDBOX_REGION_MEMORY (2)
+#define SANDBOX_REGION_IMAGE  (3)
+
+/*
+ * VIDT entries: the child starts a run from SANDBOX_ENTRY and
+ * saves its context to SANDBOX_SAVE. The partition saves its
+ * context to the MemManage entry, and is resumed from there
+ * both when the child yields back and when Pip forwards it the
+ * memory fault of the child.
+ */
+#define SANDBOX_ENTRY        (0)
+#define SANDBOX_SAVE         (1)
+#define SANDBOX_RESUME       (4)
+
+#define XPSR_THUMB           (1UL << 24)
+#define CONTEXT_VALID        (1)
+
+#define ALIGN_DOWN(addr)     ((addr) & ~(uintptr_t)(SANDBOX_ALIGN - 1))
+#define ALIGN_UP(addr)       ALIGN_DOWN((addr) + SANDBOX_ALIGN - 1)
+
+/* registers of the contexts Pip restores from a VIDT */
+enum {
+    CONTEXT_R0 = 0,
+    CONTEXT_SL = 10,
+    CONTEXT_SP = 13,
+    CONTEXT_LR,
+    CONTEXT_PC,
+    CONTEXT_XPSR,
+    CONTEXT_REGISTER_NUMBER,
+};
+
+typedef struct context_s {
+    uint32_t registers[CONTEXT_REGISTER_NUMBER];
+    uint32_t pipflags;
+    uint32_t valid;
+} context_t;
+
+/* start of the block an application writes to, where Pip expects the VIDT */
+typedef struct shared_s {
+    vidt_t vidt;
+    context_t entry;
+    rbpf_application_t *rbpf;
+    int status;
+} shared_t;
+
+/* parts of a block of the partition, by address */
+typedef struct blocks_s {
+    uint32_t *ids[SANDBOX_BLOCKS_MAX];
+    uintptr_t starts[SANDBOX_BLOCKS_MAX];
+    unsigned num;
+} blocks_t;
+
+/*
+ * bounds of the code and the constant data of the virtual
+ * machine, each between a granule of padding, see link.ld
+ */
+extern uint8_t __sandbox_rom_start[];
+extern uint8_t __sandbox_rom_end[];
+extern uint8_t __sandbox_data_end[];
+
+static blocks_t ram;
+static blocks_t rom;
+
+static uint32_t *child = NULL;
+static int child_created = 0;
+
+static inline uintptr_t
+_get_sl(void)
+{
+    uintptr_t sl;
+
+    __asm__ volatile ("mov %0, sl" : "=r" (sl));
+
+    return sl;
+}
+
+/* cuts the last part of a block, the addresses only increase */
+static uint32_t *
+sandbox_cut(blocks_t *blocks, uintptr_t addr)
+{
+    uint32_t *id;
+
+    if (addr == blocks->starts[blocks->num - 1]) {
+        return blocks->ids[blocks->num - 1];
+    }
+    if (blocks->num == SANDBOX_BLOCKS_MAX) {
+        return NULL;
+    }
+    if ((id = Pip_cutMemoryBlock(blocks->ids[blocks->num - 1],
+        (uint32_t *)addr, -1)) == NULL) {
+        return NULL;
+    }
+
+    blocks->ids[blocks->num] = id;
+    blocks->starts[blocks->num] = addr;
+    blocks->num++;
+
+    return id;
+}
+
+static void
+sandbox_merge(blocks_t *blocks)
+{
+    while (blocks->num > 1) {
+        blocks->num--;
+        blocks->ids[blocks->num - 1] = Pip_mergeMemoryBlocks(
+            blocks->ids[blocks->num - 1], blocks->ids[blocks->num], -1);
+    }
+
+    blocks->num = 0;
+}
+
+static void
+sandbox_entry(shared_t *s)
+{
+    s->status = rbpf_application_run_sandboxed(s->rbpf);
+
+    /* back to sandbox_run(), which never resumes the child */
+    Pip_yield(NULL, SANDBOX_RESUME, SANDBOX_SAVE, 1, 1);
+    for (;;) {}
+}
+
+int
+sandbox_init(void)
+{
+    interface_t *interface = get_pip_interface();
+    blockOrError block = { .error = -1 };
+    uint32_t *kernel, *code, *data;
+    uintptr_t start, sl;
+    void *buf;
+
+    if (interface == NULL) {
+        return -1;
+    }
+
+    buf = alloc_unused_ram(SANDBOX_DESC_SIZE + SANDBOX_KERNEL_SIZE +
+        SANDBOX_ALIGN);
+    if (buf == NULL) {
+        return -1;
+    }
+    start = ALIGN_UP((uintptr_t)buf);
+
+    Pip_findBlock(interface->partDescBlockId, (uint32_t *)start, &block);
+    if (block.error == -1) {
+        return -1;
+    }
+    ram.ids[0] = block.blockAttr.blockentryaddr;
+    ram.starts[0] = (uintptr_t)block.blockAttr.blockstartaddr;
+    ram.num = 1;
+
+    block.error = -1;
+    Pip_findBlock(interface->partDescBlockId, interface->root, &block);
+    if (block.error == -1) {
+        return -1;
+    }
+    rom.ids[0] = block.blockAttr.blockentryaddr;
+    rom.starts[0] = (uintptr_t)block.blockAttr.blockstartaddr;
+    rom.num = 1;
+
+    /*
+     * The child executes the code of the virtual machine, and
+     * reads the GOT followed by the constant tables of the
+     * virtual machine. Nothing else of the partition is mapped
+     * in the child, the padding keeps the rounding of the
+     * windows to the granularity of the MPU within them.
+     */
+    sl = ALIGN_DOWN(_get_sl());
+    if (sl < ram.starts[0]) {
+        sl = ram.starts[0];
+    }
+    if ((code = sandbox_cut(&rom,
+        ALIGN_DOWN((uintptr_t)__sandbox_rom_start))) == NULL ||
+        sandbox_cut(&rom, ALIGN_UP((uintptr_t)__sandbox_rom_end)) == NULL ||
+        (data = sandbox_cut(&ram, sl)) == NULL ||
+        sandbox_cut(&ram, ALIGN_UP((uintptr_t)__sandbox_data_end)) == NULL ||
+        (child = sandbox_cut(&ram, start)) == NULL ||
+        (kernel = sandbox_cut(&ram, start + SANDBOX_DESC_SIZE)) == NULL ||
+        sandbox_cut(&ram, start + SANDBOX_DESC_SIZE +
+        SANDBOX_KERNEL_SIZE) == NULL) {
+        sandbox_fini();
+        return -1;
+    }
+
+    if (Pip_createPartition(child) == 0) {
+        sandbox_fini();
+        return -1;
+    }
+    child_created = 1;
+
+    if (Pip_prepare(child, -1, kernel) == 0 ||
+        (code = Pip_addMemoryBlock(child, code, 1, 0, 1)) == NULL ||
+        (data = Pip_addMemoryBlock(child, data, 1, 0, 0)) == NULL ||
+        Pip_mapMPU(child, code, SANDBOX_REGION_CODE) == 0 ||
+        Pip_mapMPU(child, data, SANDBOX_REGION_DATA) == 0) {
+        sandbox_fini();
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+sandbox_create(sandbox_t *sandbox, size_t size, size_t image_size)
+{
+    uint32_t *memory, *image;
+    uintptr_t start, end;
+    shared_t *shared;
+    void *buf;
+
+    if (!child_created) {
+        return -1;
+    }
+
+    size = ALIGN_UP(sizeof(shared_t) + SANDBOX_STACK_SIZE + size);
+    image_size = ALIGN_UP(image_size ? image_size : 1);
+    if ((buf = alloc_unused_ram(size + image_size + SANDBOX_ALIGN)) == NULL) {
+        return -1;
+    }
+    start = ALIGN_UP((uintptr_t)buf);
+    end = start + size + image_size;
+
+    if ((memory = sandbox_cut(&ram, start)) == NULL ||
+        (image = sandbox_cut(&ram, start + size)) == NULL ||
+        sandbox_cut(&ram, end) == NULL ||
+        (sandbox->memory = Pip_addMemoryBlock(child, memory,
+        1, 1, 0)) == NULL ||
+        (sandbox->image = Pip_addMemoryBlock(child, image,
+        1, 0, 0)) == NULL) {
+        return -1;
+    }
+
+    shared = (shared_t *)start;
+    memset(shared, 0, sizeof(*shared));
+    sandbox->shared = shared;
+    sandbox->stack_top = (start + sizeof(*shared) + SANDBOX_STACK_SIZE) &
+        ~(uintptr_t)7;
+    sandbox->alloc_start = sandbox->stack_top;
+    sandbox->alloc_end = start + size;
+    sandbox->image_start = start + size;
+    sandbox->image_end = end;
+
+    return 0;
+}
+
+static void *
+sandbox_bump(uintptr_t *alloc_start, uintptr_t alloc_end, size_t size)
+{
+    uintptr_t start = (*alloc_start + 7) & ~(uintptr_t)7;
+
+    if (start < *alloc_start || start + size < start ||
+        start + size > alloc_end) {
+        return NULL;
+    }
+
+    *alloc_start = start + size;
+
+    return memset((void *)start, 0, size);
+}
+
+void *
+sandbox_alloc(sandbox_t *sandbox, size_t size)
+{
+    return sandbox_bump(&sandbox->alloc_start, sandbox->alloc_end, size);
+}
+
+void *
+sandbox_alloc_image(sandbox_t *sandbox, size_t size)
+{
+    return sandbox_bump(&sandbox->image_start, sandbox->image_end, size);
+}
+
+int
+sandbox_run(rbpf_application_t *rbpf, void *arg)
+{
+    vidt_t *vidt = get_pip_interface()->vidtStart;
+    void *resume = vidt->contexts[SANDBOX_RESUME];
+    sandbox_t *sandbox = arg;
+    shared_t *shared = sandbox->shared;
+    context_t *entry = &shared->entry;
+    unsigned i;
+
+    /* the child only reaches the blocks of this application */
+    if (Pip_mapMPU(child, sandbox->memory, SANDBOX_REGION_MEMORY) == 0 ||
+        Pip_mapMPU(child, sandbox->image, SANDBOX_REGION_IMAGE) == 0 ||
+        Pip_setVIDT(child, sandbox->memory) == 0) {
+        return RBPF_ILLEGAL_MEM;
+    }
+
+    /*
+     * every run starts afresh from sandbox_entry(), the child
+     * may have overwritten its VIDT during the previous run
+     */
+    shared->vidt.contexts[SANDBOX_ENTRY] = entry;
+    shared->vidt.contexts[SANDBOX_SAVE] = NULL;
+    for (i = 0; i < CONTEXT_REGISTER_NUMBER; i++) {
+        entry->registers[i] = 0;
+    }
+    entry->registers[CONTEXT_R0] = (uint32_t)(uintptr_t)shared;
+    entry->registers[CONTEXT_SL] = (uint32_t)_get_sl();
+    entry->registers[CONTEXT_SP] = (uint32_t)sandbox->stack_top;
+    entry->registers[CONTEXT_PC] = (uint32_t)(uintptr_t)sandbox_entry & ~1UL;
+    entry->registers[CONTEXT_XPSR] = XPSR_THUMB;
+    entry->pipflags = 0;
+    entry->valid = CONTEXT_VALID;
+
+    shared->rbpf = rbpf;
+    shared->status = RBPF_ILLEGAL_MEM;
+
+    Pip_yield(child, SANDBOX_ENTRY, SANDBOX_RESUME, 1, 1);
+
+    /* the entry belongs to the partition the rest of the time */
+    vidt->contexts[SANDBOX_RESUME] = resume;
+
+    return shared->status;
+}
+
+void
+sandbox_fini(void)
+{
+    /* Pip gives the blocks of the child back on deletion */
+    if (child_created) {
+        Pip_deletePartition(child);
+        child_created = 0;
+    }
+
+    sandbox_merge(&ram);
+    sandbox_merge(&rom);
+}
+
+#endif /* RBPF_ENABLE_MPU */
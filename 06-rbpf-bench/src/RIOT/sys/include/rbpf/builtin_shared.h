@@ -10,6 +10,8 @@
 #ifndef RBPF_BUILTIN_SHARED_H
 #define RBPF_BUILTIN_SHARED_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,8 +22,55 @@ enum {
     BPF_FUNC_BPF_STORE_GLOBAL   = 0x11,
     BPF_FUNC_BPF_FETCH_LOCAL    = 0x12,
     BPF_FUNC_BPF_FETCH_GLOBAL   = 0x13,
+
+    /* Program chaining */
+    BPF_FUNC_BPF_TAIL_CALL      = 0x20,
+
+    /* Memory functions */
+    BPF_FUNC_BPF_MEMCPY         = 0x30,
+    BPF_FUNC_BPF_MEMSET         = 0x31,
+    BPF_FUNC_BPF_MEMCMP         = 0x32,
+    BPF_FUNC_BPF_MEMCHR         = 0x33,
+
+    /* Checksum and hash functions */
+    BPF_FUNC_BPF_FLETCHER32     = 0x40,
+    BPF_FUNC_BPF_CRC32          = 0x41,
+    BPF_FUNC_BPF_SHA256_INIT    = 0x42,
+    BPF_FUNC_BPF_SHA256_UPDATE  = 0x43,
+    BPF_FUNC_BPF_SHA256_FINAL   = 0x44,
+
+    /* Maps */
+    BPF_FUNC_BPF_MAP_LOOKUP     = 0x50,
+    BPF_FUNC_BPF_MAP_SYNC       = 0x51,
 };
 
+/* Types of maps */
+#define BPF_MAP_TYPE_ARRAY      (2)
+
+/* Flags of maps, the map is loaded from and written back to the storage of
+ * the host */
+#define BPF_F_PERSISTENT        (1U << 0)
+
+/* Definition of a map in the "maps" section of the application, the key of
+ * an array map is the index of an element */
+typedef struct {
+    uint32_t type;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t max_entries;
+    uint32_t map_flags;
+} bpf_map_def_t;
+
+/* Initial state of the Fletcher-32 checksum */
+#define BPF_FLETCHER32_INIT     (0xffffffff)
+
+/* State of a SHA-256 hash, kept by the application between the calls */
+typedef struct {
+    uint32_t hash[8];
+    uint64_t len;               /* Bytes hashed so far */
+    uint8_t block[64];          /* Start of the next block */
+} bpf_sha256_state_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2023 Freie Universität Berlin
+ * Copyright (C) 2023 Inria
+ * Copyright (C) 2023 Koen Zandberg <koen@bergzand.net>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/*
+ * Atomic operations of the atomic instructions, shared by the interpreter and
+ * the native code
+ *
+ * The 32 bit operations compile to exclusive load and store loops
+ * (LDREX/STREX) on ARMv7-M, which restart when an interrupt runs in between.
+ * The core has no 64 bit exclusive accesses, the 64 bit operations mask the
+ * interrupts around plain accesses instead, as RIOT's irq_disable() does.
+ * The address is aligned on the size of the access.
+ */
+
+#ifndef RBPF_ATOMIC_H
+#define RBPF_ATOMIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rbpf/instruction.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Generate the atomic operation on the TYPE at the address, returning the
+ * previous value */
+#define RBPF_ATOMIC(NAME, TYPE) \
+    static inline TYPE NAME(TYPE *addr, int32_t op, TYPE value, TYPE expected) \
+    { \
+        switch (op & ~BPF_INSTRUCTION_ATOMIC_FETCH) { \
+        case BPF_INSTRUCTION_ATOMIC_ADD: \
+            return __atomic_fetch_add(addr, value, __ATOMIC_SEQ_CST); \
+        case BPF_INSTRUCTION_ATOMIC_OR: \
+            return __atomic_fetch_or(addr, value, __ATOMIC_SEQ_CST); \
+        case BPF_INSTRUCTION_ATOMIC_AND: \
+            return __atomic_fetch_and(addr, value, __ATOMIC_SEQ_CST); \
+        case BPF_INSTRUCTION_ATOMIC_XOR: \
+            return __atomic_fetch_xor(addr, value, __ATOMIC_SEQ_CST); \
+        case BPF_INSTRUCTION_ATOMIC_XCHG & ~BPF_INSTRUCTION_ATOMIC_FETCH: \
+            return __atomic_exchange_n(addr, value, __ATOMIC_SEQ_CST); \
+        default: \
+            __atomic_compare_exchange_n(addr, &expected, value, false, __ATOMIC_SEQ_CST, \
+                                        __ATOMIC_SEQ_CST); \
+            return expected; \
+        } \
+    }
+
+RBPF_ATOMIC(rbpf_atomic32, uint32_t)
+
+#if (__GCC_ATOMIC_LLONG_LOCK_FREE == 2)
+RBPF_ATOMIC(rbpf_atomic64, uint64_t)
+#else
+static inline uint64_t rbpf_atomic64(uint64_t *addr, int32_t op, uint64_t value,
+                                     uint64_t expected)
+{
+    uint64_t old;
+    uint32_t primask;
+
+    __asm__ volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask) :: "memory");
+    old = *addr;
+    switch (op & ~BPF_INSTRUCTION_ATOMIC_FETCH) {
+    case BPF_INSTRUCTION_ATOMIC_ADD:
+        *addr = old + value;
+        break;
+    case BPF_INSTRUCTION_ATOMIC_OR:
+        *addr = old | value;
+        break;
+    case BPF_INSTRUCTION_ATOMIC_AND:
+        *addr = old & value;
+        break;
+    case BPF_INSTRUCTION_ATOMIC_XOR:
+        *addr = old ^ value;
+        break;
+    case BPF_INSTRUCTION_ATOMIC_XCHG & ~BPF_INSTRUCTION_ATOMIC_FETCH:
+        *addr = value;
+        break;
+    default:
+        if (old == expected) {
+            *addr = value;
+        }
+    }
+    __asm__ volatile ("msr primask, %0" :: "r" (primask) : "memory");
+    return old;
+}
+#endif
+
+/* The 64 bit atomic instruction on the register file, for the native code */
+static inline void rbpf_atomic64_regs(uint64_t *regs, uint64_t *addr, int32_t op, uint32_t src)
+{
+    uint64_t old = rbpf_atomic64(addr, op, regs[src], regs[0]);
+
+    if (op == BPF_INSTRUCTION_ATOMIC_CMPXCHG) {
+        regs[0] = old;
+    }
+    else if (op & BPF_INSTRUCTION_ATOMIC_FETCH) {
+        regs[src] = old;
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* RBPF_ATOMIC_H */
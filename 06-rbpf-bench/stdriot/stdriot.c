@@ -48,6 +48,7 @@ enum syscall_index_e {
     COPY_FILE,
     GET_FILE_SIZE,
     MEMSET,
+    WRITE_FILE,
 };
 
 typedef int (*exit_t)(int status);
@@ -60,6 +61,8 @@ typedef int (*set_led_t)(int pos, int val);
 typedef ssize_t (*copy_file_t)(const char *name, void *buf, size_t nbyte);
 typedef int (*get_file_size_t)(const char *name, size_t *size);
 typedef void *(*memset_t)(void *m, int c, size_t n);
+typedef ssize_t (*write_file_t)(const char *name, size_t offset, const void *buf,
+    size_t nbyte);
 
 extern int main(int argc, char **argv);
 
@@ -68,6 +71,11 @@ static void **syscall_curr_got = NULL;
 static void **syscall_table = NULL;
 static int syscall_is_init = 0;
 
+static uintptr_t unused_ram_start = 0;
+static uintptr_t unused_ram_end = 0;
+
+static interface_t *pip_interface = NULL;
+
 static inline void
 _set_sl(volatile void *val)
 {
@@ -498,15 +506,227 @@ memset(void *m, int c, size_t n)
 }
 #endif
 
+/*
+ * The memory functions are written with inline assembly, as
+ * the memcpy of crt0 is, so that the compiler doesn't turn
+ * their loops back into calls to themselves. Buffers aligned
+ * the same way are handled a word at a time past their first
+ * bytes.
+ */
 extern void *
 memset (void *dest, register int val, register size_t len)
 {
-  register unsigned char *ptr = (unsigned char*)dest;
-  while (len-- > 0)
-    *ptr++ = val;
+  void *d = dest;
+  uint32_t word = (uint8_t)val * 0x01010101UL;
+
+  while (len > 0 && ((uintptr_t)d & 3) != 0) {
+    __asm__ volatile
+    (
+      "strb %1, [%0], #1\n"
+      : "+r" (d)
+      : "r" (word)
+      : "memory"
+    );
+    len--;
+  }
+
+  while (len >= 4) {
+    __asm__ volatile
+    (
+      "str %1, [%0], #4\n"
+      : "+r" (d)
+      : "r" (word)
+      : "memory"
+    );
+    len -= 4;
+  }
+
+  while (len > 0) {
+    __asm__ volatile
+    (
+      "strb %1, [%0], #1\n"
+      : "+r" (d)
+      : "r" (word)
+      : "memory"
+    );
+    len--;
+  }
+
   return dest;
 }
 
+extern void *
+memcpy(void *dest, const void *src, size_t n)
+{
+    void *d = dest;
+
+    if ((((uintptr_t)dest ^ (uintptr_t)src) & 3) == 0) {
+        while (n > 0 && ((uintptr_t)d & 3) != 0) {
+            __asm__ volatile
+            (
+                "ldrb r2, [%0], #1\n"
+                "strb r2, [%1], #1\n"
+                : "+r" (src), "+r" (d)
+                :
+                : "r2", "memory"
+            );
+            n--;
+        }
+
+        while (n >= 16) {
+            __asm__ volatile
+            (
+                "ldmia %0!, {r2-r5}\n"
+                "stmia %1!, {r2-r5}\n"
+                : "+r" (src), "+r" (d)
+                :
+                : "r2", "r3", "r4", "r5", "memory"
+            );
+            n -= 16;
+        }
+
+        while (n >= 4) {
+            __asm__ volatile
+            (
+                "ldr r2, [%0], #4\n"
+                "str r2, [%1], #4\n"
+                : "+r" (src), "+r" (d)
+                :
+                : "r2", "memory"
+            );
+            n -= 4;
+        }
+    }
+
+    while (n > 0) {
+        __asm__ volatile
+        (
+            "ldrb r2, [%0], #1\n"
+            "strb r2, [%1], #1\n"
+            : "+r" (src), "+r" (d)
+            :
+            : "r2", "memory"
+        );
+        n--;
+    }
+
+    return dest;
+}
+
+/*
+ * Only the buffers overlapping with the destination after the
+ * source are copied backwards, a byte at a time.
+ */
+extern void *
+memmove(void *dest, const void *src, size_t n)
+{
+    void *d = (uint8_t *)dest + n;
+
+    if ((uintptr_t)dest - (uintptr_t)src >= n) {
+        return memcpy(dest, src, n);
+    }
+
+    src = (const uint8_t *)src + n;
+    while (n > 0) {
+        __asm__ volatile
+        (
+            "ldrb r2, [%0, #-1]!\n"
+            "strb r2, [%1, #-1]!\n"
+            : "+r" (src), "+r" (d)
+            :
+            : "r2", "memory"
+        );
+        n--;
+    }
+
+    return dest;
+}
+
+extern ssize_t
+write_file(const char *name, size_t offset, const void *buf, size_t nbyte)
+{
+    volatile write_file_t func;
+    volatile void *prev_got;
+    volatile void *curr_got;
+    ssize_t res = 0;
+
+    if (syscall_table[PIP] == (void *)0) {
+        func = syscall_table[WRITE_FILE];
+        prev_got = syscall_prev_got;
+        curr_got = syscall_curr_got;
+
+        _set_sl(prev_got);
+        res = (*func)(name, offset, buf, nbyte);
+        _set_sl(curr_got);
+    } else {
+        __asm__ volatile
+        (
+            "mov r0, %4\n"
+            "push {r0}\n"
+            "mov r0, #10\n"
+            "mov r1, %1\n"
+            "mov r2, %2\n"
+            "mov r3, %3\n"
+            "push {r0-r3}\n"
+            "mov r0, #0\n"
+            "mov r1, %5\n"
+            "mov r2, #0\n"
+            "mov r3, #1\n"
+            "mov r4, #1\n"
+            "svc #12\n"
+            "pop {%0}\n"
+            "add sp, sp, #16\n"
+            : "=r" (res)
+            : "r" (name),
+              "r" (offset),
+              "r" (buf),
+              "r" (nbyte),
+              "r" (syscall_table[WRITE_FILE])
+            : "r0", "r1", "r2", "r3", "r4"
+        );
+    }
+
+    return res;
+}
+
+extern void *
+alloc_unused_ram(size_t size)
+{
+    uintptr_t start = (unused_ram_start + 7) & ~(uintptr_t)7;
+
+    if (start < unused_ram_start || start + size < start ||
+        start + size > unused_ram_end) {
+        return NULL;
+    }
+
+    unused_ram_start = start + size;
+
+    return (void *)start;
+}
+
+extern interface_t *
+get_pip_interface(void)
+{
+    if (syscall_table[PIP] == (void *)0) {
+        return NULL;
+    }
+
+    return pip_interface;
+}
+
+static void
+unused_ram_init(interface_t *interface)
+{
+    unused_ram_start = (uintptr_t)interface->unusedRamStart;
+    unused_ram_end = (uintptr_t)interface->ramEnd;
+
+    /* never hand out the stack, when it lies in the unused RAM */
+    if ((uintptr_t)interface->stackLimit > unused_ram_start &&
+        (uintptr_t)interface->stackLimit < unused_ram_end) {
+        unused_ram_end = (uintptr_t)interface->stackLimit;
+    }
+}
+
 extern int
 start(interface_t *interface, void *gotAddr,
     void *oldGotAddr, void **syscalls)
@@ -515,6 +735,8 @@ start(interface_t *interface, void *gotAddr,
     int argc;
 
     syscall_init(oldGotAddr, gotAddr, syscalls);
+    unused_ram_init(interface);
+    pip_interface = interface;
 
     argc = (int)(((uint32_t *)interface->stackTop)[0]);
     argv = (char **)&(((uint32_t *) interface->stackTop)[1]);
@@ -0,0 +1,167 @@
+/*******************************************************************************/
+/*  © Université de Lille, The Pip Development Team (2015-2024)                */
+/*                                                                             */
+/*  This software is a computer program whose purpose is to run a minimal,     */
+/*  hypervisor relying on proven properties such as memory isolation.          */
+/*                                                                             */
+/*  This software is governed by the CeCILL license under French law and       */
+/*  abiding by the rules of distribution of free software.  You can  use,      */
+/*  modify and/ or redistribute the software under the terms of the CeCILL     */
+/*  license as circulated by CEA, CNRS and INRIA at the following URL          */
+/*  "http://www.cecill.info".                                                  */
+/*                                                                             */
+/*  As a counterpart to the access to the source code and  rights to copy,     */
+/*  modify and redistribute granted by the license, users are provided only    */
+/*  with a limited warranty  and the software's author,  the holder of the     */
+/*  economic rights,  and the successive licensors  have only  limited         */
+/*  liability.                                                                 */
+/*                                                                             */
+/*  In this respect, the user's attention is drawn to the risks associated     */
+/*  with loading,  using,  modifying and/or developing or reproducing the      */
+/*  software by the user in light of its specific status of free software,     */
+/*  that may mean  that it is complicated to manipulate,  and  that  also      */
+/*  therefore means  that it is reserved for developers  and  experienced      */
+/*  professionals having in-depth computer knowledge. Users are therefore      */
+/*  encouraged to load and test the software's suitability as regards their    */
+/*  requirements in conditions enabling the security of their systems and/or   */
+/*  data to be ensured and,  more generally, to use and operate it in the      */
+/*  same conditions as regards security.                                       */
+/*                                                                             */
+/*  The fact that you are presently reading this means that you have had       */
+/*  knowledge of the CeCILL license and that you accept its terms.             */
+/*******************************************************************************/
+
+
+#ifndef SANDBOX_H
+#define SANDBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbpf.h"
+
+/*!
+ * \brief The blocks of the child partition of an rBPF
+ *        application, which the child only reaches while it
+ *        runs this application.
+ */
+typedef struct sandbox_s {
+    /*!
+     * \brief The block the application writes to, in the
+     *        child partition.
+     */
+    uint32_t *memory;
+    /*!
+     * \brief The block the application only reads, in the
+     *        child partition.
+     */
+    uint32_t *image;
+    /*!
+     * \brief The start of the block the application writes
+     *        to, where Pip expects the VIDT of the child.
+     */
+    void *shared;
+    /*!
+     * \brief The top of the stack of the child.
+     */
+    uintptr_t stack_top;
+    /*!
+     * \brief The free part of the block the application
+     *        writes to.
+     */
+    uintptr_t alloc_start;
+    uintptr_t alloc_end;
+    /*!
+     * \brief The free part of the block the application only
+     *        reads.
+     */
+    uintptr_t image_start;
+    uintptr_t image_end;
+} sandbox_t;
+
+/*!
+ * \brief Creates the child partition running the rBPF
+ *        applications. The child only executes the code of
+ *        the virtual machine and only reads its constant
+ *        data, gathered apart from the rest of the partition
+ *        by the linker script.
+ *
+ * \return 0 on success, -1 if the partition does not run over
+ *         Pip or Pip refused to create the child partition.
+ */
+int sandbox_init(void);
+
+/*!
+ * \brief Gives the child partition two blocks for a single
+ *        rBPF application, one it writes to and one it only
+ *        reads. The child never reaches the blocks of the
+ *        other applications while it runs this one.
+ *
+ * \param sandbox The sandbox of the application.
+ *
+ * \param size The size of the memory the application writes
+ *        to.
+ *
+ * \param image_size The size of the memory the application
+ *        only reads.
+ *
+ * \return 0 on success, -1 if the memory is exhausted or Pip
+ *         refused to give the blocks to the child.
+ */
+int sandbox_create(sandbox_t *sandbox, size_t size, size_t image_size);
+
+/*!
+ * \brief Allocates a buffer, aligned on 8 bytes and cleared,
+ *        from the memory an rBPF application writes to. The
+ *        copy of the application given to
+ *        rbpf_application_sandbox_init(), its stack, its
+ *        contexts, its frames and its maps must be allocated
+ *        there. The application itself, its stores and the
+ *        checksums of its maps must stay in the memory of the
+ *        partition, which the child never reaches.
+ *
+ * \param sandbox The sandbox of the application.
+ *
+ * \param size The size of the buffer in bytes.
+ *
+ * \return The buffer, or NULL if the memory is exhausted.
+ */
+void *sandbox_alloc(sandbox_t *sandbox, size_t size);
+
+/*!
+ * \brief Allocates a buffer, aligned on 8 bytes and cleared,
+ *        from the memory an rBPF application only reads, which
+ *        the partition fills. The image of the application,
+ *        its pre-decoded form and the data its contexts point
+ *        to must be allocated there.
+ *
+ * \param sandbox The sandbox of the application.
+ *
+ * \param size The size of the buffer in bytes.
+ *
+ * \return The buffer, or NULL if the memory is exhausted.
+ */
+void *sandbox_alloc_image(sandbox_t *sandbox, size_t size);
+
+/*!
+ * \brief Runs an rBPF application in the child partition,
+ *        see rbpf_application_sandbox_init().
+ *
+ * \param rbpf The copy of the application, allocated with
+ *             sandbox_alloc().
+ *
+ * \param arg The sandbox of the application.
+ *
+ * \return The execution result of the application, or
+ *         RBPF_ILLEGAL_MEM if the MPU caught an illegal
+ *         memory access.
+ */
+int sandbox_run(rbpf_application_t *rbpf, void *arg);
+
+/*!
+ * \brief Deletes the child partition and gives its blocks back
+ *        to the partition.
+ */
+void sandbox_fini(void);
+
+#endif /* SANDBOX_H */
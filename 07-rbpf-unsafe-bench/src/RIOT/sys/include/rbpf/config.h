@@ -14,13 +14,154 @@
 #define RBPF_ENABLE_ALU32 (1)
 #endif
 
+/* Dispatch instructions through a table of label addresses indexed by the
+ * opcode instead of a switch, requires the GCC "labels as values" extension */
+#ifndef RBPF_ENABLE_THREADED_CODE
+#define RBPF_ENABLE_THREADED_CODE (0)
+#endif
+
+/* Lower the application into a pre-decoded form during the pre-flight checks
+ * and execute that form, see rbpf_application_lowering_init() */
+#ifndef RBPF_ENABLE_LOWERING
+#define RBPF_ENABLE_LOWERING (0)
+#endif
+
+/* Execute the 64 bit operations and jumps of the pre-decoded form whose
+ * operands the pre-flight checks prove to fit in 32 bits as 32 bit ones, needs
+ * RBPF_ENABLE_LOWERING */
+#ifndef RBPF_ENABLE_NARROWING
+#define RBPF_ENABLE_NARROWING (0)
+#endif
+
+/* Replace the frequent sequences of instructions of the pre-decoded form by
+ * superinstructions executed with a single dispatch, which the instruction
+ * count counts once, needs RBPF_ENABLE_LOWERING */
+#ifndef RBPF_ENABLE_FUSION
+#define RBPF_ENABLE_FUSION (0)
+#endif
+
+/* Charge the iterations of the loops of the pre-decoded form with a known
+ * number of iterations once at their entry instead of on every backward
+ * branch, needs RBPF_ENABLE_LOWERING */
+#ifndef RBPF_ENABLE_BOUNDED_LOOPS
+#define RBPF_ENABLE_BOUNDED_LOOPS (0)
+#endif
+
+/* Translate the application to Thumb-2 code during the pre-flight checks and
+ * execute the native code, ARMv7-M only, see rbpf_application_jit_init() */
+#ifndef RBPF_ENABLE_JIT
+#define RBPF_ENABLE_JIT (0)
+#endif
+
+/* Execute in place the Thumb-2 code compiled ahead of time by gen_rbf.py and
+ * shipped in the native section of the application, ARMv7-M only */
+#ifndef RBPF_ENABLE_AOT
+#define RBPF_ENABLE_AOT (0)
+#endif
+
+/* Prove the memory accesses of the application in bounds during the pre-flight
+ * checks and skip their checks, see rbpf_application_proof_init() */
+#ifndef RBPF_ENABLE_MEMORY_PROOF
+#define RBPF_ENABLE_MEMORY_PROOF (0)
+#endif
+
+/* Confine every memory access of the application to its arena by masking the
+ * address instead of checking it, see rbpf_application_arena_init() */
+#ifndef RBPF_ENABLE_MASKING
+#define RBPF_ENABLE_MASKING (0)
+#endif
+
+/* Leave the memory protection to the MPU, the application only runs in the
+ * sandbox set with rbpf_application_sandbox_init() and is not checked */
+#ifndef RBPF_ENABLE_MPU
+#define RBPF_ENABLE_MPU (0)
+#endif
+
+/* Interpret the applications flagged by `gen_rbf.py generate --reg32` with 32
+ * bit registers instead of 64 bit ones, 32 bit targets only */
+#ifndef RBPF_ENABLE_REG32
+#define RBPF_ENABLE_REG32 (0)
+#endif
+
+/* Execute the applications with a compressed text, written by `gen_rbf.py
+ * generate --compress`, decoding the instructions in place */
+#ifndef RBPF_ENABLE_COMPRESSED
+#define RBPF_ENABLE_COMPRESSED (0)
+#endif
+
+/* Execute the local calls of the application to its own functions, with a
+ * frame per call saving r6 to r9 and the frame pointer, see
+ * rbpf_application_frames_init() */
+#ifndef RBPF_ENABLE_LOCAL_CALLS
+#define RBPF_ENABLE_LOCAL_CALLS (0)
+#endif
+
+/* Chain the applications of a program array with the tail call helper, the
+ * run going on with the next application on the same context, see
+ * rbpf_application_prog_array_init() */
+#ifndef RBPF_ENABLE_TAIL_CALLS
+#define RBPF_ENABLE_TAIL_CALLS (0)
+#endif
+
+/* Suspend the interpreted runs of the applications given a quantum once they
+ * executed that many instructions, the run going on with
+ * rbpf_application_resume(), see rbpf_application_quantum_init() */
+#ifndef RBPF_ENABLE_YIELD
+#define RBPF_ENABLE_YIELD (0)
+#endif
+
+/* Built-in helpers copying, filling, comparing and searching memory ranges,
+ * each range checked once */
+#ifndef RBPF_ENABLE_MEM_CALLS
+#define RBPF_ENABLE_MEM_CALLS (0)
+#endif
+
+/* Built-in helpers computing the Fletcher-32 and CRC-32 checksums and the
+ * SHA-256 hash of memory ranges, in chunks */
+#ifndef RBPF_ENABLE_HASH_CALLS
+#define RBPF_ENABLE_HASH_CALLS (0)
+#endif
+
+/* Key/value stores kept by the applications between their runs, see
+ * rbpf_application_store_init() */
+#ifndef RBPF_ENABLE_STORE_CALLS
+#define RBPF_ENABLE_STORE_CALLS (0)
+#endif
+
+/* Array maps of the applications, looked up with the BPF_FUNC_BPF_MAP_LOOKUP
+ * helper, see rbpf_application_maps_init() */
+#ifndef RBPF_ENABLE_MAPS
+#define RBPF_ENABLE_MAPS (0)
+#endif
+
+/* Count the instructions executed in rbpf_application_t::instruction_count,
+ * used by the benchmarks to derive the cost of a single instruction */
+#ifndef RBPF_ENABLE_INSTRUCTION_COUNT
+#define RBPF_ENABLE_INSTRUCTION_COUNT (0)
+#endif
+
 #ifndef RBPF_BRANCHES_ALLOWED
 #define RBPF_BRANCHES_ALLOWED 10000
 #endif
 
+/* Number of tail calls allowed to a run, over the whole chain */
+#ifndef RBPF_TAIL_CALLS_ALLOWED
+#define RBPF_TAIL_CALLS_ALLOWED 32
+#endif
+
+/* Bytes of a persistent map written back at once when they changed, a
+ * multiple of 8 */
+#ifndef RBPF_MAP_PAGE_SIZE
+#define RBPF_MAP_PAGE_SIZE 64
+#endif
+
 
-#ifndef RBPF_EXTERNAL_CALLS
-static inline rbpf_call_t rbpf_get_external_call(uint32_t num)
+/* The helpers the host adds to the built-in ones, NULL for the unknown
+ * numbers */
+#ifdef RBPF_EXTERNAL_CALLS
+const rbpf_helper_t *rbpf_get_external_call(uint32_t num);
+#else
+static inline const rbpf_helper_t *rbpf_get_external_call(uint32_t num)
 {
     (void)num;
     return NULL;
@@ -33,6 +33,7 @@ extern "C" {
 #define BPF_INSTRUCTION_CLS_STX         0x03
 #define BPF_INSTRUCTION_CLS_ALU32       0x04
 #define BPF_INSTRUCTION_CLS_BRANCH      0x05
+#define BPF_INSTRUCTION_CLS_JMP32       0x06
 #define BPF_INSTRUCTION_CLS_ALU64       0x07
 
 #define BPF_INSTRUCTION_MEM_CLS_MASK    0x07
@@ -44,11 +45,23 @@ extern "C" {
 #define BPF_INSTRUCTION_ALU_OP_MASK     0xf0
 
 #define BPF_INSTRUCTION_LDX_LDX         0x60
+#define BPF_INSTRUCTION_LDX_MEMSX       0x80
 
 #define BPF_INSTRUCTION_STX_ST          0x60
 
 #define BPF_INSTRUCTION_STX_STX         0x60
+#define BPF_INSTRUCTION_STX_ATOMIC      0xc0
 
+/* Operations of the atomic instructions, in the immediate. The fetch variants
+ * return the previous value of the memory in the source register, or in r0
+ * for the compare and exchange */
+#define BPF_INSTRUCTION_ATOMIC_FETCH    0x01
+#define BPF_INSTRUCTION_ATOMIC_ADD      0x00
+#define BPF_INSTRUCTION_ATOMIC_OR       0x40
+#define BPF_INSTRUCTION_ATOMIC_AND      0x50
+#define BPF_INSTRUCTION_ATOMIC_XOR      0xa0
+#define BPF_INSTRUCTION_ATOMIC_XCHG     (0xe0 | BPF_INSTRUCTION_ATOMIC_FETCH)
+#define BPF_INSTRUCTION_ATOMIC_CMPXCHG  (0xf0 | BPF_INSTRUCTION_ATOMIC_FETCH)
 
 #define BPF_INSTRUCTION_ALU_ADD         0x00
 #define BPF_INSTRUCTION_ALU_SUB         0x10
@@ -81,6 +94,9 @@ extern "C" {
 
 #define BPF_INSTRUCTION_ALU_BYTESWAP    0xd0
 
+/* Offset of the signed divisions and modulos */
+#define BPF_INSTRUCTION_ALU_SIGNED      1
+
 #define BPF_INSTRUCTION_ALU64_ADD_REG    (0x0f)
 #define BPF_INSTRUCTION_ALU64_SUB_REG    (0x1f)
 #define BPF_INSTRUCTION_ALU64_MUL_REG    (0x2f)
@@ -135,6 +151,12 @@ extern "C" {
 #define BPF_INSTRUCTION_ALU32_MOV_IMM    (0xb4)
 #define BPF_INSTRUCTION_ALU32_ARSH_IMM   (0xc4)
 
+/* Byte order conversions of the lower 16, 32 or 64 bits given by the
+ * immediate, and unconditional byte swap */
+#define BPF_INSTRUCTION_ALU32_END_LE     (0xd4)
+#define BPF_INSTRUCTION_ALU32_END_BE     (0xdc)
+#define BPF_INSTRUCTION_ALU64_BSWAP      (0xd7)
+
 
 #define BPF_INSTRUCTION_JMP_ALWAYS  (0x05)
 #define BPF_INSTRUCTION_JMP_EQ_IMM  (0x15)
@@ -161,6 +183,33 @@ extern "C" {
 #define BPF_INSTRUCTION_JMP_SLT_REG (0xcd)
 #define BPF_INSTRUCTION_JMP_SLE_REG (0xdd)
 
+/* Jump with the offset in the immediate */
+#define BPF_INSTRUCTION_JMP32_ALWAYS     (0x06)
+
+#define BPF_INSTRUCTION_JMP32_EQ_IMM     (0x16)
+#define BPF_INSTRUCTION_JMP32_GT_IMM     (0x26)
+#define BPF_INSTRUCTION_JMP32_GE_IMM     (0x36)
+#define BPF_INSTRUCTION_JMP32_SET_IMM    (0x46)
+#define BPF_INSTRUCTION_JMP32_NE_IMM     (0x56)
+#define BPF_INSTRUCTION_JMP32_LT_IMM     (0xa6)
+#define BPF_INSTRUCTION_JMP32_LE_IMM     (0xb6)
+#define BPF_INSTRUCTION_JMP32_SGT_IMM    (0x66)
+#define BPF_INSTRUCTION_JMP32_SGE_IMM    (0x76)
+#define BPF_INSTRUCTION_JMP32_SLT_IMM    (0xc6)
+#define BPF_INSTRUCTION_JMP32_SLE_IMM    (0xd6)
+
+#define BPF_INSTRUCTION_JMP32_EQ_REG     (0x1e)
+#define BPF_INSTRUCTION_JMP32_GT_REG     (0x2e)
+#define BPF_INSTRUCTION_JMP32_GE_REG     (0x3e)
+#define BPF_INSTRUCTION_JMP32_SET_REG    (0x4e)
+#define BPF_INSTRUCTION_JMP32_NE_REG     (0x5e)
+#define BPF_INSTRUCTION_JMP32_LT_REG     (0xae)
+#define BPF_INSTRUCTION_JMP32_LE_REG     (0xbe)
+#define BPF_INSTRUCTION_JMP32_SGT_REG    (0x6e)
+#define BPF_INSTRUCTION_JMP32_SGE_REG    (0x7e)
+#define BPF_INSTRUCTION_JMP32_SLT_REG    (0xce)
+#define BPF_INSTRUCTION_JMP32_SLE_REG    (0xde)
+
 #define BPF_INSTRUCTION_MEM_LDDW    (0x18)
 #define BPF_INSTRUCTION_MEM_LDDWD   (0xB8)
 #define BPF_INSTRUCTION_MEM_LDDWR   (0xD8)
@@ -180,9 +229,78 @@ extern "C" {
 #define BPF_INSTRUCTION_MEM_LDXB    (0x71)
 #define BPF_INSTRUCTION_MEM_LDXDW   (0x79)
 
+/* Sign extending loads */
+#define BPF_INSTRUCTION_MEM_LDXSW   (0x81)
+#define BPF_INSTRUCTION_MEM_LDXSH   (0x89)
+#define BPF_INSTRUCTION_MEM_LDXSB   (0x91)
+
+/* Atomic operations on the memory */
+#define BPF_INSTRUCTION_MEM_ATOMICW     (0xc3)
+#define BPF_INSTRUCTION_MEM_ATOMICDW    (0xdb)
+
 #define BPF_INSTRUCTION_CALL        (0x85)
 #define BPF_INSTRUCTION_RETURN      (0x95)
 
+/* Source register of a call to a function of the application, the immediate
+ * is the offset of the function from the call */
+#define BPF_INSTRUCTION_CALL_LOCAL  (1)
+
+/* Superinstructions of the pre-decoded form, replacing a sequence of
+ * instructions, the opcodes are never valid in the bytecode */
+#define BPF_INSTRUCTION_FUSED_MASK          0xe0
+
+#define BPF_INSTRUCTION_FUSED_LDXB_ADD64    (0xe0)
+#define BPF_INSTRUCTION_FUSED_LDXH_ADD64    (0xe1)
+#define BPF_INSTRUCTION_FUSED_LDXW_ADD64    (0xe2)
+#define BPF_INSTRUCTION_FUSED_LDXB_ADD32    (0xe3)
+#define BPF_INSTRUCTION_FUSED_LDXH_ADD32    (0xe4)
+#define BPF_INSTRUCTION_FUSED_LDXW_ADD32    (0xe5)
+#define BPF_INSTRUCTION_FUSED_LDXB_OR64     (0xe6)
+#define BPF_INSTRUCTION_FUSED_LDXH_OR64     (0xe7)
+#define BPF_INSTRUCTION_FUSED_LDXW_OR64     (0xe8)
+#define BPF_INSTRUCTION_FUSED_LDXB_OR32     (0xe9)
+#define BPF_INSTRUCTION_FUSED_LDXH_OR32     (0xea)
+#define BPF_INSTRUCTION_FUSED_LDXW_OR32     (0xeb)
+#define BPF_INSTRUCTION_FUSED_MOV_AND_RSH64_IMM (0xec)
+#define BPF_INSTRUCTION_FUSED_MOV_AND_RSH64_REG (0xed)
+#define BPF_INSTRUCTION_FUSED_MOV_AND_RSH32_IMM (0xee)
+#define BPF_INSTRUCTION_FUSED_MOV_AND_RSH32_REG (0xef)
+#define BPF_INSTRUCTION_FUSED_MOV_RSH64     (0xf0)
+#define BPF_INSTRUCTION_FUSED_MOV_RSH32     (0xf1)
+#define BPF_INSTRUCTION_FUSED_ZEXT          (0xf2)
+#define BPF_INSTRUCTION_FUSED_ZEXT_JEQ      (0xf3)
+#define BPF_INSTRUCTION_FUSED_ZEXT_JNE      (0xf4)
+#define BPF_INSTRUCTION_FUSED_ADD64_JEQ     (0xf5)
+#define BPF_INSTRUCTION_FUSED_ADD64_JNE     (0xf6)
+#define BPF_INSTRUCTION_FUSED_ADD32_JEQ     (0xf7)
+#define BPF_INSTRUCTION_FUSED_ADD32_JNE     (0xf8)
+#define BPF_INSTRUCTION_FUSED_AND64_JEQ     (0xf9)
+#define BPF_INSTRUCTION_FUSED_AND64_JNE     (0xfa)
+#define BPF_INSTRUCTION_FUSED_AND32_JEQ     (0xfb)
+#define BPF_INSTRUCTION_FUSED_AND32_JNE     (0xfc)
+
+/* Local call of the pre-decoded form, never valid in the bytecode either */
+#define BPF_INSTRUCTION_LOCAL_CALL          (0xfd)
+
+/* Jump always of the pre-decoded form into a loop, checking the memory the
+ * loop walks with the destination register as it counts its iterations down
+ * with the source register, never valid in the bytecode either. The
+ * immediate holds the step of the pointer, the lowest offset and the length of
+ * the accesses through it, and the flags of the loop. */
+#define BPF_INSTRUCTION_GUARD_JA            (0xfe)
+
+#define BPF_GUARD_WIDE      (0x1)   /* The counter is compared on 64 bits */
+#define BPF_GUARD_LOAD      (0x2)   /* The loop loads through the pointer */
+#define BPF_GUARD_STORE     (0x4)   /* The loop stores through the pointer */
+
+#define BPF_GUARD_IMMEDIATE(STEP, LO, LEN, FLAGS) \
+    ((int64_t)((uint64_t)(uint16_t)(STEP) | ((uint64_t)(uint16_t)(LO) << 16) | \
+               ((uint64_t)(uint16_t)(LEN) << 32) | ((uint64_t)(uint16_t)(FLAGS) << 48)))
+#define BPF_GUARD_STEP(IMM)     ((int16_t)(uint16_t)(uint64_t)(IMM))
+#define BPF_GUARD_LO(IMM)       ((int16_t)(uint16_t)((uint64_t)(IMM) >> 16))
+#define BPF_GUARD_LEN(IMM)      ((uint16_t)((uint64_t)(IMM) >> 32))
+#define BPF_GUARD_FLAGS(IMM)    ((uint16_t)((uint64_t)(IMM) >> 48))
+
 /**
  * @brief eBPF instruction format
  *
@@ -196,6 +314,12 @@ typedef struct __attribute__((packed)) {
     int32_t immediate;
 } bpf_instruction_t;
 
+/* Offset of a jump in instructions, in the immediate for the long jump */
+static inline int32_t bpf_instruction_jump_offset(const bpf_instruction_t *instr)
+{
+    return instr->opcode == BPF_INSTRUCTION_JMP32_ALWAYS ? instr->immediate : instr->offset;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2023 Inria
+ * Copyright (C) 2023 Koen Zandberg <koen@bergzand.net>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/*
+ * Execution of the native code section of an application.
+ *
+ * `gen_rbf.py aot` compiles the application text ahead of time to position
+ * independent Thumb-2 code and appends it to the application. The code is
+ * executed in place, wherever the application is stored, as long as its
+ * checksum matches the application sections preceding it. The data section,
+ * written by the application, is left out. The checksum only guards against a
+ * native section left over from another build of the application and
+ * authenticates nothing, the native code is only executed for an application
+ * the host flagged with RBPF_CONFIG_NATIVE_TRUSTED.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "rbpf.h"
+#include "rbpf/config.h"
+#include "atomic.h"
+#include "divide.h"
+
+#if (RBPF_ENABLE_AOT)
+
+extern rbpf_call_t rbpf_engine_get_call(uint32_t num);
+
+/* Fletcher-32 over little endian words, an odd last byte is padded with zero */
+static uint32_t _fletcher32(const uint8_t *data, size_t len)
+{
+    uint32_t sum1 = 0xffff, sum2 = 0xffff;
+    size_t words = (len + 1) / 2;
+
+    while (words) {
+        unsigned tlen = words > 359 ? 359 : words;
+        words -= tlen;
+        do {
+            uint16_t word = data[0];
+            if (len > 1) {
+                word |= data[1] << 8;
+            }
+            data += 2;
+            len -= len > 1 ? 2 : 1;
+            sum2 += sum1 += word;
+        } while (--tlen);
+        sum1 = (sum1 & 0xffff) + (sum1 >> 16);
+        sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+    }
+    sum1 = (sum1 & 0xffff) + (sum1 >> 16);
+    sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+    return (sum2 << 16) | sum1;
+}
+
+int rbpf_aot_load(rbpf_application_t *rbpf)
+{
+    const rbpf_header_t *header = rbpf_header(rbpf);
+    const uint8_t *start = rbpf->application;
+    size_t data_end = sizeof(rbpf_header_t) + header->data_len;
+    size_t offset = data_end + header->rodata_len + header->text_len +
+                    header->functions * sizeof(rbpf_function_t);
+    const rbpf_native_header_t *native;
+    const uint8_t *code;
+
+    rbpf->aot = NULL;
+
+#if (RBPF_ENABLE_MAPS)
+    /* The native code section follows the maps, checked by the pre-flight */
+    if (header->flags & RBPF_HEADER_FLAG_MAPS) {
+        offset += sizeof(rbpf_map_list_t) +
+                  rbpf_application_maps(rbpf)->len * sizeof(rbpf_map_def_t);
+    }
+#endif
+
+    /* The native code counts every branch taken */
+    if (!(header->flags & RBPF_HEADER_FLAG_NATIVE) || (rbpf->flags & RBPF_CONFIG_NO_RETURN)) {
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+
+    /* The native code escapes the pre-flight checks, the host must vouch for it */
+    if (!(rbpf->flags & RBPF_CONFIG_NATIVE_TRUSTED)) {
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+
+#if (RBPF_ENABLE_MASKING)
+    /* The native code checks the addresses instead of masking them */
+    return RBPF_ILLEGAL_INSTRUCTION;
+#endif
+
+    offset = (offset + 3) & ~(size_t)3;
+    if (offset + sizeof(rbpf_native_header_t) > rbpf->application_len) {
+        return RBPF_ILLEGAL_LEN;
+    }
+    native = (const rbpf_native_header_t *)(start + offset);
+    code = (const uint8_t *)(native + 1);
+    if ((native->code_len > rbpf->application_len - offset - sizeof(rbpf_native_header_t)) ||
+        (native->entry >= native->code_len) || (((uintptr_t)code + native->entry) & 0x1)) {
+        return RBPF_ILLEGAL_LEN;
+    }
+
+    if ((native->version != RBPF_NATIVE_VERSION) ||
+        (native->checksum != _fletcher32(start + data_end, offset - data_end))) {
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+
+    /* Thumb state entry point */
+    rbpf->aot = (rbpf_aot_t)((uintptr_t)code + native->entry + 1);
+    return RBPF_OK;
+}
+
+int rbpf_aot_run(rbpf_application_t *rbpf)
+{
+    rbpf_native_env_t env = {
+        .rbpf = rbpf,
+        .branches_remaining = rbpf->branches_remaining,
+        .load_allowed = rbpf_load_allowed,
+        .store_allowed = rbpf_store_allowed,
+        .get_call = rbpf_engine_get_call,
+        .div = rbpf_native_div,
+        .mod = rbpf_native_mod,
+        .sdiv = rbpf_native_sdiv,
+        .smod = rbpf_native_smod,
+        .atomic64 = rbpf_atomic64_regs,
+    };
+    int res = rbpf->aot(rbpf->regmap, &env);
+
+    rbpf->branches_remaining = env.branches_remaining;
+    return res;
+}
+
+#endif /* RBPF_ENABLE_AOT */
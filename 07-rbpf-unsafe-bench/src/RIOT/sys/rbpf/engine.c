@@ -11,6 +11,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "kernel_defines.h"
 #include "rbpf.h"
@@ -18,40 +19,89 @@
 #include "rbpf/builtin_calls.h"
 #include "rbpf/instruction.h"
 #include "rbpf/config.h"
+#include "atomic.h"
 
-static bool _check_mem(const rbpf_application_t *rbpf, const intptr_t addr, size_t size,
+#if (RBPF_ENABLE_COMPRESSED)
+#include "compressed.h"
+#endif
+
+#if (RBPF_ENABLE_AOT)
+extern int rbpf_aot_run(rbpf_application_t *rbpf);
+#endif
+
+/* The range is compared by its offset in the region, its end may not even be
+ * an address */
+static inline bool _check_region(const rbpf_mem_region_t *region, const uintptr_t addr,
+                                 const size_t size, uint8_t type)
+{
+    const uintptr_t start = (uintptr_t)region->start;
+
+    return (addr >= start) && (size <= region->len) &&
+           (addr - start <= region->len - size) &&
+           (region->flags & type);
+}
+
+static bool _check_mem(const rbpf_application_t *rbpf, const uintptr_t addr, size_t size,
                        uint8_t type)
 {
     /* no more checks */
     return true;
 }
 
-static bool _check_load(const rbpf_application_t *rbpf, const intptr_t addr, size_t size)
+static bool _check_load(const rbpf_application_t *rbpf, const uintptr_t addr, size_t size)
 {
     return _check_mem(rbpf, addr, size, RBPF_MEM_REGION_READ);
 }
 
-static bool _check_store(const rbpf_application_t *rbpf, const intptr_t addr, size_t size)
+static bool _check_store(const rbpf_application_t *rbpf, const uintptr_t addr, size_t size)
 {
     return _check_mem(rbpf, addr, size, RBPF_MEM_REGION_WRITE);
 }
 
+#if (RBPF_ENABLE_MEMORY_PROOF) && (RBPF_ENABLE_LOWERING) && !(RBPF_ENABLE_MASKING) && \
+    !(RBPF_ENABLE_MPU)
+/* Check the memory a loop walks through its pointer from its entry, over the
+ * iterations the counter runs, see BPF_INSTRUCTION_GUARD_JA. The range is
+ * checked at once, as any access within it is in the same region. */
+static bool _rbpf_guard(const rbpf_application_t *rbpf, uint64_t pointer, uint64_t counter,
+                        int64_t guard)
+{
+    int16_t step = BPF_GUARD_STEP(guard);
+    uint16_t flags = BPF_GUARD_FLAGS(guard);
+    uint64_t iterations = (flags & BPF_GUARD_WIDE) ? counter : (uint32_t)counter;
+    size_t stride = step < 0 ? (size_t)-step : (size_t)step;
+    size_t len = BPF_GUARD_LEN(guard);
+    uintptr_t start = (uintptr_t)pointer + BPF_GUARD_LO(guard);
+    size_t size;
+
+    /* A counter of zero wraps around before stopping the loop */
+    if (!iterations || (stride && iterations - 1 > (SIZE_MAX - len) / stride)) {
+        return false;
+    }
+    size = stride * (size_t)(iterations - 1) + len;
+    if (step < 0) {
+        start -= size - len;
+    }
+    return (!(flags & BPF_GUARD_LOAD) || _check_load(rbpf, start, size)) &&
+           (!(flags & BPF_GUARD_STORE) || _check_store(rbpf, start, size));
+}
+#endif
+
 bool rbpf_store_allowed(const rbpf_application_t *rbpf, void *addr, size_t size)
 {
-    return _check_store(rbpf, (intptr_t)addr, size);
+    return _check_store(rbpf, (uintptr_t)addr, size);
 }
 
 bool rbpf_load_allowed(const rbpf_application_t *rbpf, void *addr, size_t size)
 {
-    return _check_load(rbpf, (intptr_t)addr, size);
+    return _check_load(rbpf, (uintptr_t)addr, size);
 }
 
-static rbpf_call_t _rbpf_get_call(uint32_t num)
+rbpf_call_t rbpf_engine_get_call(uint32_t num)
 {
-    switch (num) {
-    default:
-        return rbpf_get_external_call(num);
-    }
+    const rbpf_helper_t *helper = rbpf_get_helper(num);
+
+    return helper ? helper->call : NULL;
 }
 
 /**
@@ -59,15 +109,144 @@ static rbpf_call_t _rbpf_get_call(uint32_t num)
  */
 
 /* Macro for the destination, source and immediate value */
-#define DST regmap[(*instr)->dst]   /* DST is the register targeted by the instruction */
-#define SRC regmap[(*instr)->src]   /* SRC is the source register from the instruction */
-#define IMM (*instr)->immediate     /* And this one matches the immediate value in the instruction */
+#if (RBPF_ENABLE_LOWERING)
+#define DST (*instr->REG(dst))      /* DST is the register targeted by the instruction */
+#define SRC (*instr->REG(src))      /* SRC is the source register from the instruction */
+#else
+#define DST regmap[instr->dst]      /* DST is the register targeted by the instruction */
+#define SRC regmap[instr->src]      /* SRC is the source register from the instruction */
+#endif
+#define IMM instr->immediate        /* And this one matches the immediate value in the instruction */
+
+/* Macro for the target of a branch by OFFSET, the branches it charges to the
+ * budget, the called function and the value of a double word load. Only the
+ * backward branches and the local calls are charged, the forward branches
+ * can't loop. The pre-decoded instructions carry them already resolved, the
+ * charge in their offset, which moves the charge of the bounded loops to their
+ * entry. */
+#if (RBPF_ENABLE_LOWERING)
+#define TARGET(OFFSET)      instr->target
+#define CHARGE(OFFSET)      instr->offset
+#define CALL_CHARGE         instr->offset
+#define CALL_FUNCTION       instr->call
+#define LDDW_VALUE(BASE)    IMM
+#else
+#define TARGET(OFFSET)      (instr + (OFFSET) + 1)
+#define CHARGE(OFFSET)      ((OFFSET) < 0)
+#define CALL_CHARGE         1
+#define CALL_FUNCTION       rbpf_engine_get_call(instr->immediate)
+#define LDDW_VALUE(BASE)    ((uint64_t)(BASE) + _rbpf_lddw_immediate(instr))
+#endif
+
+/* The instruction handlers are either the cases of a switch on the opcode, or
+ * labels in a table of label addresses indexed by the opcode. In the latter
+ * (threaded) mode every handler jumps straight to the handler of the next
+ * instruction, without going back through a central dispatch loop. */
+#if (RBPF_ENABLE_THREADED_CODE)
+#define INSTR(NAME)         _op_ ## NAME
+#define INSTR_ILLEGAL       _op_illegal
+#define INSTR_TABLE(NAME)   [BPF_INSTRUCTION_ ## NAME] = &&_op_ ## NAME,
+#define DISPATCH() \
+    do { \
+        FETCH(); \
+        goto *_rbpf_dispatch[instr->opcode]; \
+    } while (0)
+#else
+#define INSTR(NAME)         case BPF_INSTRUCTION_ ## NAME
+#define INSTR_ILLEGAL       default
+#define DISPATCH()          goto _dispatch
+#endif
+
+#if (RBPF_ENABLE_INSTRUCTION_COUNT)
+#define COUNT_INSTRUCTION() rbpf->instruction_count++
+#else
+#define COUNT_INSTRUCTION() (void)0
+#endif
+
+/* Count the instruction about to be executed against the slice of the run.
+ * With a quantum, the run is suspended before the first instruction beyond
+ * it, the slice of a run without one wraps around. */
+#if (RBPF_ENABLE_YIELD)
+#define COUNT_SLICE() \
+    do { \
+        if (slice-- == 0 && rbpf->quantum) { \
+            goto _suspend; \
+        } \
+    } while (0)
+#else
+#define COUNT_SLICE() (void)0
+#endif
 
-#define CONT_JUMP \
-    if (jump_cond) { \
-        return _rbpf_jump(rbpf, instr); \
-    } \
-    break;
+/* Move to the next instruction and execute it */
+#define NEXT() \
+    do { \
+        STEP(); \
+        COUNT_INSTRUCTION(); \
+        COUNT_SLICE(); \
+        DISPATCH(); \
+    } while (0)
+
+/* Charge branches to the budget, the run fails when it runs out */
+#define CHARGE_BRANCHES(CHARGE) \
+    do { \
+        if (_rbpf_over_max_jumps(rbpf, CHARGE)) { \
+            return RBPF_OUT_OF_BRANCHES; \
+        } \
+    } while (0)
+
+/* Take the branch of the current instruction, by OFFSET instructions */
+#define JUMP_BY(OFFSET) \
+    do { \
+        if (CHARGE(OFFSET)) { \
+            CHARGE_BRANCHES(CHARGE(OFFSET)); \
+        } \
+        BRANCH(OFFSET); \
+        COUNT_INSTRUCTION(); \
+        COUNT_SLICE(); \
+        DISPATCH(); \
+    } while (0)
+
+#define JUMP()      JUMP_BY(instr->offset)
+
+#if (RBPF_ENABLE_LOCAL_CALLS)
+/* Call the function of the application starting at TARGET. The frame saves
+ * the call, r6 to r9 and the frame pointer, the callee gets the stack below
+ * the one of the caller. The calls count as branches, as the calls of an
+ * application without loops are otherwise not bounded in number, and are
+ * charged before the frame is taken so that a suspended run makes the call
+ * again. */
+#define LOCAL_CALL(TARGET) \
+    do { \
+        rbpf_frame_t *frame; \
+        if (depth >= rbpf->frames_len || \
+            (depth + 2) * rbpf->frame_size > RBPF_STACK_SIZE) { \
+            return RBPF_OUT_OF_MEMORY; \
+        } \
+        CHARGE_BRANCHES(CALL_CHARGE); \
+        frame = &rbpf->frames[depth++]; \
+        frame->ret = instr; \
+        for (unsigned reg = 0; reg < 5; reg++) { \
+            frame->regs[reg] = rbpf->REG(regmap)[6 + reg]; \
+        } \
+        rbpf->REG(regmap)[10] = (uintptr_t)(rbpf->stack + RBPF_STACK_SIZE - \
+                                            depth * rbpf->frame_size); \
+        instr = (TARGET); \
+        COUNT_INSTRUCTION(); \
+        COUNT_SLICE(); \
+        DISPATCH(); \
+    } while (0)
+
+/* Return from a local call to the instruction following it */
+#define LOCAL_RETURN() \
+    do { \
+        const rbpf_frame_t *frame = &rbpf->frames[--depth]; \
+        for (unsigned reg = 0; reg < 5; reg++) { \
+            rbpf->REG(regmap)[6 + reg] = frame->regs[reg]; \
+        } \
+        instr = frame->ret; \
+        NEXT(); \
+    } while (0)
+#endif
 
 /* Check if we implement 32 bit instructions */
 #if (RBPF_ENABLE_ALU32)
@@ -76,281 +255,747 @@ static rbpf_call_t _rbpf_get_call(uint32_t num)
  * itself. ALU(ADD, +) generates the 2 or 4 instructions implementing the add
  * instruction, using '+' in C. Generates both the DST += SRC and DST += IMM */
 #define ALU(OPCODE, OP)         \
-    case BPF_INSTRUCTION_ALU64_ ## OPCODE ## _REG:         \
+    INSTR(ALU64_ ## OPCODE ## _REG):         \
         DST = DST OP SRC;       \
-        break;                   \
-    case BPF_INSTRUCTION_ALU64_ ## OPCODE ## _IMM:       \
+        NEXT();                  \
+    INSTR(ALU64_ ## OPCODE ## _IMM):       \
         DST = DST OP IMM;       \
-        break;                   \
-    case BPF_INSTRUCTION_ALU32_ ## OPCODE ## _REG:         \
+        NEXT();                  \
+    INSTR(ALU32_ ## OPCODE ## _REG):         \
         DST = (uint32_t)DST OP(uint32_t) SRC;   \
-        break;                   \
-    case BPF_INSTRUCTION_ALU32_ ## OPCODE ## _IMM:           \
+        NEXT();                  \
+    INSTR(ALU32_ ## OPCODE ## _IMM):           \
         DST = (uint32_t)DST OP(uint32_t) IMM;   \
-        break;
+        NEXT();
+
+#define ALU_TABLE(OPCODE)       \
+    INSTR_TABLE(ALU64_ ## OPCODE ## _REG) \
+    INSTR_TABLE(ALU64_ ## OPCODE ## _IMM) \
+    INSTR_TABLE(ALU32_ ## OPCODE ## _REG) \
+    INSTR_TABLE(ALU32_ ## OPCODE ## _IMM)
 #else
 #define ALU(OPCODE, OP)         \
-    case BPF_INSTRUCTION_ALU64_ ## OPCODE ## _REG:         \
+    INSTR(ALU64_ ## OPCODE ## _REG):         \
         DST = DST OP SRC;       \
-        break;                   \
-    case BPF_INSTRUCTION_ALU64_ ## OPCODE ## _IMM:       \
+        NEXT();                  \
+    INSTR(ALU64_ ## OPCODE ## _IMM):       \
         DST = DST OP IMM;       \
-        break;
+        NEXT();
+
+#define ALU_TABLE(OPCODE)       \
+    INSTR_TABLE(ALU64_ ## OPCODE ## _REG) \
+    INSTR_TABLE(ALU64_ ## OPCODE ## _IMM)
 #endif
 
 /* Generate jump type instructions, similar to the ALU instructions */
 #define COND_JMP(SIGN, OPCODE, CMP_OP)              \
-    case BPF_INSTRUCTION_JMP_ ## OPCODE ## _REG:                  \
-        { \
-            bool jump_cond = (SIGN ## nt64_t)DST CMP_OP(SIGN ## nt64_t) SRC; \
-            CONT_JUMP;                           \
+    INSTR(JMP_ ## OPCODE ## _REG):                  \
+        if ((SIGN ## nt64_t)DST CMP_OP(SIGN ## nt64_t) SRC) { \
+            JUMP();                             \
+        } \
+        NEXT();                                 \
+    INSTR(JMP_ ## OPCODE ## _IMM):                 \
+        if ((SIGN ## nt64_t)DST CMP_OP(SIGN ## nt64_t) IMM) { \
+            JUMP();                             \
+        } \
+        NEXT();
+
+#define COND_JMP_TABLE(OPCODE)  \
+    INSTR_TABLE(JMP_ ## OPCODE ## _REG) \
+    INSTR_TABLE(JMP_ ## OPCODE ## _IMM)
+
+/* The 32 bit jumps compare the lower half of the registers */
+#define COND_JMP32(SIGN, OPCODE, CMP_OP)            \
+    INSTR(JMP32_ ## OPCODE ## _REG):                \
+        if ((SIGN ## nt32_t)DST CMP_OP(SIGN ## nt32_t) SRC) { \
+            JUMP();                             \
         } \
-    case BPF_INSTRUCTION_JMP_ ## OPCODE ## _IMM:                 \
-        { \
-            bool jump_cond = (SIGN ## nt64_t)DST CMP_OP(SIGN ## nt64_t) IMM; \
-            CONT_JUMP;                           \
+        NEXT();                                 \
+    INSTR(JMP32_ ## OPCODE ## _IMM):               \
+        if ((SIGN ## nt32_t)DST CMP_OP(SIGN ## nt32_t) IMM) { \
+            JUMP();                             \
         } \
+        NEXT();
+
+#define COND_JMP32_TABLE(OPCODE)  \
+    INSTR_TABLE(JMP32_ ## OPCODE ## _REG) \
+    INSTR_TABLE(JMP32_ ## OPCODE ## _IMM)
+
+/* Memory accesses the pre-flight checks proved in bounds skip their check */
+#if (RBPF_ENABLE_MEMORY_PROOF) && !(RBPF_ENABLE_MASKING) && !(RBPF_ENABLE_MPU)
+#define PROVEN() \
+    (proof && (proof[(size_t)(instr - text) / 32] & (1UL << ((size_t)(instr - text) % 32))))
+#else
+#define PROVEN() false
+#endif
+
+/* With masking, every address is confined to the arena instead of checked */
+#if (RBPF_ENABLE_MASKING)
+#define ADDRESS(ADDR)               (arena | ((uintptr_t)(ADDR) & mask))
+#define LOAD_ALLOWED(ADDR, SIZE)    true
+#define STORE_ALLOWED(ADDR, SIZE)   true
+#elif (RBPF_ENABLE_MPU)
+/* The MPU isolating the sandbox catches the illegal accesses */
+#define ADDRESS(ADDR)               ((uintptr_t)(ADDR))
+#define LOAD_ALLOWED(ADDR, SIZE)    true
+#define STORE_ALLOWED(ADDR, SIZE)   true
+#else
+#define ADDRESS(ADDR)               ((uintptr_t)(ADDR))
+#define LOAD_ALLOWED(ADDR, SIZE)    (PROVEN() || _check_load(rbpf, ADDR, SIZE))
+#define STORE_ALLOWED(ADDR, SIZE)   (PROVEN() || _check_store(rbpf, ADDR, SIZE))
+#endif
 
 /* Generate all the different regular load variants */
 #define MEM(SIZEOP, SIZE)                     \
-    case BPF_INSTRUCTION_MEM_STX ## SIZEOP:                       \
-        if (!_check_store(rbpf, DST + (*instr)->offset, sizeof(SIZE))) { \
+    INSTR(MEM_STX ## SIZEOP):                       \
+        if (!STORE_ALLOWED(DST + instr->offset, sizeof(SIZE))) { \
             return RBPF_ILLEGAL_MEM; \
         } \
-        *(SIZE *)(uintptr_t)(DST + (*instr)->offset) = SRC;   \
-        break;                               \
-    case BPF_INSTRUCTION_MEM_ST ## SIZEOP:                      \
-        if (!_check_store(rbpf, DST + (*instr)->offset, sizeof(SIZE))) { \
+        *(SIZE *)ADDRESS(DST + instr->offset) = SRC;   \
+        NEXT();                              \
+    INSTR(MEM_ST ## SIZEOP):                      \
+        if (!STORE_ALLOWED(DST + instr->offset, sizeof(SIZE))) { \
             return RBPF_ILLEGAL_MEM; \
         } \
-        *(SIZE *)(uintptr_t)(DST + (*instr)->offset) = IMM;   \
-        break;                               \
-    case BPF_INSTRUCTION_MEM_LDX ## SIZEOP:                      \
-        if (!_check_load(rbpf, SRC + (*instr)->offset, sizeof(SIZE))) { \
+        *(SIZE *)ADDRESS(DST + instr->offset) = IMM;   \
+        NEXT();                              \
+    INSTR(MEM_LDX ## SIZEOP):                      \
+        if (!LOAD_ALLOWED(SRC + instr->offset, sizeof(SIZE))) { \
             return RBPF_ILLEGAL_MEM; \
         } \
-        DST = *(const SIZE *)(uintptr_t)(SRC + (*instr)->offset);   \
-        break;
+        DST = *(const SIZE *)ADDRESS(SRC + instr->offset);   \
+        NEXT();
+
+#define MEM_TABLE(SIZEOP)       \
+    INSTR_TABLE(MEM_STX ## SIZEOP) \
+    INSTR_TABLE(MEM_ST ## SIZEOP) \
+    INSTR_TABLE(MEM_LDX ## SIZEOP)
+
+/* Generate the sign extending loads */
+#define MEMSX(SIZEOP, SIZE)                   \
+    INSTR(MEM_LDXS ## SIZEOP):                     \
+        if (!LOAD_ALLOWED(SRC + instr->offset, sizeof(SIZE))) { \
+            return RBPF_ILLEGAL_MEM; \
+        } \
+        DST = (int64_t)*(const SIZE *)ADDRESS(SRC + instr->offset); \
+        NEXT();
+
+#define MEMSX_TABLE(SIZEOP)     \
+    INSTR_TABLE(MEM_LDXS ## SIZEOP)
+
+/* Generate the atomic operations, the address must be aligned on the size of
+ * the access and writable */
+#define ATOMIC(SIZEOP, SIZE, FUNC)            \
+    INSTR(MEM_ATOMIC ## SIZEOP):                   \
+    { \
+        SIZE old; \
+        if (((DST + instr->offset) & (sizeof(SIZE) - 1)) || \
+            !STORE_ALLOWED(DST + instr->offset, sizeof(SIZE))) { \
+            return RBPF_ILLEGAL_MEM; \
+        } \
+        old = FUNC((SIZE *)ADDRESS(DST + instr->offset), IMM, SRC, rbpf->REG(regmap)[0]); \
+        if (IMM == BPF_INSTRUCTION_ATOMIC_CMPXCHG) { \
+            rbpf->REG(regmap)[0] = old; \
+        } \
+        else if (IMM & BPF_INSTRUCTION_ATOMIC_FETCH) { \
+            /* The pre-decoded source points into the register file */ \
+            *(RBPF_REG_T *)&SRC = old; \
+        } \
+        NEXT(); \
+    }
 
-static inline int _rbpf_over_max_jumps(const rbpf_application_t *rbpf)
+/* The superinstructions execute the instructions of their sequence in order,
+ * reading the operands of the following ones from their pre-decoded entries */
+#define DST_AT(N)   (*instr[N].REG(dst))
+#define SRC_AT(N)   (*instr[N].REG(src))
+#define IMM_AT(N)   instr[N].immediate
+
+/* Skip the following instructions of the sequence */
+#define NEXT_AT(N) \
+    do { \
+        instr += N; \
+        NEXT(); \
+    } while (0)
+
+/* Take the branch of the instruction ending the sequence */
+#define JUMP_AT(N) \
+    do { \
+        instr += N; \
+        JUMP(); \
+    } while (0)
+
+/* Generate the load followed by an operation with the loaded value */
+#define FUSED_LDX(SIZEOP, SIZE, OPCODE, OP)  \
+    INSTR(FUSED_LDX ## SIZEOP ## _ ## OPCODE ## 64): \
+        if (!LOAD_ALLOWED(SRC + instr->offset, sizeof(SIZE))) { \
+            return RBPF_ILLEGAL_MEM; \
+        } \
+        DST = *(const SIZE *)ADDRESS(SRC + instr->offset);   \
+        DST_AT(1) = DST_AT(1) OP SRC_AT(1);  \
+        NEXT_AT(1);                          \
+    INSTR(FUSED_LDX ## SIZEOP ## _ ## OPCODE ## 32): \
+        if (!LOAD_ALLOWED(SRC + instr->offset, sizeof(SIZE))) { \
+            return RBPF_ILLEGAL_MEM; \
+        } \
+        DST = *(const SIZE *)ADDRESS(SRC + instr->offset);   \
+        DST_AT(1) = (uint32_t)DST_AT(1) OP (uint32_t)SRC_AT(1); \
+        NEXT_AT(1);
+
+#define FUSED_LDX_TABLE(SIZEOP) \
+    INSTR_TABLE(FUSED_LDX ## SIZEOP ## _ADD64) \
+    INSTR_TABLE(FUSED_LDX ## SIZEOP ## _ADD32) \
+    INSTR_TABLE(FUSED_LDX ## SIZEOP ## _OR64) \
+    INSTR_TABLE(FUSED_LDX ## SIZEOP ## _OR32)
+
+/* Generate the operation with an immediate followed by a jump on the equality
+ * of the result to another immediate */
+#define FUSED_ALU_JMP(OPCODE, OP)            \
+    INSTR(FUSED_ ## OPCODE ## 64_JEQ):       \
+        DST = DST OP IMM;                    \
+        if (DST == (uint64_t)IMM_AT(1)) {    \
+            JUMP_AT(1);                      \
+        } \
+        NEXT_AT(1);                          \
+    INSTR(FUSED_ ## OPCODE ## 64_JNE):       \
+        DST = DST OP IMM;                    \
+        if (DST != (uint64_t)IMM_AT(1)) {    \
+            JUMP_AT(1);                      \
+        } \
+        NEXT_AT(1);                          \
+    INSTR(FUSED_ ## OPCODE ## 32_JEQ):       \
+        DST = (uint32_t)DST OP (uint32_t)IMM; \
+        if ((uint32_t)DST == (uint32_t)IMM_AT(1)) { \
+            JUMP_AT(1);                      \
+        } \
+        NEXT_AT(1);                          \
+    INSTR(FUSED_ ## OPCODE ## 32_JNE):       \
+        DST = (uint32_t)DST OP (uint32_t)IMM; \
+        if ((uint32_t)DST != (uint32_t)IMM_AT(1)) { \
+            JUMP_AT(1);                      \
+        } \
+        NEXT_AT(1);
+
+#define FUSED_ALU_JMP_TABLE(OPCODE) \
+    INSTR_TABLE(FUSED_ ## OPCODE ## 64_JEQ) \
+    INSTR_TABLE(FUSED_ ## OPCODE ## 64_JNE) \
+    INSTR_TABLE(FUSED_ ## OPCODE ## 32_JEQ) \
+    INSTR_TABLE(FUSED_ ## OPCODE ## 32_JNE)
+
+/* Charge branches to the budget, true when it runs out */
+static inline bool _rbpf_over_max_jumps(rbpf_application_t *rbpf, uint32_t charge)
 {
-    return !(rbpf->flags & RBPF_CONFIG_NO_RETURN) && rbpf->branches_remaining == 0;
+    bool over = rbpf->branches_remaining <= charge;
+
+    rbpf->branches_remaining -= charge;
+    return over && !(rbpf->flags & RBPF_CONFIG_NO_RETURN);
 }
 
-/* Asking the compiler to really inline this call is the easiest way to speed up the VM */
-static inline int __attribute__((always_inline)) _rbpf_jump(rbpf_application_t *rbpf, const bpf_instruction_t **instr)
+/* The 64 bit immediate of a double word load, split over two instructions */
+static inline uint64_t _rbpf_lddw_immediate(const bpf_instruction_t *instr)
 {
-    *instr += (*instr)->offset;
-    rbpf->branches_remaining--;
-    if (_rbpf_over_max_jumps(rbpf)) {
-        return RBPF_OUT_OF_BRANCHES;
+    return (uint64_t)(uint32_t)instr->immediate |
+           ((uint64_t)(uint32_t)(instr + 1)->immediate << 32);
+}
+
+/* The signed division and modulo, the division of the smallest value by -1
+ * wraps around instead of trapping */
+static inline int64_t _rbpf_sdiv64(int64_t a, int64_t b)
+{
+    return b == -1 ? (int64_t)(0 - (uint64_t)a) : a / b;
+}
+
+static inline int64_t _rbpf_smod64(int64_t a, int64_t b)
+{
+    return b == -1 ? 0 : a % b;
+}
+
+static inline int32_t _rbpf_sdiv32(int32_t a, int32_t b)
+{
+    return b == -1 ? (int32_t)(0 - (uint32_t)a) : a / b;
+}
+
+static inline int32_t _rbpf_smod32(int32_t a, int32_t b)
+{
+    return b == -1 ? 0 : a % b;
+}
+
+/* The lower BITS bits of the value, sign extended */
+static inline int64_t _rbpf_sign_extend(uint64_t value, int16_t bits)
+{
+    return bits == 8 ? (int8_t)value : bits == 16 ? (int16_t)value : (int32_t)value;
+}
+
+/* The instructions of the text, or of the pre-decoded form, are executed
+ * where they lie */
+#define RBPF_COMPRESSED     0
+#define FETCH()             (void)0
+#define STEP()              instr++
+#define SKIP_SECOND_HALF()  instr++
+#define BRANCH(OFFSET)      instr = TARGET(OFFSET)
+
+/* The interpreter with the 64 bit register file */
+#define RBPF_RUN            _rbpf_run
+#define RBPF_REG_T          uint64_t
+#define REG(NAME)           NAME
+#include "interpreter.h"
+#undef RBPF_RUN
+#undef RBPF_REG_T
+#undef REG
+
+#if (RBPF_ENABLE_REG32)
+/* The interpreter with the 32 bit register file, the upper half of the
+ * registers reads as zero */
+#define RBPF_RUN            _rbpf_run32
+#define RBPF_REG_T          uint32_t
+#define REG(NAME)           NAME ## 32
+#include "interpreter.h"
+#undef RBPF_RUN
+#undef RBPF_REG_T
+#undef REG
+#endif
+
+#undef RBPF_COMPRESSED
+#undef FETCH
+#undef STEP
+#undef SKIP_SECOND_HALF
+#undef BRANCH
+
+#if (RBPF_ENABLE_COMPRESSED) && !(RBPF_ENABLE_LOWERING)
+/* The compressed instructions are expanded one at a time before their
+ * execution, the double word loads are a single instruction and the jump
+ * offsets count bytes from the end of the jump */
+#define RBPF_COMPRESSED     1
+#define FETCH()             len = rbpf_compressed_expand(pc, expanded)
+#define STEP()              pc += len
+#define SKIP_SECOND_HALF()  (void)0
+#define BRANCH(OFFSET)      pc += len + (OFFSET)
+
+#define RBPF_RUN            _rbpf_run_compressed
+#define RBPF_REG_T          uint64_t
+#define REG(NAME)           NAME
+#include "interpreter.h"
+#undef RBPF_RUN
+#undef RBPF_REG_T
+#undef REG
+
+#if (RBPF_ENABLE_REG32)
+#define RBPF_RUN            _rbpf_run32_compressed
+#define RBPF_REG_T          uint32_t
+#define REG(NAME)           NAME ## 32
+#include "interpreter.h"
+#undef RBPF_RUN
+#undef RBPF_REG_T
+#undef REG
+#endif
+
+#undef RBPF_COMPRESSED
+#undef FETCH
+#undef STEP
+#undef SKIP_SECOND_HALF
+#undef BRANCH
+#endif
+
+/* The number of instruction slots of the text, the double word loads of a
+ * compressed text take two */
+static size_t _rbpf_slots(const rbpf_application_t *rbpf)
+{
+#if (RBPF_ENABLE_COMPRESSED)
+    if (rbpf->flags & RBPF_FLAG_COMPRESSED) {
+        return rbpf_compressed_slots(rbpf_application_text(rbpf),
+                                     rbpf_application_text_len(rbpf));
     }
-    return RBPF_CONTINUE;
+#endif
+    return rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
 }
 
-/* Asking the compiler to really inline this call is the easiest way to speed up the VM */
-static inline int __attribute__((always_inline)) _rbpf_instruction(rbpf_application_t *rbpf,
-                                    const bpf_instruction_t **instr, uint64_t regmap[11])
+#if (RBPF_ENABLE_LOWERING)
+/* The application holding the register file the pre-decoded form refers to,
+ * the copy the sandbox runs with RBPF_ENABLE_MPU */
+rbpf_application_t *rbpf_engine_registers(rbpf_application_t *rbpf)
 {
-    switch ((*instr)->opcode) {
-
-    /* Macros implementing the instruction code for the simple ALU(32|64) based operations */
-    ALU(ADD,  +)
-    ALU(SUB,  -)
-    ALU(AND,  &)
-    ALU(OR,   |)
-    ALU(LSH, <<)
-    ALU(RSH, >>)
-    ALU(XOR,  ^)
-    ALU(MUL,  *)
-
-    /* These need additional checks inside */
-    case BPF_INSTRUCTION_ALU64_MOD_REG:
-        if (SRC == 0) {
-            return RBPF_ILLEGAL_DIV;
+#if (RBPF_ENABLE_MPU)
+    return rbpf->shadow ? rbpf->shadow : rbpf;
+#else
+    return rbpf;
+#endif
+}
+
+/* Pre-decode a single instruction, all but its branch target */
+static void _rbpf_lower_instruction(rbpf_application_t *rbpf, rbpf_insn_t *insn,
+                                    const bpf_instruction_t *instr)
+{
+    rbpf_application_t *regs = rbpf_engine_registers(rbpf);
+
+    insn->opcode = instr->opcode;
+    insn->offset = instr->offset;
+#if (RBPF_ENABLE_REG32)
+    if (rbpf->flags & RBPF_FLAG_REG32) {
+        insn->dst32 = &regs->regmap32[instr->dst];
+        insn->src32 = &regs->regmap32[instr->src];
+    }
+    else
+#endif
+    {
+        insn->dst = &regs->regmap[instr->dst];
+        insn->src = &regs->regmap[instr->src];
+    }
+    insn->immediate = instr->immediate;
+    insn->target = NULL;
+
+    switch (instr->opcode) {
+    case BPF_INSTRUCTION_MEM_LDDW:
+    case BPF_INSTRUCTION_MEM_LDDWD:
+    case BPF_INSTRUCTION_MEM_LDDWR:
+        insn->immediate = _rbpf_lddw_immediate(instr);
+        if (instr->opcode == BPF_INSTRUCTION_MEM_LDDWD) {
+            insn->immediate += (intptr_t)rbpf->data_region.start;
         }
-        DST = DST % SRC;
-        break;
-    case BPF_INSTRUCTION_ALU64_MOD_IMM:
-        if (IMM == 0) {
-            return RBPF_ILLEGAL_DIV;
+        else if (instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+            insn->immediate += (intptr_t)rbpf->rodata_region.start;
         }
-        DST = DST % IMM;
         break;
-#if (RBPF_ENABLE_ALU32)
-    case BPF_INSTRUCTION_ALU32_MOD_REG:
-        if (SRC == 0) {
-            return RBPF_ILLEGAL_DIV;
-        }
-        DST = (uint32_t)DST % (uint32_t)SRC;
+    case BPF_INSTRUCTION_CALL:
+        insn->call = rbpf_engine_get_call(instr->immediate);
         break;
-    case BPF_INSTRUCTION_ALU32_MOD_IMM:
-        if (IMM == 0) {
-            return RBPF_ILLEGAL_DIV;
+    }
+}
+
+static bool _rbpf_is_jump(uint8_t opcode)
+{
+    uint8_t cls = opcode & BPF_INSTRUCTION_CLS_MASK;
+
+    return (cls == BPF_INSTRUCTION_CLS_BRANCH && opcode != BPF_INSTRUCTION_CALL &&
+            opcode != BPF_INSTRUCTION_RETURN) || cls == BPF_INSTRUCTION_CLS_JMP32;
+}
+
+#if (RBPF_ENABLE_COMPRESSED)
+/* The compressed text lowers into the same form as the uncompressed one, the
+ * double word loads taking two entries again and the jump offsets counting
+ * entries */
+static int _rbpf_lower_compressed(rbpf_application_t *rbpf)
+{
+    const uint8_t *text = (const uint8_t *)rbpf_application_text(rbpf);
+    size_t text_len = rbpf_application_text_len(rbpf);
+    size_t num_instructions = rbpf_compressed_slots(text, text_len);
+    bpf_instruction_t expanded[2];
+    size_t i = 0;
+
+    if (!rbpf->lowered || rbpf->lowered_len < num_instructions) {
+        return RBPF_OUT_OF_MEMORY;
+    }
+
+    for (i = 0; i < num_instructions; i++) {
+        rbpf->lowered[i].branch_target = 0;
+    }
+
+    i = 0;
+    for (size_t pc = 0; pc < text_len; i++) {
+        size_t len = rbpf_compressed_expand(text + pc, expanded);
+        rbpf_insn_t *insn = &rbpf->lowered[i];
+
+        _rbpf_lower_instruction(rbpf, insn, expanded);
+        if (len == 10) {
+            _rbpf_lower_instruction(rbpf, &rbpf->lowered[++i], &expanded[1]);
         }
-        DST = (uint32_t)DST % (uint32_t)IMM;
-        break;
+        else if (_rbpf_is_jump(expanded[0].opcode)) {
+            size_t target = rbpf_compressed_slots(text, pc + len +
+                                                  bpf_instruction_jump_offset(expanded));
+            insn->offset = target <= i;
+            insn->target = &rbpf->lowered[target];
+            rbpf->lowered[target].branch_target = 1;
+        }
+        pc += len;
+    }
+    return RBPF_OK;
+}
+#endif
+
+int rbpf_engine_lower(rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+
+#if (RBPF_ENABLE_COMPRESSED)
+    if (rbpf->flags & RBPF_FLAG_COMPRESSED) {
+        return _rbpf_lower_compressed(rbpf);
+    }
 #endif
 
-    /* These need additional checks inside */
-    case BPF_INSTRUCTION_ALU64_DIV_REG:
-        if (SRC == 0) {
-            return RBPF_ILLEGAL_DIV;
+    if (!rbpf->lowered || rbpf->lowered_len < num_instructions) {
+        return RBPF_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; i < num_instructions; i++) {
+        rbpf->lowered[i].branch_target = 0;
+    }
+
+    /* The pre-decoded form keeps one entry per instruction slot, so that
+     * branch offsets translate directly. The second half of a double word load
+     * is left in place but never executed. */
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        rbpf_insn_t *insn = &rbpf->lowered[i];
+
+        if ((instr->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+             instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+             instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) && i + 1 >= num_instructions) {
+            return RBPF_ILLEGAL_LEN;
         }
-        DST = DST / SRC;
-        break;
-    case BPF_INSTRUCTION_ALU64_DIV_IMM:
-        if (IMM == 0) {
-            return RBPF_ILLEGAL_DIV;
+        _rbpf_lower_instruction(rbpf, insn, instr);
+        if (_rbpf_is_jump(instr->opcode)) {
+            size_t target = i + bpf_instruction_jump_offset(instr) + 1;
+            insn->offset = target <= i;
+            insn->target = &rbpf->lowered[target];
+            rbpf->lowered[target].branch_target = 1;
         }
-        DST = DST / IMM;
-        break;
-#if (RBPF_ENABLE_ALU32)
-    case BPF_INSTRUCTION_ALU32_DIV_REG:
-        if (SRC == 0) {
-            return RBPF_ILLEGAL_DIV;
+#if (RBPF_ENABLE_LOCAL_CALLS)
+        else if (instr->opcode == BPF_INSTRUCTION_CALL &&
+                 instr->src == BPF_INSTRUCTION_CALL_LOCAL) {
+            size_t target = i + instr->immediate + 1;
+            insn->opcode = BPF_INSTRUCTION_LOCAL_CALL;
+            insn->offset = 1;
+            insn->target = &rbpf->lowered[target];
+            rbpf->lowered[target].branch_target = 1;
         }
-        DST = (uint32_t)DST / (uint32_t)SRC;
-        break;
-    case BPF_INSTRUCTION_ALU32_DIV_IMM:
-        if (IMM == 0) {
-            return RBPF_ILLEGAL_DIV;
+#endif
+    }
+
+    /* The runs of the functions of the application start at them */
+    for (size_t i = 0; i < rbpf_header(rbpf)->functions; i++) {
+        size_t target = rbpf_application_functions(rbpf)[i].location_offset /
+                        sizeof(bpf_instruction_t);
+        if (target < num_instructions) {
+            rbpf->lowered[target].branch_target = 1;
         }
-        DST = (uint32_t)DST / (uint32_t)IMM;
-        break;
+    }
+    return RBPF_OK;
+}
 #endif
 
-    /* These only have an immediate argument variant */
-    case BPF_INSTRUCTION_ALU64_NEG_IMM:
-        DST = -(int64_t)DST;
-        break;
+/* Interpret the application with the register file it was built for, from
+ * its entry */
+static int _rbpf_interpret(rbpf_application_t *rbpf, const uint32_t *proof)
+{
+#if (RBPF_ENABLE_LOWERING)
+    const rbpf_insn_t *text = rbpf->lowered;
+#else
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+#endif
 
-#if (RBPF_ENABLE_ALU32)
-    case BPF_INSTRUCTION_ALU32_NEG_IMM:
-        DST = -(int32_t)DST;
-        break;
+#if (RBPF_ENABLE_COMPRESSED) && !(RBPF_ENABLE_LOWERING)
+    if (rbpf->flags & RBPF_FLAG_COMPRESSED) {
+        size_t len = rbpf_application_text_len(rbpf);
+        size_t pc = rbpf_compressed_offset((const uint8_t *)text, len, rbpf->entry);
 
-    /* MOV doesn't have an operation associated (breaks the pattern) */
-    case BPF_INSTRUCTION_ALU32_MOV_IMM:
-        DST = (uint32_t)IMM;
-        break;
-    case BPF_INSTRUCTION_ALU32_MOV_REG:
-        DST = (uint32_t)SRC;
-        break;
+        if (pc >= len) {
+            return RBPF_ILLEGAL_JUMP;
+        }
+#if (RBPF_ENABLE_REG32)
+        if (rbpf->flags & RBPF_FLAG_REG32) {
+            int res = _rbpf_run32_compressed(rbpf, (const uint8_t *)text + pc, NULL);
+            rbpf->regmap[0] = rbpf->regmap32[0];
+            return res;
+        }
+#endif
+        return _rbpf_run_compressed(rbpf, (const uint8_t *)text + pc, NULL);
+    }
 #endif
-    case BPF_INSTRUCTION_ALU64_MOV_IMM:
-        DST = IMM;
-        break;
-    case BPF_INSTRUCTION_ALU64_MOV_REG:
-        DST = SRC;
-        break;
 
-    /* Arithmetic shift also don't really fit the pattern */
-    case BPF_INSTRUCTION_ALU64_ARSH_REG:
-        (*(int64_t *)&DST) >>= SRC;
-        break;
-    case BPF_INSTRUCTION_ALU64_ARSH_IMM:
-        (*(int64_t *)&DST) >>= IMM;
-        break;
-#if (RBPF_ENABLE_ALU32)
-    case BPF_INSTRUCTION_ALU32_ARSH_REG:
-        DST = (int32_t)DST >> SRC;
-        break;
-    case BPF_INSTRUCTION_ALU32_ARSH_IMM:
-        DST =  (int32_t)DST >> IMM;
-        break;
+    if (rbpf->entry && rbpf->entry >= _rbpf_slots(rbpf)) {
+        return RBPF_ILLEGAL_JUMP;
+    }
+
+#if (RBPF_ENABLE_REG32)
+    if (rbpf->flags & RBPF_FLAG_REG32) {
+        int res = _rbpf_run32(rbpf, text + rbpf->entry, proof);
+        rbpf->regmap[0] = rbpf->regmap32[0];
+        return res;
+    }
 #endif
+    return _rbpf_run(rbpf, text + rbpf->entry, proof);
+}
 
-    /* Double word memory load, takes up two instructions, but acts as one */
-    case BPF_INSTRUCTION_MEM_LDDW:
-        DST = (uint64_t)(*instr)->immediate;
-        DST |= ((uint64_t)(((*instr) + 1)->immediate)) << 32;
-        (*instr)++;
-        break;
 
-    /* Custom instruction to load an address as double word relative to the application data.
-     * Takes up two instructions, but acts as one */
-    case BPF_INSTRUCTION_MEM_LDDWD:
-        DST = (intptr_t)rbpf_application_data(rbpf);
-        DST += (uint64_t)(*instr)->immediate;
-        DST += ((uint64_t)(((*instr) + 1)->immediate)) << 32;
-        (*instr)++;
-        break;
+/* The memory proof of the application, NULL when the accesses are checked */
+static const uint32_t *_rbpf_proof(const rbpf_application_t *rbpf)
+{
+#if (RBPF_ENABLE_MEMORY_PROOF)
+    /* The proof of the context accesses only holds for a large enough context */
+    if ((rbpf->flags & RBPF_FLAG_MEMORY_PROVEN) && !(rbpf->flags & RBPF_FLAG_GUARD_FAILED) &&
+        (rbpf->arg_region.len >= rbpf->proof_ctx_len)) {
+        return rbpf->proof;
+    }
+#else
+    (void)rbpf;
+#endif
+    return NULL;
+}
 
-    /* Custom instruction to load an address as double word relative to the application rodata.
-     * Takes up two instructions, but acts as one */
-    case BPF_INSTRUCTION_MEM_LDDWR:
-        DST = (intptr_t)rbpf_application_rodata(rbpf);
-        DST += (uint64_t)(*instr)->immediate;
-        DST += ((uint64_t)(((*instr) + 1)->immediate)) << 32;
-        (*instr)++;
-        break;
+#if (RBPF_ENABLE_MPU)
+/* Run the copy of the application in the sandbox, the application itself stays
+ * out of reach of the sandbox. The application may have overwritten any of the
+ * copy, so only the registers and the state of the run are taken back, once
+ * checked. */
+static int _rbpf_sandbox_run(rbpf_application_t *rbpf)
+{
+    rbpf_application_t *shadow = rbpf->shadow;
+    uint32_t budget = rbpf->branches_remaining;
+    int res;
 
-/* Regular memory instructions with different sizes */
-        MEM(B, uint8_t)
-        MEM(H, uint16_t)
-        MEM(W, uint32_t)
-        MEM(DW, uint64_t)
-
-    case BPF_INSTRUCTION_JMP_ALWAYS:
-        return _rbpf_jump(rbpf, instr);
-
-        /* generate jump instructions */
-        COND_JMP(ui, EQ, ==)
-        COND_JMP(ui, GT, >)
-        COND_JMP(ui, GE, >=)
-        COND_JMP(ui, LT, <)
-        COND_JMP(ui, LE, <=)
-        COND_JMP(ui, SET, &)
-        COND_JMP(ui, NE, !=)
-        COND_JMP(i, SGT, >)
-        COND_JMP(i, SGE, >=)
-        COND_JMP(i, SLT, <)
-        COND_JMP(i, SLE, <=)
+    if (!rbpf->sandbox || !shadow) {
+        return RBPF_ILLEGAL_MEM;
+    }
+    if (rbpf->shadow_len < sizeof(*shadow) || (rbpf->data_region.len &&
+        rbpf->data_region.start != (const uint8_t *)(shadow + 1))) {
+        return RBPF_OUT_OF_MEMORY;
+    }
 
-    case BPF_INSTRUCTION_CALL:
-    {
-        rbpf_call_t call = _rbpf_get_call((*instr)->immediate);
-        if (call) {
-            regmap[0] = (*(call))(rbpf,
-                                  regmap);
-            break;
-        }
-        else {
-            return RBPF_ILLEGAL_CALL;
-        }
+    *shadow = *rbpf;
+    res = rbpf->sandbox(shadow, rbpf->sandbox_arg);
+
+    memcpy(rbpf->regmap, shadow->regmap, sizeof(rbpf->regmap));
+#if (RBPF_ENABLE_REG32)
+    memcpy(rbpf->regmap32, shadow->regmap32, sizeof(rbpf->regmap32));
+#endif
+    rbpf->instruction_count = shadow->instruction_count;
+
+    /* The run can't give itself more branches */
+    if (shadow->branches_remaining > budget) {
+        return RBPF_ILLEGAL_MEM;
     }
-    case BPF_INSTRUCTION_RETURN:
-        return RBPF_OK;
+    rbpf->branches_remaining = shadow->branches_remaining;
 
-    default:
-        return RBPF_ILLEGAL_INSTRUCTION;
+#if (RBPF_ENABLE_MAPS)
+    rbpf->flags |= shadow->flags & RBPF_FLAG_MAPS_SYNC;
+#endif
+#if (RBPF_ENABLE_YIELD)
+    if (res == RBPF_YIELD) {
+        if (!(shadow->flags & RBPF_FLAG_SUSPENDED) || shadow->entry >= _rbpf_slots(rbpf) ||
+            shadow->depth > rbpf->frames_len) {
+            return RBPF_ILLEGAL_MEM;
+        }
+        rbpf->entry = shadow->entry;
+        rbpf->depth = shadow->depth;
+        rbpf->flags |= RBPF_FLAG_SUSPENDED;
+    }
+#endif
+    /* The helpers of the sandbox have no tail call, the program array stays
+     * out of its reach */
+    if (res == RBPF_TAIL_CALL) {
+        return RBPF_ILLEGAL_MEM;
     }
-    return RBPF_CONTINUE;
+    return res;
 }
+#endif
+
+#if (RBPF_ENABLE_AOT) || (RBPF_ENABLE_JIT)
+/* The quantum of the runs, only the interpreter suspends them */
+static uint32_t _rbpf_quantum(const rbpf_application_t *rbpf)
+{
+#if (RBPF_ENABLE_YIELD)
+    return rbpf->quantum;
+#else
+    (void)rbpf;
+    return 0;
+#endif
+}
+#endif
 
 int rbpf_engine_run(rbpf_application_t *rbpf, const void *ctx, int64_t *result)
 {
+    const uint32_t *proof = NULL;
     int res = RBPF_OK;
 
-    rbpf->branches_remaining = RBPF_BRANCHES_ALLOWED;
-    uint64_t regmap[11] = { 0 };
+    memset(rbpf->regmap, 0, sizeof(rbpf->regmap));
 
-    regmap[1] = (uint64_t)(uintptr_t)ctx;
-    regmap[10] = (uint64_t)(uintptr_t)(rbpf->stack + RBPF_STACK_SIZE);
-
-    const bpf_instruction_t *instr = (const bpf_instruction_t *)rbpf_application_text(rbpf);
+    rbpf->regmap[1] = (uint64_t)(uintptr_t)ctx;
+    rbpf->regmap[10] = (uint64_t)(uintptr_t)(rbpf->stack + RBPF_STACK_SIZE);
+#if (RBPF_ENABLE_REG32)
+    memset(rbpf->regmap32, 0, sizeof(rbpf->regmap32));
+    rbpf->regmap32[1] = (uint32_t)(uintptr_t)ctx;
+    rbpf->regmap32[10] = (uint32_t)(uintptr_t)(rbpf->stack + RBPF_STACK_SIZE);
+#endif
 
     res = rbpf_application_verify_preflight(rbpf);
     if (res < 0) {
         return res;
     }
 
-    do {
-        res = _rbpf_instruction(rbpf, &instr, regmap);
-        instr++;
-    } while (res > 0);
-    *result = regmap[0];
+#if (RBPF_ENABLE_YIELD)
+    rbpf->flags &= ~RBPF_FLAG_SUSPENDED;
+    rbpf->depth = 0;
+#endif
+
+#if (RBPF_ENABLE_BOUNDED_LOOPS)
+    /* The bounded loops the start falls through to are charged upfront, the
+     * native code section charges their iterations instead */
+    if (!rbpf->entry && rbpf->loop_charge && !rbpf->aot &&
+        _rbpf_over_max_jumps(rbpf, rbpf->loop_charge)) {
+        return RBPF_OUT_OF_BRANCHES;
+    }
+#endif
+
+#if (RBPF_ENABLE_MPU)
+    /* Without memory checks, the application only runs in its sandbox */
+    (void)proof;
+    res = _rbpf_sandbox_run(rbpf);
+    *result = rbpf->regmap[0];
+    return res;
+#endif
+
+    rbpf->flags &= ~RBPF_FLAG_GUARD_FAILED;
+    proof = _rbpf_proof(rbpf);
+
+    /* The native code only starts at the first instruction, and runs to
+     * completion */
+#if (RBPF_ENABLE_AOT)
+    if (rbpf->aot && !rbpf->entry) {
+        if (_rbpf_quantum(rbpf)) {
+            return RBPF_NOT_PREEMPTIBLE;
+        }
+        res = rbpf_aot_run(rbpf);
+        *result = rbpf->regmap[0];
+        return res;
+    }
+#endif
+
+#if (RBPF_ENABLE_JIT)
+    /* The native code relies on the memory proof as well */
+    if (rbpf->native && !rbpf->entry &&
+        (proof || !(rbpf->flags & RBPF_FLAG_MEMORY_PROVEN))) {
+        if (_rbpf_quantum(rbpf)) {
+            return RBPF_NOT_PREEMPTIBLE;
+        }
+        res = rbpf->native(rbpf);
+        *result = rbpf->regmap[0];
+        return res;
+    }
+#endif
+
+    res = _rbpf_interpret(rbpf, proof);
+    *result = rbpf->regmap[0];
     return res;
 }
 
+#if (RBPF_ENABLE_YIELD)
+int rbpf_engine_resume(rbpf_application_t *rbpf, int64_t *result)
+{
+    int res;
+
+    rbpf->flags &= ~RBPF_FLAG_SUSPENDED;
+#if (RBPF_ENABLE_MPU)
+    res = _rbpf_sandbox_run(rbpf);
+#else
+    res = _rbpf_interpret(rbpf, _rbpf_proof(rbpf));
+#endif
+    *result = rbpf->regmap[0];
+    return res;
+}
+#endif
+
+#if (RBPF_ENABLE_MPU)
+int rbpf_application_run_sandboxed(rbpf_application_t *rbpf)
+{
+    return _rbpf_interpret(rbpf, NULL);
+}
+#endif
@@ -0,0 +1,481 @@
+/*
+ * Copyright (C) 2023 Freie Universität Berlin
+ * Copyright (C) 2023 Inria
+ * Copyright (C) 2023 Koen Zandberg <koen@bergzand.net>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/*
+ * Interpreter of the virtual machine, included by engine.c once per register
+ * file and text encoding. The includer defines RBPF_RUN, the name of the
+ * function, RBPF_REG_T, the type of the registers, REG(NAME), the name of the
+ * register file or of the pre-decoded operands of that type. RBPF_COMPRESSED
+ * selects the compressed text, and FETCH(), STEP(), SKIP_SECOND_HALF() and
+ * BRANCH() decode the current instruction, move to the next one, skip the
+ * second half of a double word load and take a branch.
+ */
+
+#if (RBPF_COMPRESSED)
+static int RBPF_RUN(rbpf_application_t *rbpf, const uint8_t *pc, const uint32_t *proof)
+#elif (RBPF_ENABLE_LOWERING)
+static int RBPF_RUN(rbpf_application_t *rbpf, const rbpf_insn_t *instr, const uint32_t *proof)
+#else
+static int RBPF_RUN(rbpf_application_t *rbpf, const bpf_instruction_t *instr,
+                    const uint32_t *proof)
+#endif
+{
+#if (RBPF_COMPRESSED)
+    bpf_instruction_t expanded[2] = { 0 };
+    const bpf_instruction_t *const instr = expanded;
+    size_t len;
+#endif
+#if (RBPF_ENABLE_MEMORY_PROOF) && !(RBPF_ENABLE_MASKING) && !(RBPF_ENABLE_MPU)
+    /* The proof counts the instructions from the start of the text */
+    __typeof__(instr) const text = instr - rbpf->entry;
+#else
+    (void)proof;
+#endif
+#if (RBPF_ENABLE_MASKING)
+    const uintptr_t arena = (uintptr_t)rbpf->arena;
+    const uintptr_t mask = rbpf->arena_len - 1;
+#endif
+#if !(RBPF_ENABLE_LOWERING)
+    RBPF_REG_T *regmap = rbpf->REG(regmap);
+#endif
+#if (RBPF_ENABLE_LOCAL_CALLS) && !(RBPF_COMPRESSED) && (RBPF_ENABLE_YIELD)
+    /* The calls in progress in the suspended run */
+    size_t depth = rbpf->depth;
+#elif (RBPF_ENABLE_LOCAL_CALLS) && !(RBPF_COMPRESSED)
+    size_t depth = 0;
+#endif
+#if (RBPF_ENABLE_YIELD)
+    /* The instructions left to the run before it is suspended */
+    uint32_t slice = rbpf->slice;
+#endif
+
+#if (RBPF_ENABLE_THREADED_CODE)
+/* Opcodes without a handler of their own are routed to the illegal
+ * instruction handler by the range initializer, which the handlers then
+ * override. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static const void *const _rbpf_dispatch[256] = {
+        [0 ... 255] = &&_op_illegal,
+        ALU_TABLE(ADD)
+        ALU_TABLE(SUB)
+        ALU_TABLE(AND)
+        ALU_TABLE(OR)
+        ALU_TABLE(LSH)
+        ALU_TABLE(RSH)
+        ALU_TABLE(XOR)
+        ALU_TABLE(MUL)
+        ALU_TABLE(MOD)
+        ALU_TABLE(DIV)
+        ALU_TABLE(MOV)
+        ALU_TABLE(ARSH)
+        INSTR_TABLE(ALU64_NEG_IMM)
+        INSTR_TABLE(ALU64_BSWAP)
+#if (RBPF_ENABLE_ALU32)
+        INSTR_TABLE(ALU32_NEG_IMM)
+        INSTR_TABLE(ALU32_END_LE)
+        INSTR_TABLE(ALU32_END_BE)
+#endif
+        INSTR_TABLE(MEM_LDDW)
+        INSTR_TABLE(MEM_LDDWD)
+        INSTR_TABLE(MEM_LDDWR)
+        MEM_TABLE(B)
+        MEM_TABLE(H)
+        MEM_TABLE(W)
+        MEM_TABLE(DW)
+        MEMSX_TABLE(B)
+        MEMSX_TABLE(H)
+        MEMSX_TABLE(W)
+        INSTR_TABLE(MEM_ATOMICW)
+        INSTR_TABLE(MEM_ATOMICDW)
+        INSTR_TABLE(JMP_ALWAYS)
+        INSTR_TABLE(JMP32_ALWAYS)
+        COND_JMP_TABLE(EQ)
+        COND_JMP_TABLE(GT)
+        COND_JMP_TABLE(GE)
+        COND_JMP_TABLE(LT)
+        COND_JMP_TABLE(LE)
+        COND_JMP_TABLE(SET)
+        COND_JMP_TABLE(NE)
+        COND_JMP_TABLE(SGT)
+        COND_JMP_TABLE(SGE)
+        COND_JMP_TABLE(SLT)
+        COND_JMP_TABLE(SLE)
+        COND_JMP32_TABLE(EQ)
+        COND_JMP32_TABLE(GT)
+        COND_JMP32_TABLE(GE)
+        COND_JMP32_TABLE(LT)
+        COND_JMP32_TABLE(LE)
+        COND_JMP32_TABLE(SET)
+        COND_JMP32_TABLE(NE)
+        COND_JMP32_TABLE(SGT)
+        COND_JMP32_TABLE(SGE)
+        COND_JMP32_TABLE(SLT)
+        COND_JMP32_TABLE(SLE)
+#if (RBPF_ENABLE_FUSION) && (RBPF_ENABLE_LOWERING)
+        FUSED_LDX_TABLE(B)
+        FUSED_LDX_TABLE(H)
+        FUSED_LDX_TABLE(W)
+        INSTR_TABLE(FUSED_MOV_AND_RSH64_IMM)
+        INSTR_TABLE(FUSED_MOV_AND_RSH64_REG)
+        INSTR_TABLE(FUSED_MOV_AND_RSH32_IMM)
+        INSTR_TABLE(FUSED_MOV_AND_RSH32_REG)
+        INSTR_TABLE(FUSED_MOV_RSH64)
+        INSTR_TABLE(FUSED_MOV_RSH32)
+        INSTR_TABLE(FUSED_ZEXT)
+        INSTR_TABLE(FUSED_ZEXT_JEQ)
+        INSTR_TABLE(FUSED_ZEXT_JNE)
+        FUSED_ALU_JMP_TABLE(ADD)
+        FUSED_ALU_JMP_TABLE(AND)
+#endif
+#if (RBPF_ENABLE_LOCAL_CALLS) && (RBPF_ENABLE_LOWERING)
+        INSTR_TABLE(LOCAL_CALL)
+#endif
+#if (RBPF_ENABLE_MEMORY_PROOF) && (RBPF_ENABLE_LOWERING) && !(RBPF_ENABLE_MASKING) && \
+    !(RBPF_ENABLE_MPU)
+        INSTR_TABLE(GUARD_JA)
+#endif
+        INSTR_TABLE(CALL)
+        INSTR_TABLE(RETURN)
+    };
+#pragma GCC diagnostic pop
+
+    COUNT_INSTRUCTION();
+    COUNT_SLICE();
+    DISPATCH();
+#else
+    COUNT_INSTRUCTION();
+    COUNT_SLICE();
+_dispatch:
+    FETCH();
+    switch (instr->opcode) {
+#endif
+
+    /* Macros implementing the instruction code for the simple ALU(32|64) based operations */
+    ALU(ADD,  +)
+    ALU(SUB,  -)
+    ALU(AND,  &)
+    ALU(OR,   |)
+    ALU(LSH, <<)
+    ALU(RSH, >>)
+    ALU(XOR,  ^)
+    ALU(MUL,  *)
+
+    /* These need additional checks inside */
+    INSTR(ALU64_MOD_REG):
+        if (SRC == 0) {
+            return RBPF_ILLEGAL_DIV;
+        }
+        DST = instr->offset ? (uint64_t)_rbpf_smod64(DST, SRC) : DST % SRC;
+        NEXT();
+    INSTR(ALU64_MOD_IMM):
+        if (IMM == 0) {
+            return RBPF_ILLEGAL_DIV;
+        }
+        DST = instr->offset ? (uint64_t)_rbpf_smod64(DST, IMM) : DST % (uint64_t)IMM;
+        NEXT();
+#if (RBPF_ENABLE_ALU32)
+    INSTR(ALU32_MOD_REG):
+        if (SRC == 0) {
+            return RBPF_ILLEGAL_DIV;
+        }
+        DST = instr->offset ? (uint32_t)_rbpf_smod32(DST, SRC) :
+              (uint32_t)DST % (uint32_t)SRC;
+        NEXT();
+    INSTR(ALU32_MOD_IMM):
+        if (IMM == 0) {
+            return RBPF_ILLEGAL_DIV;
+        }
+        DST = instr->offset ? (uint32_t)_rbpf_smod32(DST, IMM) :
+              (uint32_t)DST % (uint32_t)IMM;
+        NEXT();
+#endif
+
+    /* These need additional checks inside */
+    INSTR(ALU64_DIV_REG):
+        if (SRC == 0) {
+            return RBPF_ILLEGAL_DIV;
+        }
+        DST = instr->offset ? (uint64_t)_rbpf_sdiv64(DST, SRC) : DST / SRC;
+        NEXT();
+    INSTR(ALU64_DIV_IMM):
+        if (IMM == 0) {
+            return RBPF_ILLEGAL_DIV;
+        }
+        DST = instr->offset ? (uint64_t)_rbpf_sdiv64(DST, IMM) : DST / (uint64_t)IMM;
+        NEXT();
+#if (RBPF_ENABLE_ALU32)
+    INSTR(ALU32_DIV_REG):
+        if (SRC == 0) {
+            return RBPF_ILLEGAL_DIV;
+        }
+        DST = instr->offset ? (uint32_t)_rbpf_sdiv32(DST, SRC) :
+              (uint32_t)DST / (uint32_t)SRC;
+        NEXT();
+    INSTR(ALU32_DIV_IMM):
+        if (IMM == 0) {
+            return RBPF_ILLEGAL_DIV;
+        }
+        DST = instr->offset ? (uint32_t)_rbpf_sdiv32(DST, IMM) :
+              (uint32_t)DST / (uint32_t)IMM;
+        NEXT();
+#endif
+
+    /* These only have an immediate argument variant */
+    INSTR(ALU64_NEG_IMM):
+        DST = -(int64_t)DST;
+        NEXT();
+
+#if (RBPF_ENABLE_ALU32)
+    INSTR(ALU32_NEG_IMM):
+        DST = (uint32_t)-(uint32_t)DST;
+        NEXT();
+
+    /* MOV doesn't have an operation associated (breaks the pattern) */
+    INSTR(ALU32_MOV_IMM):
+        DST = (uint32_t)IMM;
+        NEXT();
+    INSTR(ALU32_MOV_REG):
+        DST = instr->offset ? (uint32_t)_rbpf_sign_extend(SRC, instr->offset) : (uint32_t)SRC;
+        NEXT();
+
+    /* Byte order conversions of the lower IMM bits, the hosts are little
+     * endian */
+    INSTR(ALU32_END_LE):
+        DST = IMM == 16 ? (uint16_t)DST : IMM == 32 ? (uint32_t)DST : DST;
+        NEXT();
+    INSTR(ALU32_END_BE):
+#endif
+    INSTR(ALU64_BSWAP):
+        DST = IMM == 16 ? __builtin_bswap16(DST) : IMM == 32 ? __builtin_bswap32(DST) :
+              __builtin_bswap64(DST);
+        NEXT();
+    INSTR(ALU64_MOV_IMM):
+        DST = IMM;
+        NEXT();
+    INSTR(ALU64_MOV_REG):
+        DST = instr->offset ? (uint64_t)_rbpf_sign_extend(SRC, instr->offset) : SRC;
+        NEXT();
+
+    /* Arithmetic shift also don't really fit the pattern */
+    INSTR(ALU64_ARSH_REG):
+        DST = (int64_t)DST >> SRC;
+        NEXT();
+    INSTR(ALU64_ARSH_IMM):
+        DST = (int64_t)DST >> IMM;
+        NEXT();
+#if (RBPF_ENABLE_ALU32)
+    INSTR(ALU32_ARSH_REG):
+        DST = (uint32_t)((int32_t)DST >> SRC);
+        NEXT();
+    INSTR(ALU32_ARSH_IMM):
+        DST = (uint32_t)((int32_t)DST >> IMM);
+        NEXT();
+#endif
+
+    /* Double word memory load, takes up two instructions, but acts as one */
+    INSTR(MEM_LDDW):
+        DST = LDDW_VALUE(0);
+        SKIP_SECOND_HALF();
+        NEXT();
+
+    /* Custom instruction to load an address as double word relative to the application data.
+     * Takes up two instructions, but acts as one */
+    INSTR(MEM_LDDWD):
+        DST = LDDW_VALUE((intptr_t)rbpf->data_region.start);
+        SKIP_SECOND_HALF();
+        NEXT();
+
+    /* Custom instruction to load an address as double word relative to the application rodata.
+     * Takes up two instructions, but acts as one */
+    INSTR(MEM_LDDWR):
+        DST = LDDW_VALUE((intptr_t)rbpf->rodata_region.start);
+        SKIP_SECOND_HALF();
+        NEXT();
+
+/* Regular memory instructions with different sizes */
+        MEM(B, uint8_t)
+        MEM(H, uint16_t)
+        MEM(W, uint32_t)
+        MEM(DW, uint64_t)
+        MEMSX(B, int8_t)
+        MEMSX(H, int16_t)
+        MEMSX(W, int32_t)
+        ATOMIC(W, uint32_t, rbpf_atomic32)
+        ATOMIC(DW, uint64_t, rbpf_atomic64)
+
+    INSTR(JMP_ALWAYS):
+        JUMP();
+
+    /* The long jump carries its offset in the immediate */
+    INSTR(JMP32_ALWAYS):
+        JUMP_BY(IMM);
+
+        /* generate jump instructions */
+        COND_JMP(ui, EQ, ==)
+        COND_JMP(ui, GT, >)
+        COND_JMP(ui, GE, >=)
+        COND_JMP(ui, LT, <)
+        COND_JMP(ui, LE, <=)
+        COND_JMP(ui, SET, &)
+        COND_JMP(ui, NE, !=)
+        COND_JMP(i, SGT, >)
+        COND_JMP(i, SGE, >=)
+        COND_JMP(i, SLT, <)
+        COND_JMP(i, SLE, <=)
+
+        /* generate 32 bit jump instructions */
+        COND_JMP32(ui, EQ, ==)
+        COND_JMP32(ui, GT, >)
+        COND_JMP32(ui, GE, >=)
+        COND_JMP32(ui, LT, <)
+        COND_JMP32(ui, LE, <=)
+        COND_JMP32(ui, SET, &)
+        COND_JMP32(ui, NE, !=)
+        COND_JMP32(i, SGT, >)
+        COND_JMP32(i, SGE, >=)
+        COND_JMP32(i, SLT, <)
+        COND_JMP32(i, SLE, <=)
+
+#if (RBPF_ENABLE_FUSION) && (RBPF_ENABLE_LOWERING)
+    /* Superinstructions of the pre-decoded form */
+        FUSED_LDX(B, uint8_t, ADD, +)
+        FUSED_LDX(H, uint16_t, ADD, +)
+        FUSED_LDX(W, uint32_t, ADD, +)
+        FUSED_LDX(B, uint8_t, OR, |)
+        FUSED_LDX(H, uint16_t, OR, |)
+        FUSED_LDX(W, uint32_t, OR, |)
+
+    /* Bit field extraction, the 32 bit forms stand for the sequences with
+     * any 32 bit instruction */
+    INSTR(FUSED_MOV_AND_RSH64_IMM):
+        DST = SRC;
+        DST = DST & IMM_AT(1);
+        DST = DST >> IMM_AT(2);
+        NEXT_AT(2);
+    INSTR(FUSED_MOV_AND_RSH64_REG):
+        DST = SRC;
+        DST = DST & SRC_AT(1);
+        DST = DST >> IMM_AT(2);
+        NEXT_AT(2);
+    INSTR(FUSED_MOV_AND_RSH32_IMM):
+        DST = (uint32_t)SRC;
+        DST = (uint32_t)DST & (uint32_t)IMM_AT(1);
+        DST = (uint32_t)DST >> IMM_AT(2);
+        NEXT_AT(2);
+    INSTR(FUSED_MOV_AND_RSH32_REG):
+        DST = (uint32_t)SRC;
+        DST = (uint32_t)DST & (uint32_t)SRC_AT(1);
+        DST = (uint32_t)DST >> IMM_AT(2);
+        NEXT_AT(2);
+    INSTR(FUSED_MOV_RSH64):
+        DST = SRC >> IMM_AT(1);
+        NEXT_AT(1);
+    INSTR(FUSED_MOV_RSH32):
+        DST = (uint32_t)SRC >> IMM_AT(1);
+        NEXT_AT(1);
+
+    /* Zero extension by shifting left then right by 32 */
+    INSTR(FUSED_ZEXT):
+        DST = (uint32_t)SRC;
+        NEXT_AT(2);
+    INSTR(FUSED_ZEXT_JEQ):
+        DST = (uint32_t)SRC;
+        if ((uint32_t)DST == (uint32_t)IMM_AT(3)) {
+            JUMP_AT(3);
+        }
+        NEXT_AT(3);
+    INSTR(FUSED_ZEXT_JNE):
+        DST = (uint32_t)SRC;
+        if ((uint32_t)DST != (uint32_t)IMM_AT(3)) {
+            JUMP_AT(3);
+        }
+        NEXT_AT(3);
+
+        FUSED_ALU_JMP(ADD, +)
+        FUSED_ALU_JMP(AND, &)
+#endif
+
+#if (RBPF_ENABLE_LOCAL_CALLS) && (RBPF_ENABLE_LOWERING)
+    INSTR(LOCAL_CALL):
+        LOCAL_CALL(instr->target);
+#endif
+
+#if (RBPF_ENABLE_MEMORY_PROOF) && (RBPF_ENABLE_LOWERING) && !(RBPF_ENABLE_MASKING) && \
+    !(RBPF_ENABLE_MPU)
+    /* The jump into a loop whose accesses through its pointer are proven on the
+     * range it walks, the proof of the rest of the run is dropped when the
+     * range is out of bounds */
+    INSTR(GUARD_JA):
+        if (proof && !_rbpf_guard(rbpf, DST, SRC, IMM)) {
+            proof = NULL;
+            rbpf->flags |= RBPF_FLAG_GUARD_FAILED;
+        }
+        JUMP();
+#endif
+
+    INSTR(CALL):
+    {
+#if (RBPF_ENABLE_LOCAL_CALLS) && !(RBPF_ENABLE_LOWERING) && !(RBPF_COMPRESSED)
+        if (instr->src == BPF_INSTRUCTION_CALL_LOCAL) {
+            LOCAL_CALL(instr + IMM + 1);
+        }
+#endif
+        rbpf_call_t call = CALL_FUNCTION;
+        if (call) {
+            RBPF_REG_T *regs = rbpf->REG(regmap);
+            regs[0] = (*(call))(rbpf, regs[1], regs[2], regs[3], regs[4], regs[5]);
+#if (RBPF_ENABLE_TAIL_CALLS)
+            /* The run goes on with the next application, in the same slice */
+            if (rbpf->tail_call) {
+#if (RBPF_ENABLE_YIELD)
+                rbpf->slice = slice;
+#endif
+                return RBPF_TAIL_CALL;
+            }
+#endif
+            NEXT();
+        }
+        else {
+            return RBPF_ILLEGAL_CALL;
+        }
+    }
+    INSTR(RETURN):
+#if (RBPF_ENABLE_LOCAL_CALLS) && !(RBPF_COMPRESSED)
+        if (depth) {
+            LOCAL_RETURN();
+        }
+#endif
+        return RBPF_OK;
+
+    INSTR_ILLEGAL:
+        return RBPF_ILLEGAL_INSTRUCTION;
+#if !(RBPF_ENABLE_THREADED_CODE)
+    }
+#endif
+
+#if (RBPF_ENABLE_YIELD)
+    /* The run goes on with the instruction it didn't execute */
+_suspend:
+#if (RBPF_COMPRESSED)
+    rbpf->entry = rbpf_compressed_slots(rbpf_application_text(rbpf),
+                                        pc - (const uint8_t *)rbpf_application_text(rbpf));
+#elif (RBPF_ENABLE_LOWERING)
+    rbpf->entry = instr - rbpf->lowered;
+#else
+    rbpf->entry = instr - (const bpf_instruction_t *)rbpf_application_text(rbpf);
+#endif
+#if (RBPF_ENABLE_LOCAL_CALLS) && !(RBPF_COMPRESSED)
+    rbpf->depth = depth;
+#endif
+    rbpf->flags |= RBPF_FLAG_SUSPENDED;
+    return RBPF_YIELD;
+#endif
+}
@@ -14,16 +14,554 @@
 #include "rbpf.h"
 #include "rbpf/instruction.h"
 #include "rbpf/config.h"
+#include "rbpf/builtin_shared.h"
 
 extern int rbpf_engine_run(rbpf_application_t *rbpf, const void *ctx, int64_t *result);
+extern int rbpf_engine_resume(rbpf_application_t *rbpf, int64_t *result);
 
-int rbpf_application_run_ctx(rbpf_application_t *rbpf, void *ctx, size_t ctx_len, int64_t *result)
+/* Move the region to its place in the index, the regions not fitting in the
+ * index are only on the list */
+static void _rbpf_region_index(rbpf_application_t *rbpf, const rbpf_mem_region_t *region)
+{
+    size_t len = rbpf->regions_len;
+    size_t i;
+
+    for (i = 0; i < len && rbpf->regions[i] != region; i++) {}
+    if (i < len) {
+        for (len--; i < len; i++) {
+            rbpf->regions[i] = rbpf->regions[i + 1];
+        }
+    }
+    else if (len == RBPF_REGIONS_MAX) {
+        return;
+    }
+
+    for (i = len; i > 0 && (uintptr_t)rbpf->regions[i - 1]->start > (uintptr_t)region->start; i--) {
+        rbpf->regions[i] = rbpf->regions[i - 1];
+    }
+    rbpf->regions[i] = region;
+    rbpf->regions_len = len + 1;
+}
+
+#if (RBPF_ENABLE_MASKING) || (RBPF_ENABLE_MPU)
+static void _rbpf_copy(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    while (len--) {
+        *d++ = *s++;
+    }
+}
+#endif
+
+#if (RBPF_ENABLE_MPU)
+/* Lay out the data after the copy of the application the sandbox runs, the
+ * image stays out of reach of the application. The runs fail when the data
+ * doesn't fit. */
+static void _rbpf_shadow_setup(rbpf_application_t *rbpf)
+{
+    size_t data_len = rbpf_application_data_len(rbpf);
+    uint8_t *data = (uint8_t *)(rbpf->shadow + 1);
+
+    if (!rbpf->shadow || rbpf->shadow_len < sizeof(rbpf_application_t) ||
+        data_len > rbpf->shadow_len - sizeof(rbpf_application_t)) {
+        return;
+    }
+    _rbpf_copy(data, rbpf_application_data(rbpf), data_len);
+    rbpf->data_region.start = data;
+}
+#endif
+
+#if (RBPF_ENABLE_MASKING)
+
+int rbpf_application_arena_init(rbpf_application_t *rbpf, void *buf, size_t len)
+{
+    uintptr_t start = (uintptr_t)buf;
+    size_t size;
+
+    /* The accesses straddling the end of the arena reach 7 bytes further */
+    for (size = (size_t)1 << (8 * sizeof(size_t) - 1); size >= RBPF_STACK_SIZE; size >>= 1) {
+        uintptr_t arena = (start + size - 1) & ~(uintptr_t)(size - 1);
+        if (arena >= start && arena - start + size + sizeof(uint64_t) <= len) {
+            rbpf->arena = (uint8_t *)arena;
+            rbpf->arena_len = size;
+            rbpf->arena_used = 0;
+            return size;
+        }
+    }
+    return RBPF_OUT_OF_MEMORY;
+}
+
+void *rbpf_arena_alloc(rbpf_application_t *rbpf, size_t len)
+{
+    size_t used = rbpf->arena_used;
+
+    if (!used || len > rbpf->arena_len - used) {
+        return NULL;
+    }
+    rbpf->arena_used = (used + len + 7) & ~(size_t)7;
+    return rbpf->arena + used;
+}
+
+/* Lay out the stack, the data and the read-only data in the arena, leaves the
+ * arena unused when they don't fit */
+static void _rbpf_arena_setup(rbpf_application_t *rbpf)
+{
+    size_t data_len = (rbpf_application_data_len(rbpf) + 7) & ~(size_t)7;
+    size_t rodata_len = (rbpf_application_rodata_len(rbpf) + 7) & ~(size_t)7;
+    uint8_t *arena = rbpf->arena;
+
+    rbpf->arena_used = 0;
+    if (!arena || RBPF_STACK_SIZE + data_len + rodata_len > rbpf->arena_len) {
+        return;
+    }
+
+    _rbpf_copy(arena + RBPF_STACK_SIZE, rbpf_application_data(rbpf),
+               rbpf_application_data_len(rbpf));
+    _rbpf_copy(arena + RBPF_STACK_SIZE + data_len, rbpf_application_rodata(rbpf),
+               rbpf_application_rodata_len(rbpf));
+    rbpf->stack = arena;
+    rbpf->data_region.start = arena + RBPF_STACK_SIZE;
+    rbpf->rodata_region.start = arena + RBPF_STACK_SIZE + data_len;
+    rbpf->arena_used = RBPF_STACK_SIZE + data_len + rodata_len;
+}
+#endif
+
+#if (RBPF_ENABLE_MAPS)
+/* Bytes a map takes, up to the next multiple of 8 bytes */
+static uint64_t _rbpf_map_size(const rbpf_map_def_t *map)
+{
+    return ((uint64_t)map->value_size * map->max_entries + 7) & ~(uint64_t)7;
+}
+
+/* Pages of a persistent map, each with its checksum */
+static size_t _rbpf_map_pages(const rbpf_map_def_t *map)
+{
+    if (!(map->flags & BPF_F_PERSISTENT)) {
+        return 0;
+    }
+    return (_rbpf_map_size(map) + RBPF_MAP_PAGE_SIZE - 1) / RBPF_MAP_PAGE_SIZE;
+}
+
+/* FNV-1a over the 32 bit words of a page, the length a multiple of 8 */
+static uint32_t _rbpf_page_sum(const uint8_t *page, size_t len)
+{
+    const uint32_t *word = (const uint32_t *)(uintptr_t)page;
+    uint32_t sum = 2166136261u;
+
+    for (size_t i = 0; i < len / sizeof(uint32_t); i++) {
+        sum = (sum ^ word[i]) * 16777619u;
+    }
+    return sum;
+}
+
+int rbpf_application_maps_init(rbpf_application_t *rbpf, void *buf, size_t len)
+{
+    const rbpf_map_list_t *list = rbpf_application_maps(rbpf);
+    const uint8_t *end = (const uint8_t *)rbpf->application + rbpf->application_len;
+    uint8_t *maps = buf;
+    uint64_t size = 0;
+
+    /* The pre-flight checks rely on the layout of the maps */
+    rbpf->flags &= ~(RBPF_FLAG_PREFLIGHT_DONE | RBPF_FLAG_MEMORY_PROVEN |
+                     RBPF_FLAG_MAPS_LOADED);
+    /* The storage is supplied again with the checksums of the new layout */
+    rbpf->map_storage = NULL;
+    rbpf->map_sums = NULL;
+    rbpf_memory_region_init(&rbpf->maps_region, NULL, 0,
+                            RBPF_MEM_REGION_READ | RBPF_MEM_REGION_WRITE);
+    _rbpf_region_index(rbpf, &rbpf->maps_region);
+
+    if (!list) {
+        return 0;
+    }
+    if ((const uint8_t *)list->maps > end ||
+        list->len > (size_t)(end - (const uint8_t *)list->maps) / sizeof(rbpf_map_def_t)) {
+        return RBPF_ILLEGAL_LEN;
+    }
+    for (size_t i = 0; i < list->len; i++) {
+        if (list->maps[i].type != BPF_MAP_TYPE_ARRAY ||
+            (list->maps[i].flags & ~BPF_F_PERSISTENT)) {
+            return RBPF_ILLEGAL_INSTRUCTION;
+        }
+        size += _rbpf_map_size(&list->maps[i]);
+    }
+    if (size > len || size > INT32_MAX) {
+        return RBPF_OUT_OF_MEMORY;
+    }
+#if (RBPF_ENABLE_MASKING)
+    /* The accesses to the maps are confined to the arena as any other */
+    if ((uintptr_t)maps - (uintptr_t)rbpf->arena >= rbpf->arena_len ||
+        size > rbpf->arena_len - ((uintptr_t)maps - (uintptr_t)rbpf->arena)) {
+        return RBPF_ILLEGAL_MEM;
+    }
+#endif
+
+    for (size_t i = 0; i < size; i++) {
+        maps[i] = 0;
+    }
+    rbpf_memory_region_init(&rbpf->maps_region, maps, size,
+                            RBPF_MEM_REGION_READ | RBPF_MEM_REGION_WRITE);
+    _rbpf_region_index(rbpf, &rbpf->maps_region);
+    return (int)size;
+}
+
+int rbpf_application_map_storage_init(rbpf_application_t *rbpf, const rbpf_map_storage_t *storage,
+                                      uint32_t *sums, size_t len)
+{
+    const rbpf_map_list_t *list = rbpf_application_maps(rbpf);
+    size_t pages = 0;
+
+    rbpf->flags &= ~RBPF_FLAG_MAPS_LOADED;
+    rbpf->map_storage = NULL;
+    rbpf->map_sums = NULL;
+
+    /* Only the maps laid out are loaded */
+    if (storage && rbpf->maps_region.start) {
+        for (uint32_t i = 0; i < list->len; i++) {
+            pages += _rbpf_map_pages(&list->maps[i]);
+        }
+    }
+    if (pages > len) {
+        return RBPF_OUT_OF_MEMORY;
+    }
+    /* Filled once the maps are loaded */
+    rbpf->map_storage = storage;
+    rbpf->map_sums = sums;
+    return (int)pages;
+}
+
+void *rbpf_application_map_lookup(const rbpf_application_t *rbpf, uint32_t map, uint32_t index)
+{
+    const rbpf_map_list_t *list = rbpf_application_maps(rbpf);
+    uint8_t *element = (uint8_t *)(uintptr_t)rbpf->maps_region.start;
+
+    /* Laid out only when the whole list is valid */
+    if (!element || map >= list->len || index >= list->maps[map].max_entries) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < map; i++) {
+        element += _rbpf_map_size(&list->maps[i]);
+    }
+    return element + (size_t)index * list->maps[map].value_size;
+}
+
+/* Bytes of a page of a map, the last one possibly shorter */
+static size_t _rbpf_page_len(size_t size, size_t page)
+{
+    size_t offset = page * RBPF_MAP_PAGE_SIZE;
+
+    return size - offset < RBPF_MAP_PAGE_SIZE ? size - offset : RBPF_MAP_PAGE_SIZE;
+}
+
+/* Read the persistent maps back from their storage, a map never stored
+ * staying zeroed */
+static void _rbpf_maps_load(rbpf_application_t *rbpf)
+{
+    const rbpf_map_list_t *list = rbpf_application_maps(rbpf);
+    const rbpf_map_storage_t *storage = rbpf->map_storage;
+    uint8_t *map = (uint8_t *)(uintptr_t)rbpf->maps_region.start;
+    uint32_t *sums = rbpf->map_sums;
+
+    rbpf->flags |= RBPF_FLAG_MAPS_LOADED;
+    if (!map) {
+        return;
+    }
+    for (uint32_t i = 0; i < list->len; i++) {
+        size_t size = _rbpf_map_size(&list->maps[i]);
+        size_t pages = _rbpf_map_pages(&list->maps[i]);
+
+        if (pages) {
+            storage->load(storage->arg, i, map, size);
+        }
+        for (size_t page = 0; page < pages; page++) {
+            *sums++ = _rbpf_page_sum(map + page * RBPF_MAP_PAGE_SIZE,
+                                     _rbpf_page_len(size, page));
+        }
+        map += size;
+    }
+}
+
+int rbpf_application_maps_sync(rbpf_application_t *rbpf)
+{
+    const rbpf_map_list_t *list = rbpf_application_maps(rbpf);
+    const rbpf_map_storage_t *storage = rbpf->map_storage;
+    const uint8_t *map = rbpf->maps_region.start;
+    uint32_t *sums = rbpf->map_sums;
+    int written = 0;
+    int res = 0;
+
+    if (!storage || !map || !(rbpf->flags & RBPF_FLAG_MAPS_LOADED)) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < list->len; i++) {
+        size_t size = _rbpf_map_size(&list->maps[i]);
+        size_t pages = _rbpf_map_pages(&list->maps[i]);
+        size_t changed = 0;
+
+        /* A run of changed pages is written at the first unchanged page, or
+         * past the last page */
+        for (size_t page = 0; page <= pages; page++) {
+            if (page < pages) {
+                uint32_t sum = _rbpf_page_sum(map + page * RBPF_MAP_PAGE_SIZE,
+                                              _rbpf_page_len(size, page));
+
+                if (sum != sums[page]) {
+                    sums[page] = sum;
+                    changed++;
+                    continue;
+                }
+            }
+            if (changed) {
+                size_t start = (page - changed) * RBPF_MAP_PAGE_SIZE;
+                size_t end = page < pages ? page * RBPF_MAP_PAGE_SIZE : size;
+
+                if (storage->store(storage->arg, i, start, map + start, end - start) < 0) {
+                    /* Differs from the page until written, the other pages
+                     * are still written */
+                    for (size_t j = page - changed; j < page; j++) {
+                        sums[j] = ~sums[j];
+                    }
+                    res = RBPF_MAPS_NOT_SYNCED;
+                }
+                else {
+                    written += changed;
+                }
+                changed = 0;
+            }
+        }
+        sums += pages;
+        map += size;
+    }
+    return res < 0 ? res : written;
+}
+
+int rbpf_application_maps_flush(rbpf_application_t *rbpf)
+{
+    int res;
+
+    /* The maps of a suspended run are written back once it ends */
+    if (rbpf->flags & RBPF_FLAG_SUSPENDED) {
+        rbpf->flags |= RBPF_FLAG_MAPS_SYNC;
+        return 0;
+    }
+    rbpf->flags &= ~RBPF_FLAG_MAPS_SYNC;
+    res = rbpf_application_maps_sync(rbpf);
+    if (res < 0) {
+        /* Retried at the end of the next run */
+        rbpf->flags |= RBPF_FLAG_MAPS_SYNC;
+    }
+    return res;
+}
+#endif
+
+/* Run the application, or go on with its suspended run */
+static int _rbpf_engine_start(rbpf_application_t *rbpf, const void *ctx, int64_t *result)
+{
+#if (RBPF_ENABLE_YIELD)
+    if (rbpf->flags & RBPF_FLAG_SUSPENDED) {
+        return rbpf_engine_resume(rbpf, result);
+    }
+#endif
+    return rbpf_engine_run(rbpf, ctx, result);
+}
+
+/* Run the application, its persistent maps loaded before the first run and
+ * written back after the runs asking for it, once they end. A failed write-back
+ * is reported by the successful runs only, and retried. */
+static int _rbpf_engine_run(rbpf_application_t *rbpf, const void *ctx, int64_t *result)
+{
+#if (RBPF_ENABLE_MAPS)
+    int res;
+
+    if (rbpf->map_storage && !(rbpf->flags & RBPF_FLAG_MAPS_LOADED)) {
+        _rbpf_maps_load(rbpf);
+    }
+    res = _rbpf_engine_start(rbpf, ctx, result);
+    if (res != RBPF_YIELD && (rbpf->flags & RBPF_FLAG_MAPS_SYNC)) {
+        int sync = rbpf_application_maps_flush(rbpf);
+
+        if (sync < 0 && res == RBPF_OK) {
+            res = sync;
+        }
+    }
+    return res;
+#else
+    return _rbpf_engine_start(rbpf, ctx, result);
+#endif
+}
+
+/* Run the application, then the ones it hands the run over to, on the context
+ * of its run. The head of the chain keeps the application a suspended run
+ * stopped in. */
+static int _rbpf_chain(rbpf_application_t *head, rbpf_application_t *rbpf, int64_t *result)
+{
+    void *ctx = (void *)(uintptr_t)rbpf->arg_region.start;
+    int res = _rbpf_engine_run(rbpf, ctx, result);
+
+#if (RBPF_ENABLE_TAIL_CALLS)
+    size_t ctx_len = rbpf->arg_region.len;
+
+    /* The chained applications share the context and the rest of the budget */
+    while (res == RBPF_TAIL_CALL) {
+        rbpf_application_t *next = rbpf->tail_call;
+
+        rbpf->tail_call = NULL;
+        rbpf_memory_region_init(&next->arg_region, ctx, ctx_len,
+                                RBPF_MEM_REGION_READ | RBPF_MEM_REGION_WRITE);
+        _rbpf_region_index(next, &next->arg_region);
+        next->flags &= ~RBPF_FLAG_SUSPENDED;
+        next->entry = 0;
+        next->branches_remaining = rbpf->branches_remaining;
+#if (RBPF_ENABLE_YIELD)
+        next->slice = rbpf->slice;
+#endif
+        next->tail_calls_remaining = rbpf->tail_calls_remaining - 1;
+        rbpf = next;
+        res = _rbpf_engine_run(rbpf, ctx, result);
+    }
+#endif
+#if (RBPF_ENABLE_YIELD)
+    head->suspended = res == RBPF_YIELD ? rbpf : NULL;
+#else
+    (void)head;
+#endif
+    return res;
+}
+
+/* Run the application from the instruction slot entry */
+static int _rbpf_run(rbpf_application_t *rbpf, size_t entry, void *ctx, size_t ctx_len,
+                     int64_t *result)
 {
+#if (RBPF_ENABLE_MASKING)
+    /* A context outside of the arena is copied in and back */
+    if (ctx_len && ((uintptr_t)ctx - (uintptr_t)rbpf->arena >= rbpf->arena_len ||
+                    ctx_len > rbpf->arena_len - ((uintptr_t)ctx - (uintptr_t)rbpf->arena))) {
+        uint8_t *copy;
+        int res;
+
+#if (RBPF_ENABLE_YIELD)
+        /* The copy doesn't outlive the run, which can't be suspended */
+        if (rbpf->quantum) {
+            return RBPF_NOT_PREEMPTIBLE;
+        }
+#endif
+        copy = rbpf_arena_alloc(rbpf, ctx_len);
+        if (!copy) {
+            return RBPF_OUT_OF_MEMORY;
+        }
+        _rbpf_copy(copy, ctx, ctx_len);
+        res = _rbpf_run(rbpf, entry, copy, ctx_len, result);
+        _rbpf_copy(ctx, copy, ctx_len);
+        rbpf->arena_used = copy - rbpf->arena;
+        return res;
+    }
+#endif
+
     rbpf_memory_region_init(&rbpf->arg_region, ctx, ctx_len,
                             RBPF_MEM_REGION_READ | RBPF_MEM_REGION_WRITE);
+    _rbpf_region_index(rbpf, &rbpf->arg_region);
 
     assert(rbpf->flags & RBPF_FLAG_SETUP_DONE);
-    return rbpf_engine_run(rbpf, ctx, result);
+    rbpf->flags &= ~RBPF_FLAG_SUSPENDED;
+    rbpf->entry = entry;
+    rbpf->branches_remaining = RBPF_BRANCHES_ALLOWED;
+#if (RBPF_ENABLE_YIELD)
+    rbpf->slice = rbpf->quantum;
+#endif
+#if (RBPF_ENABLE_TAIL_CALLS)
+    rbpf->tail_calls_remaining = RBPF_TAIL_CALLS_ALLOWED;
+#endif
+    return _rbpf_chain(rbpf, rbpf, result);
+}
+
+int rbpf_application_run_ctx(rbpf_application_t *rbpf, void *ctx, size_t ctx_len, int64_t *result)
+{
+    return _rbpf_run(rbpf, 0, ctx, ctx_len, result);
+}
+
+#if (RBPF_ENABLE_YIELD)
+int rbpf_application_resume(rbpf_application_t *rbpf, int64_t *result)
+{
+    rbpf_application_t *suspended = rbpf->suspended;
+
+    /* Dropped by a new run of the application it stopped in */
+    if (!suspended || !(suspended->flags & RBPF_FLAG_SUSPENDED)) {
+        return RBPF_ILLEGAL_JUMP;
+    }
+    suspended->slice = suspended->quantum;
+    return _rbpf_chain(rbpf, suspended, result);
+}
+#endif
+
+/* Compare the name of a function, terminated within the read-only data, to
+ * the name looked up */
+static int _rbpf_name_cmp(const rbpf_application_t *rbpf, size_t offset, const char *name)
+{
+    const uint8_t *rodata = rbpf_application_rodata(rbpf);
+    size_t len = rbpf_application_rodata_len(rbpf);
+
+    for (;; offset++, name++) {
+        uint8_t c = offset < len ? rodata[offset] : 0;
+        if (c != (uint8_t)*name || c == 0) {
+            return (int)c - (uint8_t)*name;
+        }
+    }
+}
+
+/* The sorted function tables are searched, the others walked */
+static const rbpf_function_t *_rbpf_find_function(const rbpf_application_t *rbpf,
+                                                  const char *name)
+{
+    const rbpf_header_t *header = rbpf_header(rbpf);
+    const rbpf_function_t *functions = rbpf_application_functions(rbpf);
+    size_t low = 0, high = header->functions;
+
+    if ((const uint8_t *)(functions + high) >
+        (const uint8_t *)rbpf->application + rbpf->application_len) {
+        return NULL;
+    }
+
+    if (!(header->flags & RBPF_HEADER_FLAG_SORTED)) {
+        for (size_t i = 0; i < high; i++) {
+            if (_rbpf_name_cmp(rbpf, functions[i].name_offset, name) == 0) {
+                return &functions[i];
+            }
+        }
+        return NULL;
+    }
+
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        int cmp = _rbpf_name_cmp(rbpf, functions[mid].name_offset, name);
+        if (cmp == 0) {
+            return &functions[mid];
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+int rbpf_application_run_entry(rbpf_application_t *rbpf, const char *name, void *ctx,
+                               size_t ctx_len, int64_t *result)
+{
+    const rbpf_function_t *function = _rbpf_find_function(rbpf, name);
+
+    if (!function) {
+        return RBPF_ILLEGAL_CALL;
+    }
+    /* The location counts bytes of the uncompressed text, compressed ones too */
+    if (function->location_offset % sizeof(bpf_instruction_t)) {
+        return RBPF_ILLEGAL_JUMP;
+    }
+    return _rbpf_run(rbpf, function->location_offset / sizeof(bpf_instruction_t), ctx, ctx_len,
+                     result);
 }
 
 void rbpf_application_setup(rbpf_application_t *rbpf, uint8_t *stack,
@@ -32,6 +570,15 @@ void rbpf_application_setup(rbpf_application_t *rbpf, uint8_t *stack,
     rbpf->stack = stack;
     rbpf->application = application;
     rbpf->application_len = application_len;
+    rbpf->instruction_count = 0;
+    rbpf->native = NULL;
+    rbpf->aot = NULL;
+    rbpf->loop_charge = 0;
+    rbpf->loops = 0;
+    rbpf->guards = 0;
+    /* The trust of the host goes to one application, not to the next one */
+    rbpf->flags &= ~(RBPF_FLAG_PREFLIGHT_DONE | RBPF_FLAG_MEMORY_PROVEN | RBPF_FLAG_SUSPENDED |
+                     RBPF_CONFIG_NATIVE_TRUSTED);
 
     rbpf_memory_region_init(&rbpf->stack_region,
                             rbpf->stack,
@@ -43,11 +590,35 @@ void rbpf_application_setup(rbpf_application_t *rbpf, uint8_t *stack,
                                 rbpf), RBPF_MEM_REGION_READ | RBPF_MEM_REGION_WRITE);
     rbpf_memory_region_init(&rbpf->rodata_region, rbpf_application_rodata(rbpf),
                             rbpf_application_rodata_len(rbpf), RBPF_MEM_REGION_READ);
+    rbpf_memory_region_init(&rbpf->arg_region, NULL, 0,
+                            RBPF_MEM_REGION_READ | RBPF_MEM_REGION_WRITE);
+    /* Empty until laid out by rbpf_application_maps_init() */
+    rbpf_memory_region_init(&rbpf->maps_region, NULL, 0,
+                            RBPF_MEM_REGION_READ | RBPF_MEM_REGION_WRITE);
 
     /* Manually build the linked list of regions */
     rbpf->stack_region.next = &rbpf->data_region;
     rbpf->data_region.next = &rbpf->rodata_region;
-    rbpf->rodata_region.next = &rbpf->arg_region;
+    rbpf->rodata_region.next = &rbpf->maps_region;
+    rbpf->maps_region.next = &rbpf->arg_region;
+
+#if (RBPF_ENABLE_MPU)
+    _rbpf_shadow_setup(rbpf);
+#endif
+#if (RBPF_ENABLE_MASKING)
+    _rbpf_arena_setup(rbpf);
+    rbpf_memory_region_init(&rbpf->stack_region, rbpf->stack, RBPF_STACK_SIZE,
+                            RBPF_MEM_REGION_READ | RBPF_MEM_REGION_WRITE);
+#endif
+
+    rbpf->regions_len = 0;
+    rbpf->last_hit[0] = NULL;
+    rbpf->last_hit[1] = NULL;
+    _rbpf_region_index(rbpf, &rbpf->stack_region);
+    _rbpf_region_index(rbpf, &rbpf->data_region);
+    _rbpf_region_index(rbpf, &rbpf->rodata_region);
+    _rbpf_region_index(rbpf, &rbpf->maps_region);
+    _rbpf_region_index(rbpf, &rbpf->arg_region);
 
     rbpf->flags |= RBPF_FLAG_SETUP_DONE;
 }
@@ -56,4 +627,5 @@ void rbpf_add_region(rbpf_application_t *rbpf, rbpf_mem_region_t *region)
 {
     region->next = rbpf->arg_region.next;
     rbpf->arg_region.next = region;
+    _rbpf_region_index(rbpf, region);
 }
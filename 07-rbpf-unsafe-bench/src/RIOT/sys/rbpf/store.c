@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2023 Inria
+ * Copyright (C) 2023 Koen Zandberg <koen@bergzand.net>
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/*
+ * Key/value stores of the BPF_FUNC_BPF_STORE and BPF_FUNC_BPF_FETCH helpers.
+ *
+ * The keys are hashed into a table of a power of two of entries and the
+ * collisions probe the following entries. Keys are never removed, so that a
+ * lookup stops at the first entry not in use. The store is full at three
+ * quarters of its entries, bounding the length of the probes.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "rbpf.h"
+#include "rbpf/config.h"
+
+#if (RBPF_ENABLE_STORE_CALLS)
+
+/* Multiplicative hash, the upper bits are the best mixed */
+static inline uint32_t _rbpf_store_hash(uint32_t key)
+{
+    return key * 2654435761UL;
+}
+
+static inline bool _rbpf_store_used(const rbpf_store_t *store, uint32_t index)
+{
+    return store->used[index / 32] & (1UL << (index % 32));
+}
+
+/* Entry of the key, or the entry not in use where the key would go */
+static uint32_t _rbpf_store_find(const rbpf_store_t *store, uint32_t key)
+{
+    uint32_t index = _rbpf_store_hash(key);
+
+    /* The highest bits of the hash select the entry */
+    index >>= __builtin_clz(store->mask);
+    while (_rbpf_store_used(store, index) && store->entries[index].key != key) {
+        index = (index + 1) & store->mask;
+    }
+    return index;
+}
+
+int rbpf_store_init(rbpf_store_t *store, void *buf, size_t len)
+{
+    uint32_t entries = 2;
+
+    /* A store of a single entry would be full at once */
+    if (len < RBPF_STORE_SIZE(2)) {
+        return RBPF_OUT_OF_MEMORY;
+    }
+    while (entries < UINT32_MAX / 2 && RBPF_STORE_SIZE((size_t)entries * 2) <= len) {
+        entries *= 2;
+    }
+    store->entries = buf;
+    store->used = (uint32_t *)(store->entries + entries);
+    store->mask = entries - 1;
+    store->count = 0;
+    for (uint32_t i = 0; i < (entries + 31) / 32; i++) {
+        store->used[i] = 0;
+    }
+    return (int)entries;
+}
+
+int rbpf_store_update(rbpf_store_t *store, uint32_t key, uint32_t value)
+{
+    uint32_t index = _rbpf_store_find(store, key);
+
+    if (!_rbpf_store_used(store, index)) {
+        /* At most three quarters in use, some entry is always free for the
+         * lookups to stop at */
+        if (store->count >= store->mask - store->mask / 4) {
+            return -1;
+        }
+        store->used[index / 32] |= 1UL << (index % 32);
+        store->entries[index].key = key;
+        store->count++;
+    }
+    store->entries[index].value = value;
+    return 0;
+}
+
+bool rbpf_store_fetch(const rbpf_store_t *store, uint32_t key, uint32_t *value)
+{
+    uint32_t index = _rbpf_store_find(store, key);
+
+    if (!_rbpf_store_used(store, index)) {
+        *value = 0;
+        return false;
+    }
+    *value = store->entries[index].value;
+    return true;
+}
+
+#endif
@@ -13,37 +13,2557 @@
 
 #include "rbpf.h"
 #include "rbpf/builtin_shared.h"
+#include "rbpf/builtin_calls.h"
 #include "rbpf/instruction.h"
 #include "rbpf/config.h"
 
+#if (RBPF_ENABLE_COMPRESSED)
+#include "compressed.h"
+#endif
+
+#if (RBPF_ENABLE_LOWERING)
+extern int rbpf_engine_lower(rbpf_application_t *rbpf);
+extern rbpf_application_t *rbpf_engine_registers(rbpf_application_t *rbpf);
+#endif
+#if (RBPF_ENABLE_JIT)
+extern int rbpf_jit_compile(rbpf_application_t *rbpf);
+#endif
+#if (RBPF_ENABLE_AOT)
+extern int rbpf_aot_load(rbpf_application_t *rbpf);
+#endif
+
 static bool _rbpf_check_call(uint32_t num)
 {
-    switch (num) {
+    return rbpf_get_helper(num) ? true : false;
+}
+
+static inline bool _rbpf_is_atomic(uint8_t opcode)
+{
+    return opcode == BPF_INSTRUCTION_MEM_ATOMICW || opcode == BPF_INSTRUCTION_MEM_ATOMICDW;
+}
+
+/* The register an atomic operation returns the previous value in, -1 for the
+ * operations not fetching it */
+static inline int _rbpf_atomic_fetch_reg(const bpf_instruction_t *i)
+{
+    if (i->immediate == BPF_INSTRUCTION_ATOMIC_CMPXCHG) {
+        return 0;
+    }
+    return (i->immediate & BPF_INSTRUCTION_ATOMIC_FETCH) ? i->src : -1;
+}
+
+/* The 64 bit jumps but calls and returns, and the 32 bit jumps */
+static bool _rbpf_is_jump(uint8_t opcode)
+{
+    uint8_t cls = opcode & BPF_INSTRUCTION_CLS_MASK;
+
+    return (cls == BPF_INSTRUCTION_CLS_BRANCH && opcode != BPF_INSTRUCTION_CALL &&
+            opcode != BPF_INSTRUCTION_RETURN) || cls == BPF_INSTRUCTION_CLS_JMP32;
+}
+
+/* The calls of the functions of the application */
+static inline bool _rbpf_is_local_call(const bpf_instruction_t *i)
+{
+    return RBPF_ENABLE_LOCAL_CALLS && i->opcode == BPF_INSTRUCTION_CALL &&
+           i->src == BPF_INSTRUCTION_CALL_LOCAL;
+}
+
+/* The instruction slot of a function of the application */
+static inline size_t _rbpf_function_slot(const rbpf_application_t *rbpf, size_t function)
+{
+    return rbpf_application_functions(rbpf)[function].location_offset /
+           sizeof(bpf_instruction_t);
+}
+
+#if (RBPF_ENABLE_REG32)
+/* Only the 64 bit operations whose result the 32 bit registers hold, the
+ * register moves and the address arithmetic */
+static bool _rbpf_check_reg32(const bpf_instruction_t *i, const bpf_instruction_t *end)
+{
+    switch (i->opcode & BPF_INSTRUCTION_CLS_MASK) {
+    case BPF_INSTRUCTION_CLS_ALU32:
+        /* The 64 bit byte order conversion */
+        return i->opcode != BPF_INSTRUCTION_ALU32_END_BE || i->immediate != 64;
+    case BPF_INSTRUCTION_CLS_ALU64:
+        switch (i->opcode & BPF_INSTRUCTION_ALU_OP_MASK) {
+        case BPF_INSTRUCTION_ALU_MOV:
+            /* Not the sign extending moves */
+            return i->offset == 0;
+        case BPF_INSTRUCTION_ALU_ADD:
+        case BPF_INSTRUCTION_ALU_SUB:
+            return true;
+        default:
+            return false;
+        }
+    case BPF_INSTRUCTION_CLS_LD:
+        /* The upper half of the double word immediates */
+        if (i->opcode == BPF_INSTRUCTION_MEM_LDDW || i->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+            i->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+            return i + 1 < end && i[1].immediate == 0;
+        }
+        return true;
+    case BPF_INSTRUCTION_CLS_LDX:
+        /* Not the sign extending loads */
+        return (i->opcode & BPF_INSTRUCTION_MEM_MDE_MASK) != BPF_INSTRUCTION_LDX_MEMSX;
+    case BPF_INSTRUCTION_CLS_STX:
+        /* Not the 64 bit atomic operations */
+        return i->opcode != BPF_INSTRUCTION_MEM_ATOMICDW;
+    default:
+        return true;
+    }
+}
+#endif
+
+#if (RBPF_ENABLE_LOCAL_CALLS)
+/*
+ * Frames
+ *
+ * Every local call moves the frame pointer down by the same frame size, the
+ * deepest stack access of the application. A pass over the text follows the
+ * registers holding the frame pointer moved by a constant, the accesses
+ * through them and the pointers they hold give the depth of the stack in use.
+ * A function returning ends the registers it moved the frame pointer into.
+ */
+static void _rbpf_frame_size(rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+    uint16_t derived = 1 << 10;
+    int64_t offsets[11] = { 0 };
+    int64_t depth = 0;
+    bool calls = false;
+
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        uint8_t cls = instr->opcode & BPF_INSTRUCTION_CLS_MASK;
+        int base = -1;
+
+        switch (cls) {
+        case BPF_INSTRUCTION_CLS_ALU64:
+            if (instr->opcode == BPF_INSTRUCTION_ALU64_MOV_REG && !instr->offset &&
+                (derived & (1 << instr->src))) {
+                derived |= 1 << instr->dst;
+                offsets[instr->dst] = offsets[instr->src];
+            }
+            else if (instr->opcode == BPF_INSTRUCTION_ALU64_ADD_IMM) {
+                offsets[instr->dst] += instr->immediate;
+            }
+            else if (instr->opcode == BPF_INSTRUCTION_ALU64_SUB_IMM) {
+                offsets[instr->dst] -= instr->immediate;
+            }
+            else {
+                derived &= ~(1 << instr->dst);
+            }
+            break;
+        case BPF_INSTRUCTION_CLS_ALU32:
+        case BPF_INSTRUCTION_CLS_LD:
+            derived &= ~(1 << instr->dst);
+            if (instr->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+                instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+                instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+                i++;
+            }
+            break;
+        case BPF_INSTRUCTION_CLS_LDX:
+            base = instr->src;
+            break;
+        case BPF_INSTRUCTION_CLS_ST:
+        case BPF_INSTRUCTION_CLS_STX:
+            base = instr->dst;
+            if (_rbpf_is_atomic(instr->opcode) && _rbpf_atomic_fetch_reg(instr) >= 0) {
+                derived &= ~(1 << _rbpf_atomic_fetch_reg(instr));
+            }
+            break;
+        case BPF_INSTRUCTION_CLS_BRANCH:
+            if (instr->opcode == BPF_INSTRUCTION_CALL) {
+                calls |= _rbpf_is_local_call(instr);
+                derived &= ~0x3f;
+            }
+            else if (instr->opcode == BPF_INSTRUCTION_RETURN) {
+                derived = 1 << 10;
+                offsets[10] = 0;
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (base >= 0 && (derived & (1 << base)) && -(offsets[base] + instr->offset) > depth) {
+            depth = -(offsets[base] + instr->offset);
+        }
+        if (cls == BPF_INSTRUCTION_CLS_LDX) {
+            derived &= ~(1 << instr->dst);
+        }
+        for (unsigned reg = 0; reg < 11; reg++) {
+            if ((derived & (1 << reg)) && -offsets[reg] > depth) {
+                depth = -offsets[reg];
+            }
+        }
+    }
+
+    depth = (depth + 7) & ~(int64_t)7;
+    rbpf->frame_size = !calls ? 0 : depth > RBPF_STACK_SIZE ? RBPF_STACK_SIZE : depth;
+}
+#endif
+
+/*
+ * Values
+ *
+ * The memory proof and the checks of the helper arguments follow the value of
+ * every register within straight-line code: a number within a range, or a
+ * pointer into the stack, the context, the data, the read-only data or the
+ * maps with its offset within a range. A number with an unknown upper half
+ * keeps the range of its lower half, read as unsigned, that the JMP32 jumps
+ * compare and the ALU32 instructions operate on. At a branch target the
+ * registers written anywhere in the application are forgotten and the others
+ * get their value at the start back, so that no state is kept per
+ * instruction. Calls follow the eBPF calling convention and clobber r0 to r5,
+ * a map lookup with constant arguments then sets r0 to its element. The
+ * functions of the application and the ones locally called start like branch
+ * targets, with the frame pointer anywhere down to the size of a frame.
+ */
+enum {
+    _VALUE_UNKNOWN,     /* Any value */
+    _VALUE_SCALAR,      /* Number within [min, max] */
+    _VALUE_SCALAR32,    /* Number whose lower half is within [min, max] read as unsigned */
+    _VALUE_STACK,       /* Pointer [min, max] bytes from the start of the stack */
+    _VALUE_CTX,         /* Pointer [min, max] bytes from the start of the context */
+    _VALUE_DATA,        /* Pointer [min, max] bytes from the start of the data */
+    _VALUE_RODATA,      /* Pointer [min, max] bytes from the start of the read-only data */
+    _VALUE_MAP,         /* Pointer [min, max] bytes from the start of the maps */
+};
+
+typedef struct {
+    uint8_t kind;
+    int32_t min;
+    int32_t max;
+} _value_t;
+
+static void _value_set(_value_t *v, uint8_t kind, int64_t min, int64_t max)
+{
+    if (min < INT32_MIN || max > INT32_MAX) {
+        v->kind = _VALUE_UNKNOWN;
+        return;
+    }
+    v->kind = kind;
+    v->min = min;
+    v->max = max;
+}
+
+static void _value_entry(_value_t *v, unsigned reg, int64_t fp_min)
+{
+    if (reg == 1) {
+        _value_set(v, _VALUE_CTX, 0, 0);
+    }
+    else if (reg == 10) {
+        _value_set(v, _VALUE_STACK, fp_min, RBPF_STACK_SIZE);
+    }
+    else {
+        _value_set(v, _VALUE_SCALAR, 0, 0);
+    }
+}
+
+/* The lower half of a number within [min, max] read as unsigned */
+static void _value_set32(_value_t *v, uint32_t min, uint32_t max)
+{
+    v->kind = _VALUE_SCALAR32;
+    v->min = (int32_t)min;
+    v->max = (int32_t)max;
+}
+
+/* The range of the lower half of a number, false when it wraps */
+static bool _value_low(const _value_t *v, uint32_t *min, uint32_t *max)
+{
+    if (v->kind != _VALUE_SCALAR32 &&
+        (v->kind != _VALUE_SCALAR || (v->min < 0 && v->max >= 0))) {
+        return false;
+    }
+    *min = (uint32_t)v->min;
+    *max = (uint32_t)v->max;
+    return true;
+}
+
+static bool _value_positive(const _value_t *v)
+{
+    return v->kind == _VALUE_SCALAR && v->min >= 0;
+}
+
+static bool _value_const(const _value_t *v)
+{
+    return v->kind == _VALUE_SCALAR && v->min == v->max;
+}
+
+/* Value of an ALU instruction, as 64 bit operation */
+static void _value_alu(_value_t *d, const _value_t *s, uint8_t op, unsigned width)
+{
+    bool scalars = d->kind == _VALUE_SCALAR && s->kind == _VALUE_SCALAR;
+    bool shift = _value_const(s) && s->min >= 0 && (unsigned)s->min < width;
+
+    switch (op) {
+    case BPF_INSTRUCTION_ALU_MOV:
+        *d = *s;
+        return;
+    case BPF_INSTRUCTION_ALU_ADD:
+        if (s->kind == _VALUE_SCALAR && d->kind != _VALUE_UNKNOWN) {
+            _value_set(d, d->kind, (int64_t)d->min + s->min, (int64_t)d->max + s->max);
+            return;
+        }
+        if (d->kind == _VALUE_SCALAR && s->kind != _VALUE_UNKNOWN) {
+            _value_set(d, s->kind, (int64_t)d->min + s->min, (int64_t)d->max + s->max);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_SUB:
+        if (s->kind == _VALUE_SCALAR && d->kind != _VALUE_UNKNOWN) {
+            _value_set(d, d->kind, (int64_t)d->min - s->max, (int64_t)d->max - s->min);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_MUL:
+        if (_value_positive(d) && _value_positive(s)) {
+            _value_set(d, _VALUE_SCALAR, (int64_t)d->min * s->min, (int64_t)d->max * s->max);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_DIV:
+        if (_value_positive(d) && _value_positive(s) && s->min > 0) {
+            _value_set(d, _VALUE_SCALAR, d->min / s->max, d->max / s->min);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_MOD:
+        if (_value_positive(s) && s->min > 0) {
+            _value_set(d, _VALUE_SCALAR, 0, s->max - 1);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_AND:
+        if (_value_positive(s)) {
+            _value_set(d, _VALUE_SCALAR, 0, s->max);
+            return;
+        }
+        if (_value_positive(d)) {
+            _value_set(d, _VALUE_SCALAR, 0, d->max);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_LSH:
+        if (shift && _value_positive(d) && s->min < 32) {
+            _value_set(d, _VALUE_SCALAR, (int64_t)d->min << s->min, (int64_t)d->max << s->min);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_RSH:
+        if (shift && _value_positive(d)) {
+            _value_set(d, _VALUE_SCALAR, d->min >> s->min, d->max >> s->min);
+            return;
+        }
+        if (shift && width == 64 && s->min > 32) {
+            _value_set(d, _VALUE_SCALAR, 0, UINT64_MAX >> s->min);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_ARSH:
+        if (shift && scalars) {
+            _value_set(d, _VALUE_SCALAR, d->min >> s->min, d->max >> s->min);
+            return;
+        }
+        break;
+    case BPF_INSTRUCTION_ALU_NEG:
+        if (d->kind == _VALUE_SCALAR) {
+            _value_set(d, _VALUE_SCALAR, -(int64_t)d->max, -(int64_t)d->min);
+            return;
+        }
+        break;
+    }
+    d->kind = _VALUE_UNKNOWN;
+}
+
+/* The lower half of a number as operand of a 32 bit operation */
+static void _value_half(_value_t *v)
+{
+    if (v->kind == _VALUE_SCALAR32 && (uint32_t)v->max <= INT32_MAX) {
+        v->kind = _VALUE_SCALAR;
+    }
+}
+
+/* Value of an ALU instruction, the 32 bit operations only keep the positive
+ * values matching the 64 bit operation and the moves of a lower half */
+static void _value_alu_instruction(_value_t *regs, const bpf_instruction_t *i)
+{
+    _value_t *d = &regs[i->dst];
+    _value_t s;
+    uint8_t op = i->opcode & BPF_INSTRUCTION_ALU_OP_MASK;
+
+    /* The signed divisions and sign extending moves */
+    if (i->offset) {
+        d->kind = _VALUE_UNKNOWN;
+        return;
+    }
+
+    if (i->opcode & BPF_INSTRUCTION_ALU_S_MASK) {
+        s = regs[i->src];
+    }
+    else {
+        _value_set(&s, _VALUE_SCALAR, i->immediate, i->immediate);
+    }
+
+    if ((i->opcode & BPF_INSTRUCTION_ALU_CLS_MASK) == BPF_INSTRUCTION_CLS_ALU64) {
+        if (op != BPF_INSTRUCTION_ALU_MOV && d->kind == _VALUE_SCALAR32) {
+            d->kind = _VALUE_UNKNOWN;
+        }
+        if (op != BPF_INSTRUCTION_ALU_MOV && s.kind == _VALUE_SCALAR32) {
+            s.kind = _VALUE_UNKNOWN;
+        }
+        _value_alu(d, &s, op, 64);
+        return;
+    }
+
+    _value_half(d);
+    _value_half(&s);
+    if (op == BPF_INSTRUCTION_ALU_MOV && s.kind == _VALUE_SCALAR32) {
+        /* Zero extended */
+        *d = s;
+        return;
+    }
+    if (op != BPF_INSTRUCTION_ALU_MOV && op != BPF_INSTRUCTION_ALU_AND &&
+        op != BPF_INSTRUCTION_ALU_MOD && !_value_positive(d)) {
+        d->kind = _VALUE_UNKNOWN;
+        return;
+    }
+    _value_alu(d, &s, op, 32);
+    if (!_value_positive(d)) {
+        d->kind = _VALUE_UNKNOWN;
+    }
+}
+
+/* Narrow the value of a register compared by a jump to the side where the
+ * comparison op is false, the not taken side with the operation of the jump */
+static void _value_branch(_value_t *regs, const bpf_instruction_t *i, uint8_t op)
+{
+    _value_t *d = &regs[i->dst];
+    int64_t k = i->immediate;
+
+    if (i->opcode & BPF_INSTRUCTION_ALU_S_MASK) {
+        if (!_value_const(&regs[i->src])) {
+            return;
+        }
+        k = regs[i->src].min;
+    }
+    if (d->kind != _VALUE_SCALAR && d->kind != _VALUE_UNKNOWN) {
+        return;
+    }
+
+    switch (op) {
+    case BPF_INSTRUCTION_BRANCH_JNE:
+        _value_set(d, _VALUE_SCALAR, k, k);
+        break;
+    case BPF_INSTRUCTION_BRANCH_JEQ:
+        if (d->kind == _VALUE_SCALAR && d->min < d->max) {
+            _value_set(d, _VALUE_SCALAR, d->min + (d->min == k), d->max - (d->max == k));
+        }
+        break;
+    case BPF_INSTRUCTION_BRANCH_JGE:
+        k--;
+    /* fall through */
+    case BPF_INSTRUCTION_BRANCH_JGT:
+        /* Negative numbers are above any positive bound */
+        if (k < 0) {
+            break;
+        }
+        if (d->kind == _VALUE_UNKNOWN) {
+            _value_set(d, _VALUE_SCALAR, 0, k);
+        }
+        else if (d->max >= 0 && d->min <= k) {
+            _value_set(d, _VALUE_SCALAR, d->min < 0 ? 0 : d->min, d->max < k ? d->max : k);
+        }
+        break;
+    case BPF_INSTRUCTION_BRANCH_JLE:
+        k++;
+    /* fall through */
+    case BPF_INSTRUCTION_BRANCH_JLT:
+        if (d->kind == _VALUE_SCALAR && d->min >= 0 && k >= 0 && k <= d->max) {
+            _value_set(d, _VALUE_SCALAR, d->min > k ? d->min : k, d->max);
+        }
+        break;
+    case BPF_INSTRUCTION_BRANCH_JSGE:
+        k--;
+    /* fall through */
+    case BPF_INSTRUCTION_BRANCH_JSGT:
+        if (d->kind == _VALUE_SCALAR && d->min <= k) {
+            _value_set(d, _VALUE_SCALAR, d->min, d->max < k ? d->max : k);
+        }
+        break;
+    case BPF_INSTRUCTION_BRANCH_JSLE:
+        k++;
+    /* fall through */
+    case BPF_INSTRUCTION_BRANCH_JSLT:
+        if (d->kind == _VALUE_SCALAR && d->max >= k) {
+            _value_set(d, _VALUE_SCALAR, d->min > k ? d->min : k, d->max);
+        }
+        break;
+    }
+}
+
+/* Narrow the lower half of a register compared by a 32 bit jump to the side
+ * where the unsigned comparison op is false, the upper half of an unknown
+ * register staying unknown */
+static void _value_branch32(_value_t *regs, const bpf_instruction_t *i, uint8_t op)
+{
+    _value_t *d = &regs[i->dst];
+    uint32_t k = i->immediate;
+    uint32_t min = 0;
+    uint32_t max = UINT32_MAX;
+
+    if (i->opcode & BPF_INSTRUCTION_ALU_S_MASK) {
+        if (!_value_const(&regs[i->src])) {
+            return;
+        }
+        k = regs[i->src].min;
+    }
+    if (d->kind != _VALUE_UNKNOWN && !_value_low(d, &min, &max)) {
+        return;
+    }
+
+    switch (op) {
+    case BPF_INSTRUCTION_BRANCH_JNE:
+        if (k < min || k > max) {
+            return;
+        }
+        min = max = k;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JEQ:
+        if (min == max) {
+            return;
+        }
+        min += min == k;
+        max -= max == k;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JGE:
+        if (k == 0) {
+            return;
+        }
+        k--;
+    /* fall through */
+    case BPF_INSTRUCTION_BRANCH_JGT:
+        if (k < min) {
+            return;
+        }
+        max = max < k ? max : k;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JLE:
+        if (k == UINT32_MAX) {
+            return;
+        }
+        k++;
+    /* fall through */
+    case BPF_INSTRUCTION_BRANCH_JLT:
+        if (k > max) {
+            return;
+        }
+        min = min > k ? min : k;
+        break;
+    default:
+        return;
+    }
+
+    if (d->kind == _VALUE_SCALAR) {
+        /* The upper half is the sign extension of the lower one */
+        _value_set(d, _VALUE_SCALAR, (int32_t)min, (int32_t)max);
+    }
+    else {
+        _value_set32(d, min, max);
+    }
+}
+
+/* Check that an access of size bytes at offset from v stays in its region */
+static bool _value_in_bounds(const rbpf_application_t *rbpf, const _value_t *v, int16_t offset,
+                             unsigned size, bool store, size_t *ctx_len)
+{
+    int64_t start = (int64_t)v->min + offset;
+    int64_t end = (int64_t)v->max + offset + size;
+    int64_t len;
+
+    switch (v->kind) {
+    case _VALUE_STACK:
+        len = RBPF_STACK_SIZE;
+        break;
+    case _VALUE_DATA:
+        len = rbpf_application_data_len(rbpf);
+        break;
+    case _VALUE_RODATA:
+        if (store) {
+            return false;
+        }
+        len = rbpf_application_rodata_len(rbpf);
+        break;
+    case _VALUE_MAP:
+        len = rbpf->maps_region.len;
+        break;
+    case _VALUE_CTX:
+        /* Checked against the context of every run */
+        len = end;
+        break;
+    default:
+        return false;
+    }
+
+    if (start < 0 || end > len) {
+        return false;
+    }
+    if (v->kind == _VALUE_CTX && (size_t)end > *ctx_len) {
+        *ctx_len = end;
+    }
+    return true;
+}
+
+/* The registers the application writes, and the lowest frame pointer of its
+ * functions */
+static uint16_t _value_written(const rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                               size_t num_instructions, int64_t *fp_min)
+{
+    uint16_t written = 0;
+
+    *fp_min = RBPF_STACK_SIZE;
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        uint8_t cls = instr->opcode & BPF_INSTRUCTION_CLS_MASK;
+
+        if (instr->opcode == BPF_INSTRUCTION_CALL) {
+            written |= 0x3f;
+            if (_rbpf_is_local_call(instr)) {
+                *fp_min = rbpf->frame_size;
+            }
+        }
+        else if (cls == BPF_INSTRUCTION_CLS_BRANCH || cls == BPF_INSTRUCTION_CLS_JMP32) {
+            continue;
+        }
+        else if (_rbpf_is_atomic(instr->opcode)) {
+            if (_rbpf_atomic_fetch_reg(instr) >= 0) {
+                written |= 1 << _rbpf_atomic_fetch_reg(instr);
+            }
+        }
+        else if (cls != BPF_INSTRUCTION_CLS_ST && cls != BPF_INSTRUCTION_CLS_STX) {
+            written |= 1 << instr->dst;
+        }
+        if (instr->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+            i++;
+        }
+    }
+    return written;
+}
+
+/* The registers at a branch target */
+static void _value_target(_value_t *regs, uint16_t written, int64_t fp_min)
+{
+    for (unsigned reg = 0; reg < 11; reg++) {
+        if (written & (1 << reg)) {
+            regs[reg].kind = _VALUE_UNKNOWN;
+        }
+        else {
+            _value_entry(&regs[reg], reg, fp_min);
+        }
+    }
+}
+
+/* The element a call returns, when it is a map lookup with constant arguments
+ * of an element laid out */
+static const uint8_t *_value_map_element(const rbpf_application_t *rbpf, const _value_t *regs,
+                                         const bpf_instruction_t *instr)
+{
+#if (RBPF_ENABLE_MAPS)
+    if (instr->opcode == BPF_INSTRUCTION_CALL && !_rbpf_is_local_call(instr) &&
+        instr->immediate == BPF_FUNC_BPF_MAP_LOOKUP &&
+        _value_const(&regs[1]) && regs[1].min >= 0 &&
+        _value_const(&regs[2]) && regs[2].min >= 0) {
+        return rbpf_application_map_lookup(rbpf, regs[1].min, regs[2].min);
+    }
+#endif
+    return NULL;
+}
+
+/* The registers after an instruction, the double word loads read the second
+ * half when it lies before the end */
+static void _value_instruction(const rbpf_application_t *rbpf, _value_t *regs,
+                               const bpf_instruction_t *instr, const bpf_instruction_t *end)
+{
+    switch (instr->opcode & BPF_INSTRUCTION_CLS_MASK) {
+    case BPF_INSTRUCTION_CLS_ALU32:
+    case BPF_INSTRUCTION_CLS_ALU64:
+        _value_alu_instruction(regs, instr);
+        break;
+    case BPF_INSTRUCTION_CLS_LD:
+        if (instr + 1 < end) {
+            int64_t value = (int64_t)((uint64_t)(uint32_t)instr->immediate |
+                                      ((uint64_t)(uint32_t)instr[1].immediate << 32));
+            uint8_t kind = instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ? _VALUE_DATA :
+                           instr->opcode == BPF_INSTRUCTION_MEM_LDDWR ? _VALUE_RODATA :
+                           _VALUE_SCALAR;
+            _value_set(&regs[instr->dst], kind, value, value);
+        }
+        break;
+    case BPF_INSTRUCTION_CLS_LDX:
+    {
+        unsigned size_op = instr->opcode & BPF_INSTRUCTION_MEM_SZ_MASK;
+        unsigned size = (size_op == 0x00) ? 4 : (size_op == 0x08) ? 2 :
+                        (size_op == 0x10) ? 1 : 8;
+        bool signed_load = (instr->opcode & BPF_INSTRUCTION_MEM_MDE_MASK) ==
+                           BPF_INSTRUCTION_LDX_MEMSX;
+
+        if (size < 4 && !signed_load) {
+            _value_set(&regs[instr->dst], _VALUE_SCALAR, 0, (1 << (8 * size)) - 1);
+        }
+        else {
+            regs[instr->dst].kind = _VALUE_UNKNOWN;
+        }
+        break;
+    }
+    case BPF_INSTRUCTION_CLS_STX:
+        if (_rbpf_is_atomic(instr->opcode) && _rbpf_atomic_fetch_reg(instr) >= 0) {
+            regs[_rbpf_atomic_fetch_reg(instr)].kind = _VALUE_UNKNOWN;
+        }
+        break;
+    case BPF_INSTRUCTION_CLS_BRANCH:
+        if (instr->opcode == BPF_INSTRUCTION_CALL) {
+            const uint8_t *element = _value_map_element(rbpf, regs, instr);
+
+            for (unsigned reg = 0; reg < 6; reg++) {
+                regs[reg].kind = _VALUE_UNKNOWN;
+            }
+            if (element) {
+                int64_t offset = element - (const uint8_t *)rbpf->maps_region.start;
+                _value_set(&regs[0], _VALUE_MAP, offset, offset);
+            }
+        }
+        else if (instr->opcode != BPF_INSTRUCTION_RETURN &&
+                 instr->opcode != BPF_INSTRUCTION_JMP_ALWAYS) {
+            _value_branch(regs, instr, instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK);
+        }
+        break;
+    case BPF_INSTRUCTION_CLS_JMP32:
+        if (instr->opcode != BPF_INSTRUCTION_JMP32_ALWAYS) {
+            _value_branch32(regs, instr, instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+#if (RBPF_ENABLE_MEMORY_PROOF) && !(RBPF_ENABLE_MASKING) && !(RBPF_ENABLE_MPU)
+/*
+ * Memory proof
+ *
+ * A single pass over the text follows the values of the registers. The
+ * branch targets are marked in the proof buffer first, every instruction then
+ * replaces its mark with the proof that its memory access stays in bounds.
+ */
+static void _rbpf_prove_memory(rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+    uint32_t *proof = rbpf->proof;
+    size_t ctx_len = 0;
+    uint16_t written;
+    int64_t fp_min;
+    _value_t regs[11];
+
+    if (!proof || rbpf->proof_len < (num_instructions + 31) / 32) {
+        return;
+    }
+
+    /* Mark the branch targets */
+    for (size_t i = 0; i < (num_instructions + 31) / 32; i++) {
+        proof[i] = 0;
+    }
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+
+        if (_rbpf_is_jump(instr->opcode) || _rbpf_is_local_call(instr)) {
+            size_t target = i + 1 + (_rbpf_is_local_call(instr) ? instr->immediate :
+                                     bpf_instruction_jump_offset(instr));
+            proof[target / 32] |= 1UL << (target % 32);
+        }
+        if (instr->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+            i++;
+        }
+    }
+    written = _value_written(rbpf, text, num_instructions, &fp_min);
+
+    /* The first instruction starts with the exact state of a run */
+    for (size_t i = 0; i < rbpf_header(rbpf)->functions; i++) {
+        size_t target = _rbpf_function_slot(rbpf, i);
+        if (target && target < num_instructions) {
+            proof[target / 32] |= 1UL << (target % 32);
+        }
+    }
+
+    for (unsigned reg = 0; reg < 11; reg++) {
+        _value_entry(&regs[reg], reg, RBPF_STACK_SIZE);
+    }
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        uint8_t cls = instr->opcode & BPF_INSTRUCTION_CLS_MASK;
+        uint32_t bit = 1UL << (i % 32);
+        bool proven = false;
+
+        if (proof[i / 32] & bit) {
+            _value_target(regs, written, fp_min);
+        }
+
+        if (cls == BPF_INSTRUCTION_CLS_LDX || cls == BPF_INSTRUCTION_CLS_ST ||
+            cls == BPF_INSTRUCTION_CLS_STX) {
+            unsigned size_op = instr->opcode & BPF_INSTRUCTION_MEM_SZ_MASK;
+            unsigned size = (size_op == 0x00) ? 4 : (size_op == 0x08) ? 2 :
+                            (size_op == 0x10) ? 1 : 8;
+            bool load = cls == BPF_INSTRUCTION_CLS_LDX;
+            bool signed_load = load && (instr->opcode & BPF_INSTRUCTION_MEM_MDE_MASK) ==
+                               BPF_INSTRUCTION_LDX_MEMSX;
+            bool atomic = _rbpf_is_atomic(instr->opcode);
+
+            /* The alignment of the atomic operations is still checked */
+            proven = ((instr->opcode & BPF_INSTRUCTION_MEM_MDE_MASK) == 0x60 || signed_load ||
+                      atomic) &&
+                     _value_in_bounds(rbpf, &regs[load ? instr->src : instr->dst],
+                                      instr->offset, size, !load, &ctx_len);
+        }
+        _value_instruction(rbpf, regs, instr, text + num_instructions);
+        if (cls == BPF_INSTRUCTION_CLS_LD && i + 1 < num_instructions) {
+            /* Skip the second half, never executed */
+            proof[i / 32] &= ~bit;
+            i++;
+            bit = 1UL << (i % 32);
+        }
+
+        if (proven) {
+            proof[i / 32] |= bit;
+        }
+        else {
+            proof[i / 32] &= ~bit;
+        }
+    }
+
+    rbpf->proof_ctx_len = ctx_len;
+    rbpf->flags |= RBPF_FLAG_MEMORY_PROVEN;
+}
+#endif
+
+/*
+ * Helper arguments
+ *
+ * The arguments of every call to a helper declaring their types are checked
+ * with the values of the straight-line code before the call, from the last
+ * branch target, or the start of the text, up to the call.
+ */
+
+/* The last branch target up to the slot, the start of the text when none */
+static size_t _rbpf_last_target(const rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                                size_t num_instructions, size_t slot, bool *target)
+{
+    size_t last = 0;
+
+    *target = false;
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+
+        if (_rbpf_is_jump(instr->opcode) || _rbpf_is_local_call(instr)) {
+            size_t dest = i + 1 + (_rbpf_is_local_call(instr) ? instr->immediate :
+                                   bpf_instruction_jump_offset(instr));
+            if (dest <= slot && dest >= last) {
+                last = dest;
+                *target = true;
+            }
+        }
+        if (instr->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < rbpf_header(rbpf)->functions; i++) {
+        size_t dest = _rbpf_function_slot(rbpf, i);
+        if (dest && dest <= slot && dest >= last) {
+            last = dest;
+            *target = true;
+        }
+    }
+    return last;
+}
+
+static bool _rbpf_check_arguments(const rbpf_application_t *rbpf, const rbpf_helper_t *helper,
+                                  const _value_t *values)
+{
+    size_t ctx_len = 0;
+    _value_t regs[6];
+
+    /* The lower half of a pointer tells nothing of it */
+    for (unsigned reg = 1; reg < 6; reg++) {
+        regs[reg] = values[reg];
+        if (regs[reg].kind == _VALUE_SCALAR32) {
+            regs[reg].kind = _VALUE_UNKNOWN;
+        }
+    }
+
+    for (unsigned arg = 0; arg < 5; arg++) {
+        const _value_t *v = &regs[arg + 1];
+        bool pointer = v->kind != _VALUE_UNKNOWN && v->kind != _VALUE_SCALAR;
+
+        switch (helper->args[arg]) {
+        case RBPF_ARG_CTX:
+            if (v->kind != _VALUE_UNKNOWN &&
+                (v->kind != _VALUE_CTX || v->min != 0 || v->max != 0)) {
+                return false;
+            }
+            break;
+        case RBPF_ARG_SCALAR:
+            if (pointer) {
+                return false;
+            }
+            break;
+        case RBPF_ARG_CONST:
+            if (!_value_const(v)) {
+                return false;
+            }
+            break;
+        case RBPF_ARG_MEM:
+        case RBPF_ARG_MEM_WRITE:
+            /* A null pointer */
+            if (_value_const(v) && v->min == 0) {
+                return false;
+            }
+            break;
+        case RBPF_ARG_SIZE:
+            if (pointer || (v->kind == _VALUE_SCALAR && v->min < 0)) {
+                return false;
+            }
+            /* The memory ranges, when both ends are known */
+            for (unsigned mem = arg; v->kind == _VALUE_SCALAR && mem-- > 0;) {
+                if (helper->args[mem] == RBPF_ARG_SIZE) {
+                    break;
+                }
+                if ((helper->args[mem] == RBPF_ARG_MEM ||
+                     helper->args[mem] == RBPF_ARG_MEM_WRITE) &&
+                    regs[mem + 1].kind != _VALUE_UNKNOWN &&
+                    !_value_in_bounds(rbpf, &regs[mem + 1], 0, v->max,
+                                      helper->args[mem] == RBPF_ARG_MEM_WRITE, &ctx_len)) {
+                    return false;
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+/* The registers before the call, from the straight-line code leading to it */
+static void _rbpf_call_values(const rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                              size_t num_instructions, size_t call, uint16_t written,
+                              int64_t fp_min, _value_t *regs)
+{
+    bool target;
+    size_t i = _rbpf_last_target(rbpf, text, num_instructions, call, &target);
+
+    for (unsigned reg = 0; reg < 11; reg++) {
+        _value_entry(&regs[reg], reg, RBPF_STACK_SIZE);
+    }
+    if (target) {
+        _value_target(regs, written, fp_min);
+    }
+    for (; i < call; i++) {
+        _value_instruction(rbpf, regs, &text[i], text + num_instructions);
+        if ((text[i].opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+}
+
+#if (RBPF_ENABLE_MAPS)
+/* The map looked up exists, and so does the element when its index is known */
+static bool _rbpf_check_map_lookup(const rbpf_application_t *rbpf, const _value_t *regs)
+{
+    const rbpf_map_list_t *maps = rbpf_application_maps(rbpf);
+
+    if (!maps || regs[1].min < 0 || (uint32_t)regs[1].min >= maps->len) {
+        return false;
+    }
+    return !_value_const(&regs[2]) ||
+           (regs[2].min >= 0 && (uint32_t)regs[2].min < maps->maps[regs[1].min].max_entries);
+}
+#endif
+
+static int _rbpf_check_helpers(const rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+    uint16_t written = 0;
+    int64_t fp_min = RBPF_STACK_SIZE;
+    bool known = false;
+
+    for (size_t call = 0; call < num_instructions; call++) {
+        const bpf_instruction_t *instr = &text[call];
+        const rbpf_helper_t *helper;
+        _value_t regs[11];
+
+        if (instr->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+            call++;
+            continue;
+        }
+        if (instr->opcode != BPF_INSTRUCTION_CALL || _rbpf_is_local_call(instr) ||
+            !(helper = rbpf_get_helper(instr->immediate))) {
+            continue;
+        }
+        if (!known) {
+            written = _value_written(rbpf, text, num_instructions, &fp_min);
+            known = true;
+        }
+
+        _rbpf_call_values(rbpf, text, num_instructions, call, written, fp_min, regs);
+        if (!_rbpf_check_arguments(rbpf, helper, regs)) {
+            return RBPF_ILLEGAL_CALL;
+        }
+#if (RBPF_ENABLE_MAPS)
+        if (instr->immediate == BPF_FUNC_BPF_MAP_LOOKUP && !_rbpf_check_map_lookup(rbpf, regs)) {
+            return RBPF_ILLEGAL_CALL;
+        }
+#endif
+    }
+    return RBPF_OK;
+}
+
+#if (RBPF_ENABLE_MAPS) && (RBPF_ENABLE_LOWERING)
+/* The map lookups with constant arguments always return the same element,
+ * its address is loaded in r0 instead of calling the helper */
+static void _rbpf_lower_maps(rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+    uint16_t written = 0;
+    int64_t fp_min = RBPF_STACK_SIZE;
+    bool known = false;
+
+    for (size_t call = 0; call < num_instructions; call++) {
+        const bpf_instruction_t *instr = &text[call];
+        rbpf_insn_t *insn = &rbpf->lowered[call];
+        const uint8_t *element;
+        _value_t regs[11];
+
+        if (instr->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+            instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+            call++;
+            continue;
+        }
+        if (instr->opcode != BPF_INSTRUCTION_CALL || _rbpf_is_local_call(instr) ||
+            instr->immediate != BPF_FUNC_BPF_MAP_LOOKUP) {
+            continue;
+        }
+        if (!known) {
+            written = _value_written(rbpf, text, num_instructions, &fp_min);
+            known = true;
+        }
+
+        _rbpf_call_values(rbpf, text, num_instructions, call, written, fp_min, regs);
+        element = _value_map_element(rbpf, regs, instr);
+        if (!element) {
+            continue;
+        }
+        insn->opcode = BPF_INSTRUCTION_ALU64_MOV_IMM;
+#if (RBPF_ENABLE_REG32)
+        if (rbpf->flags & RBPF_FLAG_REG32) {
+            insn->dst32 = &rbpf_engine_registers(rbpf)->regmap32[0];
+        }
+        else
+#endif
+        {
+            insn->dst = &rbpf_engine_registers(rbpf)->regmap[0];
+        }
+        insn->immediate = (intptr_t)element;
+    }
+}
+#endif
+
+#if (RBPF_ENABLE_NARROWING) && (RBPF_ENABLE_LOWERING)
+/*
+ * Narrowing
+ *
+ * A pass over the text follows the width of every register, the number of
+ * bits its value fits in, 64 when unknown. All the branch targets share a
+ * single state, the widest value of every register reaching any of them, and
+ * the pass is repeated until that state is stable. A last pass rewrites the 64
+ * bit operations and jumps of the pre-decoded form whose operands and result
+ * fit in 32 bits into their 32 bit counterparts, which give the same result.
+ * The functions locally called are branch targets of their calls.
+ */
+static unsigned _width_of(uint64_t value)
+{
+    unsigned width = 0;
+
+    for (; value; value >>= 1) {
+        width++;
+    }
+    return width;
+}
+
+static unsigned _width_min(unsigned a, unsigned b)
+{
+    return a < b ? a : b;
+}
+
+static unsigned _width_max(unsigned a, unsigned b)
+{
+    return a > b ? a : b;
+}
+
+/* Width of the source operand, the immediates of the 64 bit instructions are
+ * sign extended */
+static unsigned _width_src(const uint8_t *widths, const bpf_instruction_t *i)
+{
+    if (i->opcode & BPF_INSTRUCTION_ALU_S_MASK) {
+        return widths[i->src];
+    }
+    if ((i->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_ALU32) {
+        return _width_of((uint32_t)i->immediate);
+    }
+    return i->immediate < 0 ? 64 : _width_of(i->immediate);
+}
+
+/* Width of the result of an ALU instruction */
+static unsigned _width_alu(const uint8_t *widths, const bpf_instruction_t *i)
+{
+    bool alu32 = (i->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_ALU32;
+    unsigned limit = alu32 ? 32 : 64;
+    unsigned d = _width_min(widths[i->dst], limit);
+    unsigned s = _width_min(_width_src(widths, i), limit);
+    bool shift = !(i->opcode & BPF_INSTRUCTION_ALU_S_MASK) &&
+                 (uint32_t)i->immediate < limit;
+    unsigned w;
+
+    /* The signed divisions and sign extending moves */
+    if (i->offset) {
+        return limit;
+    }
+
+    switch (i->opcode & BPF_INSTRUCTION_ALU_OP_MASK) {
+    case BPF_INSTRUCTION_ALU_MOV:
+        w = s;
+        break;
+    case BPF_INSTRUCTION_ALU_ADD:
+        w = _width_max(d, s) + 1;
+        break;
+    case BPF_INSTRUCTION_ALU_MUL:
+        w = d + s;
+        break;
+    case BPF_INSTRUCTION_ALU_DIV:
+        w = d;
+        break;
+    case BPF_INSTRUCTION_ALU_MOD:
+    case BPF_INSTRUCTION_ALU_AND:
+        w = _width_min(d, s);
+        break;
+    case BPF_INSTRUCTION_ALU_OR:
+    case BPF_INSTRUCTION_ALU_XOR:
+        w = _width_max(d, s);
+        break;
+    case BPF_INSTRUCTION_ALU_LSH:
+        w = shift ? d + i->immediate : (d ? 64 : 0);
+        break;
+    case BPF_INSTRUCTION_ALU_RSH:
+        w = shift ? d - _width_min(d, i->immediate) : d;
+        break;
+    case BPF_INSTRUCTION_ALU_ARSH:
+        /* A logical shift while the sign bit is clear, the 32 bit results
+         * are zero extended as the one of the negation */
+        if (d < limit) {
+            w = shift ? d - _width_min(d, i->immediate) : d;
+            break;
+        }
+        w = limit;
+        break;
+    case BPF_INSTRUCTION_ALU_NEG:
+        w = limit;
+        break;
+    case BPF_INSTRUCTION_ALU_BYTESWAP:
+        /* The lower bits given by the immediate, up to 64 in both classes */
+        if (i->opcode == BPF_INSTRUCTION_ALU32_END_LE && i->immediate == 64) {
+            return widths[i->dst];
+        }
+        return i->immediate;
+    default:
+        w = 64;
+    }
+    return _width_min(w, limit);
+}
+
+/* A 64 bit operation gives the same result as its 32 bit counterpart when
+ * the operands and the result fit in 32 bits, shifts by less than 32, and
+ * when a single operand of a bitwise and fits */
+static bool _narrow_alu(const uint8_t *widths, const bpf_instruction_t *i, unsigned w)
+{
+    unsigned s = _width_src(widths, i);
+
+    if (i->offset) {
+        return false;
+    }
+    if ((i->opcode & BPF_INSTRUCTION_ALU_OP_MASK) == BPF_INSTRUCTION_ALU_AND) {
+        return w <= 32;
+    }
+    if (widths[i->dst] > 32 || s > 32 || w > 32) {
+        return false;
+    }
+    switch (i->opcode & BPF_INSTRUCTION_ALU_OP_MASK) {
+    case BPF_INSTRUCTION_ALU_ADD:
+    case BPF_INSTRUCTION_ALU_MUL:
+    case BPF_INSTRUCTION_ALU_DIV:
+    case BPF_INSTRUCTION_ALU_MOD:
+    case BPF_INSTRUCTION_ALU_OR:
+    case BPF_INSTRUCTION_ALU_XOR:
+        return true;
+    case BPF_INSTRUCTION_ALU_LSH:
+    case BPF_INSTRUCTION_ALU_RSH:
+        return s <= 5;
+    default:
+        return false;
+    }
+}
+
+/* The 32 bit jump comparing the lower half of the registers as a 64 bit jump
+ * with operands fitting in 32 bits, 0 when there is none. The signed
+ * comparisons of such operands are unsigned ones. */
+static uint8_t _narrow_jump(const uint8_t *widths, const bpf_instruction_t *i)
+{
+    uint8_t op = i->opcode & BPF_INSTRUCTION_ALU_OP_MASK;
+
+    if (widths[i->dst] > 32 || _width_src(widths, i) > 32) {
+        return 0;
+    }
+    switch (op) {
+    case BPF_INSTRUCTION_BRANCH_JSGT:
+        op = BPF_INSTRUCTION_BRANCH_JGT;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JSGE:
+        op = BPF_INSTRUCTION_BRANCH_JGE;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JSLT:
+        op = BPF_INSTRUCTION_BRANCH_JLT;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JSLE:
+        op = BPF_INSTRUCTION_BRANCH_JLE;
+        break;
+    case BPF_INSTRUCTION_BRANCH_JA:
+    case BPF_INSTRUCTION_BRANCH_CALL:
+    case BPF_INSTRUCTION_BRANCH_EXIT:
+        return 0;
+    }
+    return op | (i->opcode & BPF_INSTRUCTION_ALU_S_MASK) | BPF_INSTRUCTION_CLS_JMP32;
+}
+
+/* Widen the state shared by the branch targets, true when it changed */
+static bool _width_join(uint8_t *join, const uint8_t *widths)
+{
+    bool changed = false;
+
+    for (unsigned reg = 0; reg < 11; reg++) {
+        if (widths[reg] > join[reg]) {
+            join[reg] = widths[reg];
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/* One pass over the text, rewriting the pre-decoded form on the last one */
+static bool _rbpf_narrow_pass(rbpf_application_t *rbpf, uint8_t *join, bool rewrite)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+    uint8_t widths[11] = { 0 };
+    bool changed = false;
+    bool reached = true;
+
+    widths[1] = widths[10] = 8 * sizeof(uintptr_t);
+
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        rbpf_insn_t *insn = &rbpf->lowered[i];
+        uint8_t cls = instr->opcode & BPF_INSTRUCTION_CLS_MASK;
+
+        if (insn->branch_target) {
+            if (reached) {
+                changed |= _width_join(join, widths);
+            }
+            for (unsigned reg = 0; reg < 11; reg++) {
+                widths[reg] = join[reg];
+            }
+        }
+        reached = true;
+
+        switch (cls) {
+        case BPF_INSTRUCTION_CLS_ALU32:
+        case BPF_INSTRUCTION_CLS_ALU64:
+        {
+            unsigned w = _width_alu(widths, instr);
+#if (RBPF_ENABLE_ALU32)
+            if (rewrite && cls == BPF_INSTRUCTION_CLS_ALU64 && _narrow_alu(widths, instr, w)) {
+                insn->opcode = (instr->opcode & ~BPF_INSTRUCTION_CLS_MASK) |
+                               BPF_INSTRUCTION_CLS_ALU32;
+            }
+#endif
+            widths[instr->dst] = w;
+            break;
+        }
+        case BPF_INSTRUCTION_CLS_LD:
+            widths[instr->dst] = instr->opcode == BPF_INSTRUCTION_MEM_LDDW ?
+                                 _width_of(insn->immediate) : 64;
+            /* Skip the second half of the double word loads, never executed */
+            if (instr->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+                instr->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+                instr->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+                i++;
+            }
+            break;
+        case BPF_INSTRUCTION_CLS_LDX:
+        {
+            unsigned size_op = instr->opcode & BPF_INSTRUCTION_MEM_SZ_MASK;
+            widths[instr->dst] = (instr->opcode & BPF_INSTRUCTION_MEM_MDE_MASK) ==
+                                 BPF_INSTRUCTION_LDX_MEMSX ? 64 :
+                                 (size_op == 0x00) ? 32 : (size_op == 0x08) ? 16 :
+                                 (size_op == 0x10) ? 8 : 64;
+            break;
+        }
+        case BPF_INSTRUCTION_CLS_STX:
+            /* The previous value of the memory fetched by the atomic operations */
+            if (_rbpf_is_atomic(instr->opcode) && _rbpf_atomic_fetch_reg(instr) >= 0) {
+                widths[_rbpf_atomic_fetch_reg(instr)] =
+                    instr->opcode == BPF_INSTRUCTION_MEM_ATOMICW ? 32 : 64;
+            }
+            break;
+        case BPF_INSTRUCTION_CLS_BRANCH:
+            if (_rbpf_is_local_call(instr)) {
+                /* The callee returns any value and clobbers r1 to r5 */
+                changed |= _width_join(join, widths);
+                for (unsigned reg = 0; reg < 6; reg++) {
+                    widths[reg] = 64;
+                }
+                break;
+            }
+            if (instr->opcode == BPF_INSTRUCTION_CALL) {
+                /* The functions return 64 bit values, the errors of the helpers
+                 * sign extended, and clobber r1 to r5 */
+                for (unsigned reg = 0; reg < 6; reg++) {
+                    widths[reg] = 64;
+                }
+                break;
+            }
+            if (instr->opcode == BPF_INSTRUCTION_RETURN) {
+                reached = false;
+                break;
+            }
+            if (rewrite && _narrow_jump(widths, instr)) {
+                insn->opcode = _narrow_jump(widths, instr);
+            }
+            changed |= _width_join(join, widths);
+            reached = instr->opcode != BPF_INSTRUCTION_JMP_ALWAYS;
+            break;
+        case BPF_INSTRUCTION_CLS_JMP32:
+            changed |= _width_join(join, widths);
+            reached = instr->opcode != BPF_INSTRUCTION_JMP32_ALWAYS;
+            break;
+        default:
+            break;
+        }
+    }
+    return changed;
+}
+
+static void _rbpf_narrow(rbpf_application_t *rbpf)
+{
+    uint8_t join[11] = { 0 };
+
+    join[1] = join[10] = 8 * sizeof(uintptr_t);
+    while (_rbpf_narrow_pass(rbpf, join, false)) {}
+    _rbpf_narrow_pass(rbpf, join, true);
+}
+#endif
+
+#if (RBPF_ENABLE_FUSION)
+/*
+ * Fusion
+ *
+ * The frequent sequences below are rewritten into a superinstruction on their
+ * first entry in the pre-decoded form, as long as no branch targets the
+ * following ones. The opcodes matched are the ones of the pre-decoded form,
+ * after the narrowing, the registers and immediates the ones of the text.
+ */
+static const char *const _fusion_names[RBPF_FUSION_NUM] = {
+    [RBPF_FUSION_LDX_ADD] = "ldx+add",
+    [RBPF_FUSION_LDX_OR] = "ldx+or",
+    [RBPF_FUSION_MOV_AND_RSH] = "mov+and+rsh",
+    [RBPF_FUSION_MOV_RSH] = "mov+rsh",
+    [RBPF_FUSION_ZEXT] = "mov+lsh+rsh",
+    [RBPF_FUSION_ZEXT_JMP] = "mov+lsh+rsh+jmp",
+    [RBPF_FUSION_ALU_JMP] = "alu+jmp",
+};
+
+const char *rbpf_fusion_name(unsigned fusion)
+{
+    return fusion < RBPF_FUSION_NUM ? _fusion_names[fusion] : NULL;
+}
+
+#if (RBPF_ENABLE_LOWERING)
+/* A 32 or 64 bit ALU instruction of the given operation */
+static bool _is_alu(uint8_t opcode, uint8_t op)
+{
+    uint8_t cls = opcode & BPF_INSTRUCTION_CLS_MASK;
+
+    return (cls == BPF_INSTRUCTION_CLS_ALU32 || cls == BPF_INSTRUCTION_CLS_ALU64) &&
+           (opcode & BPF_INSTRUCTION_ALU_OP_MASK) == op;
+}
+
+static bool _is_reg(uint8_t opcode)
+{
+    return opcode & BPF_INSTRUCTION_ALU_S_MASK;
+}
+
+static bool _is_alu32(uint8_t opcode)
+{
+    return (opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_ALU32;
+}
+
+/* Equality jump of a register fitting in 32 bits against an immediate, which
+ * the superinstructions compare on the lower half. 0 when there is none,
+ * BPF_INSTRUCTION_BRANCH_JEQ or BPF_INSTRUCTION_BRANCH_JNE otherwise. */
+static uint8_t _jump32(const rbpf_insn_t *insn, const bpf_instruction_t *i)
+{
+    switch (insn->opcode) {
+    case BPF_INSTRUCTION_JMP_EQ_IMM:
+    case BPF_INSTRUCTION_JMP_NE_IMM:
+        /* Sign extended, the immediate must be a 32 bit value */
+        if (i->immediate < 0) {
+            return 0;
+        }
+        return insn->opcode & BPF_INSTRUCTION_ALU_OP_MASK;
+    case BPF_INSTRUCTION_JMP32_EQ_IMM:
+    case BPF_INSTRUCTION_JMP32_NE_IMM:
+        return insn->opcode & BPF_INSTRUCTION_ALU_OP_MASK;
+    default:
+        return 0;
+    }
+}
+
+/* The len instructions are available and no branch targets the following ones */
+static bool _fusable(const rbpf_insn_t *insn, size_t left, size_t len)
+{
+    if (left < len) {
+        return false;
+    }
+    for (size_t k = 1; k < len; k++) {
+        if (insn[k].branch_target) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The superinstruction replacing the sequence starting with the instruction,
+ * 0 when there is none */
+static uint8_t _fused_opcode(const rbpf_insn_t *insn, const bpf_instruction_t *i, size_t left,
+                             unsigned *kind, size_t *len)
+{
+    static const uint8_t ldx[2][2][3] = {
+        {
+            { BPF_INSTRUCTION_FUSED_LDXB_ADD64, BPF_INSTRUCTION_FUSED_LDXH_ADD64,
+              BPF_INSTRUCTION_FUSED_LDXW_ADD64 },
+            { BPF_INSTRUCTION_FUSED_LDXB_ADD32, BPF_INSTRUCTION_FUSED_LDXH_ADD32,
+              BPF_INSTRUCTION_FUSED_LDXW_ADD32 },
+        },
+        {
+            { BPF_INSTRUCTION_FUSED_LDXB_OR64, BPF_INSTRUCTION_FUSED_LDXH_OR64,
+              BPF_INSTRUCTION_FUSED_LDXW_OR64 },
+            { BPF_INSTRUCTION_FUSED_LDXB_OR32, BPF_INSTRUCTION_FUSED_LDXH_OR32,
+              BPF_INSTRUCTION_FUSED_LDXW_OR32 },
+        },
+    };
+    uint8_t opcode = insn[0].opcode;
+    uint8_t jump;
+
+    /* Not the sign extending moves */
+    if (_is_alu(opcode, BPF_INSTRUCTION_ALU_MOV) && i[0].offset) {
+        return 0;
+    }
+
+    switch (opcode) {
+    case BPF_INSTRUCTION_MEM_LDXB:
+    case BPF_INSTRUCTION_MEM_LDXH:
+    case BPF_INSTRUCTION_MEM_LDXW:
+        /* Load, then addition or bitwise or of the loaded value */
+        if (_fusable(insn, left, 2) && _is_reg(insn[1].opcode) && i[1].src == i[0].dst &&
+            (_is_alu(insn[1].opcode, BPF_INSTRUCTION_ALU_ADD) ||
+             _is_alu(insn[1].opcode, BPF_INSTRUCTION_ALU_OR))) {
+            bool is_or = _is_alu(insn[1].opcode, BPF_INSTRUCTION_ALU_OR);
+            unsigned size = opcode == BPF_INSTRUCTION_MEM_LDXB ? 0 :
+                            opcode == BPF_INSTRUCTION_MEM_LDXH ? 1 : 2;
+            *kind = is_or ? RBPF_FUSION_LDX_OR : RBPF_FUSION_LDX_ADD;
+            *len = 2;
+            return ldx[is_or][_is_alu32(insn[1].opcode)][size];
+        }
+        return 0;
+    case BPF_INSTRUCTION_ALU64_MOV_REG:
+        /* Zero extension, optionally followed by an equality jump on it */
+        if (_fusable(insn, left, 3) &&
+            insn[1].opcode == BPF_INSTRUCTION_ALU64_LSH_IMM && i[1].dst == i[0].dst &&
+            i[1].immediate == 32 &&
+            insn[2].opcode == BPF_INSTRUCTION_ALU64_RSH_IMM && i[2].dst == i[0].dst &&
+            i[2].immediate == 32) {
+            if (_fusable(insn, left, 4) && i[3].dst == i[0].dst &&
+                (jump = _jump32(&insn[3], &i[3]))) {
+                *kind = RBPF_FUSION_ZEXT_JMP;
+                *len = 4;
+                return jump == BPF_INSTRUCTION_BRANCH_JEQ ? BPF_INSTRUCTION_FUSED_ZEXT_JEQ :
+                       BPF_INSTRUCTION_FUSED_ZEXT_JNE;
+            }
+            *kind = RBPF_FUSION_ZEXT;
+            *len = 3;
+            return BPF_INSTRUCTION_FUSED_ZEXT;
+        }
+        /* fall through */
+    case BPF_INSTRUCTION_ALU32_MOV_REG:
+    {
+        /* Bit field extraction, with any 32 bit instruction the result is the
+         * one of the 32 bit instructions, as long as the shift is below 32 */
+        bool alu64 = !_is_alu32(opcode);
+        if (_fusable(insn, left, 3) &&
+            _is_alu(insn[1].opcode, BPF_INSTRUCTION_ALU_AND) && i[1].dst == i[0].dst &&
+            _is_alu(insn[2].opcode, BPF_INSTRUCTION_ALU_RSH) && !_is_reg(insn[2].opcode) &&
+            i[2].dst == i[0].dst) {
+            bool reg = _is_reg(insn[1].opcode);
+            alu64 = alu64 && !_is_alu32(insn[1].opcode) && !_is_alu32(insn[2].opcode);
+            if (alu64 || (uint32_t)i[2].immediate < 32) {
+                *kind = RBPF_FUSION_MOV_AND_RSH;
+                *len = 3;
+                return alu64 ? (reg ? BPF_INSTRUCTION_FUSED_MOV_AND_RSH64_REG :
+                                BPF_INSTRUCTION_FUSED_MOV_AND_RSH64_IMM) :
+                       (reg ? BPF_INSTRUCTION_FUSED_MOV_AND_RSH32_REG :
+                        BPF_INSTRUCTION_FUSED_MOV_AND_RSH32_IMM);
+            }
+            return 0;
+        }
+        if (_fusable(insn, left, 2) && _is_alu(insn[1].opcode, BPF_INSTRUCTION_ALU_RSH) &&
+            !_is_reg(insn[1].opcode) && i[1].dst == i[0].dst) {
+            alu64 = alu64 && !_is_alu32(insn[1].opcode);
+            if (alu64 || (uint32_t)i[1].immediate < 32) {
+                *kind = RBPF_FUSION_MOV_RSH;
+                *len = 2;
+                return alu64 ? BPF_INSTRUCTION_FUSED_MOV_RSH64 : BPF_INSTRUCTION_FUSED_MOV_RSH32;
+            }
+        }
+        return 0;
+    }
+    case BPF_INSTRUCTION_ALU64_ADD_IMM:
+    case BPF_INSTRUCTION_ALU64_AND_IMM:
+        /* Operation with an immediate, then equality jump on the result */
+        if (_fusable(insn, left, 2) && i[1].dst == i[0].dst &&
+            (insn[1].opcode == BPF_INSTRUCTION_JMP_EQ_IMM ||
+             insn[1].opcode == BPF_INSTRUCTION_JMP_NE_IMM)) {
+            bool eq = insn[1].opcode == BPF_INSTRUCTION_JMP_EQ_IMM;
+            *kind = RBPF_FUSION_ALU_JMP;
+            *len = 2;
+            if (opcode == BPF_INSTRUCTION_ALU64_ADD_IMM) {
+                return eq ? BPF_INSTRUCTION_FUSED_ADD64_JEQ : BPF_INSTRUCTION_FUSED_ADD64_JNE;
+            }
+            return eq ? BPF_INSTRUCTION_FUSED_AND64_JEQ : BPF_INSTRUCTION_FUSED_AND64_JNE;
+        }
+        return 0;
+    case BPF_INSTRUCTION_ALU32_ADD_IMM:
+    case BPF_INSTRUCTION_ALU32_AND_IMM:
+        /* The result fits in 32 bits, the jump compares the lower half */
+        if (_fusable(insn, left, 2) && i[1].dst == i[0].dst &&
+            (jump = _jump32(&insn[1], &i[1]))) {
+            bool eq = jump == BPF_INSTRUCTION_BRANCH_JEQ;
+            *kind = RBPF_FUSION_ALU_JMP;
+            *len = 2;
+            if (opcode == BPF_INSTRUCTION_ALU32_ADD_IMM) {
+                return eq ? BPF_INSTRUCTION_FUSED_ADD32_JEQ : BPF_INSTRUCTION_FUSED_ADD32_JNE;
+            }
+            return eq ? BPF_INSTRUCTION_FUSED_AND32_JEQ : BPF_INSTRUCTION_FUSED_AND32_JNE;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+static void _rbpf_fuse(rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+
+    for (unsigned kind = 0; kind < RBPF_FUSION_NUM; kind++) {
+        rbpf->fusions[kind] = 0;
+    }
+
+    for (size_t i = 0; i < num_instructions; i++) {
+        rbpf_insn_t *insn = &rbpf->lowered[i];
+        unsigned kind;
+        size_t len;
+        uint8_t opcode = _fused_opcode(insn, &text[i], num_instructions - i, &kind, &len);
+
+        if (opcode) {
+            insn->opcode = opcode;
+            rbpf->fusions[kind]++;
+            /* The following instructions are only read for their operands */
+            i += len - 1;
+        }
+        else if (insn->opcode == BPF_INSTRUCTION_MEM_LDDW ||
+                 insn->opcode == BPF_INSTRUCTION_MEM_LDDWD ||
+                 insn->opcode == BPF_INSTRUCTION_MEM_LDDWR) {
+            /* Skip the second half of the double word loads, never executed */
+            i++;
+        }
+    }
+}
+#endif
+#endif
+
+#if (RBPF_ENABLE_LOWERING) && ((RBPF_ENABLE_BOUNDED_LOOPS) || \
+    ((RBPF_ENABLE_MEMORY_PROOF) && !(RBPF_ENABLE_MASKING) && !(RBPF_ENABLE_MPU)))
+/* The loops of the text, for the bounded loops and the loop guards */
+
+/* The instruction a jump or a local call moves to */
+static bool _loop_dest(const bpf_instruction_t *instr, size_t i, size_t *dest)
+{
+    if (_rbpf_is_jump(instr->opcode)) {
+        *dest = i + 1 + bpf_instruction_jump_offset(instr);
+        return true;
+    }
+    if (_rbpf_is_local_call(instr)) {
+        *dest = i + 1 + instr->immediate;
+        return true;
+    }
+    return false;
+}
+
+/* Whether an instruction writes the register */
+static bool _loop_writes(const bpf_instruction_t *instr, unsigned reg)
+{
+    uint8_t cls = instr->opcode & BPF_INSTRUCTION_CLS_MASK;
+
+    if (instr->opcode == BPF_INSTRUCTION_CALL) {
+        /* The local calls restore r6 to r9 on return */
+        return reg <= 5;
+    }
+    if (cls == BPF_INSTRUCTION_CLS_BRANCH || cls == BPF_INSTRUCTION_CLS_JMP32 ||
+        cls == BPF_INSTRUCTION_CLS_ST) {
+        return false;
+    }
+    if (cls == BPF_INSTRUCTION_CLS_STX) {
+        return _rbpf_is_atomic(instr->opcode) && _rbpf_atomic_fetch_reg(instr) == (int)reg;
+    }
+    return instr->dst == reg;
+}
+
+/* The addition or subtraction of an immediate */
+static bool _loop_step(const bpf_instruction_t *instr)
+{
+    uint8_t cls = instr->opcode & BPF_INSTRUCTION_CLS_MASK;
+    uint8_t op = instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK;
+
+    return (cls == BPF_INSTRUCTION_CLS_ALU32 || cls == BPF_INSTRUCTION_CLS_ALU64) &&
+           !(instr->opcode & BPF_INSTRUCTION_ALU_S_MASK) && !instr->offset &&
+           (op == BPF_INSTRUCTION_ALU_ADD || op == BPF_INSTRUCTION_ALU_SUB);
+}
+#endif
+
+#if (RBPF_ENABLE_BOUNDED_LOOPS) && (RBPF_ENABLE_LOWERING)
+/*
+ * Bounded loops
+ *
+ * The backward jumps and the local calls charge the budget of a run with the
+ * offset of their entry in the pre-decoded form. A loop runs a known number of
+ * iterations when its only backward jump, at its end, compares a register with
+ * an immediate, the register changes by the addition of an immediate once on
+ * every iteration and nowhere else in the loop, and is constant when the loop
+ * is entered, or within a range for a step of one, the most iterations of the
+ * range being charged. The register is followed to the loop through the joins
+ * of a couple of levels of branch targets, so that a bound picked by a
+ * conditional jump, such as min(words, 359) in fletcher32, is known. The
+ * backward jump then charges nothing and the iterations are charged once, by
+ * every way into the loop: the jumps to its first instruction, and the jumps,
+ * the local calls and the start of the run into the straight-line code
+ * falling through to it. The loops left before their end, by a jump out or a
+ * return, the loops entered by the fall through of a conditional jump and the
+ * ones a function of the application starts in keep charging every
+ * iteration, as the iterations they run aren't known.
+ */
+typedef struct {
+    size_t chain;       /* Start of the straight-line code falling through to the loop */
+    size_t head;        /* First instruction of the loop */
+    size_t back;        /* Backward jump ending the loop */
+    size_t step;        /* Addition to the register the backward jump compares */
+    uint32_t trips;     /* Iterations when falling through to the loop */
+} _loop_t;
+
+/* A conditional jump comparing a register with an immediate */
+static bool _loop_compare(const bpf_instruction_t *instr)
+{
+    if (!_rbpf_is_jump(instr->opcode) || (instr->opcode & BPF_INSTRUCTION_ALU_S_MASK)) {
+        return false;
+    }
+    switch (instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK) {
+    case BPF_INSTRUCTION_BRANCH_JEQ:
+    case BPF_INSTRUCTION_BRANCH_JGT:
+    case BPF_INSTRUCTION_BRANCH_JGE:
+    case BPF_INSTRUCTION_BRANCH_JLT:
+    case BPF_INSTRUCTION_BRANCH_JLE:
+    case BPF_INSTRUCTION_BRANCH_JSET:
+    case BPF_INSTRUCTION_BRANCH_JNE:
+    case BPF_INSTRUCTION_BRANCH_JSGT:
+    case BPF_INSTRUCTION_BRANCH_JSGE:
+    case BPF_INSTRUCTION_BRANCH_JSLT:
+    case BPF_INSTRUCTION_BRANCH_JSLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Whether the comparison of the register value takes the jump */
+static bool _loop_taken(const bpf_instruction_t *instr, uint64_t value)
+{
+    bool wide = (instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_BRANCH;
+    uint64_t u = wide ? value : (uint32_t)value;
+    uint64_t k = wide ? (uint64_t)(int64_t)instr->immediate : (uint32_t)instr->immediate;
+    int64_t s = wide ? (int64_t)value : (int32_t)value;
+
+    switch (instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK) {
+    case BPF_INSTRUCTION_BRANCH_JEQ: return u == k;
+    case BPF_INSTRUCTION_BRANCH_JGT: return u > k;
+    case BPF_INSTRUCTION_BRANCH_JGE: return u >= k;
+    case BPF_INSTRUCTION_BRANCH_JLT: return u < k;
+    case BPF_INSTRUCTION_BRANCH_JLE: return u <= k;
+    case BPF_INSTRUCTION_BRANCH_JSET: return u & k;
+    case BPF_INSTRUCTION_BRANCH_JNE: return u != k;
+    case BPF_INSTRUCTION_BRANCH_JSGT: return s > instr->immediate;
+    case BPF_INSTRUCTION_BRANCH_JSGE: return s >= instr->immediate;
+    case BPF_INSTRUCTION_BRANCH_JSLT: return s < instr->immediate;
+    default: return s <= instr->immediate;
+    }
+}
+
+/* The iterations of the loop from the register value at its entry, false when
+ * above the limit */
+static bool _loop_run(const bpf_instruction_t *text, const _loop_t *loop, uint64_t value,
+                      uint32_t limit, uint32_t *trips)
+{
+    const bpf_instruction_t *step = &text[loop->step];
+    uint64_t add = (uint64_t)(int64_t)step->immediate;
+    uint32_t n = 0;
+
+    if ((step->opcode & BPF_INSTRUCTION_ALU_OP_MASK) == BPF_INSTRUCTION_ALU_SUB) {
+        add = -add;
+    }
+    for (;;) {
+        value += add;
+        if ((step->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_ALU32) {
+            value = (uint32_t)value;
+        }
+        if (!_loop_taken(&text[loop->back], value)) {
+            *trips = n;
+            return true;
+        }
+        if (++n > limit) {
+            return false;
+        }
+    }
+}
+
+/* The most iterations of the loop from a register within a range at its
+ * entry, false when above the limit. The loop is run from one end of a range,
+ * a step of one then moves the entry by one value at a time: the loop entered
+ * one step further back runs once more when the value it steps to takes the
+ * backward jump, and not at all otherwise. */
+static bool _loop_trips(const bpf_instruction_t *text, const _loop_t *loop, const _value_t *v,
+                        uint32_t limit, uint32_t *trips)
+{
+    const bpf_instruction_t *step = &text[loop->step];
+    bool alu32 = (step->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_ALU32;
+    int64_t add = step->immediate;
+    int64_t first;
+    int64_t last;
+    uint32_t n;
+
+    if ((step->opcode & BPF_INSTRUCTION_ALU_OP_MASK) == BPF_INSTRUCTION_ALU_SUB) {
+        add = -add;
+    }
+    if (v->kind == _VALUE_SCALAR) {
+        first = add < 0 ? v->min : v->max;
+        last = add < 0 ? v->max : v->min;
+    }
+    else if (v->kind == _VALUE_SCALAR32 && alu32) {
+        /* The step only reads the lower half */
+        first = add < 0 ? (uint32_t)v->min : (uint32_t)v->max;
+        last = add < 0 ? (uint32_t)v->max : (uint32_t)v->min;
+    }
+    else {
+        return false;
+    }
+    if ((last - first) * -add < 0 ||
+        (first != last && ((add != 1 && add != -1) || (last - first) * -add > limit))) {
+        return false;
+    }
+
+    if (!_loop_run(text, loop, (uint64_t)first, limit, &n)) {
+        return false;
+    }
+    *trips = n;
+    for (int64_t entry = first; entry != last; entry -= add) {
+        n = _loop_taken(&text[loop->back], alu32 ? (uint32_t)entry : (uint64_t)entry) ? n + 1 : 0;
+        if (n > limit) {
+            return false;
+        }
+        if (n > *trips) {
+            *trips = n;
+        }
+    }
+    return true;
+}
+
+/* The body of the loop ending with the backward jump, false when it holds
+ * another backward jump or a way out but its end, or when the register the
+ * backward jump compares isn't changed by a single step run on every
+ * iteration */
+static bool _loop_body(const bpf_instruction_t *text, _loop_t *loop)
+{
+    unsigned reg = text[loop->back].dst;
+    bool found = false;
+
+    for (size_t i = loop->head; i < loop->back; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        size_t dest;
+
+        if (instr->opcode == BPF_INSTRUCTION_RETURN) {
+            return false;
+        }
+        if (_rbpf_is_jump(instr->opcode) && _loop_dest(instr, i, &dest) &&
+            (dest <= i || dest > loop->back)) {
+            return false;
+        }
+        if (_loop_writes(instr, reg)) {
+            if (found || !_loop_step(instr)) {
+                return false;
+            }
+            loop->step = i;
+            found = true;
+        }
+        if ((instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+
+    /* No jump skips the step */
+    for (size_t i = loop->head; i < loop->step; i++) {
+        size_t dest;
+
+        if (_rbpf_is_jump(text[i].opcode) && _loop_dest(&text[i], i, &dest) &&
+            dest > loop->step) {
+            return false;
+        }
+        if ((text[i].opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+    return true;
+}
+
+/* The straight-line code falling through to the loop, from the last jump or
+ * return before it, false when that is a conditional jump */
+static bool _loop_chain(const bpf_instruction_t *text, _loop_t *loop)
+{
+    const bpf_instruction_t *last = NULL;
+
+    loop->chain = 0;
+    for (size_t i = 0; i < loop->head; i++) {
+        if (_rbpf_is_jump(text[i].opcode) || text[i].opcode == BPF_INSTRUCTION_RETURN) {
+            last = &text[i];
+            loop->chain = i + 1;
+        }
+        if ((text[i].opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+    return !last || last->opcode == BPF_INSTRUCTION_RETURN ||
+           last->opcode == BPF_INSTRUCTION_JMP_ALWAYS ||
+           last->opcode == BPF_INSTRUCTION_JMP32_ALWAYS;
+}
+
+/* Whether a function of the application, but the first one, starts in the
+ * loop or the straight-line code falling through to it */
+static bool _loop_started(const rbpf_application_t *rbpf, const _loop_t *loop)
+{
+    for (size_t i = 0; i < rbpf_header(rbpf)->functions; i++) {
+        size_t slot = _rbpf_function_slot(rbpf, i);
+
+        if (slot && slot >= loop->chain && slot <= loop->back) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The levels of branch targets joined when following the registers to a way
+ * into a loop */
+#define _LOOP_DEPTH (2)
+
+/* Join the registers of another way into an instruction */
+static void _loop_join(_value_t *regs, const _value_t *other)
+{
+    for (unsigned reg = 0; reg < 11; reg++) {
+        _value_t *v = &regs[reg];
+        const _value_t *o = &other[reg];
+        uint32_t min, max, other_min, other_max;
+
+        if (v->kind == o->kind && v->kind != _VALUE_UNKNOWN && v->kind != _VALUE_SCALAR32) {
+            _value_set(v, v->kind, v->min < o->min ? v->min : o->min,
+                       v->max > o->max ? v->max : o->max);
+        }
+        else if ((v->kind == _VALUE_SCALAR32 || o->kind == _VALUE_SCALAR32) &&
+                 _value_low(v, &min, &max) && _value_low(o, &other_min, &other_max)) {
+            _value_set32(v, min < other_min ? min : other_min, max > other_max ? max : other_max);
+        }
+        else {
+            v->kind = _VALUE_UNKNOWN;
+        }
+    }
+}
+
+/* The comparison found false on the taken side of a conditional jump */
+static uint8_t _loop_taken_op(uint8_t op)
+{
+    switch (op) {
+    case BPF_INSTRUCTION_BRANCH_JEQ: return BPF_INSTRUCTION_BRANCH_JNE;
+    case BPF_INSTRUCTION_BRANCH_JNE: return BPF_INSTRUCTION_BRANCH_JEQ;
+    case BPF_INSTRUCTION_BRANCH_JGT: return BPF_INSTRUCTION_BRANCH_JLE;
+    case BPF_INSTRUCTION_BRANCH_JLE: return BPF_INSTRUCTION_BRANCH_JGT;
+    case BPF_INSTRUCTION_BRANCH_JGE: return BPF_INSTRUCTION_BRANCH_JLT;
+    case BPF_INSTRUCTION_BRANCH_JLT: return BPF_INSTRUCTION_BRANCH_JGE;
+    case BPF_INSTRUCTION_BRANCH_JSGT: return BPF_INSTRUCTION_BRANCH_JSLE;
+    case BPF_INSTRUCTION_BRANCH_JSLE: return BPF_INSTRUCTION_BRANCH_JSGT;
+    case BPF_INSTRUCTION_BRANCH_JSGE: return BPF_INSTRUCTION_BRANCH_JSLT;
+    case BPF_INSTRUCTION_BRANCH_JSLT: return BPF_INSTRUCTION_BRANCH_JSGE;
+    default: return BPF_INSTRUCTION_BRANCH_JSET;
+    }
+}
+
+/* Narrow the registers to the taken side of a jump */
+static void _loop_jump_values(_value_t *regs, const bpf_instruction_t *instr)
+{
+    uint8_t op = _loop_taken_op(instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK);
+
+    if ((instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_JMP32) {
+        _value_branch32(regs, instr, op);
+    }
+    else {
+        _value_branch(regs, instr, op);
+    }
+}
+
+/* Whether only the jumps and the fall through lead to the branch target */
+static bool _loop_joinable(const rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                           size_t num_instructions, size_t slot)
+{
+    for (size_t i = 0; i < num_instructions; i++) {
+        if (_rbpf_is_local_call(&text[i]) && i + 1 + text[i].immediate == slot) {
+            return false;
+        }
+        if ((text[i].opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < rbpf_header(rbpf)->functions; i++) {
+        if (slot && _rbpf_function_slot(rbpf, i) == slot) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _loop_values(const rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                         size_t num_instructions, size_t slot, unsigned depth,
+                         uint16_t written, int64_t fp_min, _value_t *regs);
+
+/* The registers falling through to the slot from the straight-line code
+ * before it, false when nothing falls through */
+static bool _loop_fall(const rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                       size_t num_instructions, size_t slot, unsigned depth,
+                       uint16_t written, int64_t fp_min, _value_t *regs)
+{
+    bool target;
+    size_t i;
+
+    if (!slot) {
+        return false;
+    }
+    i = _rbpf_last_target(rbpf, text, num_instructions, slot - 1, &target);
+    if (target) {
+        _loop_values(rbpf, text, num_instructions, i, depth, written, fp_min, regs);
+    }
+    else {
+        for (unsigned reg = 0; reg < 11; reg++) {
+            _value_entry(&regs[reg], reg, RBPF_STACK_SIZE);
+        }
+    }
+    for (; i < slot; i++) {
+        const bpf_instruction_t *instr = &text[i];
+
+        if (instr->opcode == BPF_INSTRUCTION_RETURN ||
+            instr->opcode == BPF_INSTRUCTION_JMP_ALWAYS ||
+            instr->opcode == BPF_INSTRUCTION_JMP32_ALWAYS) {
+            return false;
+        }
+        _value_instruction(rbpf, regs, instr, text + num_instructions);
+        if ((instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+    return true;
+}
+
+/* The registers before the slot. They are the ones of the straight-line code
+ * from the last branch target, taken as forgotten when the depth is zero.
+ * Above, the registers at a branch target only led to by jumps and the fall
+ * through are joined over these ways in, one level less deep, each jump
+ * narrowing them by its comparison. */
+static void _loop_values(const rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                         size_t num_instructions, size_t slot, unsigned depth,
+                         uint16_t written, int64_t fp_min, _value_t *regs)
+{
+    _value_t other[11];
+    bool target;
+    bool reached;
+
+    if (_rbpf_last_target(rbpf, text, num_instructions, slot, &target) != slot || !target) {
+        if (!_loop_fall(rbpf, text, num_instructions, slot, depth, written, fp_min, regs)) {
+            _value_target(regs, written, fp_min);
+        }
+        return;
+    }
+    if (!depth || !_loop_joinable(rbpf, text, num_instructions, slot)) {
+        _value_target(regs, written, fp_min);
+        return;
+    }
+
+    reached = _loop_fall(rbpf, text, num_instructions, slot, depth - 1, written, fp_min, regs);
+    if (!slot) {
+        /* The start of the run */
+        for (unsigned reg = 0; reg < 11; reg++) {
+            _value_entry(&regs[reg], reg, RBPF_STACK_SIZE);
+        }
+        reached = true;
+    }
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        size_t dest;
+
+        if (_rbpf_is_jump(instr->opcode) && _loop_dest(instr, i, &dest) && dest == slot) {
+            _loop_values(rbpf, text, num_instructions, i, depth - 1, written, fp_min,
+                         reached ? other : regs);
+            _loop_jump_values(reached ? other : regs, instr);
+            if (reached) {
+                _loop_join(regs, other);
+            }
+            reached = true;
+        }
+        if ((instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+    if (!reached) {
+        _value_target(regs, written, fp_min);
+    }
+}
+
+/* Charge the iterations to the jumps and the local calls into the loop, or
+ * only check that they can be charged. False when a jump or a call lands
+ * within the loop, when the register is unknown at a jump to the loop or when
+ * a charge overflows. */
+static bool _loop_entries(rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                          size_t num_instructions, const _loop_t *loop, uint32_t limit,
+                          uint16_t written, int64_t fp_min, bool apply)
+{
+    unsigned reg = text[loop->back].dst;
+
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        uint32_t trips = loop->trips;
+        size_t dest;
+
+        if ((instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+            continue;
+        }
+        if ((i >= loop->chain && i <= loop->back) || !_loop_dest(instr, i, &dest) ||
+            dest < loop->chain || dest > loop->back) {
+            continue;
+        }
+        if (dest > loop->head) {
+            return false;
+        }
+        if (dest == loop->head) {
+            _value_t regs[11];
+
+            if (!_rbpf_is_jump(instr->opcode)) {
+                return false;
+            }
+            _loop_values(rbpf, text, num_instructions, i, _LOOP_DEPTH, written, fp_min, regs);
+            _loop_jump_values(regs, instr);
+            if (!_loop_trips(text, loop, &regs[reg], limit, &trips)) {
+                return false;
+            }
+        }
+        if (rbpf->lowered[i].offset + trips > INT16_MAX) {
+            return false;
+        }
+        if (apply) {
+            rbpf->lowered[i].offset += trips;
+        }
+    }
+    return true;
+}
+
+static void _rbpf_bound_loops(rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+    uint32_t limit = RBPF_BRANCHES_ALLOWED < INT16_MAX ? RBPF_BRANCHES_ALLOWED : INT16_MAX;
+    uint16_t written = 0;
+    int64_t fp_min = RBPF_STACK_SIZE;
+    bool known = false;
+
+    rbpf->loop_charge = 0;
+    rbpf->loops = 0;
+#if (RBPF_ENABLE_REG32)
+    /* The register values are followed as 64 bit ones */
+    if (rbpf->flags & RBPF_FLAG_REG32) {
+        return;
+    }
+#endif
+
+    for (size_t back = 0; back < num_instructions; back++) {
+        const bpf_instruction_t *instr = &text[back];
+        _loop_t loop = { .back = back, .trips = 0 };
+
+        if ((instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            back++;
+            continue;
+        }
+        if (!_loop_compare(instr)) {
+            continue;
+        }
+        loop.head = back + 1 + bpf_instruction_jump_offset(instr);
+        if (!loop.head || loop.head >= back || !_loop_body(text, &loop) ||
+            !_loop_chain(text, &loop) || _loop_started(rbpf, &loop)) {
+            continue;
+        }
+        if (!known) {
+            written = _value_written(rbpf, text, num_instructions, &fp_min);
+            known = true;
+        }
+
+        /* The register falling through to the loop, nothing being charged
+         * when the straight-line code before it is never run */
+        if (loop.chain < loop.head) {
+            _value_t regs[11];
+
+            if (_loop_fall(rbpf, text, num_instructions, loop.head, _LOOP_DEPTH, written, fp_min,
+                           regs) &&
+                !_loop_trips(text, &loop, &regs[instr->dst], limit, &loop.trips)) {
+                continue;
+            }
+        }
+
+        if (!_loop_entries(rbpf, text, num_instructions, &loop, limit, written, fp_min, false)) {
+            continue;
+        }
+        _loop_entries(rbpf, text, num_instructions, &loop, limit, written, fp_min, true);
+        if (!loop.chain) {
+            rbpf->loop_charge += loop.trips;
+        }
+        rbpf->lowered[back].offset = 0;
+        rbpf->loops++;
+    }
+}
+#endif
+
+#if (RBPF_ENABLE_MEMORY_PROOF) && (RBPF_ENABLE_LOWERING) && !(RBPF_ENABLE_MASKING) && \
+    !(RBPF_ENABLE_MPU)
+/*
+ * Loop guards
+ *
+ * The memory proof only follows the pointers within straight-line code, the
+ * pointer a loop walks the memory with is forgotten at its first instruction,
+ * such as the data pointer of fletcher32. A loop whose straight-line body
+ * counts down by one, in the register its only backward jump compares with
+ * zero, and moves the pointer by immediates only, walks a range known from
+ * the pointer and the counter at its entry: the iterations times the step of
+ * the pointer, widened by the offsets and the sizes of the accesses through
+ * it. When every way into the loop is a jump always to its first instruction,
+ * these jumps become guarded jumps checking the whole range once, and the
+ * accesses through the pointer are marked proven. A range out of bounds drops
+ * the proof for the rest of the run, which then checks every access and fails
+ * on the first one out of bounds, as without the proof. The guards are left
+ * out of the applications compiled to native code, which read the proof at
+ * compile time, and of the ones with 32 bit registers.
+ */
+typedef struct {
+    size_t head;        /* First instruction of the loop */
+    size_t back;        /* Backward jump ending the loop */
+    unsigned counter;   /* Register counting the iterations down */
+    unsigned pointer;   /* Register walking the memory */
+    int64_t step;       /* Move of the pointer on every iteration */
+    int64_t lo;         /* Lowest offset accessed from the pointer at the start of an iteration */
+    int64_t hi;         /* End of the highest access from there */
+    uint16_t flags;     /* BPF_GUARD_WIDE, BPF_GUARD_LOAD and BPF_GUARD_STORE */
+} _guard_t;
+
+/* The access of an instruction through the register, false when it has none
+ * the proof covers */
+static bool _guard_access(const bpf_instruction_t *instr, unsigned reg, unsigned *size,
+                          bool *store)
+{
+    uint8_t cls = instr->opcode & BPF_INSTRUCTION_CLS_MASK;
+    uint8_t mode = instr->opcode & BPF_INSTRUCTION_MEM_MDE_MASK;
+    unsigned size_op = instr->opcode & BPF_INSTRUCTION_MEM_SZ_MASK;
+
+    if (cls == BPF_INSTRUCTION_CLS_LDX) {
+        if (instr->src != reg || (mode != 0x60 && mode != BPF_INSTRUCTION_LDX_MEMSX)) {
+            return false;
+        }
+        *store = false;
+    }
+    else if (cls == BPF_INSTRUCTION_CLS_ST || cls == BPF_INSTRUCTION_CLS_STX) {
+        /* The alignment of the atomic operations is still checked */
+        if (instr->dst != reg || (mode != 0x60 && !_rbpf_is_atomic(instr->opcode))) {
+            return false;
+        }
+        *store = true;
+    }
+    else {
+        return false;
+    }
+    *size = (size_op == 0x00) ? 4 : (size_op == 0x08) ? 2 : (size_op == 0x10) ? 1 : 8;
+    return true;
+}
+
+/* The addition of an immediate, as a signed step */
+static int64_t _guard_step(const bpf_instruction_t *instr)
+{
+    int64_t add = instr->immediate;
+
+    return (instr->opcode & BPF_INSTRUCTION_ALU_OP_MASK) == BPF_INSTRUCTION_ALU_SUB ? -add : add;
+}
+
+/* The range the body of the loop accesses through the pointer, false when it
+ * holds a jump, a call or a return, when the counter isn't stepped down by one
+ * once, or when the pointer moves by anything else than 64 bit additions of
+ * immediates */
+static bool _guard_body(const bpf_instruction_t *text, _guard_t *guard)
+{
+    uint8_t back_cls = text[guard->back].opcode & BPF_INSTRUCTION_CLS_MASK;
+    bool counted = false;
+    int64_t moved = 0;
+
+    guard->lo = INT16_MAX;
+    guard->hi = INT16_MIN;
+    guard->flags = 0;
+    for (size_t i = guard->head; i < guard->back; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        uint8_t cls = instr->opcode & BPF_INSTRUCTION_CLS_MASK;
+        unsigned size;
+        bool store;
+
+        if (cls == BPF_INSTRUCTION_CLS_BRANCH || cls == BPF_INSTRUCTION_CLS_JMP32) {
+            return false;
+        }
+        if (_guard_access(instr, guard->pointer, &size, &store)) {
+            if (moved + instr->offset < guard->lo) {
+                guard->lo = moved + instr->offset;
+            }
+            if (moved + instr->offset + size > guard->hi) {
+                guard->hi = moved + instr->offset + size;
+            }
+            guard->flags |= store ? BPF_GUARD_STORE : BPF_GUARD_LOAD;
+        }
+        if (_loop_writes(instr, guard->counter)) {
+            if (counted || !_loop_step(instr) || _guard_step(instr) != -1) {
+                return false;
+            }
+            if (cls == BPF_INSTRUCTION_CLS_ALU64 && back_cls == BPF_INSTRUCTION_CLS_BRANCH) {
+                guard->flags |= BPF_GUARD_WIDE;
+            }
+            counted = true;
+        }
+        if (_loop_writes(instr, guard->pointer)) {
+            if (cls != BPF_INSTRUCTION_CLS_ALU64 || !_loop_step(instr)) {
+                return false;
+            }
+            moved += _guard_step(instr);
+            if (moved < INT16_MIN || moved > INT16_MAX) {
+                return false;
+            }
+        }
+        if (cls == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+    guard->step = moved;
+    return counted && guard->lo >= INT16_MIN && guard->hi <= INT16_MAX && guard->lo < guard->hi;
+}
+
+/* Whether the loop is only entered by jumps always to its first instruction,
+ * which become guarded jumps when apply is set */
+static bool _guard_entries(rbpf_application_t *rbpf, const bpf_instruction_t *text,
+                           size_t num_instructions, const _guard_t *guard, bool apply)
+{
+    rbpf_application_t *regs = rbpf_engine_registers(rbpf);
+    size_t last = 0;
+
+    /* Nothing falls through to the loop, and no run starts in it */
+    for (size_t i = 0; i < guard->head; i++) {
+        last = i;
+        if ((text[i].opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+        }
+    }
+    if (!guard->head || (text[last].opcode != BPF_INSTRUCTION_RETURN &&
+                         text[last].opcode != BPF_INSTRUCTION_JMP_ALWAYS &&
+                         text[last].opcode != BPF_INSTRUCTION_JMP32_ALWAYS)) {
+        return false;
+    }
+    for (size_t i = 0; i < rbpf_header(rbpf)->functions; i++) {
+        size_t slot = _rbpf_function_slot(rbpf, i);
+
+        if (slot >= guard->head && slot <= guard->back) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < num_instructions; i++) {
+        const bpf_instruction_t *instr = &text[i];
+        rbpf_insn_t *insn = &rbpf->lowered[i];
+        size_t dest;
+
+        if ((instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            i++;
+            continue;
+        }
+        if ((i >= guard->head && i <= guard->back) || !_loop_dest(instr, i, &dest) ||
+            dest < guard->head || dest > guard->back) {
+            continue;
+        }
+        if (dest != guard->head || (insn->opcode != BPF_INSTRUCTION_JMP_ALWAYS &&
+                                    insn->opcode != BPF_INSTRUCTION_JMP32_ALWAYS)) {
+            return false;
+        }
+        if (apply) {
+            /* The charge of the jump and its target stay */
+            insn->opcode = BPF_INSTRUCTION_GUARD_JA;
+            insn->dst = &regs->regmap[guard->pointer];
+            insn->src = &regs->regmap[guard->counter];
+            insn->immediate = BPF_GUARD_IMMEDIATE(guard->step, guard->lo, guard->hi - guard->lo,
+                                                  guard->flags);
+        }
+    }
+    return true;
+}
+
+static void _rbpf_guard_loops(rbpf_application_t *rbpf)
+{
+    const bpf_instruction_t *text = rbpf_application_text(rbpf);
+    size_t num_instructions = rbpf_application_text_len(rbpf) / sizeof(bpf_instruction_t);
+    uint32_t *proof = rbpf->proof;
+
+    rbpf->guards = 0;
+    if (!(rbpf->flags & RBPF_FLAG_MEMORY_PROVEN) || (rbpf->flags & RBPF_FLAG_REG32)) {
+        return;
+    }
+
+    for (size_t back = 0; back < num_instructions; back++) {
+        const bpf_instruction_t *instr = &text[back];
+        _guard_t guard = { .back = back, .counter = instr->dst };
+
+        if ((instr->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+            back++;
+            continue;
+        }
+        if ((instr->opcode != BPF_INSTRUCTION_JMP_NE_IMM &&
+             instr->opcode != BPF_INSTRUCTION_JMP32_NE_IMM) || instr->immediate) {
+            continue;
+        }
+        guard.head = back + 1 + bpf_instruction_jump_offset(instr);
+        if (guard.head >= back) {
+            continue;
+        }
+
+        /* The pointer of the first access left unproven */
+        guard.pointer = guard.counter;
+        for (size_t i = guard.head; i < back; i++) {
+            uint8_t cls = text[i].opcode & BPF_INSTRUCTION_CLS_MASK;
+
+            if ((cls == BPF_INSTRUCTION_CLS_LDX || cls == BPF_INSTRUCTION_CLS_ST ||
+                 cls == BPF_INSTRUCTION_CLS_STX) && !(proof[i / 32] & (1UL << (i % 32)))) {
+                guard.pointer = cls == BPF_INSTRUCTION_CLS_LDX ? text[i].src : text[i].dst;
+                break;
+            }
+            if (cls == BPF_INSTRUCTION_CLS_LD) {
+                i++;
+            }
+        }
+        if (guard.pointer == guard.counter || !_guard_body(text, &guard) ||
+            !_guard_entries(rbpf, text, num_instructions, &guard, false)) {
+            continue;
+        }
+        _guard_entries(rbpf, text, num_instructions, &guard, true);
+
+        for (size_t i = guard.head; i < back; i++) {
+            unsigned size;
+            bool store;
+
+            if (_guard_access(&text[i], guard.pointer, &size, &store)) {
+                proof[i / 32] |= 1UL << (i % 32);
+            }
+            if ((text[i].opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_LD) {
+                i++;
+            }
+        }
+        rbpf->guards++;
+    }
+}
+#endif
+
+
+/* The operation of the atomic instructions, and the alignment of their offset
+ * on the size of the access. The address itself is only known at run time,
+ * where its alignment is checked again. */
+static bool _rbpf_check_atomic(const bpf_instruction_t *i)
+{
+    int16_t size = i->opcode == BPF_INSTRUCTION_MEM_ATOMICW ? 4 : 8;
+
+    switch (i->immediate) {
+    case BPF_INSTRUCTION_ATOMIC_ADD:
+    case BPF_INSTRUCTION_ATOMIC_OR:
+    case BPF_INSTRUCTION_ATOMIC_AND:
+    case BPF_INSTRUCTION_ATOMIC_XOR:
+    case BPF_INSTRUCTION_ATOMIC_ADD | BPF_INSTRUCTION_ATOMIC_FETCH:
+    case BPF_INSTRUCTION_ATOMIC_OR | BPF_INSTRUCTION_ATOMIC_FETCH:
+    case BPF_INSTRUCTION_ATOMIC_AND | BPF_INSTRUCTION_ATOMIC_FETCH:
+    case BPF_INSTRUCTION_ATOMIC_XOR | BPF_INSTRUCTION_ATOMIC_FETCH:
+    case BPF_INSTRUCTION_ATOMIC_XCHG:
+    case BPF_INSTRUCTION_ATOMIC_CMPXCHG:
+        return (i->offset & (size - 1)) == 0;
+    default:
+        return false;
+    }
+}
+
+/* The offset of the signed divisions and sign extending moves, the width of
+ * the byte order conversions and the atomic operations */
+static bool _rbpf_check_variant(const bpf_instruction_t *i)
+{
+    switch (i->opcode) {
+    case BPF_INSTRUCTION_ALU64_DIV_REG:
+    case BPF_INSTRUCTION_ALU64_DIV_IMM:
+    case BPF_INSTRUCTION_ALU64_MOD_REG:
+    case BPF_INSTRUCTION_ALU64_MOD_IMM:
+    case BPF_INSTRUCTION_ALU32_DIV_REG:
+    case BPF_INSTRUCTION_ALU32_DIV_IMM:
+    case BPF_INSTRUCTION_ALU32_MOD_REG:
+    case BPF_INSTRUCTION_ALU32_MOD_IMM:
+        return i->offset == 0 || i->offset == BPF_INSTRUCTION_ALU_SIGNED;
+    case BPF_INSTRUCTION_ALU64_MOV_REG:
+        return i->offset == 0 || i->offset == 8 || i->offset == 16 || i->offset == 32;
+    case BPF_INSTRUCTION_ALU32_MOV_REG:
+        return i->offset == 0 || i->offset == 8 || i->offset == 16;
+    case BPF_INSTRUCTION_ALU32_END_LE:
+    case BPF_INSTRUCTION_ALU32_END_BE:
+    case BPF_INSTRUCTION_ALU64_BSWAP:
+        return i->immediate == 16 || i->immediate == 32 || i->immediate == 64;
+    case BPF_INSTRUCTION_MEM_ATOMICW:
+    case BPF_INSTRUCTION_MEM_ATOMICDW:
+        return _rbpf_check_atomic(i);
     default:
-        return rbpf_get_external_call(num) ? true : false;
+        return true;
     }
 }
 
+/* Checks of a single instruction, independent of its encoding */
+static int _rbpf_check_instruction(const rbpf_application_t *rbpf, const bpf_instruction_t *i,
+                                   const bpf_instruction_t *end)
+{
+    /* Check if register values are valid */
+    if (i->dst >= 11 || i->src >= 11) {
+        return RBPF_ILLEGAL_REGISTER;
+    }
 
-int rbpf_application_verify_preflight(rbpf_application_t *rbpf)
+    if (!_rbpf_check_variant(i)) {
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+
+#if (RBPF_ENABLE_REG32)
+    if ((rbpf->flags & RBPF_FLAG_REG32) && !_rbpf_check_reg32(i, end)) {
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+#else
+    (void)rbpf;
+    (void)end;
+#endif
+
+#if (RBPF_ENABLE_FUSION) || (RBPF_ENABLE_LOCAL_CALLS) || (RBPF_ENABLE_MEMORY_PROOF)
+    /* The superinstructions, local calls and guarded jumps of the pre-decoded
+     * form */
+    if ((i->opcode & BPF_INSTRUCTION_FUSED_MASK) == BPF_INSTRUCTION_FUSED_MASK) {
+        return RBPF_ILLEGAL_INSTRUCTION;
+    }
+#endif
+
+    if (i->opcode == (BPF_INSTRUCTION_BRANCH_CALL | BPF_INSTRUCTION_CLS_BRANCH)) {
+        /* The compressed text has no encoding for the offset of a local call */
+        if (i->src == BPF_INSTRUCTION_CALL_LOCAL) {
+            if (!_rbpf_is_local_call(i) || (rbpf->flags & RBPF_FLAG_COMPRESSED)) {
+                return RBPF_ILLEGAL_CALL;
+            }
+        }
+        else if (!_rbpf_check_call(i->immediate)) {
+            return RBPF_ILLEGAL_CALL;
+        }
+    }
+    return RBPF_OK;
+}
+
+static int _rbpf_preflight_text(rbpf_application_t *rbpf)
 {
     const bpf_instruction_t *application = rbpf_application_text(rbpf);
     size_t length = rbpf_application_text_len(rbpf);
 
-    if (rbpf->flags & RBPF_FLAG_PREFLIGHT_DONE) {
-        return RBPF_OK;
-    }
-
     if (length & 0x7) {
         return RBPF_ILLEGAL_LEN;
     }
 
-
     for (const bpf_instruction_t *i = application;
          i < (bpf_instruction_t *)((uint8_t *)application + length); i++) {
-        /* Check if register values are valid */
-        if (i->dst >= 11 || i->src >= 11) {
-            return RBPF_ILLEGAL_REGISTER;
+        int res = _rbpf_check_instruction(rbpf, i,
+                                          (bpf_instruction_t *)((uint8_t *)application + length));
+        if (res < 0) {
+            return res;
         }
 
         /* Double length instruction */
@@ -53,21 +2573,17 @@ int rbpf_application_verify_preflight(rbpf_application_t *rbpf)
         }
 
         /* Only instruction-specific checks here */
-        if ((i->opcode & BPF_INSTRUCTION_CLS_MASK) == BPF_INSTRUCTION_CLS_BRANCH) {
-            intptr_t target = (intptr_t)(i + i->offset);
-            /* Check if the jump target is within bounds. The address is
-             * incremented after the jump by the regular PC increase */
-            if ((target >= (intptr_t)((uint8_t *)application + length))
-                || (target < (intptr_t)application)) {
+        if (_rbpf_is_jump(i->opcode) || _rbpf_is_local_call(i)) {
+            /* Check if the jump target is within bounds. The target is the
+             * instruction following the offset, as the PC is incremented after
+             * the jump by the regular PC increase */
+            intptr_t target = (i - application) + 1 + (_rbpf_is_local_call(i) ? i->immediate :
+                                                       bpf_instruction_jump_offset(i));
+            if ((target >= (intptr_t)(length / sizeof(bpf_instruction_t)))
+                || (target < 0)) {
                 return RBPF_ILLEGAL_JUMP;
             }
         }
-
-        if (i->opcode == (BPF_INSTRUCTION_BRANCH_CALL | BPF_INSTRUCTION_CLS_BRANCH)) {
-            if (!_rbpf_check_call(i->immediate)) {
-                return RBPF_ILLEGAL_CALL;
-            }
-        }
     }
 
     size_t num_instructions = length / sizeof(bpf_instruction_t);
@@ -77,6 +2593,202 @@ int rbpf_application_verify_preflight(rbpf_application_t *rbpf)
         !(rbpf->flags & RBPF_CONFIG_NO_RETURN)) {
         return RBPF_NO_RETURN;
     }
+    return RBPF_OK;
+}
+
+#if (RBPF_ENABLE_COMPRESSED)
+/* Whether an instruction of the compressed text starts at the offset */
+static bool _rbpf_compressed_starts_at(const uint8_t *text, size_t offset)
+{
+    size_t pc = 0;
+
+    while (pc < offset) {
+        pc += rbpf_compressed_len(text[pc]);
+    }
+    return pc == offset;
+}
+
+static int _rbpf_preflight_compressed(rbpf_application_t *rbpf)
+{
+    const uint8_t *text = (const uint8_t *)rbpf_application_text(rbpf);
+    size_t length = rbpf_application_text_len(rbpf);
+    bpf_instruction_t expanded[2];
+    uint8_t last = 0;
+
+    /* Every instruction must have an encoding and fit in the text before the
+     * instructions are walked */
+    for (size_t pc = 0; pc < length; ) {
+        size_t len = rbpf_compressed_len(text[pc]);
+        if (len == 0) {
+            return RBPF_ILLEGAL_INSTRUCTION;
+        }
+        if (len > length - pc) {
+            return RBPF_ILLEGAL_LEN;
+        }
+        pc += len;
+    }
+
+    for (size_t pc = 0; pc < length; ) {
+        size_t len = rbpf_compressed_expand(text + pc, expanded);
+        const bpf_instruction_t *i = expanded;
+        int res = _rbpf_check_instruction(rbpf, i, expanded + (len == 10 ? 2 : 1));
+        if (res < 0) {
+            return res;
+        }
+
+        /* The jump target must be an instruction of the text, the offset
+         * counts bytes from the end of the jump */
+        if (_rbpf_is_jump(i->opcode)) {
+            intptr_t target = (intptr_t)(pc + len) + bpf_instruction_jump_offset(i);
+            if (target < 0 || target >= (intptr_t)length ||
+                !_rbpf_compressed_starts_at(text, target)) {
+                return RBPF_ILLEGAL_JUMP;
+            }
+        }
+        last = i->opcode;
+        pc += len;
+    }
+
+    if (last != BPF_INSTRUCTION_RETURN && !(rbpf->flags & RBPF_CONFIG_NO_RETURN)) {
+        return RBPF_NO_RETURN;
+    }
+    return RBPF_OK;
+}
+#endif
+
+int rbpf_application_verify_preflight(rbpf_application_t *rbpf)
+{
+    int res;
+
+    if (rbpf->flags & RBPF_FLAG_PREFLIGHT_DONE) {
+        return RBPF_OK;
+    }
+
+#if (RBPF_ENABLE_REG32)
+    if (rbpf_header(rbpf)->flags & RBPF_HEADER_FLAG_REG32) {
+        rbpf->flags |= RBPF_FLAG_REG32;
+    }
+#endif
+
+#if (RBPF_ENABLE_MASKING)
+    /* The stack and the data must be laid out in the arena */
+    if (!rbpf->arena_used) {
+        return RBPF_OUT_OF_MEMORY;
+    }
+#endif
+
+    /* The functions are where the runs and the local calls start */
+    if ((const uint8_t *)(rbpf_application_functions(rbpf) + rbpf_header(rbpf)->functions) >
+        (const uint8_t *)rbpf->application + rbpf->application_len) {
+        return RBPF_ILLEGAL_LEN;
+    }
+
+    /* The maps follow the functions, their lookups are checked against them */
+    if (rbpf_header(rbpf)->flags & RBPF_HEADER_FLAG_MAPS) {
+#if (RBPF_ENABLE_MAPS)
+        const rbpf_map_list_t *maps = rbpf_application_maps(rbpf);
+        const uint8_t *end = (const uint8_t *)rbpf->application + rbpf->application_len;
+
+        if ((const uint8_t *)maps->maps > end ||
+            maps->len > (size_t)(end - (const uint8_t *)maps->maps) / sizeof(rbpf_map_def_t)) {
+            return RBPF_ILLEGAL_LEN;
+        }
+#else
+        return RBPF_ILLEGAL_INSTRUCTION;
+#endif
+    }
+
+    if (rbpf_header(rbpf)->flags & RBPF_HEADER_FLAG_COMPRESSED) {
+#if (RBPF_ENABLE_COMPRESSED)
+        rbpf->flags |= RBPF_FLAG_COMPRESSED;
+        res = _rbpf_preflight_compressed(rbpf);
+#else
+        return RBPF_ILLEGAL_INSTRUCTION;
+#endif
+    }
+    else {
+        res = _rbpf_preflight_text(rbpf);
+    }
+    if (res < 0) {
+        return res;
+    }
+
+    /* The checks of the helper arguments, the proof, the narrowing, the
+     * fusion and the native code work on the uncompressed text only */
+    const bool compressed = rbpf->flags & RBPF_FLAG_COMPRESSED;
+
+#if (RBPF_ENABLE_LOCAL_CALLS)
+    if (!compressed) {
+        _rbpf_frame_size(rbpf);
+    }
+#endif
+
+    if (!compressed) {
+        res = _rbpf_check_helpers(rbpf);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+#if (RBPF_ENABLE_MEMORY_PROOF) && !(RBPF_ENABLE_MASKING) && !(RBPF_ENABLE_MPU)
+    /* Masked or sandboxed accesses need no proof */
+    if (!compressed) {
+        _rbpf_prove_memory(rbpf);
+    }
+#endif
+
+#if (RBPF_ENABLE_LOWERING)
+    /* Lower the application once, the pre-decoded form is kept for all the
+     * following runs */
+    res = rbpf_engine_lower(rbpf);
+    if (res < 0) {
+        return res;
+    }
+#if (RBPF_ENABLE_MAPS)
+    if (!compressed) {
+        _rbpf_lower_maps(rbpf);
+    }
+#endif
+#if (RBPF_ENABLE_NARROWING)
+    if (!compressed) {
+        _rbpf_narrow(rbpf);
+    }
+#endif
+#if (RBPF_ENABLE_FUSION)
+    if (!compressed) {
+        _rbpf_fuse(rbpf);
+    }
+#endif
+#if (RBPF_ENABLE_BOUNDED_LOOPS)
+    if (!compressed) {
+        _rbpf_bound_loops(rbpf);
+    }
+#endif
+#endif
+
+#if (RBPF_ENABLE_AOT) && !(RBPF_ENABLE_MPU)
+    /* Applications without a matching native code section stay interpreted */
+    if (!compressed) {
+        rbpf_aot_load(rbpf);
+    }
+#endif
+
+#if (RBPF_ENABLE_JIT) && !(RBPF_ENABLE_MPU)
+    /* Applications the compiler can't translate stay interpreted */
+    if (!compressed && !rbpf->aot) {
+        rbpf_jit_compile(rbpf);
+    }
+#endif
+
+#if (RBPF_ENABLE_MEMORY_PROOF) && (RBPF_ENABLE_LOWERING) && !(RBPF_ENABLE_MASKING) && \
+    !(RBPF_ENABLE_MPU)
+    /* The native code compiled from the proof doesn't check the loops it
+     * enters */
+    if (!compressed && !rbpf->native) {
+        _rbpf_guard_loops(rbpf);
+    }
+#endif
+
     rbpf->flags |= RBPF_FLAG_PREFLIGHT_DONE;
     return RBPF_OK;
 }
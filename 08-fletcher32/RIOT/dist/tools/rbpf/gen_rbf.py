@@ -11,7 +11,8 @@
 
 import argparse
 import logging
-from rbpf import rbf, instructions
+import sys
+from rbpf import rbf, instructions, aot
 
 
 def test_instr(arguments):
@@ -27,14 +28,39 @@ def dump(arguments):
 
 
 def generate(arguments):
-    rbf_o = rbf.RBF.from_elf(arguments.input)
+    try:
+        rbf_o = rbf.RBF.from_elf(arguments.input)
+    except rbf.MapError as e:
+        logging.critical(f"Unable to lay out the maps of the application: {e}")
+        sys.exit(1)
+    if arguments.reg32:
+        try:
+            rbf_o.set_reg32()
+        except rbf.Reg32Error as e:
+            logging.critical(f"Unable to run the application with 32 bit registers: {e}")
+            sys.exit(1)
     if arguments.compress:
-        data = rbf_o.format_compressed()
+        try:
+            data = rbf_o.format_compressed()
+        except instructions.CompressError as e:
+            logging.critical(f"Unable to compress the application: {e}")
+            sys.exit(1)
     else:
         data = rbf_o.format()
     arguments.output.write(data)
 
 
+def compile_native(arguments):
+    rbf_content = arguments.input.read()
+    rbf_o = rbf.RBF.from_rbf(rbf_content)
+    try:
+        data = rbf_o.format_native()
+    except aot.AOTError as e:
+        logging.critical(f"Unable to compile the application: {e}")
+        sys.exit(1)
+    arguments.output.write(data)
+
+
 if __name__ == "__main__":
     parser = argparse.ArgumentParser("RIOT BPF format utility")
     parser.add_argument(
@@ -59,6 +85,12 @@ if __name__ == "__main__":
     parser_gen = subparsers.add_parser("generate")
     parser_gen.set_defaults(func=generate)
     parser_gen.add_argument("--compress", "-c", action="store_true", default=False)
+    parser_gen.add_argument(
+        "--reg32",
+        action="store_true",
+        default=False,
+        help="Flag the application to run with 32 bit registers",
+    )
     parser_gen.add_argument(
         "input", type=argparse.FileType("rb"), help="ELF file to read"
     )
@@ -66,6 +98,17 @@ if __name__ == "__main__":
         "output", type=argparse.FileType("wb"), help="RBF file to write"
     )
 
+    parser_aot = subparsers.add_parser("aot")
+    parser_aot.set_defaults(func=compile_native)
+    parser_aot.add_argument(
+        "input", type=argparse.FileType("rb"), help="RBF file to read"
+    )
+    parser_aot.add_argument(
+        "output",
+        type=argparse.FileType("wb"),
+        help="RBF file to write, with the text compiled to Thumb-2",
+    )
+
     args = parser.parse_args()
 
     logging.basicConfig(format="%(message)s")
@@ -0,0 +1,1031 @@
+"""
+Ahead-of-time compiler from eBPF to Thumb-2, for ARMv7-M cores.
+
+The generated code is position independent and is executed in place by the
+virtual machine from the native section of the RBF file. It follows the
+translation of the just-in-time compiler of the virtual machine, with the
+exceptions that the data and read-only data sections are found relative to
+the program counter and that the virtual machine is only reached through the
+environment passed as second argument (rbpf_native_env_t):
+
+    int native(uint64_t *regs, rbpf_native_env_t *env);
+
+Register usage of the generated code:
+ - r0:r1 and r2:r3 hold the destination and source operands of the
+   instruction being executed when they live in the register file,
+ - r4:r5, r6:r7 and r8:r9 cache the three most used eBPF registers,
+ - r11 holds the register file,
+ - r12 and lr are scratch registers,
+ - r10 (sl) is the PIC base of the firmware and is never touched.
+
+The environment pointer is kept on the stack by the prologue. Helpers are
+called with the AAPCS, the application in r0, r1 in r2:r3 and r2 to r5 on the
+stack:
+
+    uint64_t call(rbpf_application_t *rbpf, uint64_t r1, ..., uint64_t r5);
+"""
+
+import struct
+import logging
+
+INSTRUCTION_STRUCT = struct.Struct("<BBhi")
+
+# Version of the interface with the virtual machine, RBPF_NATIVE_VERSION
+VERSION = 4
+
+NATIVE_HEADER_STRUCT = struct.Struct("<IIII")
+
+# Offsets in rbpf_native_env_t
+ENV_RBPF = 0
+ENV_BUDGET = 4
+ENV_LOAD_ALLOWED = 8
+ENV_STORE_ALLOWED = 12
+ENV_GET_CALL = 16
+ENV_DIV = 20
+ENV_MOD = 24
+ENV_SDIV = 28
+ENV_SMOD = 32
+ENV_ATOMIC64 = 36
+
+# Offset of the environment pointer from the stack pointer after the prologue
+STACK_ENV = 4
+
+# Stack taken by the arguments r2 to r5 of a helper call
+CALL_STACK = 32
+
+# Exit codes of the virtual machine
+RBPF_OK = 0
+RBPF_ILLEGAL_INSTRUCTION = -1
+RBPF_ILLEGAL_MEM = -2
+RBPF_OUT_OF_BRANCHES = -8
+RBPF_ILLEGAL_DIV = -9
+
+STACK_SIZE = 512
+
+# Registers of the generated code
+DST = 0
+SRC = 2
+PAIRS = 4
+NUM_PAIRS = 3
+REGS = 11
+TMP = 12
+TMP2 = 14
+SP = 13
+PC = 15
+
+SAVED_REGS = (
+    (1 << 4) | (1 << 5) | (1 << 6) | (1 << 7) | (1 << 8) | (1 << 9) | (1 << 11)
+)
+
+# Condition codes
+COND_EQ = 0x0
+COND_NE = 0x1
+COND_CS = 0x2
+COND_CC = 0x3
+COND_PL = 0x5
+COND_GE = 0xA
+COND_LT = 0xB
+COND_AL = 0xE
+
+# Data processing operations
+DP_AND = 0x0
+DP_ORR = 0x2
+DP_ORN = 0x3
+DP_EOR = 0x4
+DP_ADD = 0x8
+DP_ADC = 0xA
+DP_SBC = 0xB
+DP_SUB = 0xD
+DP_RSB = 0xE
+
+# Shift types
+SHIFT_LSL = 0x0
+SHIFT_LSR = 0x1
+SHIFT_ASR = 0x2
+
+# Load and store with a 12 bit positive offset
+LDST_STRB = 0xF880
+LDST_LDRB = 0xF890
+LDST_STRH = 0xF8A0
+LDST_LDRH = 0xF8B0
+LDST_STR = 0xF8C0
+LDST_LDR = 0xF8D0
+LDST_LDRSB = 0xF990
+LDST_LDRSH = 0xF9B0
+
+# Extensions of the low byte or halfword
+EXTEND_SXTH = 0xFA0F
+EXTEND_UXTH = 0xFA1F
+EXTEND_SXTB = 0xFA4F
+
+# eBPF opcodes
+CLS_MASK = 0x07
+CLS_LD = 0x00
+CLS_LDX = 0x01
+CLS_ST = 0x02
+CLS_STX = 0x03
+CLS_ALU32 = 0x04
+CLS_BRANCH = 0x05
+CLS_JMP32 = 0x06
+CLS_ALU64 = 0x07
+ALU_S_MASK = 0x08
+OP_MASK = 0xF0
+MEM_SZ_MASK = 0x18
+MEM_MDE_MASK = 0xE0
+MEM_MEMSX = 0x80
+
+# Operations of the atomic instructions, in the immediate
+ATOMIC_FETCH = 0x01
+ATOMIC_ADD = 0x00
+ATOMIC_OR = 0x40
+ATOMIC_AND = 0x50
+ATOMIC_XOR = 0xA0
+ATOMIC_XCHG = 0xE0 | ATOMIC_FETCH
+ATOMIC_CMPXCHG = 0xF0 | ATOMIC_FETCH
+ATOMICW = 0xC3
+ATOMICDW = 0xDB
+
+ALU_ADD = 0x00
+ALU_SUB = 0x10
+ALU_MUL = 0x20
+ALU_DIV = 0x30
+ALU_OR = 0x40
+ALU_AND = 0x50
+ALU_LSH = 0x60
+ALU_RSH = 0x70
+ALU_NEG = 0x80
+ALU_MOD = 0x90
+ALU_XOR = 0xA0
+ALU_MOV = 0xB0
+ALU_ARSH = 0xC0
+ALU_BYTESWAP = 0xD0
+
+JEQ = 0x10
+JGT = 0x20
+JGE = 0x30
+JSET = 0x40
+JNE = 0x50
+JSGT = 0x60
+JSGE = 0x70
+JLT = 0xA0
+JLE = 0xB0
+JSLT = 0xC0
+JSLE = 0xD0
+
+JMP_ALWAYS = 0x05
+JMP32_ALWAYS = 0x06
+END_LE = 0xD4
+END_BE = 0xDC
+ALU64_MOV_REG = 0xBF
+CALL = 0x85
+CALL_LOCAL = 1
+# The tail call helper, BPF_FUNC_BPF_TAIL_CALL
+TAIL_CALL = 0x20
+RETURN = 0x95
+
+LDDW = 0x18
+LDDWD = 0xB8
+LDDWR = 0xD8
+
+# Exits of the generated code, shared by all instructions
+EXITS = [
+    RBPF_ILLEGAL_INSTRUCTION,
+    RBPF_ILLEGAL_MEM,
+    RBPF_OUT_OF_BRANCHES,
+    RBPF_ILLEGAL_DIV,
+]
+EXIT_ILLEGAL_INSTRUCTION = 0
+EXIT_ILLEGAL_MEM = 1
+EXIT_OUT_OF_BRANCHES = 2
+EXIT_ILLEGAL_DIV = 3
+
+U32 = 0xFFFFFFFF
+
+
+class AOTError(Exception):
+    pass
+
+
+class Instruction(object):
+    def __init__(self, raw):
+        self.opcode, registers, self.offset, self.immediate = INSTRUCTION_STRUCT.unpack(
+            raw
+        )
+        self.dst = registers & 0x0F
+        self.src = (registers & 0xF0) >> 4
+
+    @property
+    def jump_offset(self):
+        """Offset of a jump, in the immediate for the long jump"""
+        return self.immediate if self.opcode == JMP32_ALWAYS else self.offset
+
+
+class Compiler(object):
+    """
+    Translates the text section of an application.
+
+    :param text: text section, not compressed
+    :param data_offset: offset of the data section from the start of the code
+    :param rodata_offset: offset of the read-only data section from the
+        start of the code
+    """
+
+    def __init__(self, text, data_offset, rodata_offset):
+        if len(text) % 8:
+            raise AOTError("text is not a whole number of instructions")
+        self.text = [
+            Instruction(text[i : i + 8]) for i in range(0, len(text), 8)
+        ]
+        self.data_offset = data_offset
+        self.rodata_offset = rodata_offset
+        self.code = []
+        self.slots = [0] * len(self.text)
+        self.exits = [0] * len(EXITS)
+        self.epilogue = 0
+        self.map = [0] * 11
+        self.fixed_fp = True
+        self._registers()
+
+    # Instruction encoders
+
+    def _emit16(self, hw):
+        self.code.append(hw & 0xFFFF)
+
+    def _emit32(self, hw1, hw2):
+        self._emit16(hw1)
+        self._emit16(hw2)
+
+    def _dp_reg(self, op, s, rd, rn, rm, shift=SHIFT_LSL, amount=0):
+        self._emit32(
+            0xEA00 | (op << 5) | (int(s) << 4) | rn,
+            ((amount >> 2) << 12)
+            | (rd << 8)
+            | ((amount & 0x3) << 6)
+            | (shift << 4)
+            | rm,
+        )
+
+    def _dp_imm(self, op, s, rd, rn, imm):
+        self._emit32(0xF000 | (op << 5) | (int(s) << 4) | rn, (rd << 8) | imm)
+
+    def _mov(self, rd, rm):
+        self._dp_reg(DP_ORR, False, rd, PC, rm)
+
+    def _shift_imm(self, shift, rd, rm, amount):
+        self._dp_reg(DP_ORR, False, rd, PC, rm, shift, amount)
+
+    def _shift_reg(self, shift, rd, rn, rm):
+        self._emit32(0xFA00 | (shift << 5) | rn, 0xF000 | (rd << 8) | rm)
+
+    def _rev(self, halfwords, rd, rm):
+        """rd = rm with its bytes reversed, within its halfwords with REV16"""
+        self._emit32(0xFA90 | rm, 0xF080 | (rd << 8) | (halfwords << 4) | rm)
+
+    def _extend(self, op, rd, rm):
+        self._emit32(op, 0xF080 | (rd << 8) | rm)
+
+    def _cmp(self, rn, rm):
+        self._dp_reg(DP_SUB, True, PC, rn, rm)
+
+    def _cmp_imm(self, rn, imm):
+        self._dp_imm(DP_SUB, True, PC, rn, imm)
+
+    def _tst(self, rn, rm):
+        self._dp_reg(DP_AND, True, PC, rn, rm)
+
+    def _addw(self, rd, rn, imm):
+        self._emit32(
+            0xF200 | ((imm >> 11) << 10) | rn,
+            (((imm >> 8) & 0x7) << 12) | (rd << 8) | (imm & 0xFF),
+        )
+
+    def _subw(self, rd, rn, imm):
+        self._emit32(
+            0xF2A0 | ((imm >> 11) << 10) | rn,
+            (((imm >> 8) & 0x7) << 12) | (rd << 8) | (imm & 0xFF),
+        )
+
+    def _movw(self, rd, imm):
+        self._emit32(
+            0xF240 | (((imm >> 11) & 0x1) << 10) | (imm >> 12),
+            (((imm >> 8) & 0x7) << 12) | (rd << 8) | (imm & 0xFF),
+        )
+
+    def _movt(self, rd, imm):
+        self._emit32(
+            0xF2C0 | (((imm >> 11) & 0x1) << 10) | (imm >> 12),
+            (((imm >> 8) & 0x7) << 12) | (rd << 8) | (imm & 0xFF),
+        )
+
+    def _mov_imm32(self, rd, imm):
+        imm &= U32
+        if imm <= 0xFF:
+            self._dp_imm(DP_ORR, False, rd, PC, imm)
+        elif (~imm & U32) <= 0xFF:
+            self._dp_imm(DP_ORN, False, rd, PC, ~imm & U32)
+        else:
+            self._movw(rd, imm & 0xFFFF)
+            if imm >> 16:
+                self._movt(rd, imm >> 16)
+
+    def _mov_imm64(self, rd, imm):
+        self._mov_imm32(rd, imm)
+        self._mov_imm32(rd + 1, U32 if imm < 0 else 0)
+
+    def _sp(self, sub, size):
+        """sp = sp - size or sp + size, size a multiple of 4 up to 508"""
+        self._emit16((0xB080 if sub else 0xB000) | (size >> 2))
+
+    def _ldst(self, op, rt, rn, offset):
+        self._emit32(op | rn, (rt << 12) | offset)
+
+    def _ldrd(self, rt, rn, offset):
+        self._emit32(0xE9D0 | rn, (rt << 12) | ((rt + 1) << 8) | (offset >> 2))
+
+    def _strd(self, rt, rn, offset):
+        self._emit32(0xE9C0 | rn, (rt << 12) | ((rt + 1) << 8) | (offset >> 2))
+
+    def _ldrex(self, rt, rn):
+        self._emit32(0xE850 | rn, (rt << 12) | 0x0F00)
+
+    def _strex(self, rd, rt, rn):
+        """Exclusive store of rt to [rn], rd is 0 on success"""
+        self._emit32(0xE840 | rn, (rt << 12) | (rd << 8))
+
+    def _it(self, cond):
+        self._emit16(0xBF08 | (cond << 4))
+
+    def _blx(self, rm):
+        self._emit16(0x4780 | (rm << 3))
+
+    def _branch(self, cond, target):
+        offset = (target - (len(self.code) + 2)) * 2
+        s = (offset >> 24) & 0x1
+        if cond == COND_AL:
+            j1 = (~(offset >> 23) ^ s) & 0x1
+            j2 = (~(offset >> 22) ^ s) & 0x1
+            self._emit32(
+                0xF000 | (s << 10) | ((offset >> 12) & 0x3FF),
+                0x9000 | (j1 << 13) | (j2 << 11) | ((offset >> 1) & 0x7FF),
+            )
+        else:
+            self._emit32(
+                0xF000 | (s << 10) | (cond << 6) | ((offset >> 12) & 0x3F),
+                0x8000
+                | (((offset >> 18) & 0x1) << 13)
+                | (((offset >> 19) & 0x1) << 11)
+                | ((offset >> 1) & 0x7FF),
+            )
+
+    def _env(self, rd, field):
+        """Load a field of the environment"""
+        self._ldst(LDST_LDR, rd, SP, STACK_ENV)
+        self._ldst(LDST_LDR, rd, rd, field)
+
+    def _call(self, field):
+        """Call a function of the environment"""
+        self._env(TMP, field)
+        self._blx(TMP)
+
+    def _pc_relative(self, rd, offset):
+        """Address of an offset from the start of the code, with a fixed size"""
+        # The program counter reads as the address of the add plus 4
+        value = (offset - (2 * (len(self.code) + 4) + 4)) & U32
+        self._movw(rd, value & 0xFFFF)
+        self._movt(rd, value >> 16)
+        self._emit16(0x4478 | (rd & 0x7) | ((rd & 0x8) << 4))
+
+    # eBPF register handling
+
+    def _load(self, reg, scratch):
+        if self.map[reg]:
+            return self.map[reg]
+        self._ldrd(scratch, REGS, 8 * reg)
+        return scratch
+
+    def _target(self, reg):
+        return self.map[reg] if self.map[reg] else DST
+
+    def _store(self, reg, pair):
+        if not self.map[reg]:
+            self._strd(pair, REGS, 8 * reg)
+
+    def _flush(self):
+        for reg in range(11):
+            if self.map[reg]:
+                self._strd(self.map[reg], REGS, 8 * reg)
+
+    def _reload(self):
+        for reg in range(11):
+            if self.map[reg]:
+                self._ldrd(self.map[reg], REGS, 8 * reg)
+
+    def _budget(self):
+        self._ldst(LDST_LDR, TMP, SP, STACK_ENV)
+        self._ldst(LDST_LDR, TMP2, TMP, ENV_BUDGET)
+        self._dp_imm(DP_SUB, True, TMP2, TMP2, 1)
+        self._ldst(LDST_STR, TMP2, TMP, ENV_BUDGET)
+        self._branch(COND_EQ, self.exits[EXIT_OUT_OF_BRANCHES])
+
+    def _check_div(self, pair):
+        self._dp_reg(DP_ORR, True, TMP, pair, pair + 1)
+        self._branch(COND_EQ, self.exits[EXIT_ILLEGAL_DIV])
+
+    # Instruction translation
+
+    def _shift64_imm(self, op, d, n):
+        lo, hi = d, d + 1
+        if n == 0:
+            return
+        if op == ALU_LSH:
+            if n < 32:
+                self._shift_imm(SHIFT_LSL, hi, hi, n)
+                self._dp_reg(DP_ORR, False, hi, hi, lo, SHIFT_LSR, 32 - n)
+                self._shift_imm(SHIFT_LSL, lo, lo, n)
+            else:
+                if n == 32:
+                    self._mov(hi, lo)
+                else:
+                    self._shift_imm(SHIFT_LSL, hi, lo, n - 32)
+                self._mov_imm32(lo, 0)
+            return
+        shift = SHIFT_LSR if op == ALU_RSH else SHIFT_ASR
+        if n < 32:
+            self._shift_imm(SHIFT_LSR, lo, lo, n)
+            self._dp_reg(DP_ORR, False, lo, lo, hi, SHIFT_LSL, 32 - n)
+            self._shift_imm(shift, hi, hi, n)
+        else:
+            if n == 32:
+                self._mov(lo, hi)
+            else:
+                self._shift_imm(shift, lo, hi, n - 32)
+            if shift == SHIFT_LSR:
+                self._mov_imm32(hi, 0)
+            else:
+                self._shift_imm(SHIFT_ASR, hi, hi, 31)
+
+    def _shift64_reg(self, op, d, s):
+        lo, hi = d, d + 1
+        self._dp_imm(DP_AND, False, TMP, s, 63)
+        if op == ALU_LSH:
+            self._shift_reg(SHIFT_LSL, hi, hi, TMP)
+            self._dp_imm(DP_RSB, False, TMP2, TMP, 32)
+            self._shift_reg(SHIFT_LSR, TMP2, lo, TMP2)
+            self._dp_reg(DP_ORR, False, hi, hi, TMP2)
+            self._dp_imm(DP_SUB, False, TMP2, TMP, 32)
+            self._shift_reg(SHIFT_LSL, TMP2, lo, TMP2)
+            self._dp_reg(DP_ORR, False, hi, hi, TMP2)
+            self._shift_reg(SHIFT_LSL, lo, lo, TMP)
+            return
+        self._shift_reg(SHIFT_LSR, lo, lo, TMP)
+        self._dp_imm(DP_RSB, False, TMP2, TMP, 32)
+        self._shift_reg(SHIFT_LSL, TMP2, hi, TMP2)
+        self._dp_reg(DP_ORR, False, lo, lo, TMP2)
+        if op == ALU_RSH:
+            self._dp_imm(DP_SUB, False, TMP2, TMP, 32)
+            self._shift_reg(SHIFT_LSR, TMP2, hi, TMP2)
+            self._dp_reg(DP_ORR, False, lo, lo, TMP2)
+            self._shift_reg(SHIFT_LSR, hi, hi, TMP)
+        else:
+            self._dp_imm(DP_SUB, True, TMP2, TMP, 32)
+            self._it(COND_PL)
+            self._shift_reg(SHIFT_ASR, lo, hi, TMP2)
+            self._shift_reg(SHIFT_ASR, hi, hi, TMP)
+
+    def _shift32_imm(self, op, d, imm):
+        # Matches a shift by a register, which only uses the lowest byte
+        n = imm & 0xFF
+        shift = {ALU_LSH: SHIFT_LSL, ALU_RSH: SHIFT_LSR}.get(op, SHIFT_ASR)
+        if n == 0:
+            return
+        if n < 32:
+            self._shift_imm(shift, d, d, n)
+        elif shift == SHIFT_ASR:
+            self._shift_imm(SHIFT_ASR, d, d, 31)
+        else:
+            self._mov_imm32(d, 0)
+
+    def _alu(self, instr):
+        alu32 = (instr.opcode & CLS_MASK) == CLS_ALU32
+        imm = not (instr.opcode & ALU_S_MASK)
+        op = instr.opcode & OP_MASK
+        value = instr.immediate
+
+        if op == ALU_MOV:
+            d = self._target(instr.dst)
+            if imm:
+                self._mov_imm32(d, value)
+                self._mov_imm32(d + 1, U32 if not alu32 and value < 0 else 0)
+            elif instr.offset:
+                # Sign extension of the lower 8, 16 or 32 bits
+                s = self._load(instr.src, d)
+                if instr.offset != 32:
+                    self._extend(EXTEND_SXTB if instr.offset == 8 else EXTEND_SXTH, d, s)
+                elif s != d:
+                    self._mov(d, s)
+                if alu32:
+                    self._mov_imm32(d + 1, 0)
+                else:
+                    self._shift_imm(SHIFT_ASR, d + 1, d, 31)
+            else:
+                s = self._load(instr.src, d)
+                if s != d:
+                    self._mov(d, s)
+                if alu32:
+                    self._mov_imm32(d + 1, 0)
+                elif s != d:
+                    self._mov(d + 1, s + 1)
+            self._store(instr.dst, d)
+            return
+
+        d = self._load(instr.dst, DST)
+
+        # Byte order conversions of the lower 16, 32 or 64 bits, the target is
+        # little endian
+        if op == ALU_BYTESWAP:
+            swap = instr.opcode != END_LE
+            if value in (16, 32):
+                if swap:
+                    self._rev(value == 16, d, d)
+                if value == 16:
+                    self._extend(EXTEND_UXTH, d, d)
+                self._mov_imm32(d + 1, 0)
+            elif swap:
+                self._rev(False, TMP, d)
+                self._rev(False, d, d + 1)
+                self._mov(d + 1, TMP)
+            self._store(instr.dst, d)
+            return
+
+        if imm and op in (ALU_ADD, ALU_SUB) and -255 <= value <= 255:
+            add = (op == ALU_ADD) == (value >= 0)
+            self._dp_imm(DP_ADD if add else DP_SUB, not alu32, d, d, abs(value))
+            if not alu32:
+                self._dp_imm(DP_ADC if add else DP_SBC, False, d + 1, d + 1, 0)
+            return self._done(instr, d, alu32)
+        if imm and op in (ALU_AND, ALU_OR, ALU_XOR) and 0 <= value <= 255:
+            dp = {ALU_AND: DP_AND, ALU_OR: DP_ORR, ALU_XOR: DP_EOR}[op]
+            self._dp_imm(dp, False, d, d, value)
+            if not alu32 and op == ALU_AND:
+                self._mov_imm32(d + 1, 0)
+            return self._done(instr, d, alu32)
+
+        if op == ALU_NEG:
+            if not imm:
+                raise AOTError(f"illegal instruction {hex(instr.opcode)}")
+            if alu32:
+                self._dp_imm(DP_RSB, False, d, d, 0)
+            else:
+                self._dp_imm(DP_RSB, True, d, d, 0)
+                self._dp_reg(DP_SBC, False, d + 1, d + 1, d + 1, SHIFT_LSL, 1)
+            return self._done(instr, d, alu32)
+        if op in (ALU_LSH, ALU_RSH, ALU_ARSH):
+            if imm:
+                if alu32:
+                    self._shift32_imm(op, d, value)
+                else:
+                    self._shift64_imm(op, d, value & 63)
+                return self._done(instr, d, alu32)
+        if op in (ALU_DIV, ALU_MOD) and imm and value == 0:
+            self._branch(COND_AL, self.exits[EXIT_ILLEGAL_DIV])
+            return
+
+        if imm:
+            s = SRC
+            self._mov_imm64(s, value)
+        else:
+            s = self._load(instr.src, SRC)
+            if s == d and op == ALU_MUL and not alu32:
+                # The multiplication overwrites its operands
+                self._mov(SRC, s)
+                self._mov(SRC + 1, s + 1)
+                s = SRC
+
+        if op in (ALU_ADD, ALU_SUB, ALU_AND, ALU_OR, ALU_XOR):
+            dp_lo, dp_hi = {
+                ALU_ADD: (DP_ADD, DP_ADC),
+                ALU_SUB: (DP_SUB, DP_SBC),
+                ALU_AND: (DP_AND, DP_AND),
+                ALU_OR: (DP_ORR, DP_ORR),
+                ALU_XOR: (DP_EOR, DP_EOR),
+            }[op]
+            self._dp_reg(dp_lo, not alu32 and dp_lo != dp_hi, d, d, s)
+            if not alu32:
+                self._dp_reg(dp_hi, False, d + 1, d + 1, s + 1)
+        elif op == ALU_MUL:
+            if alu32:
+                self._emit32(0xFB00 | d, 0xF000 | (d << 8) | s)
+            else:
+                self._emit32(0xFB00 | (d + 1), 0xF000 | ((d + 1) << 8) | s)
+                self._emit32(0xFB00 | d, ((d + 1) << 12) | ((d + 1) << 8) | (s + 1))
+                self._emit32(0xFBA0 | d, (d << 12) | (TMP << 8) | s)
+                self._dp_reg(DP_ADD, False, d + 1, d + 1, TMP)
+        elif op in (ALU_DIV, ALU_MOD):
+            # The whole 64 bit source is checked, as the interpreter does
+            if not imm:
+                self._check_div(s)
+            if alu32:
+                # UDIV, or SDIV for the signed ones
+                div = 0xFB90 if instr.offset else 0xFBB0
+                if op == ALU_DIV:
+                    self._emit32(div | d, 0xF0F0 | (d << 8) | s)
+                else:
+                    self._emit32(div | d, 0xF0F0 | (TMP << 8) | s)
+                    self._emit32(0xFB00 | TMP, (d << 12) | (d << 8) | 0x10 | s)
+            else:
+                # Arguments in r0:r1 and r2:r3, result in r0:r1
+                if s != SRC:
+                    self._mov(SRC, s)
+                    self._mov(SRC + 1, s + 1)
+                if d != DST:
+                    self._mov(DST, d)
+                    self._mov(DST + 1, d + 1)
+                if instr.offset:
+                    self._call(ENV_SDIV if op == ALU_DIV else ENV_SMOD)
+                else:
+                    self._call(ENV_DIV if op == ALU_DIV else ENV_MOD)
+                if d != DST:
+                    self._mov(d, DST)
+                    self._mov(d + 1, DST + 1)
+        elif op in (ALU_LSH, ALU_RSH, ALU_ARSH):
+            if alu32:
+                shift = {ALU_LSH: SHIFT_LSL, ALU_RSH: SHIFT_LSR}.get(op, SHIFT_ASR)
+                self._shift_reg(shift, d, d, s)
+            else:
+                self._shift64_reg(op, d, s)
+        else:
+            raise AOTError(f"illegal instruction {hex(instr.opcode)}")
+        self._done(instr, d, alu32)
+
+    def _done(self, instr, d, alu32):
+        if alu32:
+            # The 32 bit results are zero extended, the signed ones included
+            self._mov_imm32(d + 1, 0)
+        self._store(instr.dst, d)
+
+    def _lddw(self, instr, high):
+        d = self._target(instr.dst)
+        if instr.opcode == LDDW:
+            value = (instr.immediate & U32) | ((high.immediate & U32) << 32)
+            self._mov_imm32(d, value)
+            self._mov_imm32(d + 1, value >> 32)
+        else:
+            base = self.data_offset if instr.opcode == LDDWD else self.rodata_offset
+            self._pc_relative(d, base + instr.immediate)
+            self._mov_imm32(d + 1, high.immediate)
+        self._store(instr.dst, d)
+
+    def _address(self, reg, offset, rd):
+        """Register holding the base of an access and the displacement left"""
+        base = self.map[reg]
+        if not base:
+            self._ldst(LDST_LDR, rd, REGS, 8 * reg)
+            base = rd
+        if 0 <= offset <= 4088:
+            return base, offset
+        if -4096 < offset < 0:
+            self._subw(rd, base, -offset)
+        else:
+            self._mov_imm32(TMP2, offset)
+            self._dp_reg(DP_ADD, False, rd, base, TMP2)
+        return rd, 0
+
+    def _check(self, reg, offset, size, load):
+        """Check a memory access through the environment"""
+        # Accesses within the stack through an untouched frame pointer need no check
+        if reg == 10 and self.fixed_fp and offset >= -STACK_SIZE and offset + size <= 0:
+            return
+        base, displacement = self._address(reg, offset, 1)
+        if displacement:
+            self._addw(1, base, displacement)
+        elif base != 1:
+            self._mov(1, base)
+        self._mov_imm32(2, size)
+        self._env(0, ENV_RBPF)
+        self._call(ENV_LOAD_ALLOWED if load else ENV_STORE_ALLOWED)
+        self._cmp_imm(0, 0)
+        self._branch(COND_EQ, self.exits[EXIT_ILLEGAL_MEM])
+
+    def _atomic(self, instr):
+        """
+        Atomic operations, the 32 bit ones in an exclusive load and store
+        loop, the 64 bit ones through the environment. The address is kept in
+        lr and must be aligned on the size of the access.
+        """
+        size = 4 if instr.opcode == ATOMICW else 8
+        op = instr.immediate
+
+        self._check(instr.dst, instr.offset, size, False)
+
+        if size == 4:
+            s = self._load(instr.src, SRC)
+            expected = self.map[0] if self.map[0] else 3
+            if op == ATOMIC_CMPXCHG and not self.map[0]:
+                self._ldst(LDST_LDR, expected, REGS, 0)
+        else:
+            self._flush()
+
+        base, displacement = self._address(instr.dst, instr.offset, TMP2)
+        if base != TMP2 or displacement:
+            self._addw(TMP2, base, displacement)
+        self._dp_imm(DP_AND, True, PC, TMP2, size - 1)
+        self._branch(COND_NE, self.exits[EXIT_ILLEGAL_MEM])
+
+        if size == 8:
+            self._mov(0, REGS)
+            self._mov(1, TMP2)
+            self._mov_imm32(2, op)
+            self._mov_imm32(3, instr.src)
+            self._call(ENV_ATOMIC64)
+            self._reload()
+            return
+
+        # Previous value in r0, new value in r1
+        loop = len(self.code)
+        value = 1
+        self._ldrex(0, TMP2)
+        alu = {
+            ATOMIC_ADD: DP_ADD,
+            ATOMIC_OR: DP_ORR,
+            ATOMIC_AND: DP_AND,
+            ATOMIC_XOR: DP_EOR,
+        }
+        if op & ~ATOMIC_FETCH in alu:
+            self._dp_reg(alu[op & ~ATOMIC_FETCH], False, 1, 0, s)
+        elif op == ATOMIC_XCHG:
+            value = s
+        elif op == ATOMIC_CMPXCHG:
+            # Skip the store and the retry when the values differ
+            self._cmp(0, expected)
+            self._branch(COND_NE, len(self.code) + 2 + 6)
+            value = s
+        else:
+            raise AOTError(f"illegal atomic operation {hex(op)}")
+        self._strex(TMP, value, TMP2)
+        self._cmp_imm(TMP, 0)
+        self._branch(COND_NE, loop)
+
+        # The compare and exchange returns the previous value in r0
+        if op & ATOMIC_FETCH:
+            reg = 0 if op == ATOMIC_CMPXCHG else instr.src
+            d = self._target(reg)
+            if d != 0:
+                self._mov(d, 0)
+            self._mov_imm32(d + 1, 0)
+            self._store(reg, d)
+
+    def _mem(self, instr):
+        cls = instr.opcode & CLS_MASK
+        size = {0x00: 4, 0x08: 2, 0x10: 1, 0x18: 8}[instr.opcode & MEM_SZ_MASK]
+        load = cls == CLS_LDX
+        reg = instr.src if load else instr.dst
+        sign_extend = load and (instr.opcode & MEM_MDE_MASK) == MEM_MEMSX
+
+        if instr.opcode in (ATOMICW, ATOMICDW):
+            self._atomic(instr)
+            return
+        if (instr.opcode & MEM_MDE_MASK) != 0x60 and not sign_extend:
+            raise AOTError(f"illegal instruction {hex(instr.opcode)}")
+
+        self._check(reg, instr.offset, size, load)
+
+        if load:
+            d = self._target(instr.dst)
+            base, displacement = self._address(reg, instr.offset, TMP)
+            if size == 8 and base == d:
+                # The first load overwrites the base
+                self._mov(TMP, base)
+                base = TMP
+            if sign_extend:
+                op = {1: LDST_LDRSB, 2: LDST_LDRSH, 4: LDST_LDR}[size]
+            else:
+                op = {1: LDST_LDRB, 2: LDST_LDRH, 4: LDST_LDR, 8: LDST_LDR}[size]
+            self._ldst(op, d, base, displacement)
+            if size == 8:
+                # Two word loads, as the double word loads fault on unaligned addresses
+                self._ldst(LDST_LDR, d + 1, base, displacement + 4)
+            elif sign_extend:
+                self._shift_imm(SHIFT_ASR, d + 1, d, 31)
+            else:
+                self._mov_imm32(d + 1, 0)
+            self._store(instr.dst, d)
+            return
+
+        if cls == CLS_STX:
+            d = self._load(instr.src, SRC)
+        else:
+            d = SRC
+            self._mov_imm32(d, instr.immediate)
+            if size == 8:
+                self._mov_imm32(d + 1, U32 if instr.immediate < 0 else 0)
+        base, displacement = self._address(reg, instr.offset, TMP)
+        op = {1: LDST_STRB, 2: LDST_STRH, 4: LDST_STR, 8: LDST_STR}[size]
+        self._ldst(op, d, base, displacement)
+        if size == 8:
+            self._ldst(LDST_STR, d + 1, base, displacement + 4)
+
+    def _jump(self, instr, i, target):
+        op = instr.opcode & OP_MASK
+        imm = not (instr.opcode & ALU_S_MASK)
+        wide = instr.opcode & CLS_MASK == CLS_BRANCH
+        # Only the backward jumps can loop, the others aren't charged
+        charged = target <= i
+
+        if instr.opcode in (JMP_ALWAYS, JMP32_ALWAYS):
+            if charged:
+                self._budget()
+            self._branch(COND_AL, self.slots[target])
+            return
+
+        d = self._load(instr.dst, DST)
+        if imm:
+            s = SRC
+            self._mov_imm64(s, instr.immediate)
+        else:
+            s = self._load(instr.src, SRC)
+
+        # Compare the 64 bit values, the ordered comparisons subtract the high
+        # words with carry and only keep the carry and the sign flags valid.
+        # The 32 bit jumps compare the low words only.
+        if op in (JEQ, JNE):
+            self._cmp(d, s)
+            if wide:
+                self._it(COND_EQ)
+                self._cmp(d + 1, s + 1)
+            cond = COND_EQ if op == JEQ else COND_NE
+        elif op == JSET:
+            self._tst(d, s)
+            if wide:
+                self._it(COND_EQ)
+                self._tst(d + 1, s + 1)
+            cond = COND_NE
+        elif op in (JGE, JLT, JSGE, JSLT):
+            self._cmp(d, s)
+            if wide:
+                self._dp_reg(DP_SBC, True, TMP, d + 1, s + 1)
+            cond = {JGE: COND_CS, JLT: COND_CC, JSGE: COND_GE, JSLT: COND_LT}[op]
+        elif op in (JGT, JLE, JSGT, JSLE):
+            self._cmp(s, d)
+            if wide:
+                self._dp_reg(DP_SBC, True, TMP, s + 1, d + 1)
+            cond = {JGT: COND_CC, JLE: COND_CS, JSGT: COND_LT, JSLE: COND_GE}[op]
+        else:
+            raise AOTError(f"illegal instruction {hex(instr.opcode)}")
+
+        if not charged:
+            self._branch(cond, self.slots[target])
+            return
+
+        # Skip the taken path with the inverted condition
+        skip = len(self.code)
+        self._branch(cond ^ 1, skip)
+        self._budget()
+        self._branch(COND_AL, self.slots[target])
+        following = self.code[skip + 2 :]
+        del self.code[skip:]
+        self._branch(cond ^ 1, skip + 2 + len(following))
+        self.code += following
+
+    def _call_instr(self, instr):
+        # The function is looked up by the virtual machine, which checked its
+        # existence in the pre-flight checks
+        if instr.src == CALL_LOCAL:
+            raise AOTError("local calls are interpreted")
+        if instr.immediate == TAIL_CALL:
+            raise AOTError("tail calls are interpreted")
+        self._mov_imm32(0, instr.immediate)
+        self._call(ENV_GET_CALL)
+        self._mov(TMP, 0)
+        # The cached pairs are saved by the called function
+        self._sp(True, CALL_STACK)
+        for reg in range(2, 6):
+            self._strd(self._load(reg, DST), SP, 8 * (reg - 2))
+        arg = self._load(1, SRC)
+        if arg != SRC:
+            self._mov(SRC, arg)
+            self._mov(SRC + 1, arg + 1)
+        self._ldst(LDST_LDR, 0, SP, STACK_ENV + CALL_STACK)
+        self._ldst(LDST_LDR, 0, 0, ENV_RBPF)
+        self._blx(TMP)
+        self._sp(False, CALL_STACK)
+        d = self._target(0)
+        if d != DST:
+            self._mov(d, DST)
+            self._mov(d + 1, DST + 1)
+        self._store(0, DST)
+
+    def _instruction(self, i):
+        instr = self.text[i]
+        cls = instr.opcode & CLS_MASK
+        if cls in (CLS_ALU32, CLS_ALU64):
+            self._alu(instr)
+        elif cls in (CLS_LDX, CLS_ST, CLS_STX):
+            self._mem(instr)
+        elif cls in (CLS_BRANCH, CLS_JMP32):
+            if instr.opcode == CALL:
+                self._call_instr(instr)
+            elif instr.opcode == RETURN:
+                self._mov_imm32(0, RBPF_OK)
+                self._branch(COND_AL, self.epilogue)
+            else:
+                target = i + instr.jump_offset + 1
+                if not 0 <= target < len(self.text):
+                    raise AOTError(f"illegal jump at instruction {i}")
+                self._jump(instr, i, target)
+        elif instr.opcode in (LDDW, LDDWD, LDDWR):
+            if i + 1 >= len(self.text):
+                raise AOTError("truncated double word load")
+            self._lddw(instr, self.text[i + 1])
+        else:
+            raise AOTError(f"illegal instruction {hex(instr.opcode)}")
+
+    def _registers(self):
+        """Cache the most used eBPF registers in register pairs"""
+        uses = [0] * 11
+        for instr in self.text:
+            if instr.dst >= 11 or instr.src >= 11:
+                raise AOTError("illegal register")
+            uses[instr.dst] += 1
+            uses[instr.src] += 1
+            if instr.dst == 10 and (instr.opcode & CLS_MASK) in (
+                CLS_ALU32,
+                CLS_ALU64,
+                CLS_LD,
+                CLS_LDX,
+            ):
+                self.fixed_fp = False
+            # The atomic operations fetching into the source register
+            if (
+                instr.src == 10
+                and instr.opcode in (ATOMICW, ATOMICDW)
+                and instr.immediate & ATOMIC_FETCH
+            ):
+                self.fixed_fp = False
+        for pair in range(NUM_PAIRS):
+            best = 0
+            for reg in range(1, 11):
+                if not self.map[reg] and uses[reg] > uses[best]:
+                    best = reg
+            if self.map[best] or not uses[best]:
+                break
+            self.map[best] = PAIRS + 2 * pair
+            uses[best] = 0
+
+    def _program(self):
+        """Emit the whole program, returns the position of the entry point"""
+        self.code = []
+        for exit, code in enumerate(EXITS):
+            self.exits[exit] = len(self.code)
+            self._mov_imm32(0, code)
+            if exit + 1 < len(EXITS):
+                self._branch(COND_AL, self.epilogue)
+
+        self.epilogue = len(self.code)
+        self._flush()
+        # The saved arguments are dropped into the scratch registers
+        self._emit32(0xE8BD, (1 << 1) | (1 << 2) | SAVED_REGS | (1 << PC))
+
+        entry = len(self.code)
+        self._emit32(0xE92D, (1 << 0) | (1 << 1) | SAVED_REGS | (1 << TMP2))
+        self._mov(REGS, 0)
+        self._reload()
+
+        i = 0
+        while i < len(self.text):
+            self.slots[i] = len(self.code)
+            self._instruction(i)
+            if self.text[i].opcode in (LDDW, LDDWD, LDDWR):
+                # The second half is not an instruction on its own
+                i += 1
+                self.slots[i] = self.exits[EXIT_ILLEGAL_INSTRUCTION]
+            i += 1
+        return entry
+
+    def compile(self):
+        """
+        :return: a tuple of the code and the offset of its entry point
+        """
+        # The first pass finds the position of every slot and exit, the
+        # second one emits the branches to them. Both passes emit the same sizes.
+        for _ in range(2):
+            entry = self._program()
+        code = struct.pack(f"<{len(self.code)}H", *self.code)
+        logging.info(f"Native code: {len(code)} B, entry at {hex(2 * entry)}")
+        return code, 2 * entry
+
+
+def fletcher32(data):
+    """Checksum of the native section, as computed by the virtual machine"""
+    if len(data) % 2:
+        data = data + b"\x00"
+    words = struct.unpack(f"<{len(data) // 2}H", data)
+    sum1 = sum2 = 0xFFFF
+    for start in range(0, len(words), 359):
+        for word in words[start : start + 359]:
+            sum1 += word
+            sum2 += sum1
+        sum1 = (sum1 & 0xFFFF) + (sum1 >> 16)
+        sum2 = (sum2 & 0xFFFF) + (sum2 >> 16)
+    sum1 = (sum1 & 0xFFFF) + (sum1 >> 16)
+    sum2 = (sum2 & 0xFFFF) + (sum2 >> 16)
+    return (sum2 << 16) | sum1
@@ -2,7 +2,7 @@ import struct
 import logging
 from collections import namedtuple
 from elftools.elf.elffile import ELFFile
-from rbpf import instructions
+from rbpf import instructions, aot
 import itertools
 
 MAGIC = int.from_bytes(b"rBPF", "little")
@@ -15,13 +15,35 @@ HEADER = namedtuple(
 SYMBOL_STRUCT = struct.Struct("<HHH")
 SYMBOL = namedtuple("Symbol", "name_offset flags location_offset")
 
+MAPS_LEN_STRUCT = struct.Struct("<I")
+MAP_STRUCT = struct.Struct("<IIII")
+MAP = namedtuple("Map", "type value_size max_entries flags")
+
+# Definition of a map in the maps section of the ELF file, bpf_map_def_t
+ELF_MAP_STRUCT = struct.Struct("<IIIII")
+ELF_MAP = namedtuple("ElfMap", "type key_size value_size max_entries map_flags")
+MAP_TYPE_ARRAY = 2
+MAP_F_PERSISTENT = 0x1
+
 TEXT = ".text"
 DATA = ".data"
 RODATA = ".rodata"
 SYMBOLS = ".symtab"
 RELOCATIONS = ".rel.text"
+MAPS_SECTION = "maps"
 
 COMPRESSED = 0x01
+NATIVE = 0x02
+REG32 = 0x04
+SORTED = 0x08
+MAPS = 0x10
+
+# 64 bit operations the 32 bit registers hold: moves, additions and subtractions
+REG32_ALU64_OPS = (0xB0, 0x00, 0x10)
+
+
+class Reg32Error(Exception):
+    pass
 
 
 class Symbol(object):
@@ -31,19 +53,25 @@ class Symbol(object):
         self.instruction = instruction
 
 
+class MapError(Exception):
+    pass
+
+
 class RBF(object):
-    def __init__(self, data, rodata, text, symbols, header=None):
+    def __init__(self, data, rodata, text, symbols, header=None, native=None, maps=None):
         self.data = data
         self.rodata = rodata
         self.text = text
         self.header = header
+        self.maps = maps if maps else []
         if header:
             self.flags = self.header.flags
         else:
-            self.flags = 0
+            self.flags = MAPS if self.maps else 0
         compressed = bool(self.flags & COMPRESSED)
         self.instructions = instructions.parse_text(self.text, compressed=compressed)
         self.symbols = symbols
+        self.native = native
 
         def _round_len(bstr):
             if (len(bstr) % 8) != 0:
@@ -54,7 +82,7 @@ class RBF(object):
         _round_len(self.data)
         _round_len(self.rodata)
 
-        if (len(text) % 8) != 0:
+        if not compressed and (len(text) % 8) != 0:
             logging.error(
                 f"Length of the text is not a whole number of instructions: {len(text)}"
             )
@@ -111,6 +139,16 @@ class RBF(object):
             print(f'\t"{symbol.name}": {hex(symbol.location)}')
         print()
 
+        if self.maps:
+            print("maps:")
+            for index, map_def in enumerate(self.maps):
+                print(
+                    f"\t{index}: type {map_def.type}, {map_def.max_entries} x "
+                    f"{map_def.value_size} B"
+                    f"{', persistent' if map_def.flags & MAP_F_PERSISTENT else ''}"
+                )
+            print()
+
         print("data:")
         print("".join(data for data in RBF.obj_hexstr(self.data)))
 
@@ -127,12 +165,24 @@ class RBF(object):
                     print(f"<{symbol.name}>")
                 print(instr.full_print())
 
+        if self.native:
+            checksum, version, entry, code_len = aot.NATIVE_HEADER_STRUCT.unpack_from(
+                self.native, 0
+            )
+            print(
+                f"\nnative:\n"
+                f"Checksum:\t{hex(checksum)}\n"
+                f"Version:\t{version}\n"
+                f"Entry:\t\t{hex(entry)}\n"
+                f"Code length:\t{code_len} B"
+            )
+
     def format(self):
         if not self.header:
             self.header = HEADER(
                 MAGIC,
                 0,
-                0,
+                self.flags,
                 len(self.data),
                 len(self.rodata),
                 len(self.text),
@@ -145,26 +195,103 @@ class RBF(object):
         data += self.text
         for symbol in self.symbols:
             data += SYMBOL_STRUCT.pack(*symbol)
+        data += self._format_maps()
+        if self.native:
+            data += RBF._native_padding(data)
+            data += self.native
         return data
 
+    def _format_maps(self):
+        # The list of maps follows the functions
+        if not self.maps:
+            return bytes()
+        data = bytearray(MAPS_LEN_STRUCT.pack(len(self.maps)))
+        for map_def in self.maps:
+            data += MAP_STRUCT.pack(*map_def)
+        return data
+
+    @staticmethod
+    def _native_padding(data):
+        # The native section starts at a multiple of 4 bytes offset
+        return bytes(-len(data) % 4)
+
+    def format_native(self):
+        if self.flags & COMPRESSED:
+            raise aot.AOTError("the text of compressed applications can't be compiled")
+        if not self.header:
+            self.format()
+        self.flags |= NATIVE
+        self.header = self.header._replace(flags=self.flags)
+        self.native = None
+
+        data = self.format()
+        data += RBF._native_padding(data)
+
+        # The sections are addressed relative to the code
+        code_offset = len(data) + aot.NATIVE_HEADER_STRUCT.size
+        data_offset = HEADER_STRUCT.size - code_offset
+        rodata_offset = data_offset + self.header.data_len
+        code, entry = aot.Compiler(self.text, data_offset, rodata_offset).compile()
+
+        # The data section is left out of the checksum, as it is written at run time
+        checksum = aot.fletcher32(bytes(data[HEADER_STRUCT.size + self.header.data_len :]))
+        self.native = aot.NATIVE_HEADER_STRUCT.pack(
+            checksum, aot.VERSION, entry, len(code)
+        )
+        self.native += code
+        return data + self.native
+
+    def set_reg32(self):
+        """
+        Flags the application to be interpreted with 32 bit registers, see
+        RBPF_ENABLE_REG32.
+
+        :raises Reg32Error: the text needs 64 bit registers
+        """
+        text = [aot.Instruction(self.text[i : i + 8]) for i in range(0, len(self.text), 8)]
+        for i, instr in enumerate(text):
+            if instr.opcode & 0x07 == 0x07 and instr.opcode & 0xF0 not in REG32_ALU64_OPS:
+                raise Reg32Error(f"64 bit operation {hex(instr.opcode)} at instruction {i}")
+            if instr.opcode == aot.ALU64_MOV_REG and instr.offset:
+                raise Reg32Error(f"64 bit sign extension at instruction {i}")
+            if instr.opcode == aot.END_BE and instr.immediate == 64:
+                raise Reg32Error(f"64 bit byte swap at instruction {i}")
+            if (instr.opcode & aot.CLS_MASK == aot.CLS_LDX and
+                    instr.opcode & aot.MEM_MDE_MASK == aot.MEM_MEMSX):
+                raise Reg32Error(f"64 bit sign extension at instruction {i}")
+            if instr.opcode == aot.ATOMICDW:
+                raise Reg32Error(f"64 bit atomic operation at instruction {i}")
+            if instr.opcode in (instructions.LDDW_OPCODE, instructions.LDDWD_OPCODE,
+                                instructions.LDDWR_OPCODE):
+                if i + 1 >= len(text) or text[i + 1].immediate:
+                    raise Reg32Error(f"64 bit immediate at instruction {i}")
+        self.flags |= REG32
+        if self.header:
+            self.header = self.header._replace(flags=self.flags)
+
     def format_compressed(self):
         compressed_text = bytes().join(instr.compress() for instr in self.instructions)
         if not self.header:
             self.header = HEADER(
                 MAGIC,
                 0,
-                COMPRESSED,
+                self.flags | COMPRESSED,
                 len(self.data),
                 len(self.rodata),
                 len(compressed_text),
                 len(self.symbols),
             )
+        else:
+            self.header = self.header._replace(
+                flags=self.flags | COMPRESSED, text_len=len(compressed_text)
+            )
         data = bytearray(HEADER_STRUCT.pack(*self.header))
         data += self.data
         data += self.rodata
         data += compressed_text
         for symbol in self.symbols:
             data += SYMBOL_STRUCT.pack(*symbol)
+        data += self._format_maps()
         return data
 
     @staticmethod
@@ -178,16 +305,28 @@ class RBF(object):
         text_start = rodata_end = offset
         offset += header.text_len
         syms_start = text_end = offset
+        offset += header.functions_len * SYMBOL_STRUCT.size
+        syms_end = offset
         rodata = byte_data[rodata_start:rodata_end]
         data = byte_data[data_start:data_end]
         text = byte_data[text_start:text_end]
-        syms = byte_data[syms_start:]
+        syms = byte_data[syms_start:syms_end]
+        maps = []
+        if header.flags & MAPS:
+            (maps_len,) = MAPS_LEN_STRUCT.unpack_from(byte_data, offset)
+            offset += MAPS_LEN_STRUCT.size
+            for _ in range(maps_len):
+                maps.append(MAP._make(MAP_STRUCT.unpack_from(byte_data, offset)))
+                offset += MAP_STRUCT.size
+        native = None
+        if header.flags & NATIVE:
+            native = byte_data[offset + (-offset % 4) :]
 
         syms_array = []
         while len(syms):
             syms_array.append(SYMBOL._make(SYMBOL_STRUCT.unpack_from(syms, 0)))
             syms = syms[SYMBOL_STRUCT.size :]
-        return RBF(data, rodata, text, syms_array, header)
+        return RBF(data, rodata, text, syms_array, header, native, maps)
 
     @staticmethod
     def _get_section_lddw_opcode(section):
@@ -196,6 +335,24 @@ class RBF(object):
         elif section == DATA:
             return instructions.LDDWD_OPCODE
 
+    @staticmethod
+    def _patch_map(text, location, instruction, offset):
+        # The address of the definition of a map becomes its number
+        if offset % ELF_MAP_STRUCT.size:
+            raise MapError(f"Reference inside a map definition at {hex(location)}")
+        index = offset // ELF_MAP_STRUCT.size
+        logging.info(f"Replacing {instruction} at {location} with map {index}")
+        text[location : location + 16] = instructions.LDDW_STRUCT.pack(
+            instructions.LDDW_OPCODE,
+            instruction.registers,
+            instruction.offset,
+            index,
+            0,
+            0,
+            0,
+            0,
+        )
+
     @staticmethod
     def _patch_text(text, elffile, relocation):
         entry = relocation.entry
@@ -217,6 +374,9 @@ class RBF(object):
             instruction = instructions.LDDW._make(
                 instructions.LDDW_STRUCT.unpack_from(text, location)
             )
+            if section_name == MAPS_SECTION:
+                RBF._patch_map(text, location, instruction, instruction.immediate_l + offset)
+                return
             logging.info(
                 f"Replacing {instruction} at {location} with {opcode} at {offset}"
             )
@@ -264,6 +424,9 @@ class RBF(object):
                 logging.info(f"Found global function {name} at offset {text_offset}")
                 rbf_symbols.append((name, text_offset, 0))  # potential flags
 
+        # The virtual machine looks the entry points up by binary search over
+        # the name bytes
+        rbf_symbols.sort(key=lambda symbol: bytes(symbol[0], "UTF-8"))
         symbol_structs = []
         logging.debug(f"rodata length: {len(rodata)}")
         for name, text_offset, flags in rbf_symbols:
@@ -276,6 +439,22 @@ class RBF(object):
             )
         logging.info(f"Total rodata size: {len(rodata)}. Total data size: {len(data)}")
 
+        maps = []
+        elf_maps = elffile.get_section_by_name(MAPS_SECTION)
+        if elf_maps:
+            maps_data = elf_maps.data()
+            if len(maps_data) % ELF_MAP_STRUCT.size:
+                raise MapError(f"Maps section of {len(maps_data)} B is not a list of definitions")
+            for offset in range(0, len(maps_data), ELF_MAP_STRUCT.size):
+                elf_map = ELF_MAP._make(ELF_MAP_STRUCT.unpack_from(maps_data, offset))
+                if elf_map.type != MAP_TYPE_ARRAY:
+                    raise MapError(f"Map {len(maps)} of type {elf_map.type} not supported")
+                if elf_map.map_flags & ~MAP_F_PERSISTENT:
+                    raise MapError(f"Map {len(maps)} with flags {hex(elf_map.map_flags)} not supported")
+                maps.append(MAP(elf_map.type, elf_map.value_size, elf_map.max_entries,
+                                elf_map.map_flags))
+            logging.info(f"Found {len(maps)} maps")
+
         if relocations:
             for relocation in relocations.iter_relocations():
                 logging.debug(relocation.entry)
@@ -295,4 +474,6 @@ class RBF(object):
 
                 RBF._patch_text(text, elffile, relocation)
 
-        return RBF(data=data, rodata=rodata, text=text, symbols=symbol_structs)
+        rbf = RBF(data=data, rodata=rodata, text=text, symbols=symbol_structs, maps=maps)
+        rbf.flags |= SORTED
+        return rbf
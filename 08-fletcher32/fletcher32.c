@@ -32,6 +32,18 @@ typedef struct {
     uint32_t words;
 } fletcher32_ctx_t;
 
+#ifdef FLETCHER32_HELPER
+#include "builtin_shared.h"
+
+/* The checksum computed natively by the virtual machine */
+static uint32_t (*bpf_fletcher32)(uint32_t state, const void *data, uint32_t len) =
+    (void *)BPF_FUNC_BPF_FLETCHER32;
+
+uint32_t fletcher32(fletcher32_ctx_t *ctx)
+{
+    return bpf_fletcher32(BPF_FLETCHER32_INIT, ctx->data, ctx->words * 2);
+}
+#else
 uint32_t fletcher32(fletcher32_ctx_t *ctx)
 {
     uint32_t words = ctx->words;
@@ -53,3 +65,4 @@ uint32_t fletcher32(fletcher32_ctx_t *ctx)
     sum2 = (sum2 & 0xffff) + (sum2 >> 16);
     return (sum2 << 16) | sum1;
 }
+#endif
@@ -13,6 +13,10 @@ LDDWD_OPCODE = 0xB8
 LDDWR_OPCODE = 0xD8
 
 
+class CompressError(Exception):
+    pass
+
+
 class Instruction(object):
 
     OPERATION_STRUCT = struct.Struct("<BBhI")
@@ -117,7 +121,15 @@ class AluInstruction(Instruction):
     def asm_print(self):
         return f"r{self.dst_register} {self.operand}= r{self.src_register}"
 
+    def check_compressible(self):
+        # The signed divisions and sign extending moves have no compressed form
+        if self.offset:
+            raise CompressError(
+                f"{hex(self.OPCODE)} with offset {self.offset} at {hex(self.address)}"
+            )
+
     def compress(self):
+        self.check_compressible()
         return self.COMPRESSED.pack(self.OPCODE, self.registers)
 
 
@@ -130,6 +142,7 @@ class AluImmInstruction(AluInstruction):
         return f"r{self.dst_register} {self.operand}= {self.immediate}"
 
     def compress(self):
+        self.check_compressible()
         return self.COMPRESSED.pack(self.OPCODE, self.registers, self.immediate)
 
     @classmethod
@@ -265,6 +278,30 @@ class ARSHInstruction(AluInstruction):
     OPCODE = 0xCF
 
 
+class EndLEInstruction(AluImmInstruction):
+
+    OPCODE = 0xD4
+
+    def asm_print(self):
+        return f"r{self.dst_register} = le{self.immediate} r{self.dst_register}"
+
+
+class EndBEInstruction(AluImmInstruction):
+
+    OPCODE = 0xDC
+
+    def asm_print(self):
+        return f"r{self.dst_register} = be{self.immediate} r{self.dst_register}"
+
+
+class BswapInstruction(AluImmInstruction):
+
+    OPCODE = 0xD7
+
+    def asm_print(self):
+        return f"r{self.dst_register} = bswap{self.immediate} r{self.dst_register}"
+
+
 class MemInstruction(Instruction):
 
     COMPRESSED = struct.Struct("<BBh")
@@ -303,6 +340,16 @@ class LoadXInstruction(MemInstruction):
         return f"r{self.dst_register} = *({self.size_str}*)(r{self.src_register} + {self.offset})"
 
 
+class LoadSXInstruction(MemInstruction):
+
+    @property
+    def size_str(self):
+        return {0: "int32_t", 1: "int16_t", 2: "int8_t"}[self.size]
+
+    def asm_print(self):
+        return f"r{self.dst_register} = *({self.size_str}*)(r{self.src_register} + {self.offset})"
+
+
 class StoreXInstruction(MemInstruction):
     def asm_print(self):
         return f"*({self.size_str}*)(r{self.dst_register} + {self.offset}) = r{self.src_register}"
@@ -325,6 +372,32 @@ class StoreInstruction(MemInstruction):
         return fields
 
 
+class AtomicInstruction(StoreInstruction):
+
+    OPERATIONS = {0x00: "add", 0x40: "or", 0x50: "and", 0xA0: "xor"}
+    SYMBOLS = {0x00: "+=", 0x40: "|=", 0x50: "&=", 0xA0: "^="}
+
+    @property
+    def size_str(self):
+        return {0: "uint32_t", 3: "uint64_t"}[self.size]
+
+    def asm_print(self):
+        target = f"({self.size_str}*)(r{self.dst_register} + {self.offset})"
+        operation = self.immediate & ~0x01
+        if self.immediate == 0xF1:
+            return f"r0 = atomic_cmpxchg({target}, r0, r{self.src_register})"
+        if self.immediate == 0xE1:
+            return f"r{self.src_register} = atomic_xchg({target}, r{self.src_register})"
+        if operation not in self.OPERATIONS:
+            return f"atomic {hex(self.immediate)} *{target} r{self.src_register}"
+        if self.immediate & 0x01:
+            return (
+                f"r{self.src_register} = atomic_fetch_{self.OPERATIONS[operation]}"
+                f"({target}, r{self.src_register})"
+            )
+        return f"lock *{target} {self.SYMBOLS[operation]} r{self.src_register}"
+
+
 class LDDWInstruction(LoadInstruction):
 
     COMPRESSED = struct.Struct("<BBQ")
@@ -439,6 +512,21 @@ class LDXBInstruction(LoadXInstruction):
     OPCODE = 0x71
 
 
+class LDXSWInstruction(LoadSXInstruction):
+
+    OPCODE = 0x81
+
+
+class LDXSHInstruction(LoadSXInstruction):
+
+    OPCODE = 0x89
+
+
+class LDXSBInstruction(LoadSXInstruction):
+
+    OPCODE = 0x91
+
+
 class STXDWInstruction(StoreXInstruction):
 
     OPCODE = 0x7B
@@ -459,6 +547,16 @@ class STXBInstruction(StoreXInstruction):
     OPCODE = 0x73
 
 
+class AtomicDWInstruction(AtomicInstruction):
+
+    OPCODE = 0xDB
+
+
+class AtomicWInstruction(AtomicInstruction):
+
+    OPCODE = 0xC3
+
+
 class STDWInstruction(StoreInstruction):
 
     OPCODE = 0x7A
@@ -492,6 +590,10 @@ class BranchInstruction(Instruction):
         self.target = target
         self.offset = int((self.target.address - self.address - self.LENGTH) / 8)
 
+    @property
+    def jump_offset(self):
+        return self.offset
+
     @property
     def operand(self):
         return self.OPERAND
@@ -550,11 +652,40 @@ class AlwaysBranchInstruction(BranchInstruction):
         return f"goto {self.offset}"
 
     def compress(self):
-        return self.COMPRESSED.pack(self.OPCODE, self.registers)
+        return self.COMPRESSED.pack(self.OPCODE, self.registers, self._compressed_offset())
 
     @classmethod
     def expand_compressed(cls, fields):
-        return fields[0], fields[1], 0, 0
+        return fields[0], fields[1], fields[2], 0
+
+
+class LongAlwaysBranchInstruction(BranchInstruction):
+    """Jump with the offset in the immediate, in bytes when compressed"""
+
+    OPCODE = 0x06
+    COMPRESSED = struct.Struct("<BBhi")
+
+    def set_target(self, target: Instruction):
+        self.target = target
+        offset = int((self.target.address - self.address - self.LENGTH) / 8)
+        self.immediate = offset & 0xFFFFFFFF
+
+    @property
+    def jump_offset(self):
+        return self.immediate - (1 << 32) if self.immediate & (1 << 31) else self.immediate
+
+    def asm_print(self):
+        return f"gotol {self.jump_offset}"
+
+    def compressed_asm_print(self):
+        return f"gotol {'{:+}'.format(self._compressed_offset())}"
+
+    def compress(self):
+        return self.COMPRESSED.pack(self.OPCODE, self.registers, 0, self._compressed_offset())
+
+    @classmethod
+    def expand_compressed(cls, fields):
+        return fields[0], fields[1], 0, fields[3]
 
 
 class EqBranchInstruction(BranchInstruction):
@@ -741,15 +872,21 @@ INSTRUCTIONS = {
     LDXWInstruction.OPCODE: LDXWInstruction,
     LDXHInstruction.OPCODE: LDXHInstruction,
     LDXBInstruction.OPCODE: LDXBInstruction,
+    LDXSWInstruction.OPCODE: LDXSWInstruction,
+    LDXSHInstruction.OPCODE: LDXSHInstruction,
+    LDXSBInstruction.OPCODE: LDXSBInstruction,
     STXDWInstruction.OPCODE: STXDWInstruction,
     STXWInstruction.OPCODE: STXWInstruction,
     STXHInstruction.OPCODE: STXHInstruction,
     STXBInstruction.OPCODE: STXBInstruction,
+    AtomicDWInstruction.OPCODE: AtomicDWInstruction,
+    AtomicWInstruction.OPCODE: AtomicWInstruction,
     STDWInstruction.OPCODE: STDWInstruction,
     STWInstruction.OPCODE: STWInstruction,
     STHInstruction.OPCODE: STHInstruction,
     STBInstruction.OPCODE: STBInstruction,
     AlwaysBranchInstruction.OPCODE: AlwaysBranchInstruction,
+    LongAlwaysBranchInstruction.OPCODE: LongAlwaysBranchInstruction,
     EqBranchInstruction.OPCODE: EqBranchInstruction,
     EqBranchImmInstruction.OPCODE: EqBranchImmInstruction,
     GtBranchInstruction.OPCODE: GtBranchInstruction,
@@ -779,6 +916,27 @@ INSTRUCTIONS = {
     LDDWRInstruction.OPCODE: LDDWRInstruction,
 }
 
+# The 32 bit ALU instructions and jumps share the encoding of the 64 bit ones
+ALU32_CLASS = 0x04
+JMP32_CLASS = 0x06
+for _opcode, _cls in list(INSTRUCTIONS.items()):
+    if _opcode & 0x07 == 0x07:
+        _opcode32 = (_opcode & ~0x07) | ALU32_CLASS
+    elif issubclass(_cls, BranchInstruction) and _opcode & 0x07 == 0x05 and (
+        _cls is not AlwaysBranchInstruction
+    ):
+        _opcode32 = (_opcode & ~0x07) | JMP32_CLASS
+    else:
+        continue
+    INSTRUCTIONS[_opcode32] = type(
+        _cls.__name__.replace("Instruction", "32Instruction"), (_cls,), {"OPCODE": _opcode32}
+    )
+
+# The byte order conversions, registered after the 32 bit instructions as the
+# 64 bit byte swap has no 32 bit counterpart
+for _cls in (EndLEInstruction, EndBEInstruction, BswapInstruction):
+    INSTRUCTIONS[_cls.OPCODE] = _cls
+
 
 def from_bytes(instruction: bytes):
     opcode = instruction[0]
@@ -820,19 +978,19 @@ def parse_text(text: bytes, compressed=False):
     for instruction in instructions:
         if isinstance(instruction, BranchInstruction):
             logging.debug(
-                f"Instruction {type(instruction)} at {hex(instruction.address)} with offset is {instruction.offset}"
+                f"Instruction {type(instruction)} at {hex(instruction.address)} with offset is {instruction.jump_offset}"
             )
             if compressed:
                 target_address = (
                     instruction.compressed_address
-                    + instruction.offset
+                    + instruction.jump_offset
                     + instruction.compressed_size()
                 )
                 logging.debug(f"Compressed address target at {hex(target_address)}")
             else:
-                target_address = instruction.address + (instruction.offset + 1) * 8
+                target_address = instruction.address + (instruction.jump_offset + 1) * 8
                 logging.debug(
-                    f"target {hex(target_address)} = {instruction.address} + {instruction.offset} + 1"
+                    f"target {hex(target_address)} = {instruction.address} + {instruction.jump_offset} + 1"
                 )
             for instr in instructions:
                 compare_address = (